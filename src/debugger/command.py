@@ -7,6 +7,74 @@ import struct
 from . import interface
 from . import protocol
 
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles sending a `query processors` request to the kernel.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     DebuggeeProtocolAddress - IP(v4) address of the debuggee.
+#     DebuggeePort - Target UDP port of the debuggee.
+#     InputTokens - What we read from the user.
+#
+# RETURN VALUE:
+#     None.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryProcessorsRequest(
+    Socket: socket.socket,
+    DebuggeeProtocolAddress: str,
+    DebuggeePort: int,
+    InputTokens: list[str]) -> None:
+    if len(InputTokens) != 1:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            "expected format: ps\n")
+        return
+
+    # Same as `pt`, the receiver will keep requesting the next chunk until we have everything.
+    protocol.KdpCurrentState = protocol.KDP_STATE_QUERY_PROCESSORS
+    Packet = struct.pack(
+            protocol.KDP_DEBUG_PACKET_QUERY_REQ_FORMAT,
+            protocol.KDP_DEBUG_PACKET_QUERY_PROCESSORS_REQ,
+            0)
+    Socket.sendto(Packet, (DebuggeeProtocolAddress, DebuggeePort))
+
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles sending a `query locks` request to the kernel.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     DebuggeeProtocolAddress - IP(v4) address of the debuggee.
+#     DebuggeePort - Target UDP port of the debuggee.
+#     InputTokens - What we read from the user.
+#
+# RETURN VALUE:
+#     None.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryLocksRequest(
+    Socket: socket.socket,
+    DebuggeeProtocolAddress: str,
+    DebuggeePort: int,
+    InputTokens: list[str]) -> None:
+    if len(InputTokens) != 1:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            "expected format: ls\n")
+        return
+
+    # The kernel gives us one entry per call site per processor, so the receiver merges everything
+    # and only prints once the last chunk arrives.
+    protocol.KdpCurrentState = protocol.KDP_STATE_QUERY_LOCKS
+    protocol.KdpLockStatistics = {}
+    Packet = struct.pack(
+            protocol.KDP_DEBUG_PACKET_QUERY_REQ_FORMAT,
+            protocol.KDP_DEBUG_PACKET_QUERY_LOCKS_REQ,
+            0)
+    Socket.sendto(Packet, (DebuggeeProtocolAddress, DebuggeePort))
+
 #--------------------------------------------------------------------------------------------------
 # PURPOSE:
 #     This function handles sending a `read memory` request to the kernel (while setting everything
@@ -144,6 +212,12 @@ commands:
     ip/<size> <address>        - tries to read some data at the specified port address
                                  <size> can be `b` (8-bits), `w` (16-bits), or `d` (32-bits)
                                  <address> should be a hexadecimal value
+    ls                         - shows the lock statistics (acquisitions, contention, spin and max
+                                 hold cycles) of each lock call site, merged across processors
+                                 requires a kernel built with -DKE_LOCK_STATISTICS=ON
+    ps                         - shows the scheduler statistics (ready threads, work stealing, and
+                                 dispatch IPIs) of each processor
+    pt                         - shows the current usage of each pool tag
     q                          - closes this application
     quit                       - alias to `q`
     rp/<size>[count] <address> - tries to read some data at the specified physical address
@@ -213,6 +287,40 @@ def KdpHandleReadPortRequest(
             ItemSize)
     Socket.sendto(Packet, (DebuggeeProtocolAddress, DebuggeePort))
 
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles sending a `query pool tags` request to the kernel.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     DebuggeeProtocolAddress - IP(v4) address of the debuggee.
+#     DebuggeePort - Target UDP port of the debuggee.
+#     InputTokens - What we read from the user.
+#
+# RETURN VALUE:
+#     None.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryPoolTagsRequest(
+    Socket: socket.socket,
+    DebuggeeProtocolAddress: str,
+    DebuggeePort: int,
+    InputTokens: list[str]) -> None:
+    if len(InputTokens) != 1:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            "expected format: pt\n")
+        return
+
+    # The kernel only sends a few tags at a time; The receiver will keep requesting the next
+    # chunk until we have all of them.
+    protocol.KdpCurrentState = protocol.KDP_STATE_QUERY_POOL_TAGS
+    Packet = struct.pack(
+            protocol.KDP_DEBUG_PACKET_QUERY_REQ_FORMAT,
+            protocol.KDP_DEBUG_PACKET_QUERY_POOL_TAGS_REQ,
+            0)
+    Socket.sendto(Packet, (DebuggeeProtocolAddress, DebuggeePort))
+
 #--------------------------------------------------------------------------------------------------
 # PURPOSE:
 #     This function handles sending a `read memory` request to the kernel.
@@ -318,6 +426,12 @@ def KdHandleInput(
         KdpHandleHelpRequest()
     elif CommandName == "ip":
         KdpHandleReadPortRequest(Socket, DebuggeeProtocolAddress, DebuggeePort, InputTokens)
+    elif CommandName == "ls":
+        KdpHandleQueryLocksRequest(Socket, DebuggeeProtocolAddress, DebuggeePort, InputTokens)
+    elif CommandName == "ps":
+        KdpHandleQueryProcessorsRequest(Socket, DebuggeeProtocolAddress, DebuggeePort, InputTokens)
+    elif CommandName == "pt":
+        KdpHandleQueryPoolTagsRequest(Socket, DebuggeeProtocolAddress, DebuggeePort, InputTokens)
     elif CommandName == "q" or CommandName == "quit":
         return True
     elif CommandName == "rp" or CommandName == "rv":
@@ -14,6 +14,9 @@ KDP_DEBUG_PACKET_READ_PHYSICAL_REQ = 0x03
 KDP_DEBUG_PACKET_READ_VIRTUAL_REQ = 0x04
 KDP_DEBUG_PACKET_READ_PORT_REQ = 0x05
 KDP_DEBUG_PACKET_READ_REGISTERS_REQ = 0x06
+KDP_DEBUG_PACKET_QUERY_POOL_TAGS_REQ = 0x07
+KDP_DEBUG_PACKET_QUERY_PROCESSORS_REQ = 0x08
+KDP_DEBUG_PACKET_QUERY_LOCKS_REQ = 0x09
 
 # ACKs always have the higher (7th) bit set.
 KDP_DEBUG_PACKET_CONNECT_ACK = 0x80
@@ -21,12 +24,20 @@ KDP_DEBUG_PACKET_READ_PHYSICAL_ACK = 0x83
 KDP_DEBUG_PACKET_READ_VIRTUAL_ACK = 0x84
 KDP_DEBUG_PACKET_READ_PORT_ACK = 0x85
 KDP_DEBUG_PACKET_READ_REGISTERS_ACK = 0x86
+KDP_DEBUG_PACKET_QUERY_POOL_TAGS_ACK = 0x87
+KDP_DEBUG_PACKET_QUERY_PROCESSORS_ACK = 0x88
+KDP_DEBUG_PACKET_QUERY_LOCKS_ACK = 0x89
 
 # Format for the custom debugger protocol structure.
 KDP_DEBUG_PACKET_FORMAT = "<B"
 KDP_DEBUG_PACKET_READ_ADDRESS_FORMAT = "<BQBLL"
 KDP_DEBUG_PACKET_READ_PORT_REQ_FORMAT = "<BQB"
 KDP_DEBUG_PACKET_READ_PORT_ACK_FORMAT = "<BQBL"
+KDP_DEBUG_PACKET_QUERY_REQ_FORMAT = "<BL"
+KDP_DEBUG_PACKET_QUERY_ACK_FORMAT = "<BLLL"
+KDP_DEBUG_POOL_TAG_INFORMATION_FORMAT = "<4s4xQQQQ"
+KDP_DEBUG_PROCESSOR_INFORMATION_FORMAT = "<L4xQQQQQQQQQ"
+KDP_DEBUG_LOCK_INFORMATION_FORMAT = "<L4xQQQQQ"
 
 # Definitions related to the current state/context.
 KDP_STATE_NONE = 0
@@ -35,7 +46,13 @@ KDP_STATE_READ_VIRTUAL = 2
 KDP_STATE_READ_PORT = 3
 KDP_STATE_DISASSEMBLE_PHYSICAL = 4
 KDP_STATE_DISASSEMBLE_VIRTUAL = 5
+KDP_STATE_QUERY_POOL_TAGS = 6
+KDP_STATE_QUERY_PROCESSORS = 7
+KDP_STATE_QUERY_LOCKS = 8
 
 # Internal context.
 KdpCurrentState = KDP_STATE_NONE
 KdpCurrentArchitecture = ""
+
+# Lock statistics merged (by call site) across all processors, while we're still receiving them.
+KdpLockStatistics: dict[int, list[int]] = {}
@@ -147,6 +147,235 @@ def KdpHandleReadPortAck(Data: bytes) -> None:
             interface.KD_TYPE_NONE,
             f"received corrupted `ip` acknowledgement\n")
 
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles the common part of the chunked query acknowledgements (`pt`, `ps` and
+#     `ls`), validating the packet, unpacking its entries, and requesting the next chunk if the
+#     kernel still has more entries for us.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     Address - Who sent us this packet.
+#     Data - What we got back.
+#     ExpectedState - Which state we should be in to accept this packet.
+#     PacketCommand - Name of the command (for the error messages).
+#     RequestType - Which packet we should send to request the next chunk.
+#     EntryFormat - Format of each entry in the packet.
+#
+# RETURN VALUE:
+#     None if the packet was invalid, otherwise a tuple containing the index of the first entry,
+#     the unpacked entries, and true/false depending on if this was the last chunk.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryAck(
+        Socket: socket.socket,
+        Address: tuple,
+        Data: bytes,
+        ExpectedState: int,
+        PacketCommand: str,
+        RequestType: int,
+        EntryFormat: str) -> tuple[int, list[tuple], bool] | None:
+    if protocol.KdpCurrentState != ExpectedState:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"received unexpected `{PacketCommand}` acknowledgement\n")
+        return None
+
+    HeaderSize = struct.calcsize(protocol.KDP_DEBUG_PACKET_QUERY_ACK_FORMAT)
+    EntrySize = struct.calcsize(EntryFormat)
+    if len(Data) < HeaderSize:
+        protocol.KdpCurrentState = protocol.KDP_STATE_NONE
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"received corrupted `{PacketCommand}` acknowledgement\n")
+        return None
+
+    IncomingStruct = struct.unpack(protocol.KDP_DEBUG_PACKET_QUERY_ACK_FORMAT, Data[:HeaderSize])
+    Start: int = IncomingStruct[1]
+    Count: int = IncomingStruct[2]
+    Total: int = IncomingStruct[3]
+
+    # Parameter validation (just to ensure no one can break us by manually sending bad packets).
+    if len(Data) - HeaderSize != Count * EntrySize:
+        protocol.KdpCurrentState = protocol.KDP_STATE_NONE
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"received corrupted `{PacketCommand}` acknowledgement\n")
+        return None
+
+    Entries = list(struct.iter_unpack(EntryFormat, Data[HeaderSize:]))
+
+    # Keep asking for the next chunk until we have everything.
+    if Count and Start + Count < Total:
+        Packet = struct.pack(protocol.KDP_DEBUG_PACKET_QUERY_REQ_FORMAT, RequestType, Start + Count)
+        Socket.sendto(Packet, Address)
+        return (Start, Entries, False)
+
+    protocol.KdpCurrentState = protocol.KDP_STATE_NONE
+    return (Start, Entries, True)
+
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles the received `pt` data from the kernel.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     Address - Who sent us this packet.
+#     Data - What we got back.
+#
+# RETURN VALUE:
+#     None.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryPoolTagsAck(Socket: socket.socket, Address: tuple, Data: bytes) -> None:
+    Result = KdpHandleQueryAck(
+        Socket,
+        Address,
+        Data,
+        protocol.KDP_STATE_QUERY_POOL_TAGS,
+        "pt",
+        protocol.KDP_DEBUG_PACKET_QUERY_POOL_TAGS_REQ,
+        protocol.KDP_DEBUG_POOL_TAG_INFORMATION_FORMAT)
+    if Result is None:
+        return
+
+    Start, Entries, _ = Result
+    if not Start:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"{'tag':<6} {'allocs':>12} {'bytes':>16} {'max allocs':>12} {'max bytes':>16}\n")
+
+    # Tags that were still being created when the kernel filled the chunk come back empty.
+    for (Tag, Allocations, AllocatedBytes, MaxAllocations, MaxAllocatedBytes) in Entries:
+        if not any(Tag):
+            continue
+
+        TagName = Tag.decode("ascii", errors="replace").replace("\0", " ")
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"{TagName:<6} {Allocations:>12} {AllocatedBytes:>16} " +
+            f"{MaxAllocations:>12} {MaxAllocatedBytes:>16}\n")
+
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles the received `ps` data from the kernel.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     Address - Who sent us this packet.
+#     Data - What we got back.
+#
+# RETURN VALUE:
+#     None.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryProcessorsAck(Socket: socket.socket, Address: tuple, Data: bytes) -> None:
+    Result = KdpHandleQueryAck(
+        Socket,
+        Address,
+        Data,
+        protocol.KDP_STATE_QUERY_PROCESSORS,
+        "ps",
+        protocol.KDP_DEBUG_PACKET_QUERY_PROCESSORS_REQ,
+        protocol.KDP_DEBUG_PROCESSOR_INFORMATION_FORMAT)
+    if Result is None:
+        return
+
+    Start, Entries, _ = Result
+    if not Start:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"{'processor':<10} {'ready':>12} {'steals':>12} {'stolen threads':>16} " +
+            f"{'ipis sent':>12} {'ipis skipped':>14} {'switches':>12} {'avg cycles':>12} " +
+            f"{'xstate switches':>16} {'xstate avg cycles':>18}\n")
+
+    for (Number,
+         ThreadCount,
+         StealCount,
+         StolenThreadCount,
+         DispatchIpiCount,
+         SuppressedDispatchIpiCount,
+         ContextSwitchCount,
+         ContextSwitchCycles,
+         ExtendedStateSwitchCount,
+         ExtendedStateSwitchCycles) in Entries:
+        AverageCycles = ContextSwitchCycles // ContextSwitchCount if ContextSwitchCount else 0
+        ExtendedAverageCycles = \
+            ExtendedStateSwitchCycles // ExtendedStateSwitchCount if ExtendedStateSwitchCount else 0
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"{Number:<10} {ThreadCount:>12} {StealCount:>12} {StolenThreadCount:>16} " +
+            f"{DispatchIpiCount:>12} {SuppressedDispatchIpiCount:>14} " +
+            f"{ContextSwitchCount:>12} {AverageCycles:>12} " +
+            f"{ExtendedStateSwitchCount:>16} {ExtendedAverageCycles:>18}\n")
+
+#--------------------------------------------------------------------------------------------------
+# PURPOSE:
+#     This function handles the received `ls` data from the kernel.
+#
+# PARAMETERS:
+#     Socket - What socket we're using.
+#     Address - Who sent us this packet.
+#     Data - What we got back.
+#
+# RETURN VALUE:
+#     None.
+#--------------------------------------------------------------------------------------------------
+def KdpHandleQueryLocksAck(Socket: socket.socket, Address: tuple, Data: bytes) -> None:
+    Result = KdpHandleQueryAck(
+        Socket,
+        Address,
+        Data,
+        protocol.KDP_STATE_QUERY_LOCKS,
+        "ls",
+        protocol.KDP_DEBUG_PACKET_QUERY_LOCKS_REQ,
+        protocol.KDP_DEBUG_LOCK_INFORMATION_FORMAT)
+    if Result is None:
+        return
+
+    # Merge the per-processor entries of each call site (the max hold time is the max across all
+    # processors, everything else just adds up).
+    _, Entries, Done = Result
+    for (_, Site, Acquisitions, Contentions, SpinCycles, MaxHoldCycles) in Entries:
+        Entry = protocol.KdpLockStatistics.setdefault(Site, [0, 0, 0, 0])
+        Entry[0] += Acquisitions
+        Entry[1] += Contentions
+        Entry[2] += SpinCycles
+        Entry[3] = max(Entry[3], MaxHoldCycles)
+
+    if not Done:
+        return
+
+    if not protocol.KdpLockStatistics:
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            "no lock statistics available (was the kernel built with -DKE_LOCK_STATISTICS=ON?)\n")
+        return
+
+    # Show the most expensive call sites (by time spent spinning) first.
+    interface.KdPrint(
+        interface.KD_DEST_COMMAND,
+        interface.KD_TYPE_NONE,
+        f"{'site':<18} {'acquires':>12} {'contended':>12} {'spin cycles':>16} " +
+        f"{'max hold cycles':>16}\n")
+
+    for Site, (Acquisitions, Contentions, SpinCycles, MaxHoldCycles) in sorted(
+            protocol.KdpLockStatistics.items(),
+            key=lambda Item: Item[1][2],
+            reverse=True):
+        interface.KdPrint(
+            interface.KD_DEST_COMMAND,
+            interface.KD_TYPE_NONE,
+            f"{Site:#018x} {Acquisitions:>12} {Contentions:>12} {SpinCycles:>16} " +
+            f"{MaxHoldCycles:>16}\n")
+
+    protocol.KdpLockStatistics = {}
+
 #--------------------------------------------------------------------------------------------------
 # PURPOSE:
 #     This function handles parsing an incoming debug packet.
@@ -163,7 +392,7 @@ def KdHandleIncomingPacket(Socket: socket.socket) -> tuple[bool, bool, int]:
     AllowInput = False
 
     try:
-        Data, _ = Socket.recvfrom(2048)
+        Data, Address = Socket.recvfrom(2048)
         PacketType: int = struct.unpack(protocol.KDP_DEBUG_PACKET_FORMAT, Data[:1])[0]
         if PacketType == protocol.KDP_DEBUG_PACKET_PRINT:
             Message = Data[1:].decode("utf-8")
@@ -175,6 +404,12 @@ def KdHandleIncomingPacket(Socket: socket.socket) -> tuple[bool, bool, int]:
             KdpHandleReadMemoryAck(PacketType, Data)
         elif PacketType == protocol.KDP_DEBUG_PACKET_READ_PORT_ACK:
             KdpHandleReadPortAck(Data)
+        elif PacketType == protocol.KDP_DEBUG_PACKET_QUERY_POOL_TAGS_ACK:
+            KdpHandleQueryPoolTagsAck(Socket, Address, Data)
+        elif PacketType == protocol.KDP_DEBUG_PACKET_QUERY_PROCESSORS_ACK:
+            KdpHandleQueryProcessorsAck(Socket, Address, Data)
+        elif PacketType == protocol.KDP_DEBUG_PACKET_QUERY_LOCKS_ACK:
+            KdpHandleQueryLocksAck(Socket, Address, Data)
         else:
             interface.KdPrint(
                 interface.KD_DEST_COMMAND,
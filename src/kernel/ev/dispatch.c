@@ -2,49 +2,53 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <kernel/ev.h>
+#include <kernel/evp.h>
+#include <kernel/hal.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/ob.h>
 #include <kernel/ps.h>
 #include <kernel/psp.h>
 #include <os/containing_record.h>
-#include <rt/avltree.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
 
 extern KeAffinity KiIdleProcessors;
-extern uint64_t PspGlobalThreadCount;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function attempts to wake the next available thread that was waiting for the given
- *     object (but leaves the rest of the wait list untouched).
+ *     This function removes the next wait block from the given object's wait list, and claims the
+ *     wait completion of its thread (unless a timeout or another object already claimed it first).
  *
  * PARAMETERS:
  *     Header - Common event header of the object.
+ *     WaitAll - Output; Set to true if the thread is waiting for all of its objects at once (in
+ *               which case it only needs to recheck them, instead of taking this object).
  *
  * RETURN VALUE:
- *     None.
+ *     Thread that should be queued, or NULL if there's nothing for us to wake.
  *-----------------------------------------------------------------------------------------------*/
-void EvpWakeSingleThread(EvHeader *Header) {
+static PsThread *ClaimWaitingThread(EvHeader *Header, bool *WaitAll) {
     RtDList *ListHeader = RtPopDList(&Header->WaitList);
     if (ListHeader == &Header->WaitList) {
-        return;
+        return NULL;
     }
 
+    /* The wait block lives in the waiting thread's stack, but the thread can't return before
+     * unlinking it (which needs the header lock we're holding), so it's safe to use it here. */
+    EvpWaitBlock *WaitBlock = CONTAINING_RECORD(ListHeader, EvpWaitBlock, ListHeader);
+    PsThread *Thread = WaitBlock->Thread;
+    WaitBlock->Linked = false;
+    *WaitAll = WaitBlock->WaitAll;
+
     /* Do the main checks under the processor lock; This guarantees that we'll be properly synched
-     * with EvWaitForObject (and won't accidentally "see"/try to manipulate a thread in the list
+     * with WaitForHeaders (and won't accidentally "see"/try to manipulate a thread in the list
      * before it enters the waiting state). */
-    PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, WaitListHeader);
-    Thread->WaitListLinked = false;
     KeProcessor *Processor = Thread->Processor;
-    KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
-
-    /* Everything inside the event wait list should be guaranteed to be in PS_STATE_WAITING (so we
-     * can use that as a sanity check). */
-    if (Thread->State != PS_STATE_WAITING) {
-        KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_WAITING, 0, 0);
-    }
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
 
     uint8_t ExpectedCompletion = PS_WAIT_COMPLETION_NONE;
     if (!__atomic_compare_exchange_n(
@@ -54,35 +58,62 @@ void EvpWakeSingleThread(EvHeader *Header) {
             false,
             __ATOMIC_ACQ_REL,
             __ATOMIC_ACQUIRE)) {
-        KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
-        return;
+        KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+        return NULL;
+    }
+
+    /* Any thread whose wait we could still claim should be guaranteed to be in PS_STATE_WAITING
+     * (so we can use that as a sanity check). */
+    if (Thread->State != PS_STATE_WAITING) {
+        KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_WAITING, 0, 0);
+    }
+
+    if (Thread->WaitWheelLinked) {
+        PspRemoveWaitThread(Processor, Thread);
     }
 
-    if (Thread->WaitTreeLinked) {
-        if (RtRemoveAvlTree(&Processor->WaitTree, &Thread->WaitTreeNode) != &Thread->WaitTreeNode) {
-            KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_WAITING, 1, 0);
+    Thread->WaitIndex = WaitBlock->Index;
+    Thread->State = PS_STATE_QUEUED;
+    KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+    return Thread;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function attempts to wake the next available thread that was waiting for the given
+ *     object (but leaves the rest of the wait list untouched). Threads waiting for all of multiple
+ *     objects can't take the object from us (they need to recheck everything else under all the
+ *     locks), so they just get woken up while we move on to the next waiter.
+ *
+ * PARAMETERS:
+ *     Header - Common event header of the object.
+ *
+ * RETURN VALUE:
+ *     Thread that we woke up, or NULL if all the threads we popped had already timed out (or if
+ *     the wait list was empty).
+ *-----------------------------------------------------------------------------------------------*/
+void *EvpWakeSingleThread(EvHeader *Header) {
+    while (Header->WaitList.Next != &Header->WaitList) {
+        bool WaitAll;
+        PsThread *Thread = ClaimWaitingThread(Header, &WaitAll);
+        if (!Thread) {
+            continue;
         }
 
-        Thread->WaitTreeLinked = false;
-        if (Thread->WaitTicks == Processor->ClosestWaitTick &&
-            RtQuerySizeAvlTree(&Processor->WaitTree)) {
-            Processor->ClosestWaitTick =
-                CONTAINING_RECORD(
-                    RtLookupByIndexAvlTree(&Processor->WaitTree, 0), PsThread, WaitTreeNode)
-                    ->WaitTicks;
-        } else if (Thread->WaitTicks == Processor->ClosestWaitTick) {
-            Processor->ClosestWaitTick = UINT64_MAX;
+        PspQueueThread(Thread, true);
+        if (!WaitAll) {
+            return Thread;
         }
     }
 
-    Thread->State = PS_STATE_QUEUED;
-    KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
-    PspQueueThread(Thread, true);
+    return NULL;
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function attempts to wake all threads that were waiting for the given object.
+ *     This function attempts to wake all threads that were waiting for the given object. The
+ *     threads get queued as a single batch, so that each target processor only gets locked and
+ *     notified once (instead of once per thread).
  *
  * PARAMETERS:
  *     Header - Common event header of the object.
@@ -91,88 +122,980 @@ void EvpWakeSingleThread(EvHeader *Header) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 void EvpWakeAllThreads(EvHeader *Header) {
+    RtDList ThreadList;
+    RtInitializeDList(&ThreadList);
+
     while (Header->WaitList.Next != &Header->WaitList) {
-        EvpWakeSingleThread(Header);
+        bool WaitAll;
+        PsThread *Thread = ClaimWaitingThread(Header, &WaitAll);
+        if (Thread) {
+            RtAppendDList(&ThreadList, &Thread->ListHeader);
+        }
     }
+
+    PspQueueThreads(&ThreadList, true);
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function adds the thread to the given object's waiting queue, and sets up the thread
- *     into an waiting state.
+ *     This function sorts the given headers by address, so that we can always lock them in the
+ *     same order (and never deadlock against another thread waiting on the same objects).
  *
  * PARAMETERS:
- *     Object - Which object to wait for.
+ *     Count - How many headers there are.
+ *     Headers - Which headers to sort.
+ *     Order - Output; Indices into the header array, in lock order.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void SortHeaders(uint32_t Count, EvHeader **Headers, uint8_t *Order) {
+    for (uint32_t i = 0; i < Count; i++) {
+        uint32_t j = i;
+        while (j > 0 && (uintptr_t)Headers[Order[j - 1]] > (uintptr_t)Headers[i]) {
+            Order[j] = Order[j - 1];
+            j--;
+        }
+
+        Order[j] = i;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the lock of all the given headers (skipping duplicates).
+ *
+ * PARAMETERS:
+ *     Count - How many headers there are.
+ *     Headers - Which headers to lock.
+ *     Order - Lock order (from SortHeaders).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void LockHeaders(uint32_t Count, EvHeader **Headers, uint8_t *Order) {
+    for (uint32_t i = 0; i < Count; i++) {
+        if (!i || Headers[Order[i]] != Headers[Order[i - 1]]) {
+            KeAcquireSpinLockAtCurrentIrql(&Headers[Order[i]]->Lock);
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases the lock of all the given headers (skipping duplicates).
+ *
+ * PARAMETERS:
+ *     Count - How many headers there are.
+ *     Headers - Which headers to unlock.
+ *     Order - Lock order (from SortHeaders).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void UnlockHeaders(uint32_t Count, EvHeader **Headers, uint8_t *Order) {
+    for (uint32_t i = 0; i < Count; i++) {
+        if (!i || Headers[Order[i]] != Headers[Order[i - 1]]) {
+            KeReleaseSpinLockAtCurrentIrql(&Headers[Order[i]]->Lock);
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if the current thread could take the given object right now. This
+ *     should be called with the header lock already owned.
+ *
+ * PARAMETERS:
+ *     Header - Common event header of the object.
+ *     Thread - Current thread.
+ *
+ * RETURN VALUE:
+ *     true if the object is signaled (or is a mutex we already own), false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool IsSignaled(EvHeader *Header, PsThread *Thread) {
+    if (Header->Type == EV_TYPE_MUTEX) {
+        EvMutex *Mutex = (EvMutex *)Header;
+        return Mutex->Owner == Thread || (Header->Signaled && !Mutex->Owner);
+    }
+
+    return Header->Signaled;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function takes an object that IsSignaled said was available (which only does anything
+ *     for mutexes, the other types stay signaled). This should be called with the header lock
+ *     already owned.
+ *
+ * PARAMETERS:
+ *     Header - Common event header of the object.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void Satisfy(EvHeader *Header) {
+    if (Header->Type == EV_TYPE_MUTEX) {
+        EvpTryAcquireMutex((EvMutex *)Header);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if the wait can be satisfied without blocking, taking the object(s)
+ *     if so. This should be called with all header locks already owned.
+ *
+ * PARAMETERS:
+ *     Count - How many headers there are.
+ *     Headers - Which headers we're waiting for.
+ *     Order - Lock order (from SortHeaders).
+ *     WaitAll - Whether we need all of the headers, or just any one of them.
+ *     Thread - Current thread.
+ *
+ * RETURN VALUE:
+ *     Index of the header that satisfied the wait (always 0 for WaitAll), or EV_WAIT_TIMED_OUT if
+ *     we need to block.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t TrySatisfy(
+    uint32_t Count,
+    EvHeader **Headers,
+    uint8_t *Order,
+    bool WaitAll,
+    PsThread *Thread) {
+    if (!WaitAll) {
+        for (uint32_t i = 0; i < Count; i++) {
+            if (IsSignaled(Headers[i], Thread)) {
+                Satisfy(Headers[i]);
+                return i;
+            }
+        }
+
+        return EV_WAIT_TIMED_OUT;
+    }
+
+    /* Check everything before taking anything, so that we never end up holding only part of the
+     * mutexes. */
+    for (uint32_t i = 0; i < Count; i++) {
+        if (!IsSignaled(Headers[i], Thread)) {
+            return EV_WAIT_TIMED_OUT;
+        }
+    }
+
+    /* The same object might have been passed more than once; Take each one only once (otherwise a
+     * duplicated mutex would be acquired recursively, and the caller's single release would leave
+     * us still owning it). */
+    for (uint32_t i = 0; i < Count; i++) {
+        if (!i || Headers[Order[i]] != Headers[Order[i - 1]]) {
+            Satisfy(Headers[Order[i]]);
+        }
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function removes any of our wait blocks that are still linked after waking up. If the
+ *     wait was satisfied by a mutex, the releasing thread already made us the owner, and we
+ *     finish the handoff by adding the mutex to our owned list.
+ *
+ * PARAMETERS:
+ *     Count - How many wait blocks there are.
+ *     WaitBlocks - Our wait blocks.
+ *     SatisfiedIndex - Which wait block satisfied the wait, or EV_WAIT_TIMED_OUT if none did.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void UnlinkWaitBlocks(uint32_t Count, EvpWaitBlock *WaitBlocks, uint32_t SatisfiedIndex) {
+    for (uint32_t i = 0; i < Count; i++) {
+        EvHeader *Header = WaitBlocks[i].Header;
+        KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Header->Lock, KE_IRQL_DISPATCH);
+
+        if (WaitBlocks[i].Linked) {
+            RtUnlinkDList(&WaitBlocks[i].ListHeader);
+            WaitBlocks[i].Linked = false;
+        }
+
+        if (i == SatisfiedIndex && Header->Type == EV_TYPE_MUTEX) {
+            EvMutex *Mutex = (EvMutex *)Header;
+            PsThread *Thread = WaitBlocks[i].Thread;
+            if (Mutex->Owner != Thread) {
+                KeFatalError(
+                    KE_PANIC_BAD_THREAD_STATE,
+                    (uint64_t)Mutex->Owner,
+                    (uint64_t)Thread,
+                    (uint64_t)Mutex,
+                    0);
+            }
+
+            RtAppendDList(&Thread->OwnedMutexList, &Mutex->OwnerListHeader);
+        }
+
+        KeReleaseSpinLockAndLowerIrql(&Header->Lock, OldIrql);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function waits until either any or all of the given event headers are signaled; Any
+ *     mutexes that satisfy the wait are acquired by the current thread.
+ *
+ * PARAMETERS:
+ *     Count - How many headers there are (up to EV_MAX_WAIT_OBJECTS).
+ *     Headers - Which event headers to wait for.
+ *     WaitAll - Set this to true to wait for all headers at once, instead of just any one of them.
+ *     Reference - Set this to true if the headers are part of objects (which we keep referenced
+ *                 during the wait); Otherwise, the caller guarantees their lifetime.
  *     Timeout - Either how many ns to wait, or -1 (EV_TIMEOUT_UNLIMITED) for no timeout.
  *
  * RETURN VALUE:
- *     false if the timeout expires, true otherwise.
+ *     Index of the header that satisfied the wait (always 0 for WaitAll), or EV_WAIT_TIMED_OUT if
+ *     the timeout expires.
  *-----------------------------------------------------------------------------------------------*/
-bool EvWaitForObject(void *Object, uint64_t Timeout) {
+static uint32_t WaitForHeaders(
+    uint32_t Count,
+    EvHeader **Headers,
+    bool WaitAll,
+    bool Reference,
+    uint64_t Timeout) {
     KeIrql CurrentIrql = KeGetIrql();
     if (CurrentIrql >= KE_IRQL_SYNCH) {
         KeFatalError(KE_PANIC_IRQL_NOT_LESS_OR_EQUAL, CurrentIrql, KE_IRQL_SYNCH, 0, 0);
+    } else if (Count > EV_MAX_WAIT_OBJECTS) {
+        KeFatalError(KE_PANIC_TOO_MANY_WAIT_OBJECTS, Count, EV_MAX_WAIT_OBJECTS, 0, 0);
+    } else if (!Count) {
+        return EV_WAIT_TIMED_OUT;
+    }
+
+    PsThread *CurrentThread = PsGetCurrentThread();
+
+    /* Shortcut if any of the objects is already signaled; We don't need to hold all the locks at
+     * once for this (unlike WaitAll, or the slow path, where everything needs to be atomic). */
+    if (!WaitAll && Count > 1) {
+        for (uint32_t i = 0; i < Count; i++) {
+            KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Headers[i]->Lock, KE_IRQL_DISPATCH);
+            bool Signaled = IsSignaled(Headers[i], CurrentThread);
+            if (Signaled) {
+                Satisfy(Headers[i]);
+            }
+
+            KeReleaseSpinLockAndLowerIrql(&Headers[i]->Lock, OldIrql);
+            if (Signaled) {
+                return i;
+            }
+        }
+    }
+
+    uint8_t Order[EV_MAX_WAIT_OBJECTS];
+    EvpWaitBlock WaitBlocks[EV_MAX_WAIT_OBJECTS];
+    SortHeaders(Count, Headers, Order);
+
+    /* WaitAll might need to wait multiple times (whenever we get woken up but something else is
+     * still not signaled), so we need to know how much of the timeout is left every time. */
+    uint64_t Deadline = 0;
+    if (WaitAll && Timeout && Timeout != EV_TIMEOUT_UNLIMITED) {
+        uint64_t Now = HalGetTimerTicks();
+        __uint128_t Ticks = (__uint128_t)Timeout * HalGetTimerFrequency() / EV_SECS;
+        Deadline = Ticks >= UINT64_MAX - Now ? UINT64_MAX : Now + (uint64_t)Ticks;
     }
 
+    while (true) {
+        KeIrql OldIrql = KeRaiseIrql(KE_IRQL_SYNCH);
+        LockHeaders(Count, Headers, Order);
+
+        uint32_t Result = TrySatisfy(Count, Headers, Order, WaitAll, CurrentThread);
+        if (Result != EV_WAIT_TIMED_OUT || !Timeout) {
+            UnlockHeaders(Count, Headers, Order);
+            KeLowerIrql(OldIrql);
+            return Result;
+        }
+
+        /* We're about to modify the scheduler structures, lock the current processor (IRQL is
+         * already high enough). */
+        KeProcessor *Processor = KeGetCurrentProcessor();
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+
+        /* Make sure the thread state is sane. */
+        if (CurrentThread->State != PS_STATE_RUNNING) {
+            KeFatalError(KE_PANIC_BAD_THREAD_STATE, CurrentThread->State, PS_STATE_RUNNING, 0, 0);
+        }
+
+        /* Setup the thread wait as early as possible (because it also does timeout-related
+         * calculations). */
+        for (uint32_t i = 0; Reference && i < Count; i++) {
+            ObReferenceObject(Headers[i]);
+        }
+
+        CurrentThread->WaitCompletion = PS_WAIT_COMPLETION_NONE;
+        CurrentThread->WaitWheelLinked = false;
+        for (uint32_t i = 0; i < Count; i++) {
+            WaitBlocks[i].Header = Headers[i];
+            WaitBlocks[i].Thread = CurrentThread;
+            WaitBlocks[i].Index = i;
+            WaitBlocks[i].WaitAll = WaitAll;
+            WaitBlocks[i].Linked = true;
+            RtAppendDList(&Headers[i]->WaitList, &WaitBlocks[i].ListHeader);
+        }
+
+        if (Timeout != EV_TIMEOUT_UNLIMITED) {
+            PspSetupThreadWait(Processor, CurrentThread, Timeout);
+        } else {
+            CurrentThread->WaitTicks = 0;
+        }
+
+        /* Now all we need to do on the event headers has already been done. */
+        UnlockHeaders(Count, Headers, Order);
+
+        /* Grab either the next available thread, or the idle thread if all else fails. */
+        PsThread *TargetThread = PspPopReadyThread(Processor);
+        if (!TargetThread) {
+            TargetThread = Processor->IdleThread;
+            KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
+        }
+
+        PspSwitchThreads(Processor, CurrentThread, TargetThread, PS_STATE_WAITING, OldIrql);
+
+        bool Signaled = __atomic_load_n(&CurrentThread->WaitCompletion, __ATOMIC_ACQUIRE) ==
+                        PS_WAIT_COMPLETION_SIGNAL;
+        Result = Signaled && !WaitAll ? CurrentThread->WaitIndex : EV_WAIT_TIMED_OUT;
+        UnlinkWaitBlocks(Count, WaitBlocks, Result);
+
+        for (uint32_t i = 0; Reference && i < Count; i++) {
+            ObDereferenceObject(Headers[i]);
+        }
+
+        if (!Signaled || !WaitAll) {
+            return Result;
+        }
+
+        /* One of the objects got signaled while we were waiting for all of them; Go back and
+         * recheck everything (with whatever is left of the timeout). */
+        if (Deadline) {
+            uint64_t Now = HalGetTimerTicks();
+            if (Now >= Deadline) {
+                Timeout = 0;
+            } else {
+                Timeout = (__uint128_t)(Deadline - Now) * EV_SECS / HalGetTimerFrequency();
+            }
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function adds the thread to the given object's waiting queue, and sets up the thread
+ *     into an waiting state. Waiting on a mutex acquires it.
+ *
+ * PARAMETERS:
+ *     Object - Which object to wait for.
+ *     Timeout - Either how many ns to wait, or -1 (EV_TIMEOUT_UNLIMITED) for no timeout.
+ *
+ * RETURN VALUE:
+ *     false if the timeout expires, true otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+bool EvWaitForObject(void *Object, uint64_t Timeout) {
     /* The object should always start with an EvHeader field. */
     EvHeader *Header = Object;
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Header->Lock, KE_IRQL_SYNCH);
+    return WaitForHeaders(1, &Header, false, true, Timeout) != EV_WAIT_TIMED_OUT;
+}
 
-    /* Shortcut if the event has already been signaled. */
-    if (Header->Signaled) {
-        KeReleaseSpinLockAndLowerIrql(&Header->Lock, OldIrql);
-        return true;
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function waits until either any or all of the given objects are signaled. When waiting
+ *     for all of them, they're only taken together (so we never end up owning just part of the
+ *     mutexes).
+ *
+ * PARAMETERS:
+ *     Count - How many objects there are (up to EV_MAX_WAIT_OBJECTS).
+ *     Objects - Which objects to wait for.
+ *     WaitAll - Set this to true to wait for all objects at once, instead of just any one of them.
+ *     Timeout - Either how many ns to wait, or -1 (EV_TIMEOUT_UNLIMITED) for no timeout.
+ *
+ * RETURN VALUE:
+ *     Index of the object that satisfied the wait (always 0 for WaitAll), or EV_WAIT_TIMED_OUT if
+ *     the timeout expires.
+ *-----------------------------------------------------------------------------------------------*/
+uint32_t EvWaitForMultipleObjects(uint32_t Count, void **Objects, bool WaitAll, uint64_t Timeout) {
+    /* The objects should always start with an EvHeader field. */
+    return WaitForHeaders(Count, (EvHeader **)Objects, WaitAll, true, Timeout);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function waits on an event header that isn't part of an object (such as one living in
+ *     the caller's stack); The caller is responsible for keeping it alive until the wait is over,
+ *     and until whoever signals it releases its lock.
+ *
+ * PARAMETERS:
+ *     Header - Which event header to wait for.
+ *     Timeout - Either how many ns to wait, or -1 (EV_TIMEOUT_UNLIMITED) for no timeout.
+ *
+ * RETURN VALUE:
+ *     false if the timeout expires, true otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+bool EvpWaitForHeader(EvHeader *Header, uint64_t Timeout) {
+    return WaitForHeaders(1, &Header, false, false, Timeout) != EV_WAIT_TIMED_OUT;
+}
+
+#ifndef NDEBUG
+#define TEST_DELAY (10 * EV_MILLISECS)
+#define TEST_THREADS 8
+#define TEST_ITERATIONS 1024
+#define BENCHMARK_WAITERS 64
+#define BENCHMARK_ROUNDS 16
+#define BENCHMARK_EVENTS 1024
+
+/* Objects shared between the wait self-test and its helper thread. */
+typedef struct {
+    EvSignal *Ready;
+    EvSignal *Signals[3];
+    EvMutex *Mutex;
+} TestObjects;
+
+/* Mutexes (and how many threads are currently inside each one) shared between the wait race
+ * threads. */
+typedef struct {
+    EvMutex *Mutexes[2];
+    volatile uint64_t Holders[2];
+} TestRaceState;
+
+/* Signals (and wakeup bookkeeping) shared between the broadcast benchmark and its waiters. */
+typedef struct {
+    EvSignal *Start[2];
+    EvSignal *Done;
+    uint64_t Awake;
+    uint64_t EndTicks;
+} BenchmarkState;
+
+/* Objects shared between the event loop benchmark and its service thread. */
+typedef struct {
+    EvSignal *Shutdown;
+    EvSignal *Work;
+    EvSignal *Ack;
+    uint64_t Timeouts;
+} EventLoopState;
+
+static uint32_t TestStep = 0;
+static TestRaceState TestRace = {0};
+static BenchmarkState Benchmark = {0};
+static EventLoopState EventLoop = {0};
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function makes sure a self-test wait returned what we expected.
+ *
+ * PARAMETERS:
+ *     Result - What the wait returned.
+ *     Expected - What it should have returned.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckTestWait(uint32_t Result, uint32_t Expected) {
+    TestStep++;
+    if (Result != Expected) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestStep, Result, Expected, 0);
     }
+}
 
-    if (!Timeout) {
-        KeReleaseSpinLockAndLowerIrql(&Header->Lock, OldIrql);
-        return false;
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function makes sure the self-test mutex is owned by who we expect.
+ *
+ * PARAMETERS:
+ *     Mutex - Self-test mutex.
+ *     Owner - Who should own it, or NULL if it should be free.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckTestMutex(EvMutex *Mutex, PsThread *Owner) {
+    TestStep++;
+    if (Mutex->Owner != Owner || Mutex->Recursion != (Owner ? 1 : 0)) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            TestStep,
+            (uint64_t)Mutex->Owner,
+            (uint64_t)Owner,
+            Mutex->Recursion);
     }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the wait self-test helper thread; It grabs the mutex,
+ *     and then signals/releases the objects the main thread is blocked on, one at a time.
+ *
+ * PARAMETERS:
+ *     Parameter - Self-test objects.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunWaitTest(void *Parameter) {
+    TestObjects *Objects = Parameter;
+
+    EvAcquireMutex(Objects->Mutex, EV_TIMEOUT_UNLIMITED);
+    EvSetSignal(Objects->Ready);
 
-    /* We're about to modify the scheduler structures, lock the current processor (IRQL is already
-     * high enough). */
-    KeProcessor *Processor = KeGetCurrentProcessor();
-    KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
+    /* The wait-all should get woken up by the signal, but go back to sleep until the mutex is
+     * released. */
+    PsDelayThread(TEST_DELAY);
+    EvSetSignal(Objects->Signals[0]);
+    PsDelayThread(TEST_DELAY);
+    EvReleaseMutex(Objects->Mutex);
+
+    /* And the wait-any should return the index of whatever we signal. */
+    PsDelayThread(TEST_DELAY);
+    EvSetSignal(Objects->Signals[2]);
+
+    PsTerminateThread();
+}
 
-    /* Make sure the thread state is sane. */
-    PsThread *CurrentThread = Processor->CurrentThread;
-    if (CurrentThread->State != PS_STATE_RUNNING) {
-        KeFatalError(KE_PANIC_BAD_THREAD_STATE, CurrentThread->State, PS_STATE_RUNNING, 0, 0);
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function marks the current thread as being inside one of the race test mutexes (or
+ *     leaving it), making sure nobody else ever is at the same time.
+ *
+ * PARAMETERS:
+ *     Index - Which mutex we own.
+ *     Enter - true if we just acquired the mutex, false if we're about to release it.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckTestRaceOwner(uint32_t Index, bool Enter) {
+    EvMutex *Mutex = TestRace.Mutexes[Index];
+    uint64_t Holders = Enter ? __atomic_add_fetch(&TestRace.Holders[Index], 1, __ATOMIC_ACQ_REL)
+                             : __atomic_sub_fetch(&TestRace.Holders[Index], 1, __ATOMIC_ACQ_REL);
+    if (Holders != (Enter ? 1 : 0) || Mutex->Owner != PsGetCurrentThread()) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            (uint64_t)Mutex,
+            (uint64_t)Mutex->Owner,
+            (uint64_t)PsGetCurrentThread(),
+            Holders);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the wait race threads; Each iteration either waits for
+ *     both mutexes at once (listing them in a different order depending on the thread, so lock
+ *     ordering mistakes would deadlock us), or for any one of them.
+ *
+ * PARAMETERS:
+ *     Parameter - Index of this thread.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunWaitRaceTest(void *Parameter) {
+    uint32_t Index = (uintptr_t)Parameter;
+    void *Mutexes[2] = {TestRace.Mutexes[Index & 1], TestRace.Mutexes[~Index & 1]};
+
+    for (uint32_t i = 0; i < TEST_ITERATIONS; i++) {
+        if (i & 1) {
+            uint32_t Result = EvWaitForMultipleObjects(2, Mutexes, false, EV_TIMEOUT_UNLIMITED);
+            if (Result >= 2) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Index, i, Result, 0);
+            }
+
+            uint32_t Owned = Mutexes[Result] == TestRace.Mutexes[0] ? 0 : 1;
+            CheckTestRaceOwner(Owned, true);
+            CheckTestRaceOwner(Owned, false);
+            EvReleaseMutex(TestRace.Mutexes[Owned]);
+        } else {
+            uint32_t Result = EvWaitForMultipleObjects(2, Mutexes, true, EV_TIMEOUT_UNLIMITED);
+            if (Result) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Index, i, Result, 0);
+            }
+
+            CheckTestRaceOwner(0, true);
+            CheckTestRaceOwner(1, true);
+            CheckTestRaceOwner(1, false);
+            CheckTestRaceOwner(0, false);
+            EvReleaseMutex(TestRace.Mutexes[1]);
+            EvReleaseMutex(TestRace.Mutexes[0]);
+        }
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function exercises EvWaitForMultipleObjects (debug builds only), for both wait-any and
+ *     wait-all; It covers already signaled objects, polling and timed out waits (making sure
+ *     wait-all never takes only part of the mutexes), waits that block until a helper thread
+ *     signals the objects, and finally a few threads (spread over the processors) racing wait-any
+ *     and wait-all over the same mutexes. This should be called after all processors are online,
+ *     from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpTestWaits(void) {
+    PsThread *CurrentThread = PsGetCurrentThread();
+    TestObjects Objects;
+
+    Objects.Ready = EvCreateSignal();
+    Objects.Mutex = EvCreateMutex();
+    for (uint32_t i = 0; i < 3; i++) {
+        Objects.Signals[i] = EvCreateSignal();
+    }
+
+    if (!Objects.Ready || !Objects.Mutex || !Objects.Signals[0] || !Objects.Signals[1] ||
+        !Objects.Signals[2]) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestStep, 0, 0, 0);
+    }
+
+    void *Signals[3] = {Objects.Signals[0], Objects.Signals[1], Objects.Signals[2]};
+    void *Mixed[2] = {Objects.Signals[0], Objects.Mutex};
+    void *Twice[2] = {Objects.Mutex, Objects.Mutex};
+
+    /* Nothing is signaled yet, so polling should fail right away, and a timed wait should only
+     * give up after (about) the whole timeout. */
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, false, 0), EV_WAIT_TIMED_OUT);
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, true, 0), EV_WAIT_TIMED_OUT);
+
+    uint64_t Start = HalGetTimerTicks();
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, false, TEST_DELAY), EV_WAIT_TIMED_OUT);
+    uint64_t Elapsed =
+        (__uint128_t)(HalGetTimerTicks() - Start) * EV_SECS / HalGetTimerFrequency();
+    if (Elapsed + EVP_TICK_PERIOD < TEST_DELAY) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestStep, Elapsed, TEST_DELAY, 0);
     }
 
-    /* Setup the thread wait as early as possible (because it also does timeout-related
-     * calculations). */
-    ObReferenceObject(Object);
-    CurrentThread->WaitObject = Object;
-    CurrentThread->WaitCompletion = PS_WAIT_COMPLETION_NONE;
-    CurrentThread->WaitListLinked = true;
-    CurrentThread->WaitTreeLinked = false;
-    RtAppendDList(&Header->WaitList, &CurrentThread->WaitListHeader);
-    if (Timeout != EV_TIMEOUT_UNLIMITED) {
-        PspSetupThreadWait(Processor, CurrentThread, Timeout);
-    } else {
-        CurrentThread->WaitTicks = 0;
+    /* Wait-any should take the first signaled object, and wait-all should only succeed once
+     * everything is signaled. */
+    EvSetSignal(Objects.Signals[2]);
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, false, 0), 2);
+    EvSetSignal(Objects.Signals[1]);
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, false, 0), 1);
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, true, TEST_DELAY), EV_WAIT_TIMED_OUT);
+    EvSetSignal(Objects.Signals[0]);
+    CheckTestWait(EvWaitForMultipleObjects(3, Signals, true, 0), 0);
+
+    /* Wait-all shouldn't take the mutex unless it can take everything else as well. */
+    EvClearSignal(Objects.Signals[0]);
+    CheckTestWait(EvWaitForMultipleObjects(2, Mixed, true, 0), EV_WAIT_TIMED_OUT);
+    CheckTestMutex(Objects.Mutex, NULL);
+    EvSetSignal(Objects.Signals[0]);
+    CheckTestWait(EvWaitForMultipleObjects(2, Mixed, true, 0), 0);
+    CheckTestMutex(Objects.Mutex, CurrentThread);
+    EvReleaseMutex(Objects.Mutex);
+    CheckTestMutex(Objects.Mutex, NULL);
+
+    /* Passing the same mutex twice should still only take it once (so that a single release
+     * gives it up). */
+    CheckTestWait(EvWaitForMultipleObjects(2, Twice, true, 0), 0);
+    CheckTestMutex(Objects.Mutex, CurrentThread);
+    EvReleaseMutex(Objects.Mutex);
+    CheckTestMutex(Objects.Mutex, NULL);
+
+    /* Now for the blocking paths; The helper thread will take the mutex, and then signal
+     * everything we're about to wait on. */
+    for (uint32_t i = 0; i < 3; i++) {
+        EvClearSignal(Objects.Signals[i]);
+    }
+
+    PsThread *Thread = PsCreateThread(PS_CREATE_THREAD_DEFAULT, RunWaitTest, &Objects);
+    if (!Thread) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestStep, 0, 0, 0);
+    }
+
+    CheckTestWait(EvWaitForObject(Objects.Ready, EV_TIMEOUT_UNLIMITED), true);
+    CheckTestMutex(Objects.Mutex, Thread);
+    CheckTestWait(EvWaitForMultipleObjects(2, Mixed, true, EV_TIMEOUT_UNLIMITED), 0);
+    CheckTestMutex(Objects.Mutex, CurrentThread);
+    EvReleaseMutex(Objects.Mutex);
+
+    CheckTestWait(EvWaitForMultipleObjects(2, &Signals[1], false, EV_TIMEOUT_UNLIMITED), 1);
+    CheckTestWait(EvWaitForObject(Thread, EV_TIMEOUT_UNLIMITED), true);
+
+    ObDereferenceObject(Thread);
+    ObDereferenceObject(Objects.Ready);
+    ObDereferenceObject(Objects.Mutex);
+    for (uint32_t i = 0; i < 3; i++) {
+        ObDereferenceObject(Objects.Signals[i]);
     }
 
-    /* Now all we need to do on the event header has already been done. */
-    KeReleaseSpinLockAtCurrentIrql(&Header->Lock);
+    /* Now for the races; Wait-all takes both mutexes or none of them, so nobody should ever see
+     * another thread inside a mutex they just got (and the threads should never deadlock). */
+    TestRace.Mutexes[0] = EvCreateMutex();
+    TestRace.Mutexes[1] = EvCreateMutex();
+    if (!TestRace.Mutexes[0] || !TestRace.Mutexes[1]) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestStep, 0, 0, 0);
+    }
+
+    void *Threads[TEST_THREADS];
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        Thread = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, RunWaitRaceTest, (void *)(uintptr_t)i);
+        if (!Thread) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestStep, i, HalpOnlineProcessorCount, 0);
+        }
 
-    /* Grab either the next available thread, or the idle thread if all else fails. */
-    RtDList *ListHeader = RtPopDList(&Processor->ThreadQueue);
-    PsThread *TargetThread = Processor->IdleThread;
-    if (ListHeader == &Processor->ThreadQueue) {
-        KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
-    } else {
-        __atomic_sub_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
-        __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
-        TargetThread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+        PsSetIdealProcessor(Thread, i % HalpOnlineProcessorCount);
+        PsResumeThread(Thread);
+        Threads[i] = Thread;
     }
 
-    PspSwitchThreads(Processor, CurrentThread, TargetThread, PS_STATE_WAITING, OldIrql);
+    /* Which also makes for a good wait-all test on thread objects. */
+    CheckTestWait(EvWaitForMultipleObjects(TEST_THREADS, Threads, true, EV_TIMEOUT_UNLIMITED), 0);
+    CheckTestMutex(TestRace.Mutexes[0], NULL);
+    CheckTestMutex(TestRace.Mutexes[1], NULL);
+
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        ObDereferenceObject(Threads[i]);
+    }
+
+    ObDereferenceObject(TestRace.Mutexes[0]);
+    ObDereferenceObject(TestRace.Mutexes[1]);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the broadcast benchmark waiters; Every round, we wait
+ *     for the start signal, and the last waiter to wake up records when that happened.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void RunBroadcastBenchmark(void *) {
+    for (uint32_t i = 0; i < BENCHMARK_ROUNDS; i++) {
+        EvWaitForObject(Benchmark.Start[i & 1], EV_TIMEOUT_UNLIMITED);
+        if (__atomic_add_fetch(&Benchmark.Awake, 1, __ATOMIC_ACQ_REL) == BENCHMARK_WAITERS) {
+            Benchmark.EndTicks = HalpGetTscTicks();
+            EvSetSignal(Benchmark.Done);
+        }
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function sums how many dispatch IPIs every processor sent so far.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Total dispatch IPI count.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t GetDispatchIpiCount(void) {
+    uint64_t Count = 0;
+
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        Count += __atomic_load_n(&HalpProcessorList[i]->DispatchIpiCount, __ATOMIC_RELAXED);
+    }
+
+    return Count;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures how long a single EvSetSignal takes to wake up a lot of waiters
+ *     (spread over all processors), and how many dispatch IPIs that took (debug builds only). The
+ *     results are only printed (nothing fails). This should be called after all processors are
+ *     online, from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpBenchmarkBroadcast(void) {
+    Benchmark.Start[0] = EvCreateSignal();
+    Benchmark.Start[1] = EvCreateSignal();
+    Benchmark.Done = EvCreateSignal();
+    if (!Benchmark.Start[0] || !Benchmark.Start[1] || !Benchmark.Done) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    PsThread *Threads[BENCHMARK_WAITERS];
+    for (uint32_t i = 0; i < BENCHMARK_WAITERS; i++) {
+        Threads[i] = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, RunBroadcastBenchmark, NULL);
+        if (!Threads[i]) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 0, 0, 0);
+        }
+
+        PsSetIdealProcessor(Threads[i], i % HalpOnlineProcessorCount);
+        PsResumeThread(Threads[i]);
+    }
+
+    uint64_t TotalCycles = 0;
+    uint64_t MaxCycles = 0;
+    uint64_t TotalIpis = 0;
+    for (uint32_t i = 0; i < BENCHMARK_ROUNDS; i++) {
+        /* The waiters go straight from one start signal to the other, so the next one needs to be
+         * clear before we let them go; Then give them some time to all block. */
+        EvClearSignal(Benchmark.Start[(i + 1) & 1]);
+        PsDelayThread(TEST_DELAY);
+        __atomic_store_n(&Benchmark.Awake, 0, __ATOMIC_RELEASE);
+
+        uint64_t Ipis = GetDispatchIpiCount();
+        uint64_t Start = HalpGetTscTicks();
+        EvSetSignal(Benchmark.Start[i & 1]);
+        EvWaitForObject(Benchmark.Done, EV_TIMEOUT_UNLIMITED);
+        EvClearSignal(Benchmark.Done);
+
+        uint64_t Cycles = Benchmark.EndTicks - Start;
+        TotalCycles += Cycles;
+        TotalIpis += GetDispatchIpiCount() - Ipis;
+        if (Cycles > MaxCycles) {
+            MaxCycles = Cycles;
+        }
+    }
+
+    for (uint32_t i = 0; i < BENCHMARK_WAITERS; i++) {
+        EvWaitForObject(Threads[i], EV_TIMEOUT_UNLIMITED);
+        ObDereferenceObject(Threads[i]);
+    }
+
+    ObDereferenceObject(Benchmark.Start[0]);
+    ObDereferenceObject(Benchmark.Start[1]);
+    ObDereferenceObject(Benchmark.Done);
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "broadcast benchmark (%u waiters): %llu cycles average, %llu cycles worst case, %llu "
+        "dispatch IPIs per wakeup\n",
+        BENCHMARK_WAITERS,
+        TotalCycles / BENCHMARK_ROUNDS,
+        MaxCycles,
+        TotalIpis / BENCHMARK_ROUNDS);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the event loop benchmark service thread; A single wait
+ *     handles the shutdown signal, the work signal, and a periodic timeout.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void RunEventLoopBenchmark(void *) {
+    void *Objects[2] = {EventLoop.Shutdown, EventLoop.Work};
+
+    while (true) {
+        uint32_t Result = EvWaitForMultipleObjects(2, Objects, false, TEST_DELAY);
+        if (Result == 0) {
+            break;
+        } else if (Result == 1) {
+            EvClearSignal(EventLoop.Work);
+            EvSetSignal(EventLoop.Ack);
+        } else if (Result == EV_WAIT_TIMED_OUT) {
+            EventLoop.Timeouts++;
+        } else {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Result, 0, 0, 0);
+        }
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures a multi-source event loop (debug builds only): How long it takes for
+ *     a work item to get picked up by a service thread waiting on {shutdown, work, timeout} (and
+ *     acknowledged back to us), and how long the wait-any fast path takes when one of the objects
+ *     is already signaled (compared against a single object wait). The results are only printed
+ *     (nothing fails). This should be called from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpBenchmarkEventLoop(void) {
+    EventLoop.Shutdown = EvCreateSignal();
+    EventLoop.Work = EvCreateSignal();
+    EventLoop.Ack = EvCreateSignal();
+    EventLoop.Timeouts = 0;
+    if (!EventLoop.Shutdown || !EventLoop.Work || !EventLoop.Ack) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    /* The fast path first; Nothing blocks here, as the work signal is already set. */
+    void *Objects[2] = {EventLoop.Shutdown, EventLoop.Work};
+    EvSetSignal(EventLoop.Work);
+
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_EVENTS; i++) {
+        if (EvWaitForMultipleObjects(2, Objects, false, 0) != 1) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 0, 0, 0);
+        }
+    }
+
+    uint64_t MultipleCycles = (HalpGetTscTicks() - Start) / BENCHMARK_EVENTS;
+
+    Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_EVENTS; i++) {
+        if (!EvWaitForObject(EventLoop.Work, 0)) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 1, 0, 0);
+        }
+    }
+
+    uint64_t SingleCycles = (HalpGetTscTicks() - Start) / BENCHMARK_EVENTS;
+    EvClearSignal(EventLoop.Work);
+
+    /* Now the full loop, with the service thread (preferably) on another processor. */
+    PsThread *Thread = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, RunEventLoopBenchmark, NULL);
+    if (!Thread) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 2, 0, 0);
+    }
+
+    PsSetIdealProcessor(Thread, HalpOnlineProcessorCount - 1);
+    PsResumeThread(Thread);
+
+    uint64_t TotalCycles = 0;
+    uint64_t MaxCycles = 0;
+    for (uint32_t i = 0; i < BENCHMARK_EVENTS; i++) {
+        Start = HalpGetTscTicks();
+        EvSetSignal(EventLoop.Work);
+        EvWaitForObject(EventLoop.Ack, EV_TIMEOUT_UNLIMITED);
+        uint64_t Cycles = HalpGetTscTicks() - Start;
+        EvClearSignal(EventLoop.Ack);
+
+        TotalCycles += Cycles;
+        if (Cycles > MaxCycles) {
+            MaxCycles = Cycles;
+        }
+    }
+
+    /* Let the timeout fire a few times before shutting the loop down. */
+    PsDelayThread(4 * TEST_DELAY);
+    EvSetSignal(EventLoop.Shutdown);
+    EvWaitForObject(Thread, EV_TIMEOUT_UNLIMITED);
+    ObDereferenceObject(Thread);
+
+    ObDereferenceObject(EventLoop.Shutdown);
+    ObDereferenceObject(EventLoop.Work);
+    ObDereferenceObject(EventLoop.Ack);
 
-    bool Result = __atomic_load_n(&CurrentThread->WaitCompletion, __ATOMIC_ACQUIRE) ==
-                  PS_WAIT_COMPLETION_SIGNAL;
-    CurrentThread->WaitObject = NULL;
-    ObDereferenceObject(Object);
-    return Result;
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "event loop benchmark: %llu/%llu cycles per work item (average/worst case), %llu "
+        "timeouts, %llu/%llu cycles per signaled wait-any/single wait\n",
+        TotalCycles / BENCHMARK_EVENTS,
+        MaxCycles,
+        EventLoop.Timeouts,
+        MultipleCycles,
+        SingleCycles);
 }
+#endif /* NDEBUG */
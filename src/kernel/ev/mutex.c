@@ -3,15 +3,34 @@
 
 #include <kernel/ev.h>
 #include <kernel/evp.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/mm.h>
 #include <kernel/ob.h>
 #include <kernel/obp.h>
 #include <kernel/ps.h>
+#include <os/intrin.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef NDEBUG
+#define BENCHMARK_DELAY (10 * EV_MILLISECS)
+#define BENCHMARK_ITERATIONS 1024
+#define BENCHMARK_HOLD 64
+
+/* State shared between the contended mutex benchmark and its threads. */
+typedef struct {
+    EvSignal *Start;
+    EvMutex *Mutex;
+    volatile uint64_t Counter;
+} BenchmarkState;
+
+static bool DisableSpinning = false;
+static BenchmarkState Benchmark = {0};
+#endif /* NDEBUG */
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function attempts to acquire the given mutex, and updates its contention according to
@@ -71,6 +90,80 @@ static bool TryAcquire(EvMutex *Mutex, bool IncreaseContention) {
     return false;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function tries acquiring the mutex on behalf of the dispatcher (when the mutex is one of
+ *     the objects a thread is waiting for). This should be called with the lock already owned.
+ *
+ * PARAMETERS:
+ *     Mutex - Which mutex object to try acquiring.
+ *
+ * RETURN VALUE:
+ *     Either true (we acquired the mutex), or false (we didn't).
+ *-----------------------------------------------------------------------------------------------*/
+bool EvpTryAcquireMutex(EvMutex *Mutex) {
+    return TryAcquire(Mutex, false);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function spins (with exponential backoff) while the mutex owner is running on another
+ *     processor; Critical sections are usually short, so the owner will most likely release the
+ *     mutex soon, and blocking would cost us two context switches. We give up as soon as the owner
+ *     stops running, or once we've spun for EVP_MUTEX_SPIN_LIMIT iterations.
+ *
+ * PARAMETERS:
+ *     Mutex - Which mutex object to acquire.
+ *
+ * RETURN VALUE:
+ *     true if we acquired the mutex while spinning, false if we should block instead.
+ *-----------------------------------------------------------------------------------------------*/
+static bool SpinForMutex(EvMutex *Mutex) {
+    uint32_t Backoff = 1;
+
+#ifndef NDEBUG
+    /* The benchmark compares against plain blocking. */
+    if (DisableSpinning) {
+        return false;
+    }
+#endif /* NDEBUG */
+
+    for (uint32_t Spins = 0; Spins < EVP_MUTEX_SPIN_LIMIT; Spins += Backoff) {
+        /* The owner can't go away while we hold the lock (threads can't terminate while owning a
+         * mutex), so peeking at its state is safe in here. */
+        KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Mutex->Header.Lock, KE_IRQL_DISPATCH);
+        if (TryAcquire(Mutex, false)) {
+            KeReleaseSpinLockAndLowerIrql(&Mutex->Header.Lock, OldIrql);
+            return true;
+        }
+
+        PsThread *Owner = Mutex->Owner;
+        bool OwnerRunning =
+            Owner && __atomic_load_n(&Owner->State, __ATOMIC_RELAXED) == PS_STATE_RUNNING;
+        KeReleaseSpinLockAndLowerIrql(&Mutex->Header.Lock, OldIrql);
+
+        if (!OwnerRunning) {
+            return false;
+        }
+
+        /* Back off outside the lock (so that we don't slow down the owner's release), but recheck
+         * early if the ownership changes. */
+        for (uint32_t i = 0; i < Backoff; i++) {
+            if (__atomic_load_n(&Mutex->Owner, __ATOMIC_RELAXED) != Owner) {
+                break;
+            }
+
+            PauseProcessor();
+        }
+
+        if (Backoff < EVP_MUTEX_MAX_BACKOFF) {
+            Backoff *= 2;
+        }
+    }
+
+    return false;
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function creates a new binary mutex.
@@ -114,9 +207,7 @@ bool EvTryAcquireMutex(EvMutex *Mutex) {
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function loops until we are able to acquire the mutex, increasing the recursion count if
- *     the current thread already owns the mutex. This function will block if the mutex cannot be
- *     currently acquired (until the mutex is acquired, or the timeout is reached).
+ *     This function implements EvAcquireMutex (without any of the lock statistics tracking).
  *
  * PARAMETERS:
  *     Mutex - Which mutex object to acquire.
@@ -125,7 +216,13 @@ bool EvTryAcquireMutex(EvMutex *Mutex) {
  * RETURN VALUE:
  *     true if the lock was acquired before the timeout, false otherwise.
  *-----------------------------------------------------------------------------------------------*/
-bool EvAcquireMutex(EvMutex *Mutex, uint64_t Timeout) {
+static bool AcquireMutex(EvMutex *Mutex, uint64_t Timeout) {
+    /* If the owner is currently running, it'll probably release the mutex before we would even
+     * finish blocking; Spin for a bit first (unless the caller doesn't want to wait at all). */
+    if (Timeout && SpinForMutex(Mutex)) {
+        return true;
+    }
+
     KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Mutex->Header.Lock, KE_IRQL_DISPATCH);
 
     /* Check if we can take the fast path (or update the contention and get ready to wait). */
@@ -136,8 +233,9 @@ bool EvAcquireMutex(EvMutex *Mutex, uint64_t Timeout) {
 
     KeReleaseSpinLockAndLowerIrql(&Mutex->Header.Lock, OldIrql);
 
-    /* Let's use WaitForObject and rely on EvReleaseMutex only waking up one thread at a time
-     * (so when it returns, it's either timeout or we're safe to setup the lock). */
+    /* Let's use WaitForObject and rely on it acquiring the mutex for us (either directly, or
+     * through EvReleaseMutex handing it over to the thread it wakes up); So when it returns, it's
+     * either timeout or we already own the lock. */
     if (!EvWaitForObject(Mutex, Timeout)) {
         OldIrql = KeAcquireSpinLockAndRaiseIrql(&Mutex->Header.Lock, KE_IRQL_DISPATCH);
         if (!Mutex->Contention) {
@@ -150,7 +248,8 @@ bool EvAcquireMutex(EvMutex *Mutex, uint64_t Timeout) {
     }
 
     OldIrql = KeAcquireSpinLockAndRaiseIrql(&Mutex->Header.Lock, KE_IRQL_DISPATCH);
-    if (!Mutex->Contention || Mutex->Owner || Mutex->Header.Signaled) {
+    PsThread *Thread = PsGetCurrentThread();
+    if (!Mutex->Contention || Mutex->Owner != Thread || Mutex->Header.Signaled) {
         KeFatalError(
             KE_PANIC_BAD_THREAD_STATE,
             Mutex->Contention,
@@ -159,15 +258,50 @@ bool EvAcquireMutex(EvMutex *Mutex, uint64_t Timeout) {
             (uint64_t)Mutex);
     }
 
-    Mutex->Recursion = 1;
-    Mutex->Owner = PsGetCurrentThread();
-    RtAppendDList(&((PsThread *)Mutex->Owner)->OwnedMutexList, &Mutex->OwnerListHeader);
     Mutex->Contention--;
     KeReleaseSpinLockAndLowerIrql(&Mutex->Header.Lock, OldIrql);
 
     return true;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function loops until we are able to acquire the mutex, increasing the recursion count if
+ *     the current thread already owns the mutex. This function will block if the mutex cannot be
+ *     currently acquired (until the mutex is acquired, or the timeout is reached).
+ *
+ * PARAMETERS:
+ *     Mutex - Which mutex object to acquire.
+ *     Timeout - Maximum amount to wait until the mutex is acquired.
+ *
+ * RETURN VALUE:
+ *     true if the lock was acquired before the timeout, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+bool EvAcquireMutex(EvMutex *Mutex, uint64_t Timeout) {
+#ifdef KE_LOCK_STATISTICS
+    /* Mutexes can be held across context switches (and released on another processor), so we
+     * track the hold time inside the mutex itself, instead of in the processor held lock list. */
+    void *Site = __builtin_return_address(0);
+    uint64_t StartTicks = 0;
+    if (!EvTryAcquireMutex(Mutex)) {
+        StartTicks = KiGetLockTicks();
+        if (!AcquireMutex(Mutex, Timeout)) {
+            return false;
+        }
+    }
+
+    KiRecordLockSite(Site, StartTicks);
+    if (Mutex->Recursion == 1) {
+        Mutex->AcquireSite = Site;
+        Mutex->AcquireTicks = KiGetLockTicks();
+    }
+
+    return true;
+#else
+    return AcquireMutex(Mutex, Timeout);
+#endif /* KE_LOCK_STATISTICS */
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function decreases the recursion count for the given mutex, releasing it when the count
@@ -195,12 +329,25 @@ void EvReleaseMutex(EvMutex *Mutex) {
             Mutex->Contention);
     } else if (!--Mutex->Recursion) {
         /* Take a bit of caution here; If we just set ourselves as signaled and wake up the next
-         * thread, that thread and someone else that just called WaitForObject might see it as
-         * signaled/acquirable, and that would cause a lot of trouble. */
+         * thread, that thread and someone else that just called WaitForObject (or that is
+         * spinning) might see it as signaled/acquirable, and that would cause a lot of trouble.
+         * Instead, hand the ownership directly to the next waiter (skipping any that already timed
+         * out, or that are waiting for all of multiple objects), and only become signaled if nobody
+         * is left. */
         RtUnlinkDList(&Mutex->OwnerListHeader);
         Mutex->Owner = NULL;
-        if (Mutex->Header.WaitList.Next != &Mutex->Header.WaitList) {
-            EvpWakeSingleThread(&Mutex->Header);
+
+#ifdef KE_LOCK_STATISTICS
+        if (Mutex->AcquireSite) {
+            KiRecordLockHold(Mutex->AcquireSite, Mutex->AcquireTicks);
+            Mutex->AcquireSite = NULL;
+        }
+#endif /* KE_LOCK_STATISTICS */
+
+        PsThread *NextOwner = EvpWakeSingleThread(&Mutex->Header);
+        if (NextOwner) {
+            Mutex->Recursion = 1;
+            Mutex->Owner = NextOwner;
         } else {
             Mutex->Header.Signaled = true;
         }
@@ -208,3 +355,143 @@ void EvReleaseMutex(EvMutex *Mutex) {
 
     KeReleaseSpinLockAndLowerIrql(&Mutex->Header.Lock, OldIrql);
 }
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the contended mutex benchmark threads; Once started,
+ *     we keep taking the mutex for a short critical section.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void RunMutexBenchmark(void *) {
+    EvWaitForObject(Benchmark.Start, EV_TIMEOUT_UNLIMITED);
+
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        EvAcquireMutex(Benchmark.Mutex, EV_TIMEOUT_UNLIMITED);
+        for (uint32_t j = 0; j < BENCHMARK_HOLD; j++) {
+            PauseProcessor();
+        }
+
+        Benchmark.Counter++;
+        EvReleaseMutex(Benchmark.Mutex);
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function sums how many context switches every processor did so far.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Total context switch count.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t GetContextSwitchCount(void) {
+    uint64_t Count = 0;
+
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        Count += __atomic_load_n(&HalpProcessorList[i]->ContextSwitchCount, __ATOMIC_RELAXED);
+    }
+
+    return Count;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function runs a single round of the contended mutex benchmark.
+ *
+ * PARAMETERS:
+ *     ThreadCount - How many threads should fight over the mutex.
+ *     Spin - Whether the threads are allowed to spin before blocking.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunMutexBenchmarkRound(uint32_t ThreadCount, bool Spin) {
+    PsThread *Threads[16];
+
+    DisableSpinning = !Spin;
+    Benchmark.Counter = 0;
+    EvClearSignal(Benchmark.Start);
+
+    for (uint32_t i = 0; i < ThreadCount; i++) {
+        Threads[i] = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, RunMutexBenchmark, NULL);
+        if (!Threads[i]) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, ThreadCount, i, 0, 0);
+        }
+
+        PsSetIdealProcessor(Threads[i], i % HalpOnlineProcessorCount);
+        PsResumeThread(Threads[i]);
+    }
+
+    /* Give everyone some time to block on the start signal, so that they all start together. */
+    PsDelayThread(BENCHMARK_DELAY);
+
+    uint64_t Switches = GetContextSwitchCount();
+    uint64_t Start = HalpGetTscTicks();
+    EvSetSignal(Benchmark.Start);
+
+    for (uint32_t i = 0; i < ThreadCount; i++) {
+        EvWaitForObject(Threads[i], EV_TIMEOUT_UNLIMITED);
+    }
+
+    uint64_t Cycles = HalpGetTscTicks() - Start;
+    Switches = GetContextSwitchCount() - Switches;
+
+    for (uint32_t i = 0; i < ThreadCount; i++) {
+        ObDereferenceObject(Threads[i]);
+    }
+
+    if (Benchmark.Counter != ThreadCount * BENCHMARK_ITERATIONS) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, ThreadCount, Spin, Benchmark.Counter, 0);
+    }
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "mutex benchmark (%u threads, %s): %llu cycles per critical section, %llu context "
+        "switches\n",
+        ThreadCount,
+        Spin ? "spinning" : "blocking",
+        Cycles / (ThreadCount * BENCHMARK_ITERATIONS),
+        Switches);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures short critical sections on a contended mutex (debug builds only),
+ *     at 2, 4, 8 and 16 threads (spread over the processors), with and without spinning before
+ *     blocking; The context switch count shows how many switches spinning avoided. The results
+ *     are only printed (nothing fails). This should be called after all processors are online,
+ *     from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpBenchmarkMutex(void) {
+    Benchmark.Start = EvCreateSignal();
+    Benchmark.Mutex = EvCreateMutex();
+    if (!Benchmark.Start || !Benchmark.Mutex) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    for (uint32_t ThreadCount = 2; ThreadCount <= 16; ThreadCount *= 2) {
+        RunMutexBenchmarkRound(ThreadCount, true);
+        RunMutexBenchmarkRound(ThreadCount, false);
+    }
+
+    DisableSpinning = false;
+    ObDereferenceObject(Benchmark.Start);
+    ObDereferenceObject(Benchmark.Mutex);
+}
+#endif /* NDEBUG */
@@ -0,0 +1,738 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <kernel/ev.h>
+#include <kernel/evp.h>
+#include <kernel/halp.h>
+#include <kernel/ke.h>
+#include <kernel/ob.h>
+#include <kernel/ps.h>
+#include <os/intrin.h>
+#include <rt/list.h>
+#include <stdint.h>
+
+/* Push locks are a single pointer-sized word; While nobody is waiting, it holds the exclusive bit
+ * and the shared owner count. Once someone needs to wait, it gets replaced by a pointer to the
+ * newest wait block (these live in the waiters' stacks, and are chained from newest to oldest),
+ * and the shared count moves into that block. Any change to the chain (or to anything while the
+ * chain exists) happens with the LIST_LOCKED bit held. */
+typedef struct WaitBlock {
+    struct WaitBlock *Next;
+    uint64_t ShareCount;
+    EvHeader Header;
+    bool Exclusive;
+    bool Blocking;
+} __attribute__((aligned(16))) WaitBlock;
+
+#ifndef NDEBUG
+#define TEST_THREADS 8
+#define TEST_ITERATIONS 1024
+
+/* Self-test state; One of these is used through the blocking functions, and the other through the
+ * spinning functions (as a single lock can't mix both). */
+typedef struct {
+    EvPushLock Lock;
+    volatile uint64_t Readers;
+    volatile uint64_t Writer;
+    volatile uint64_t Counter;
+} TestState;
+
+static TestState TestStates[2] = {0};
+#endif /* NDEBUG */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the LIST_LOCKED bit of the given push lock. This should be called
+ *     at DISPATCH (as other processors will spin while we hold it).
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to use.
+ *
+ * RETURN VALUE:
+ *     Value of the lock word at the moment we acquired it (without the LIST_LOCKED bit).
+ *-----------------------------------------------------------------------------------------------*/
+static uintptr_t LockWaitList(EvPushLock *Lock) {
+    while (true) {
+        uintptr_t Value = __atomic_load_n(Lock, __ATOMIC_RELAXED);
+        if (!(Value & EVP_PUSH_LOCK_LIST_LOCKED) &&
+            __atomic_compare_exchange_n(
+                Lock,
+                &Value,
+                Value | EVP_PUSH_LOCK_LIST_LOCKED,
+                false,
+                __ATOMIC_ACQUIRE,
+                __ATOMIC_RELAXED)) {
+            return Value;
+        }
+
+        PauseProcessor();
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function marks the given wait block as signaled (and wakes up its owner if it's
+ *     sleeping). The block might vanish as soon as we're done with it, so don't touch it after
+ *     calling this function.
+ *
+ * PARAMETERS:
+ *     Block - Which wait block to signal.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void SignalWaitBlock(WaitBlock *Block) {
+    if (!Block->Blocking) {
+        __atomic_store_n(&Block->Header.Signaled, true, __ATOMIC_RELEASE);
+        return;
+    }
+
+    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Block->Header.Lock, KE_IRQL_DISPATCH);
+    __atomic_store_n(&Block->Header.Signaled, true, __ATOMIC_RELEASE);
+    EvpWakeSingleThread(&Block->Header);
+    KeReleaseSpinLockAndLowerIrql(&Block->Header.Lock, OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function waits until someone signals the given wait block (handing us the lock).
+ *     Blocking waiters only spin for a little while before going to sleep.
+ *
+ * PARAMETERS:
+ *     Block - Which wait block to wait on.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void WaitForBlock(WaitBlock *Block) {
+    uint64_t Spins = 0;
+    while (!__atomic_load_n(&Block->Header.Signaled, __ATOMIC_ACQUIRE)) {
+        if (Block->Blocking && Spins++ >= EVP_PUSH_LOCK_SPIN_COUNT) {
+            EvpWaitForHeader(&Block->Header, EV_TIMEOUT_UNLIMITED);
+            break;
+        }
+
+        PauseProcessor();
+    }
+
+    /* The block lives in our stack, so we can't leave while the waker is still holding its
+     * lock. */
+    while (KeTestSpinLockAtCurrentIrql(&Block->Header.Lock)) {
+        PauseProcessor();
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function hands the (just released) push lock to the oldest waiter(s); Either the
+ *     oldest waiter alone (if it wants exclusive access), or every shared waiter older than the
+ *     oldest exclusive one. This should be called at DISPATCH, with the LIST_LOCKED bit held.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to use.
+ *     Head - Newest wait block in the chain.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void GrantWaiters(EvPushLock *Lock, WaitBlock *Head) {
+    WaitBlock *Previous = NULL;
+    WaitBlock *BeforeTail = NULL;
+    WaitBlock *LastExclusive = NULL;
+
+    for (WaitBlock *Block = Head; Block; Block = Block->Next) {
+        if (Block->Exclusive) {
+            LastExclusive = Block;
+        }
+
+        BeforeTail = Previous;
+        Previous = Block;
+    }
+
+    /* Detach whoever we're granting from the end of the chain (where the oldest waiters are). */
+    WaitBlock *Tail = Previous;
+    WaitBlock *GrantedList;
+    uint64_t ShareCount = 0;
+    uintptr_t Flags = 0;
+
+    if (Tail->Exclusive) {
+        GrantedList = Tail;
+        Flags = EVP_PUSH_LOCK_EXCLUSIVE;
+        if (BeforeTail) {
+            BeforeTail->Next = NULL;
+        } else {
+            Head = NULL;
+        }
+    } else {
+        GrantedList = LastExclusive ? LastExclusive->Next : Head;
+        if (LastExclusive) {
+            LastExclusive->Next = NULL;
+        } else {
+            Head = NULL;
+        }
+
+        for (WaitBlock *Block = GrantedList; Block; Block = Block->Next) {
+            ShareCount++;
+        }
+    }
+
+    /* Publish the new owners (dropping LIST_LOCKED) before waking any of them up. */
+    if (Head) {
+        Head->ShareCount = ShareCount;
+        __atomic_store_n(Lock, (uintptr_t)Head | EVP_PUSH_LOCK_WAITING | Flags, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(Lock, (ShareCount << EVP_PUSH_LOCK_SHARE_SHIFT) | Flags, __ATOMIC_RELEASE);
+    }
+
+    while (GrantedList) {
+        WaitBlock *Next = GrantedList->Next;
+        SignalWaitBlock(GrantedList);
+        GrantedList = Next;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the push lock, waiting if necessary. New shared owners queue up behind
+ *     anyone already waiting (so that writers don't get starved by a stream of readers).
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *     Exclusive - Set this to true for exclusive access, or to false for shared access.
+ *     Blocking - Set this to true if we should go to sleep (instead of spinning) while waiting.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void AcquirePushLock(EvPushLock *Lock, bool Exclusive, bool Blocking) {
+    uintptr_t Value = __atomic_load_n(Lock, __ATOMIC_RELAXED);
+    uintptr_t NewValue = Value + EVP_PUSH_LOCK_SHARE_INCREMENT;
+    uintptr_t BusyMask = EVP_PUSH_LOCK_EXCLUSIVE | EVP_PUSH_LOCK_WAITING;
+    if (Exclusive) {
+        NewValue = EVP_PUSH_LOCK_EXCLUSIVE;
+        BusyMask = ~(uintptr_t)0;
+    }
+
+    /* Fast path, a single CAS when nobody is in our way (exclusive access needs the lock to be
+     * completely free). */
+    if (!(Value & (BusyMask | EVP_PUSH_LOCK_LIST_LOCKED)) &&
+        __atomic_compare_exchange_n(
+            Lock,
+            &Value,
+            NewValue,
+            false,
+            __ATOMIC_ACQUIRE,
+            __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    WaitBlock Block;
+    Block.Exclusive = Exclusive;
+    Block.Blocking = Blocking;
+    Block.Header.Type = EV_TYPE_SIGNAL;
+    Block.Header.Lock = 0;
+    Block.Header.Signaled = false;
+    RtInitializeDList(&Block.Header.WaitList);
+
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    Value = LockWaitList(Lock);
+
+    WaitBlock *Head = NULL;
+    uint64_t ShareCount = Value >> EVP_PUSH_LOCK_SHARE_SHIFT;
+    if (Value & EVP_PUSH_LOCK_WAITING) {
+        Head = (WaitBlock *)(Value & EVP_PUSH_LOCK_POINTER_MASK);
+        ShareCount = Head->ShareCount;
+    }
+
+    /* The fast path might have only failed because of someone else's (now finished) update. */
+    if (!(Value & EVP_PUSH_LOCK_EXCLUSIVE) && !Head && (!Exclusive || !ShareCount)) {
+        NewValue = Exclusive ? EVP_PUSH_LOCK_EXCLUSIVE
+                             : (ShareCount + 1) << EVP_PUSH_LOCK_SHARE_SHIFT;
+        __atomic_store_n(Lock, NewValue, __ATOMIC_RELEASE);
+        KeLowerIrql(OldIrql);
+        return;
+    }
+
+    /* Otherwise, push ourselves as the newest waiter; Whoever releases the lock will hand it to
+     * us. */
+    Block.Next = Head;
+    Block.ShareCount = ShareCount;
+    __atomic_store_n(
+        Lock,
+        (uintptr_t)&Block | EVP_PUSH_LOCK_WAITING | (Value & EVP_PUSH_LOCK_EXCLUSIVE),
+        __ATOMIC_RELEASE);
+    KeLowerIrql(OldIrql);
+
+    WaitForBlock(&Block);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases the push lock, handing it to the next waiter(s) if we were the last
+ *     owner.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *     Exclusive - Set this to true if we own the lock exclusively, or to false if shared.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ReleasePushLock(EvPushLock *Lock, bool Exclusive) {
+    uintptr_t Value = __atomic_load_n(Lock, __ATOMIC_RELAXED);
+
+    /* Fast path, nobody is waiting (nor touching the wait list). */
+    while (!(Value & (EVP_PUSH_LOCK_WAITING | EVP_PUSH_LOCK_LIST_LOCKED))) {
+        uintptr_t NewValue = Exclusive ? 0 : Value - EVP_PUSH_LOCK_SHARE_INCREMENT;
+        if (__atomic_compare_exchange_n(
+                Lock,
+                &Value,
+                NewValue,
+                false,
+                __ATOMIC_RELEASE,
+                __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    Value = LockWaitList(Lock);
+
+    if (!(Value & EVP_PUSH_LOCK_WAITING)) {
+        uintptr_t NewValue = Exclusive ? 0 : Value - EVP_PUSH_LOCK_SHARE_INCREMENT;
+        __atomic_store_n(Lock, NewValue, __ATOMIC_RELEASE);
+        KeLowerIrql(OldIrql);
+        return;
+    }
+
+    /* Other shared owners are still around, the last one of them will do the handoff. */
+    WaitBlock *Head = (WaitBlock *)(Value & EVP_PUSH_LOCK_POINTER_MASK);
+    if (!Exclusive && --Head->ShareCount) {
+        __atomic_store_n(Lock, Value, __ATOMIC_RELEASE);
+        KeLowerIrql(OldIrql);
+        return;
+    }
+
+    GrantWaiters(Lock, Head);
+    KeLowerIrql(OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the push lock for shared (read) access, going to sleep if necessary.
+ *     This should be called below DISPATCH, and the lock should only ever be used with the
+ *     blocking functions.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvAcquirePushLockShared(EvPushLock *Lock) {
+    AcquirePushLock(Lock, false, true);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the push lock for exclusive (write) access, going to sleep if
+ *     necessary. This should be called below DISPATCH, and the lock should only ever be used with
+ *     the blocking functions.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvAcquirePushLockExclusive(EvPushLock *Lock) {
+    AcquirePushLock(Lock, true, true);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases shared access to the push lock.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvReleasePushLockShared(EvPushLock *Lock) {
+    ReleasePushLock(Lock, false);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases exclusive access to the push lock.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvReleasePushLockExclusive(EvPushLock *Lock) {
+    ReleasePushLock(Lock, true);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function raises the IRQL to DISPATCH, and acquires the push lock for shared (read)
+ *     access, spinning if necessary. The lock should only ever be used with the spinning
+ *     functions.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *
+ * RETURN VALUE:
+ *     Previous IRQL value.
+ *-----------------------------------------------------------------------------------------------*/
+KeIrql EvAcquireSpinPushLockShared(EvPushLock *Lock) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    AcquirePushLock(Lock, false, false);
+    return OldIrql;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function raises the IRQL to DISPATCH, and acquires the push lock for exclusive (write)
+ *     access, spinning if necessary. The lock should only ever be used with the spinning
+ *     functions.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *
+ * RETURN VALUE:
+ *     Previous IRQL value.
+ *-----------------------------------------------------------------------------------------------*/
+KeIrql EvAcquireSpinPushLockExclusive(EvPushLock *Lock) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    AcquirePushLock(Lock, true, false);
+    return OldIrql;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases shared access to the push lock, and lowers the IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *     OldIrql - Value returned by EvAcquireSpinPushLockShared.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvReleaseSpinPushLockShared(EvPushLock *Lock, KeIrql OldIrql) {
+    ReleasePushLock(Lock, false);
+    KeLowerIrql(OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases exclusive access to the push lock, and lowers the IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *     OldIrql - Value returned by EvAcquireSpinPushLockExclusive.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvReleaseSpinPushLockExclusive(EvPushLock *Lock, KeIrql OldIrql) {
+    ReleasePushLock(Lock, true);
+    KeLowerIrql(OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks (on debug builds) that we're exactly at DISPATCH; The lock internals
+ *     raise to DISPATCH (which panics above it), and holding a spinning lock below DISPATCH would
+ *     let us get preempted while other processors spin on it.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckDispatchIrql(void) {
+#ifndef NDEBUG
+    KeIrql Irql = KeGetIrql();
+    if (Irql != KE_IRQL_DISPATCH) {
+        KeFatalError(KE_PANIC_IRQL_NOT_EQUAL, KE_IRQL_DISPATCH, Irql, 0, 0);
+    }
+#endif /* NDEBUG */
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the push lock for shared (read) access, spinning if necessary. This
+ *     should be called at DISPATCH (usually while already holding another spin lock), and the
+ *     lock should only ever be used with the spinning functions.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvAcquireSpinPushLockSharedAtCurrentIrql(EvPushLock *Lock) {
+    CheckDispatchIrql();
+    AcquirePushLock(Lock, false, false);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the push lock for exclusive (write) access, spinning if necessary.
+ *     This should be called at DISPATCH (usually while already holding another spin lock), and
+ *     the lock should only ever be used with the spinning functions.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to acquire.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvAcquireSpinPushLockExclusiveAtCurrentIrql(EvPushLock *Lock) {
+    CheckDispatchIrql();
+    AcquirePushLock(Lock, true, false);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases shared access to the push lock, without touching the IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvReleaseSpinPushLockSharedAtCurrentIrql(EvPushLock *Lock) {
+    CheckDispatchIrql();
+    ReleasePushLock(Lock, false);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases exclusive access to the push lock, without touching the IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to release.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvReleaseSpinPushLockExclusiveAtCurrentIrql(EvPushLock *Lock) {
+    CheckDispatchIrql();
+    ReleasePushLock(Lock, true);
+}
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function makes sure a push lock that nobody is waiting on holds the expected value.
+ *
+ * PARAMETERS:
+ *     Lock - Which push lock to check.
+ *     Expected - What the lock word should be.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckTestLock(EvPushLock *Lock, uintptr_t Expected) {
+    uintptr_t Value = __atomic_load_n(Lock, __ATOMIC_RELAXED);
+    if (Value != Expected) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)Lock, Value, Expected, 0);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires one of the self-test locks, makes sure nobody is inside it in a
+ *     conflicting mode, and releases it again.
+ *
+ * PARAMETERS:
+ *     State - Which self-test state to use.
+ *     Exclusive - Set this to true for exclusive access, or to false for shared access.
+ *     Blocking - Set this to true to use the blocking functions, or to false for the spinning ones.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunTestIteration(TestState *State, bool Exclusive, bool Blocking) {
+    KeIrql OldIrql = KE_IRQL_PASSIVE;
+    if (Blocking && Exclusive) {
+        EvAcquirePushLockExclusive(&State->Lock);
+    } else if (Blocking) {
+        EvAcquirePushLockShared(&State->Lock);
+    } else if (Exclusive) {
+        OldIrql = EvAcquireSpinPushLockExclusive(&State->Lock);
+    } else {
+        OldIrql = EvAcquireSpinPushLockShared(&State->Lock);
+    }
+
+    if (Exclusive) {
+        uint64_t Writer = __atomic_exchange_n(&State->Writer, 1, __ATOMIC_RELAXED);
+        uint64_t Readers = __atomic_load_n(&State->Readers, __ATOMIC_RELAXED);
+        if (Writer || Readers) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                (uint64_t)&State->Lock,
+                Writer,
+                Readers,
+                State->Counter);
+        }
+
+        /* Not atomic on purpose (any lost update means someone else was inside the lock); On the
+         * blocking lock, also give everyone else the chance to pile up (and go to sleep) behind
+         * us. */
+        uint64_t Counter = State->Counter;
+        if (Blocking) {
+            PsYieldThread();
+        } else {
+            PauseProcessor();
+        }
+
+        State->Counter = Counter + 1;
+        __atomic_store_n(&State->Writer, 0, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&State->Readers, 1, __ATOMIC_RELAXED);
+        uint64_t Writer = __atomic_load_n(&State->Writer, __ATOMIC_RELAXED);
+        if (Writer) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE, (uint64_t)&State->Lock, Writer, State->Readers, 0);
+        }
+
+        PauseProcessor();
+        __atomic_sub_fetch(&State->Readers, 1, __ATOMIC_RELAXED);
+    }
+
+    if (Blocking && Exclusive) {
+        EvReleasePushLockExclusive(&State->Lock);
+    } else if (Blocking) {
+        EvReleasePushLockShared(&State->Lock);
+    } else if (Exclusive) {
+        EvReleaseSpinPushLockExclusive(&State->Lock, OldIrql);
+    } else {
+        EvReleaseSpinPushLockShared(&State->Lock, OldIrql);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the self-test threads; Every fourth acquisition is
+ *     exclusive (at a different phase for each thread), and the rest are shared.
+ *
+ * PARAMETERS:
+ *     Parameter - Index of this thread.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunPushLockTest(void *Parameter) {
+    uint32_t Index = (uintptr_t)Parameter;
+
+    for (uint32_t i = 0; i < TEST_ITERATIONS; i++) {
+        bool Exclusive = !((i + Index) & 3);
+        RunTestIteration(&TestStates[0], Exclusive, true);
+        RunTestIteration(&TestStates[1], Exclusive, false);
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function exercises the push locks (debug builds only); It first checks the lock word
+ *     for every combination of owners on the current thread, and then has a few threads (spread
+ *     over the processors) fight over a blocking and a spinning lock, making sure shared and
+ *     exclusive owners never overlap, and that no exclusive update ever gets lost. This should be
+ *     called after all processors are online, from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpTestPushLocks(void) {
+    EvPushLock Lock = 0;
+    EvPushLock SpinLock = 0;
+
+    /* Without any waiters, the lock word should just hold the exclusive bit or the owner count. */
+    EvAcquirePushLockShared(&Lock);
+    EvAcquirePushLockShared(&Lock);
+    CheckTestLock(&Lock, 2 * EVP_PUSH_LOCK_SHARE_INCREMENT);
+    EvReleasePushLockShared(&Lock);
+    CheckTestLock(&Lock, EVP_PUSH_LOCK_SHARE_INCREMENT);
+    EvReleasePushLockShared(&Lock);
+    CheckTestLock(&Lock, 0);
+    EvAcquirePushLockExclusive(&Lock);
+    CheckTestLock(&Lock, EVP_PUSH_LOCK_EXCLUSIVE);
+    EvReleasePushLockExclusive(&Lock);
+    CheckTestLock(&Lock, 0);
+
+    /* The spinning functions should raise to DISPATCH (and the AtCurrentIrql ones should nest
+     * inside them without touching the IRQL). */
+    KeIrql OldIrql = EvAcquireSpinPushLockShared(&SpinLock);
+    EvAcquireSpinPushLockSharedAtCurrentIrql(&SpinLock);
+    KeIrql Irql = KeGetIrql();
+    if (Irql != KE_IRQL_DISPATCH) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)&SpinLock, Irql, OldIrql, 0);
+    }
+
+    CheckTestLock(&SpinLock, 2 * EVP_PUSH_LOCK_SHARE_INCREMENT);
+    EvReleaseSpinPushLockSharedAtCurrentIrql(&SpinLock);
+    EvReleaseSpinPushLockShared(&SpinLock, OldIrql);
+    CheckTestLock(&SpinLock, 0);
+
+    OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    EvAcquireSpinPushLockExclusiveAtCurrentIrql(&SpinLock);
+    CheckTestLock(&SpinLock, EVP_PUSH_LOCK_EXCLUSIVE);
+    EvReleaseSpinPushLockExclusiveAtCurrentIrql(&SpinLock);
+    KeLowerIrql(OldIrql);
+    CheckTestLock(&SpinLock, 0);
+
+    Irql = KeGetIrql();
+    if (Irql != OldIrql) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)&SpinLock, Irql, OldIrql, 0);
+    }
+
+    /* Now for the contended paths; Spread the threads over the processors, so that the spinning
+     * lock is actually contended (instead of just serialized by the scheduler). */
+    void *Threads[TEST_THREADS];
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        PsThread *Thread =
+            PsCreateThread(PS_CREATE_THREAD_SUSPENDED, RunPushLockTest, (void *)(uintptr_t)i);
+        if (!Thread) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, HalpOnlineProcessorCount, 0, 0);
+        }
+
+        PsSetIdealProcessor(Thread, i % HalpOnlineProcessorCount);
+        PsResumeThread(Thread);
+        Threads[i] = Thread;
+    }
+
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        EvWaitForObject(Threads[i], EV_TIMEOUT_UNLIMITED);
+        ObDereferenceObject(Threads[i]);
+    }
+
+    uint64_t Expected = TEST_THREADS * (TEST_ITERATIONS / 4);
+    for (uint32_t i = 0; i < 2; i++) {
+        TestState *State = &TestStates[i];
+        CheckTestLock(&State->Lock, 0);
+        if (State->Counter != Expected || State->Readers || State->Writer) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                (uint64_t)&State->Lock,
+                State->Counter,
+                Expected,
+                State->Readers);
+        }
+    }
+}
+#endif /* NDEBUG */
@@ -1,10 +1,96 @@
 /* SPDX-FileCopyrightText: (C) 2025-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <kernel/evp.h>
 #include <kernel/hal.h>
 #include <kernel/halp.h>
 #include <kernel/ke.h>
 #include <kernel/ps.h>
+#include <kernel/psp.h>
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function stops the periodic tick on the current processor, arming the timer to fire
+ *     only once the closest wait expires (capped to EVP_MAX_STOPPED_TICKS). Nothing happens if the
+ *     closest wait is already due on the next tick.
+ *
+ * PARAMETERS:
+ *     Processor - Pointer to the current processor structure.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpStopTick(KeProcessor *Processor) {
+    void *Context = HalpEnterCriticalSection();
+
+    /* If the tick was already stopped, catch up first, as the old deadline is relative to a tick
+     * count that isn't valid anymore. */
+    EvpRestartTick(Processor, false);
+
+    uint64_t ClosestWaitTick = Processor->ClosestWaitTick;
+    if (ClosestWaitTick <= Processor->Ticks + 1) {
+        HalpLeaveCriticalSection(Context);
+        return;
+    }
+
+    uint64_t Ticks = ClosestWaitTick - Processor->Ticks;
+    if (Ticks > EVP_MAX_STOPPED_TICKS) {
+        Ticks = EVP_MAX_STOPPED_TICKS;
+    }
+
+    Processor->TickStopped = true;
+    HalpSetTimerDeadline(Ticks);
+    HalpLeaveCriticalSection(Context);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function restarts the periodic tick on the current processor (if it was stopped),
+ *     accounting for all the ticks that elapsed in the meantime, and triggering a dispatch event
+ *     if any waits expired while we weren't looking.
+ *
+ * PARAMETERS:
+ *     Processor - Pointer to the current processor structure.
+ *     TimerFired - Set this to true if we're being called from the timer interrupt (which always
+ *                  counts as at least one tick, and handles dispatching by itself).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void EvpRestartTick(KeProcessor *Processor, bool TimerFired) {
+    void *Context = HalpEnterCriticalSection();
+    if (!Processor->TickStopped) {
+        HalpLeaveCriticalSection(Context);
+        return;
+    }
+
+    HalpSetPeriodicTimer();
+    Processor->TickStopped = false;
+
+    /* The tick count should always follow the timer source; If it fell behind (because we had
+     * no periodic ticks for a while), bring it back up to date. */
+    uint64_t Elapsed = HalGetTimerTicks() - Processor->TickBaseTime;
+    uint64_t Ticks = (__uint128_t)Elapsed * EV_SECS / HalGetTimerFrequency() / EVP_TICK_PERIOD;
+    if (TimerFired && Ticks <= Processor->Ticks) {
+        Ticks = Processor->Ticks + 1;
+    }
+
+    if (Ticks > Processor->Ticks) {
+        if (Processor->CurrentThread != Processor->IdleThread) {
+            Processor->LowIrqlTicks += Ticks - Processor->Ticks;
+        } else {
+            Processor->IdleTicks += Ticks - Processor->Ticks;
+        }
+
+        Processor->Ticks = Ticks;
+    }
+
+    if (!TimerFired && Processor->Ticks >= Processor->ClosestWaitTick) {
+        HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
+    }
+
+    HalpLeaveCriticalSection(Context);
+}
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -19,13 +105,18 @@
 void EvpHandleTimer(HalInterruptFrame *InterruptFrame) {
     KeProcessor *Processor = KeGetCurrentProcessor();
 
-    /* Update the runtime counters. */
-    Processor->Ticks++;
-    if (InterruptFrame->Irql >= KE_IRQL_DISPATCH) {
+    /* Update the runtime counters; If the tick was stopped, this is the one-shot deadline (or an
+     * earlier wake up), so catch up on everything we missed instead. */
+    if (Processor->TickStopped) {
+        EvpRestartTick(Processor, true);
+    } else if (InterruptFrame->Irql >= KE_IRQL_DISPATCH) {
+        Processor->Ticks++;
         Processor->HighIrqlTicks++;
     } else if (Processor->CurrentThread != Processor->IdleThread) {
+        Processor->Ticks++;
         Processor->LowIrqlTicks++;
     } else {
+        Processor->Ticks++;
         Processor->IdleTicks++;
     }
 
@@ -55,5 +146,14 @@ void EvpHandleTimer(HalInterruptFrame *InterruptFrame) {
      * the dispatch handler. */
     if (NotifyProcessor && InterruptFrame->Irql < KE_IRQL_DISPATCH) {
         HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
+        return;
+    }
+
+    /* Otherwise, if the current thread is the only runnable one, there is nothing the tick can do
+     * for us until the closest wait expires (anyone queueing work/threads here will notify us, and
+     * that restarts the tick). The idle thread stops the tick by itself. */
+    if (!NotifyProcessor && InterruptFrame->Irql < KE_IRQL_DISPATCH && CurrentThread &&
+        CurrentThread != Processor->IdleThread && PspGetHighestReadyPriority(Processor) < 0) {
+        EvpStopTick(Processor);
     }
 }
@@ -111,6 +111,10 @@ void HalpInitializeGdt(KeProcessor *Processor) {
     __asm__ volatile("lgdt %0" : : "m"(Descriptor));
     HalpFlushGdt();
     __asm__ volatile("mov $0x28, %%ax; ltr %%ax" : : : "%rax");
+
+    /* Reloading GS (inside HalpFlushGdt) also zeroed the GS base, so restore it (otherwise
+     * KeGetCurrentProcessor() would start reading from address 0). */
+    WriteMsr(HALP_MSR_GS_BASE, (uint64_t)Processor);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -61,7 +61,7 @@ static void WriteHpetRegister(uint32_t Number, uint64_t Data) {
 void HalpHandleTimer(void) {
     /* This routine should only run in the BSP, and only for active (in use) 32-bit HPET timers
      * (don't do anything if the TSC is active instead). */
-    if (Width != 32 || HalpTscActive || KeGetCurrentProcessor()->Number) {
+    if (Width != 32 || HalpTscActive || KeGetCurrentProcessorNumber()) {
         return;
     }
 
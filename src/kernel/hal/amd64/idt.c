@@ -48,6 +48,7 @@ extern void HalpFastFailEntry(void);
 extern void HalpDispatchEntry(void);
 extern void HalpTimerEntry(void);
 extern void HalpIpiEntry(void);
+extern void HalpTlbEntry(void);
 extern void HalpSpuriousEntry(void);
 
 static struct {
@@ -366,6 +367,8 @@ void HalpInitializeIdt(KeProcessor *Processor) {
             Base = (uint64_t)HalpTimerEntry;
         } else if (i == HALP_INT_IPI_VECTOR) {
             Base = (uint64_t)HalpIpiEntry;
+        } else if (i == HALP_INT_TLB_VECTOR) {
+            Base = (uint64_t)HalpTlbEntry;
         } else if (i == HALP_INT_SPURIOUS_VECTOR) {
             Base = (uint64_t)HalpSpuriousEntry;
         }
@@ -450,7 +453,9 @@ bool HalInitializeInterruptData(HalInterruptData *Data, uint32_t BusVector) {
  *-----------------------------------------------------------------------------------------------*/
 void HalAllocateInterruptVector(HalInterruptData *Data) {
     KeProcessor *Processor = KeGetCurrentProcessor();
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
     uint8_t LowestCount = UINT8_MAX;
     size_t LowestVector = 0;
 
@@ -465,7 +470,7 @@ void HalAllocateInterruptVector(HalInterruptData *Data) {
                 Data->TargetVector = Vector;
                 Data->Irql = Irql;
                 Processor->InterruptUsage[Vector]++;
-                KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+                KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
                 return;
             }
 
@@ -481,7 +486,7 @@ void HalAllocateInterruptVector(HalInterruptData *Data) {
     Data->TargetVector = LowestVector;
     Data->Irql = LowestVector >> 4;
     Processor->InterruptUsage[LowestVector]++;
-    KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -498,7 +503,9 @@ void HalAllocateInterruptVector(HalInterruptData *Data) {
  *-----------------------------------------------------------------------------------------------*/
 void HalReleaseInterruptData(HalInterruptData *Data) {
     KeProcessor *Processor = KeGetCurrentProcessor();
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
 
     if (Data->HasGsi) {
         __atomic_store_n(&GsiUsed[Data->SourceGsi], 0, __ATOMIC_RELEASE);
@@ -508,7 +515,7 @@ void HalReleaseInterruptData(HalInterruptData *Data) {
         Processor->InterruptUsage[Data->TargetVector]--;
     }
 
-    KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -595,7 +602,9 @@ bool HalEnableInterrupt(HalInterrupt *Interrupt) {
     }
 
     KeProcessor *Processor = KeGetCurrentProcessor();
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
     RtDList *Handlers = &Processor->InterruptList[Interrupt->Data.TargetVector];
 
     if (Handlers->Next != Handlers) {
@@ -604,13 +613,13 @@ bool HalEnableInterrupt(HalInterrupt *Interrupt) {
         HalInterrupt *FirstHandler = CONTAINING_RECORD(Handlers->Next, HalInterrupt, ListHeader);
         if (FirstHandler->Data.PinPolarity != Interrupt->Data.PinPolarity ||
             FirstHandler->Data.TriggerMode != Interrupt->Data.TriggerMode) {
-            KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+            KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
             return false;
         }
     }
 
     RtAppendDList(Handlers, &Interrupt->ListHeader);
-    KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
     HalpEnableGsi(
         Interrupt->Data.SourceGsi,
         Interrupt->Data.TargetVector,
@@ -638,9 +647,11 @@ void HalDisableInterrupt(HalInterrupt *Interrupt) {
     /* Should be as simple as marking us as not enabled + unlinking from the interrupt handler
      * list. */
     KeProcessor *Processor = KeGetCurrentProcessor();
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
     RtUnlinkDList(&Interrupt->ListHeader);
-    KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
     HalpDisableGsi(Interrupt->Data.SourceGsi);
     Interrupt->Enabled = false;
 }
@@ -674,3 +685,36 @@ void *HalpEnterCriticalSection(void) {
 void HalpLeaveCriticalSection(void *Context) {
     __asm__ volatile("push %0; popf" : : "rm"(Context) : "memory", "cc");
 }
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function halts the current processor until the next interrupt (or, when MWAIT is
+ *     available, until someone writes to the wake flag). This should be called with interrupts
+ *     disabled, and it returns with them still disabled (any pending interrupt will be handled
+ *     once the caller leaves its critical section).
+ *
+ * PARAMETERS:
+ *     WakeFlag - Address we should monitor for writes; We won't halt at all if it's non-zero.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpWaitForInterrupt(volatile uint32_t *WakeFlag) {
+    /* MWAIT (with the interrupt break event) wakes up on interrupts without running their
+     * handlers, so we can stay in lazy TLB mode while waiting. */
+    if (HalpPlatformFeatures & HALP_FEATURE_MWAIT_BREAK) {
+        __asm__ volatile("monitor" : : "a"(WakeFlag), "c"(0), "d"(0) : "memory");
+        if (!*WakeFlag) {
+            __asm__ volatile("mwait" : : "a"(0), "c"(1) : "memory");
+        }
+
+        return;
+    }
+
+    /* Otherwise, the handlers will run while we're halted, so we can't be lazy anymore. STI only
+     * takes effect after the next instruction, so nothing can sneak in between it and the HLT. */
+    HalpLeaveLazyTlb();
+    if (!*WakeFlag) {
+        __asm__ volatile("sti; hlt; cli" : : : "memory");
+    }
+}
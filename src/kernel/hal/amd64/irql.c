@@ -0,0 +1,277 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <kernel/hal.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
+#include <kernel/ke.h>
+#include <kernel/psp.h>
+#include <stdint.h>
+
+#ifndef NDEBUG
+#define BENCHMARK_PAIRS 4096
+#define BENCHMARK_TICKS 64
+#endif /* NDEBUG */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function lowers the current IRQL, dropping the hardware IRQL as well if it was raised
+ *     to hold back an interrupt. Any software interrupts pending above the new IRQL either run
+ *     right now (if the caller had interrupts enabled), or get sent back to ourselves through the
+ *     APIC (so that they'll arrive as soon as interrupts get enabled). This should only be called
+ *     inside a critical section.
+ *
+ * PARAMETERS:
+ *     NewIrql - Target IRQL level.
+ *     InterruptsEnabled - Whether we can temporarily enable interrupts to run the handlers.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void LowerIrql(KeIrql NewIrql, bool InterruptsEnabled) {
+    while (true) {
+        /* The handlers might switch threads, so we might be on another processor every time we
+         * loop back. */
+        KeProcessor *Processor = KeGetCurrentProcessor();
+        Processor->Irql = NewIrql;
+
+        /* Anything that the APIC is holding back for us gets delivered as soon as interrupts get
+         * enabled again (which might be right before we run the first software interrupt). */
+        if (Processor->HardwareIrql > NewIrql) {
+            __asm__ volatile("mov %0, %%cr8" : : "r"(NewIrql) : "memory");
+            Processor->HardwareIrql = NewIrql;
+        }
+
+        uint32_t Pending = Processor->PendingSoftwareInterrupts & ~((2u << NewIrql) - 1);
+        if (!Pending) {
+            return;
+        }
+
+        if (!InterruptsEnabled) {
+            Processor->PendingSoftwareInterrupts &= ~Pending;
+            if (Pending & (1u << KE_IRQL_DISPATCH)) {
+                HalpSendIpi(
+                    Processor->ApicId, HALP_INT_DISPATCH_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
+            }
+
+            if (Pending & (1u << KE_IRQL_ALERT)) {
+                HalpSendIpi(Processor->ApicId, HALP_INT_ALERT_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
+            }
+
+            return;
+        }
+
+        /* Run the highest pending level first, exactly like the interrupts would have. */
+        KeIrql Irql = 31 - __builtin_clz(Pending);
+        Processor->PendingSoftwareInterrupts &= ~(1u << Irql);
+        Processor->Irql = Irql;
+
+        __asm__ volatile("sti" : : : "memory");
+        if (Irql == KE_IRQL_DISPATCH) {
+            HalpHandleDispatch();
+        } else {
+            PspProcessAlertQueue();
+        }
+
+        __asm__ volatile("cli" : : : "memory");
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the slow path of KeSetIrql; It gets called whenever we're lowering the IRQL
+ *     and either the hardware IRQL had to be raised, or a software interrupt got pending while we
+ *     were at a higher IRQL.
+ *
+ * PARAMETERS:
+ *     NewIrql - Target IRQL level.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalLowerIrql(KeIrql NewIrql) {
+    void *Context = HalpEnterCriticalSection();
+    LowerIrql(NewIrql, (uint64_t)Context & HALP_RFLAGS_IF);
+    HalpLeaveCriticalSection(Context);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if an interrupt that just arrived can run right now; As we don't touch
+ *     the hardware IRQL when raising, the APIC lets through interrupts that the current IRQL
+ *     should be masking. Software interrupts (ALERT and DISPATCH) just get marked as pending, while
+ *     hardware ones get held back by the APIC itself after raising the hardware IRQL (so that
+ *     they'll only arrive again once we lower the IRQL). This should only be called from the
+ *     interrupt entry stubs (with interrupts still disabled).
+ *
+ * PARAMETERS:
+ *     Irql - IRQL of the interrupt.
+ *     Vector - Which vector the interrupt came from.
+ *
+ * RETURN VALUE:
+ *     true if the handler should run (the IRQL was already raised), false if the interrupt was
+ *     deferred (and the EOI was already sent).
+ *-----------------------------------------------------------------------------------------------*/
+bool HalpBeginInterrupt(KeIrql Irql, uint8_t Vector) {
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    if (Irql > Processor->Irql) {
+        Processor->Irql = Irql;
+        return true;
+    }
+
+    if (Irql == KE_IRQL_ALERT || Irql == KE_IRQL_DISPATCH) {
+        Processor->PendingSoftwareInterrupts |= 1u << Irql;
+        HalpSendEoi();
+        return false;
+    }
+
+    __asm__ volatile("mov %0, %%cr8" : : "r"(Processor->Irql) : "memory");
+    Processor->HardwareIrql = Processor->Irql;
+
+    /* The vector already left the IRR when we accepted it, and it stays in service (masking
+     * everything at or below its priority) until the EOI. Level-triggered sources come back into
+     * the IRR by themselves after the EOI (the device is still asserting the line, and the I/O
+     * APIC resends it), so the hardware IRQL is enough to hold them back; Sending them to
+     * ourselves would run the handler twice. Edge-triggered ones would be lost, so those still
+     * need to be sent again. */
+    if (!(HalpReadLapicRegister(HALP_APIC_TMR_REG(Vector >> 5)) & (1u << (Vector & 31)))) {
+        HalpSendIpi(Processor->ApicId, Vector, HALP_APIC_ICR_DELIVERY_FIXED);
+    }
+
+    HalpSendEoi();
+    return false;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function restores the IRQL of the interrupted code (running anything that got pending
+ *     in the meantime). This should only be called from the interrupt exit path (with interrupts
+ *     disabled).
+ *
+ * PARAMETERS:
+ *     InterruptFrame - Current interrupt frame.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpLeaveInterrupt(HalInterruptFrame *InterruptFrame) {
+    LowerIrql(InterruptFrame->Irql, InterruptFrame->Rflags & HALP_RFLAGS_IF);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function tries raising a software interrupt on the current processor without going
+ *     through the APIC. If we're at or above its IRQL, it only gets marked as pending (and runs
+ *     once the IRQL is lowered); Otherwise, it runs right away.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor the interrupt is for.
+ *     Irql - Which software interrupt to raise (KE_IRQL_ALERT or KE_IRQL_DISPATCH).
+ *
+ * RETURN VALUE:
+ *     true if we handled the interrupt, false if the caller needs to send an IPI instead (either
+ *     because the target is another processor, or because we need to run it now but interrupts
+ *     are disabled).
+ *-----------------------------------------------------------------------------------------------*/
+bool HalpRequestSoftwareInterrupt(KeProcessor *Processor, KeIrql Irql) {
+    /* We might get migrated before the critical section starts, so compare the processors
+     * inside it. */
+    void *Context = HalpEnterCriticalSection();
+    KeProcessor *CurrentProcessor = KeGetCurrentProcessor();
+    if (Processor != CurrentProcessor) {
+        HalpLeaveCriticalSection(Context);
+        return false;
+    }
+
+    KeIrql CurrentIrql = CurrentProcessor->Irql;
+    if (CurrentIrql < Irql && !((uint64_t)Context & HALP_RFLAGS_IF)) {
+        HalpLeaveCriticalSection(Context);
+        return false;
+    }
+
+    CurrentProcessor->PendingSoftwareInterrupts |= 1u << Irql;
+    if (CurrentIrql < Irql) {
+        LowerIrql(CurrentIrql, true);
+    }
+
+    HalpLeaveCriticalSection(Context);
+    return true;
+}
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures the IRQL costs (debug builds only): KeRaiseIrql/KeLowerIrql pairs
+ *     (which should never touch the hardware when nothing arrives in between), a pair of CR8
+ *     writes as the baseline for what they used to cost, and the whole timer tick path (entry
+ *     stub to exit, measured as the gaps the ticks leave in a TSC polling loop). The results are
+ *     only printed (nothing fails). This should be called from a thread, after the timer is
+ *     running.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpBenchmarkIrql(void) {
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_PAIRS; i++) {
+        KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+        KeLowerIrql(OldIrql);
+    }
+
+    uint64_t LazyCycles = (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS;
+
+    /* Raising the hardware IRQL only holds interrupts back, so doing it behind the IRQL's back is
+     * fine, as long as we restore the value the processor struct expects. */
+    void *Context = HalpEnterCriticalSection();
+    uint64_t HardwareIrql = KeGetCurrentProcessor()->HardwareIrql;
+    Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_PAIRS; i++) {
+        __asm__ volatile("mov %0, %%cr8" : : "r"((uint64_t)KE_IRQL_DISPATCH) : "memory");
+        __asm__ volatile("mov %0, %%cr8" : : "r"(HardwareIrql) : "memory");
+    }
+
+    uint64_t Cr8Cycles = (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS;
+    HalpLeaveCriticalSection(Context);
+
+    /* At DISPATCH, we can't get migrated, and the tick never stops or requests a dispatch, so
+     * every time the tick count changes, the gap since the last TSC read is exactly one run of
+     * the timer interrupt path. */
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    uint64_t Ticks = __atomic_load_n(&Processor->Ticks, __ATOMIC_RELAXED);
+    uint64_t LastTicks = Ticks;
+    uint64_t LastTsc = HalpGetTscTicks();
+    uint64_t TickCycles = 0;
+    uint64_t MaxTickCycles = 0;
+
+    while (LastTicks - Ticks < BENCHMARK_TICKS) {
+        uint64_t CurrentTsc = HalpGetTscTicks();
+        uint64_t CurrentTicks = __atomic_load_n(&Processor->Ticks, __ATOMIC_RELAXED);
+        if (CurrentTicks != LastTicks) {
+            uint64_t Cycles = CurrentTsc - LastTsc;
+            TickCycles += Cycles;
+            if (Cycles > MaxTickCycles) {
+                MaxTickCycles = Cycles;
+            }
+
+            LastTicks = CurrentTicks;
+        }
+
+        LastTsc = CurrentTsc;
+    }
+
+    KeLowerIrql(OldIrql);
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "irql benchmark: %llu cycles per raise/lower pair, %llu cycles per cr8 write pair, "
+        "%llu/%llu cycles per timer tick (average/worst case)\n",
+        LazyCycles,
+        Cr8Cycles,
+        TickCycles / (LastTicks - Ticks),
+        MaxTickCycles);
+}
+#endif /* NDEBUG */
@@ -6,24 +6,19 @@
 #include <kernel/ki.h>
 #include <kernel/mi.h>
 #include <kernel/mm.h>
+#include <os/containing_record.h>
 #include <rt/bitmap.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
-extern bool HalpSmpInitializationComplete;
-
-static KeSpinLock Lock = {0};
+static KeQueuedSpinLock Lock = {0};
+static RtSList SplitReserveListHead = {0};
 
 static uint64_t EarlyMapBitmapBuffer[((HALP_EARLY_MAP_PAGES + 63) >> 6) << 3] = {0};
 static RtBitmap EarlyMapBitmap = {0};
-static uint64_t EarlyMapHint = 2;
-
-typedef struct {
-    bool ReloadCr3;
-    uint64_t Start;
-    uint64_t End;
-} IpiContext;
+static uint64_t EarlyMapHint = HALP_EARLY_MAP_SPLIT_PAGE + 1;
+static bool EarlyMapFlushPending = false;
 
 /* Constants related to each page table level. */
 typedef struct {
@@ -88,8 +83,9 @@ static void BuildFrame(HalpPageFrame *Frame, uint64_t Source, uint64_t Level, in
  *     true on success, false otherwise.
  *-----------------------------------------------------------------------------------------------*/
 static bool AllocateFrame(HalpPageFrame *CurrentFrame, HalpPageFrame *NextFrame) {
+    /* Large pages can't be walked into (the caller needs to unmap them first). */
     if (CurrentFrame->Present) {
-        return true;
+        return !CurrentFrame->PageSize;
     }
 
     /* Allocate a new page frame; This shouldn't require any invlpg/TLB shootdown. */
@@ -217,6 +213,130 @@ static bool CleanFrame(uint64_t VirtualAddress, uint64_t TargetLevel) {
     return Result;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function reserves the page table page that a new large page would need to get split
+ *     later (so that a partial unmap never has to allocate memory). This should be called with
+ *     the map lock held.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     true on success, false if we couldn't allocate the page.
+ *-----------------------------------------------------------------------------------------------*/
+static bool ReserveSplitPage(void) {
+    uint64_t Page = MiPageList ? MmAllocateSinglePage() : 0;
+    if (!Page) {
+        return false;
+    }
+
+    RtPushSList(&SplitReserveListHead, &MI_PAGE_ENTRY(Page).ListHeader);
+    return true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function takes one of the reserved split pages out of the reserve list. This should be
+ *     called with the map lock held.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Physical address of the page.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t TakeSplitPage(void) {
+    /* Every large page marked as SplitReserved has one page waiting for it, so this can only fail
+     * if someone corrupted the page tables. */
+    RtSList *ListHeader = RtPopSList(&SplitReserveListHead);
+    if (!ListHeader) {
+        KeFatalError(KE_PANIC_BAD_PFN_HEADER, 0, 0, 0, 0);
+    }
+
+    return MI_PAGE_BASE(CONTAINING_RECORD(ListHeader, MiPageEntry, ListHeader));
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gives back the split page reserved for a large page that is going away as a
+ *     whole. This should be called with the map lock held.
+ *
+ * PARAMETERS:
+ *     Frame - Large page entry that is about to be cleared.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ReleaseSplitPage(HalpPageFrame *Frame) {
+    if (Frame->SplitReserved) {
+        Frame->SplitReserved = 0;
+        MmFreeSinglePage(TakeSplitPage());
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function splits a large page into a table of the next level, keeping all translations
+ *     (and attributes) the same. This should be called with the map lock held.
+ *
+ * PARAMETERS:
+ *     TargetLevel - Level of the large page (as returned by GetFrame).
+ *     TargetFrame - Pointer to the large page entry.
+ *
+ * RETURN VALUE:
+ *     true on success, false if we couldn't allocate the new table (which can only happen for
+ *     large pages we didn't map ourselves).
+ *-----------------------------------------------------------------------------------------------*/
+static bool SplitFrame(uint64_t TargetLevel, HalpPageFrame *TargetFrame) {
+    /* Large pages we mapped ourselves already have their table page reserved; Only the ones we
+     * inherited from the boot loader need an allocation here. */
+    uint64_t Page = 0;
+    if (TargetFrame->SplitReserved) {
+        Page = TakeSplitPage();
+    } else {
+        Page = MiPageList ? MmAllocateSinglePage() : MiAllocateEarlyPages(1);
+    }
+
+    if (!Page) {
+        return false;
+    }
+
+    /* Other processors might still be using the large page, so the new table needs to be fully
+     * built before it gets linked in; Use the scratch early map slot for that (the recursive
+     * mapping can only reach the table after it's linked). */
+    uint64_t ScratchAddress = HALP_EARLY_MAP_START + (HALP_EARLY_MAP_SPLIT_PAGE << HALP_PT_SHIFT);
+    HalpPageFrame *ScratchFrame = &HALP_PT_BASE[(ScratchAddress >> HALP_PT_SHIFT) & HALP_PT_MASK];
+    BuildFrame(ScratchFrame, Page, HALP_PT_LEVEL, MI_MAP_WRITE);
+    __asm__ volatile("invlpg (%0)" : : "r"(ScratchAddress) : "memory");
+
+    HalpPageFrame *Table = (HalpPageFrame *)ScratchAddress;
+    uint64_t ChildLevel = TargetLevel + 1;
+    uint64_t ChildPages = TableLevels[ChildLevel].Size >> HALP_PT_SHIFT;
+    for (uint64_t i = 0; i < 512; i++) {
+        Table[i].RawData = TargetFrame->RawData;
+        Table[i].Address = TargetFrame->Address + i * ChildPages;
+        Table[i].SplitReserved = 0;
+
+        /* The PAT bit goes back into the "PageSize" bit on the PT level (see BuildFrame). */
+        if (ChildLevel == HALP_PT_LEVEL) {
+            Table[i].PageSize = TargetFrame->Pat;
+            Table[i].Pat = 0;
+        }
+    }
+
+    ScratchFrame->RawData = 0;
+    __asm__ volatile("invlpg (%0)" : : "r"(ScratchAddress) : "memory");
+
+    HalpPageFrame Frame = {0};
+    Frame.Present = 1;
+    Frame.Writable = 1;
+    Frame.Address = Page >> HALP_PT_SHIFT;
+    __atomic_store_n(&TargetFrame->RawData, Frame.RawData, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&MiTotalPtePages, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function rolls back leaf mappings and empty page-table levels while the map lock is
@@ -239,40 +359,28 @@ static void RollbackMap(uint64_t Start, uint64_t End) {
         uint64_t TargetLevel = 0;
         HalpPageFrame *TargetFrame = NULL;
         bool Present = GetFrame(Address, &TargetLevel, &TargetFrame);
+        uint64_t Step = HALP_PT_SIZE;
         if (Present && TargetLevel == HALP_PT_LEVEL) {
             TargetFrame->RawData = 0;
             CleanFrame(Address, TargetLevel);
-        } else if (!Present) {
+        } else if (Present) {
+            /* Large pages we mapped are always fully inside the range; Anything else was already
+             * there before (and made the walk fail), so leave it alone. */
+            Step = TableLevels[TargetLevel].Size - (Address & (TableLevels[TargetLevel].Size - 1));
+            if (Step <= End - Address) {
+                ReleaseSplitPage(TargetFrame);
+                TargetFrame->RawData = 0;
+                CleanFrame(Address, TargetLevel);
+            }
+        } else {
             CleanFrame(Address, TargetLevel);
         }
 
-        if (End - Address <= HALP_PT_SIZE) {
+        if (End - Address <= Step) {
             break;
         }
 
-        Address += HALP_PT_SIZE;
-    }
-}
-
-/*-------------------------------------------------------------------------------------------------
- * PURPOSE:
- *     This function invalidates a range of pages (or the whole page directory) after something got
- *     unmapped.
- *
- * PARAMETERS:
- *     ContextPointer - Information about what to invalidate.
- *
- * RETURN VALUE:
- *     None.
- *-----------------------------------------------------------------------------------------------*/
-static void IpiRoutine(void *ContextPointer) {
-    IpiContext *Context = ContextPointer;
-    if (Context->ReloadCr3) {
-        __asm__ volatile("mov %%cr3, %%rax; mov %%rax, %%cr3;" : : : "%rax", "memory");
-    } else {
-        for (uint64_t Address = Context->Start; Address < Context->End; Address += HALP_PT_SIZE) {
-            __asm__ volatile("invlpg (%0)" : : "r"(Address) : "memory");
-        }
+        Address += Step;
     }
 }
 
@@ -299,37 +407,31 @@ uint64_t HalpGetPhysicalAddress(void *VirtualAddress) {
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function walks the page tables until we reach the lowest level (PTE), allocating all
- *     levels along the way (or we fail because we encoutered a large page). This should only be
- *     used when mapping new pages!
+ *     This function walks the page tables until we reach the target level (PTE for small pages,
+ *     PDE for large pages), allocating all levels along the way (or we fail because we encoutered
+ *     a large page). This should only be used when mapping new pages!
  *
  * PARAMETERS:
  *     Target - Which address to get the page frame from.
+ *     TargetLevel - Which level the returned frame should be in.
  *
  * RETURN VALUE:
  *     Either a pointer to the target page frame, or NULL on failure.
  *-----------------------------------------------------------------------------------------------*/
-static HalpPageFrame *WalkPageTable(uint64_t Target) {
-    /* Extending this to PML5 should be as easy as handling the PML5 level the same as PML4. */
+static HalpPageFrame *WalkPageTable(uint64_t Target, uint64_t TargetLevel) {
+    /* Extending this to PML5 should be as easy as starting the walk one level higher. */
     HalpPageFrame *CurrentFrame = &HALP_PML4_BASE[(Target >> HALP_PML4_SHIFT) & HALP_PML4_MASK];
-    HalpPageFrame *NextFrame = &HALP_PDPT_BASE[(Target >> HALP_PDPT_SHIFT) & HALP_PDPT_MASK];
-    if (!AllocateFrame(CurrentFrame, NextFrame)) {
-        return NULL;
-    }
-
-    CurrentFrame = NextFrame;
-    NextFrame = &HALP_PD_BASE[(Target >> HALP_PD_SHIFT) & HALP_PD_MASK];
-    if (!AllocateFrame(CurrentFrame, NextFrame)) {
-        return NULL;
-    }
+    for (uint64_t Level = HALP_PDPT_LEVEL; Level <= TargetLevel; Level++) {
+        const TableLevel *Next = &TableLevels[Level];
+        HalpPageFrame *NextFrame = &Next->Base[(Target >> Next->Shift) & Next->Mask];
+        if (!AllocateFrame(CurrentFrame, NextFrame)) {
+            return NULL;
+        }
 
-    CurrentFrame = NextFrame;
-    NextFrame = &HALP_PT_BASE[(Target >> HALP_PT_SHIFT) & HALP_PT_MASK];
-    if (!AllocateFrame(CurrentFrame, NextFrame)) {
-        return NULL;
+        CurrentFrame = NextFrame;
     }
 
-    return NextFrame;
+    return CurrentFrame;
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -357,26 +459,44 @@ bool HalpMapContiguousPages(
         return false;
     }
 
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Lock, KE_IRQL_DISPATCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&Lock, &LockNode, KE_IRQL_DISPATCH);
     uint64_t Target = (uint64_t)VirtualAddress;
     uint64_t Source = PhysicalAddress;
+    HalpPageFrame *CurrentFrame = NULL;
+
+    for (uint64_t Offset = 0; Offset < Size;) {
+        /* Use a 2MiB page if the caller allows it, both addresses are aligned, and there is no
+         * page table in the way (we don't try merging into existing page tables). We also need to
+         * reserve the page table that splitting the page would take, or we fall back to small
+         * pages. */
+        if ((Flags & MI_MAP_LARGE) && !(Target & (HALP_PD_SIZE - 1)) &&
+            !(Source & (HALP_PD_SIZE - 1)) && Size - Offset >= HALP_PD_SIZE) {
+            HalpPageFrame *LargeFrame = WalkPageTable(Target, HALP_PD_LEVEL);
+            if (!LargeFrame) {
+                RollbackMap((uint64_t)VirtualAddress, Target + HALP_PT_SIZE);
+                KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
+                return false;
+            }
 
-    /* Fully walk the page table (once, it should be enough for most cases). */
-    HalpPageFrame *CurrentFrame = WalkPageTable(Target);
-    if (!CurrentFrame) {
-        RollbackMap((uint64_t)VirtualAddress, Target + HALP_PT_SIZE);
-        KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
-        return false;
-    }
+            if (!LargeFrame->Present && ReserveSplitPage()) {
+                BuildFrame(LargeFrame, Source, HALP_PD_LEVEL, Flags);
+                LargeFrame->SplitReserved = 1;
+                Offset += HALP_PD_SIZE;
+                Target += HALP_PD_SIZE;
+                Source += HALP_PD_SIZE;
+                CurrentFrame = NULL;
+                continue;
+            }
+        }
 
-    for (uint64_t Offset = 0; Offset < Size; Offset += HALP_PT_SIZE) {
         /* If we reached the end of this PD (2MiB page), rewalk the page table (we really should
          * only rewalk what we need, but for now let's rewalk the whole thing). */
-        if (Offset && !(Target & (HALP_PD_SIZE - 1))) {
-            CurrentFrame = WalkPageTable(Target);
+        if (!CurrentFrame || !(Target & (HALP_PD_SIZE - 1))) {
+            CurrentFrame = WalkPageTable(Target, HALP_PT_LEVEL);
             if (!CurrentFrame) {
                 RollbackMap((uint64_t)VirtualAddress, Target + HALP_PT_SIZE);
-                KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+                KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
                 return false;
             }
         }
@@ -385,17 +505,18 @@ bool HalpMapContiguousPages(
          * doing Map again). */
         if (CurrentFrame->Present) {
             RollbackMap((uint64_t)VirtualAddress, Target);
-            KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+            KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
             return false;
         }
 
         BuildFrame(CurrentFrame, Source, HALP_PT_LEVEL, Flags);
+        Offset += HALP_PT_SIZE;
         Target += HALP_PT_SIZE;
         Source += HALP_PT_SIZE;
         CurrentFrame++;
     }
 
-    KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
     return true;
 }
 
@@ -433,30 +554,31 @@ bool HalpMapNonContiguousPages(
         }
     }
 
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Lock, KE_IRQL_DISPATCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&Lock, &LockNode, KE_IRQL_DISPATCH);
     uint64_t Target = (uint64_t)VirtualAddress;
     uint64_t *Source = PhysicalAddresses;
 
-    HalpPageFrame *CurrentFrame = WalkPageTable(Target);
+    HalpPageFrame *CurrentFrame = WalkPageTable(Target, HALP_PT_LEVEL);
     if (!CurrentFrame) {
         RollbackMap((uint64_t)VirtualAddress, Target + HALP_PT_SIZE);
-        KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+        KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
         return false;
     }
 
     for (uint64_t Offset = 0; Offset < Size; Offset += HALP_PT_SIZE) {
         if (Offset && !(Target & (HALP_PD_SIZE - 1))) {
-            CurrentFrame = WalkPageTable(Target);
+            CurrentFrame = WalkPageTable(Target, HALP_PT_LEVEL);
             if (!CurrentFrame) {
                 RollbackMap((uint64_t)VirtualAddress, Target + HALP_PT_SIZE);
-                KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+                KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
                 return false;
             }
         }
 
         if (CurrentFrame->Present) {
             RollbackMap((uint64_t)VirtualAddress, Target);
-            KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+            KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
             return false;
         }
 
@@ -466,7 +588,7 @@ bool HalpMapNonContiguousPages(
         CurrentFrame++;
     }
 
-    KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
     return true;
 }
 
@@ -483,50 +605,56 @@ bool HalpMapNonContiguousPages(
  *-----------------------------------------------------------------------------------------------*/
 void HalpUnmapPages(void *VirtualAddress, uint64_t Size) {
     uint64_t Address = (uint64_t)VirtualAddress;
-    uint64_t End = Address + Size;
-    bool ReloadCr3 = Size >= 32 * HALP_PT_SIZE;
+    uint64_t FlushSize = Size;
+    bool ReloadCr3 = false;
 
     /* Ensure at least proper 4KiB alignment. */
     if ((Address & (HALP_PT_SIZE - 1)) || (Size & (HALP_PT_SIZE - 1))) {
         return;
     }
 
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Lock, KE_IRQL_DISPATCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&Lock, &LockNode, KE_IRQL_DISPATCH);
 
     while (Size) {
         uint64_t TargetLevel = 0;
         HalpPageFrame *TargetFrame = NULL;
         bool Present = GetFrame(Address, &TargetLevel, &TargetFrame);
         uint64_t TargetSize = TableLevels[TargetLevel].Size;
-
-        /* We'll be freeing large pages if we match the proper alignment (maybe we shouldn't do
-         * it like this?). */
-        if (Present && TargetLevel != HALP_PT_LEVEL && !(Address & (TargetSize - 1))) {
+        uint64_t Step = TargetSize - (Address & (TargetSize - 1));
+
+        /* Large pages fully inside the range can be dropped as a whole, but anything else needs
+         * to be split first (and then we retry the same address on the new table). If the split
+         * fails (only possible for large pages the boot loader left us), the large page stays
+         * mapped, and we skip the part of it that is inside the range. */
+        if (Present && TargetLevel != HALP_PT_LEVEL && Step == TargetSize && Size >= TargetSize) {
+            ReleaseSplitPage(TargetFrame);
             TargetFrame->Present = 0;
             ReloadCr3 = true;
             CleanFrame(Address, TargetLevel);
-        } else if (Present && TargetLevel == HALP_PT_LEVEL) {
+        } else if (Present && TargetLevel != HALP_PT_LEVEL) {
+            if (SplitFrame(TargetLevel, TargetFrame)) {
+                ReloadCr3 = true;
+                continue;
+            }
+        } else if (Present) {
             TargetFrame->Present = 0;
             ReloadCr3 = ReloadCr3 || CleanFrame(Address, TargetLevel);
         }
 
-        Address += TargetSize;
-        Size = Size > TargetSize ? Size - TargetSize : 0;
-    }
+        if (Size <= Step) {
+            break;
+        }
 
-    KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+        Address += Step;
+        Size -= Step;
+    }
 
-    IpiContext Context;
-    Context.ReloadCr3 = ReloadCr3;
-    Context.Start = (uint64_t)VirtualAddress;
-    Context.End = End;
+    KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
 
-    /* No need for a broadcast if we're still too early in the initailization phase. */
-    if (HalpSmpInitializationComplete) {
-        KeRequestIpiRoutine(IpiRoutine, &Context);
-    } else {
-        IpiRoutine(&Context);
-    }
+    /* The shootdown code decides between INVLPG and a full flush based on the size, we just need
+     * to force the full flush if we freed any page table (or large page). */
+    HalpFlushTlb(VirtualAddress, FlushSize, ReloadCr3 ? HALP_TLB_FLUSH_ALL : 0);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -545,6 +673,10 @@ void HalpInitializeEarlyMap(KiLoaderBlock *) {
      * into the next page if the physical address is above a certain threshold. */
     RtInitializeBitmap(&EarlyMapBitmap, EarlyMapBitmapBuffer, HALP_EARLY_MAP_PAGES);
     RtSetBits(&EarlyMapBitmap, 0, 2);
+
+    /* The page right after those is used as scratch space when splitting large pages (so that we
+     * can build the new table before linking it in). */
+    RtSetBits(&EarlyMapBitmap, HALP_EARLY_MAP_SPLIT_PAGE, 1);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -627,12 +759,8 @@ void HalpUnmapDebuggerMemory(void *VirtualAddress, size_t Size) {
     }
 
     /* Everyone should be frozen, so just rely on the other processors doing a CR3 reload once they
-     * unfreeze. */
-    IpiContext Context;
-    Context.ReloadCr3 = Pages >= 32;
-    Context.Start = VirtualStart;
-    Context.End = VirtualEnd;
-    IpiRoutine(&Context);
+     * unfreeze (and let the local flush pick between INVLPG and a CR3 reload based on the size). */
+    HalpFlushLocalTlbRange(VirtualStart, Pages);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -662,10 +790,19 @@ void *HalpMapEarlyMemory(uint64_t PhysicalAddress, size_t Size, int Flags) {
 
     /* Any operations on the kernel-side of the page tables need to be done under the lock (though
      * this isn't really necessary before SMP initialization). */
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Lock, KE_IRQL_DISPATCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&Lock, &LockNode, KE_IRQL_DISPATCH);
+
+    /* Unmapping early memory doesn't wait for the other processors to finish invalidating the
+     * range, so make sure they're done before handing out any (possibly reused) address. */
+    if (EarlyMapFlushPending) {
+        HalpWaitTlbFlush();
+        EarlyMapFlushPending = false;
+    }
+
     uint64_t Index = RtFindClearBitsAndSet(&EarlyMapBitmap, EarlyMapHint, Pages);
     if (Index == (uint64_t)-1) {
-        KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+        KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
         return NULL;
     }
 
@@ -679,7 +816,7 @@ void *HalpMapEarlyMemory(uint64_t PhysicalAddress, size_t Size, int Flags) {
     }
 
     EarlyMapHint = Index + Pages;
-    KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+    KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
     return (char *)VirtualAddress + (PhysicalAddress - PhysicalStart);
 }
 
@@ -708,7 +845,8 @@ void HalpUnmapEarlyMemory(void *VirtualAddress, size_t Size) {
 
     /* Any operations on the kernel-side of the page tables need to be done under the lock (though
      * this isn't really necessary before SMP initialization). */
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Lock, KE_IRQL_DISPATCH);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&Lock, &LockNode, KE_IRQL_DISPATCH);
     EarlyMapHint = (VirtualStart - HALP_EARLY_MAP_START) >> HALP_PT_SHIFT;
     RtClearBits(&EarlyMapBitmap, EarlyMapHint, Pages);
 
@@ -719,16 +857,11 @@ void HalpUnmapEarlyMemory(void *VirtualAddress, size_t Size) {
         Frame[Page].Present = 0;
     }
 
-    KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
-
-    /* No need for a broadcast if we're still too early in the initailization phase. */
-    IpiContext Context;
-    Context.ReloadCr3 = Pages >= 32;
-    Context.Start = VirtualStart;
-    Context.End = VirtualEnd;
-    if (HalpSmpInitializationComplete) {
-        KeRequestIpiRoutine(IpiRoutine, &Context);
-    } else {
-        IpiRoutine(&Context);
-    }
+    /* Nobody should be accessing this range anymore, so we don't need to wait for the shootdown to
+     * finish (HalpMapEarlyMemory waits for it before reusing anything). The bits are already
+     * clear, so the shootdown needs to be queued before anyone else can take the lock (otherwise
+     * HalpWaitTlbFlush might not see it, and the range could be reused while still cached). */
+    HalpFlushTlb((void *)VirtualStart, VirtualEnd - VirtualStart, HALP_TLB_FLUSH_ASYNC);
+    EarlyMapFlushPending = true;
+    KeReleaseQueuedSpinLockAndLowerIrql(&Lock, OldIrql);
 }
@@ -94,6 +94,7 @@ static void CollectFeatures(void) {
         CHECK_FEATURE(HALP_FEATURE_X2APIC, Ecx, 21);
         CHECK_FEATURE(HALP_FEATURE_MOVBE, Ecx, 22);
         CHECK_FEATURE(HALP_FEATURE_POPCNT, Ecx, 23);
+        CHECK_FEATURE(HALP_FEATURE_TSC_DEADLINE, Ecx, 24);
         CHECK_FEATURE(HALP_FEATURE_AES_NI, Ecx, 25);
         CHECK_FEATURE(HALP_FEATURE_XSAVE, Ecx, 26);
         CHECK_FEATURE(HALP_FEATURE_AVX, Ecx, 28);
@@ -104,6 +105,26 @@ static void CollectFeatures(void) {
         CHECK_FEATURE(HALP_FEATURE_SSE2, Edx, 26);
     }
 
+    /* MWAIT is only useful for us if it can be woken up by interrupts while they're masked
+     * (bit 0 says the extensions are enumerated at all, bit 1 is the interrupt break event). */
+    if ((HalpPlatformFeatures & HALP_FEATURE_MONITOR) &&
+        HalpPlatformMaxLeaf >= HALP_CPUID_MONITOR) {
+        __cpuid(HALP_CPUID_MONITOR, Eax, Ebx, Ecx, Edx);
+        if ((Ecx & 0x03) == 0x03) {
+            HalpPlatformFeatures |= HALP_FEATURE_MWAIT_BREAK;
+        }
+    }
+
+    /* Sub-leaf 1 of the extended state leaf says which of the optimized XSAVE variants we have
+     * (bit 0 is XSAVEOPT, bit 1 is XSAVEC, bit 3 is XSAVES/XRSTORS). */
+    if ((HalpPlatformFeatures & HALP_FEATURE_XSAVE) &&
+        HalpPlatformMaxLeaf >= HALP_CPUID_EXTENDED_STATE) {
+        __get_cpuid_count(HALP_CPUID_EXTENDED_STATE, 1, &Eax, &Ebx, &Ecx, &Edx);
+        CHECK_FEATURE(HALP_FEATURE_XSAVEOPT, Eax, 0);
+        CHECK_FEATURE(HALP_FEATURE_XSAVEC, Eax, 1);
+        CHECK_FEATURE(HALP_FEATURE_XSAVES, Eax, 3);
+    }
+
     if (HalpPlatformMaxLeaf >= HALP_CPUID_EXTENDED_FEATURES) {
         __get_cpuid_count(HALP_CPUID_EXTENDED_FEATURES, 0, &Eax, &Ebx, &Ecx, &Edx);
         CHECK_FEATURE(HALP_FEATURE_FSGSBASE, Ebx, 0);
@@ -113,6 +134,7 @@ static void CollectFeatures(void) {
         CHECK_FEATURE(HALP_FEATURE_BMI2, Ebx, 8);
         CHECK_FEATURE(HALP_FEATURE_ERMS, Ebx, 9);
         CHECK_FEATURE(HALP_FEATURE_INVPCID, Ebx, 10);
+        CHECK_FEATURE(HALP_FEATURE_AVX512F, Ebx, 16);
         CHECK_FEATURE(HALP_FEATURE_RDSEED, Ebx, 18);
         CHECK_FEATURE(HALP_FEATURE_SMAP, Ebx, 20);
         CHECK_FEATURE(HALP_FEATURE_SHA, Ebx, 29);
@@ -160,6 +182,11 @@ static void CollectFeatures(void) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 void HalpInitializeBootStack(KiLoaderBlock *LoaderBlock) {
+    /* The IRQL lives inside the processor struct, so the GS base needs to be setup before anyone
+     * tries raising it (which includes the very first KdPrint). */
+    BootProcessor.Self = &BootProcessor;
+    WriteMsr(HALP_MSR_GS_BASE, (uint64_t)&BootProcessor);
+
     __asm__ volatile("mov %0, %%rax\n"
                      "mov %1, %%rcx\n"
                      "mov %2, %%rdx\n"
@@ -193,7 +220,6 @@ void HalpInitializePlatform(KiLoaderBlock *LoaderBlock) {
 
     /* We're already safe to setup the stack base/limit (as we know for sure we're inside the
      * system stack). */
-    WriteMsr(HALP_MSR_KERNEL_GS_BASE, (uint64_t)&BootProcessor);
     BootProcessor.StackBase = BootProcessor.SystemStack;
     BootProcessor.StackLimit = BootProcessor.SystemStack + sizeof(BootProcessor.SystemStack);
 
@@ -222,6 +248,47 @@ void HalpInitializePlatform(KiLoaderBlock *LoaderBlock) {
     HalpSetActiveTimer(LoaderBlock->Arch.CycleCounterFrequency, HalpGetTscTicks);
 }
 
+#ifndef NDEBUG
+#define BENCHMARK_READS 4096
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures how long it takes to get the current processor block (debug builds
+ *     only), both through the GS-relative self pointer, and through reading the GS base MSR (the
+ *     old way of doing it). The results are only printed (nothing fails).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void BenchmarkProcessorAccess(void) {
+    volatile uint64_t Sink = 0;
+
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_READS; i++) {
+        Sink = ReadMsr(HALP_MSR_GS_BASE);
+    }
+
+    uint64_t MsrCycles = HalpGetTscTicks() - Start;
+
+    Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_READS; i++) {
+        Sink = (uint64_t)KeGetCurrentProcessor();
+    }
+
+    uint64_t GsCycles = HalpGetTscTicks() - Start;
+    (void)Sink;
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "processor block access: %llu cycles through RDMSR, %llu cycles through GS\n",
+        MsrCycles / BENCHMARK_READS,
+        GsCycles / BENCHMARK_READS);
+}
+#endif /* NDEBUG */
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function runs any remaining HAL/arch-specific initialization routines required for the
@@ -245,6 +312,10 @@ void HalpInitializeBootProcessor(void) {
     HalpInitializeTsc();
     HalpInitializeTimer();
 
+    /* The APs reuse the extended state mask/size we figure out here, so this needs to happen
+     * before they get started. */
+    HalpInitializeExtendedState();
+
     /* Spin up all the application processors (and also finish setting up our per-processor
      * struct). */
     HalpInitializeSmp();
@@ -252,6 +323,10 @@ void HalpInitializeBootProcessor(void) {
     /* Now the all of the processor block data is initialized, so it should be safe to start
      * receiving the periodic interrupt (even if the scheduler is still off). */
     HalpInitializeApicTimer();
+
+#ifndef NDEBUG
+    BenchmarkProcessorAccess();
+#endif /* NDEBUG */
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -267,8 +342,10 @@ void HalpInitializeBootProcessor(void) {
  *-----------------------------------------------------------------------------------------------*/
 void HalpInitializeApplicationProcessor(KeProcessor *Processor) {
     /* We're already safe to setup the stack base/limit (as we know for sure we're inside the
-     * system stack). */
-    WriteMsr(HALP_MSR_KERNEL_GS_BASE, (uint64_t)Processor);
+     * system stack). The GS base also needs to be setup asap, as KeGetCurrentProcessor() depends
+     * on it. */
+    Processor->Self = Processor;
+    WriteMsr(HALP_MSR_GS_BASE, (uint64_t)Processor);
     Processor->StackBase = Processor->SystemStack;
     Processor->StackLimit = Processor->SystemStack + sizeof(Processor->SystemStack);
 
@@ -276,6 +353,9 @@ void HalpInitializeApplicationProcessor(KeProcessor *Processor) {
     HalpInitializeGdt(Processor);
     HalpInitializeIdt(Processor);
 
+    /* Enable the same extended state components as the BSP. */
+    HalpInitializeExtendedState();
+
     /* Setup the interrupt controller. */
     HalpEnableApic();
     Processor->ApicId = HalpReadLapicId();
@@ -9,13 +9,14 @@
 #include <kernel/mm.h>
 #include <kernel/psp.h>
 #include <os/containing_record.h>
-#include <rt/avltree.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
 extern void HalpApplicationProcessorEntry(void);
+extern void KiProcessWorkQueue(void);
+extern void PspProcessQueue(void);
 extern uint64_t HalpKernelPageMap;
 extern RtSList HalpLapicListHead;
 
@@ -81,10 +82,14 @@ void HalpInitializeSmp(void) {
 
         HalpProcessorList[i]->Number = i;
         HalpProcessorList[i]->ClosestWaitTick = UINT64_MAX;
+        HalpProcessorList[i]->StealCursor = i;
 
         RtInitializeDList(&HalpProcessorList[i]->WorkQueue);
-        RtInitializeAvlTree(&HalpProcessorList[i]->WaitTree, PspCompareWaitThreads);
-        RtInitializeDList(&HalpProcessorList[i]->ThreadQueue);
+        PspInitializeWaitWheel(&HalpProcessorList[i]->WaitWheel);
+        for (uint32_t Priority = 0; Priority < PS_PRIORITY_COUNT; Priority++) {
+            RtInitializeDList(&HalpProcessorList[i]->ThreadQueue[Priority]);
+        }
+
         RtInitializeDList(&HalpProcessorList[i]->TerminationQueue);
     }
 
@@ -118,12 +123,20 @@ void HalpInitializeSmp(void) {
     }
 
     HalpUnmapPages((void *)EntryAddress, MM_PAGE_SIZE);
+    HalpInitializeTopology();
+
+#ifndef NDEBUG
+    /* The scheduler placement and stealing decisions only make sense if the topology levels
+     * properly nest, so make sure they do. */
+    HalpTestTopology();
+#endif /* NDEBUG */
+
     HalpSmpInitializationComplete = true;
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function notifies all but the current processor that the IPI handler should run.
+ *     This function notifies all but the current processor that they should stop running.
  *
  * PARAMETERS:
  *     None.
@@ -131,52 +144,77 @@ void HalpInitializeSmp(void) {
  * RETURN VALUE:
  *     None.
  *-----------------------------------------------------------------------------------------------*/
-void HalpBroadcastIpi(void) {
+void HalpBroadcastFreeze(void) {
     KeProcessor *CurrentProcessor = KeGetCurrentProcessor();
     for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
         if (i != CurrentProcessor->Number) {
-            HalpSendIpi(
-                HalpProcessorList[i]->ApicId, HALP_INT_IPI_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
+            HalpProcessorList[i]->EventType = KE_EVENT_TYPE_FREEZE;
+            HalpSendIpi(HalpProcessorList[i]->ApicId, 0, HALP_APIC_ICR_DELIVERY_NMI);
         }
     }
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function notifies all but the current processor that they should stop running.
+ *     This function notifies another processor that some event has happend. DISPATCH
+ *     notifications only send an interrupt if the target doesn't already have one pending, and
+ *     isn't idle polling (where it can see the pending flag by itself). ALERT and DISPATCH
+ *     notifications to the current processor don't send an interrupt either (they either run
+ *     right away, or get marked as pending until the IRQL is lowered).
  *
  * PARAMETERS:
- *     None.
+ *     Processor - Which processor to notify.
+ *     TargetIrql - At which IRQL the event happened (this defines which interrupt vector will be
+ *                  invoked).
  *
  * RETURN VALUE:
  *     None.
  *-----------------------------------------------------------------------------------------------*/
-void HalpBroadcastFreeze(void) {
-    KeProcessor *CurrentProcessor = KeGetCurrentProcessor();
-    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
-        if (i != CurrentProcessor->Number) {
-            HalpProcessorList[i]->EventType = KE_EVENT_TYPE_FREEZE;
-            HalpSendIpi(HalpProcessorList[i]->ApicId, 0, HALP_APIC_ICR_DELIVERY_NMI);
+void HalpNotifyProcessor(KeProcessor *Processor, KeIrql TargetIrql) {
+    if (TargetIrql == KE_IRQL_ALERT) {
+        if (!HalpRequestSoftwareInterrupt(Processor, KE_IRQL_ALERT)) {
+            HalpSendIpi(Processor->ApicId, HALP_INT_ALERT_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
         }
+
+        return;
+    } else if (TargetIrql == KE_IRQL_IPI) {
+        HalpSendIpi(Processor->ApicId, HALP_INT_IPI_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
+        return;
+    }
+
+    /* Only the first notification since the target last ran its dispatch handler needs to do
+     * anything; The same handler run will pick up whatever the others queued. The flag and the
+     * idle polling check need to be sequentially consistent with the idle loop (which sets the
+     * polling flag and then checks the pending flag). Notifying ourselves never needs the
+     * interrupt unless we need to run the handler right now but interrupts are disabled. */
+    KeProcessor *CurrentProcessor = KeGetCurrentProcessor();
+    if (__atomic_exchange_n(&Processor->DispatchPending, 1, __ATOMIC_SEQ_CST) ||
+        __atomic_load_n(&Processor->IdlePolling, __ATOMIC_SEQ_CST) ||
+        HalpRequestSoftwareInterrupt(Processor, KE_IRQL_DISPATCH)) {
+        __atomic_add_fetch(&CurrentProcessor->SuppressedDispatchIpiCount, 1, __ATOMIC_RELAXED);
+        return;
     }
+
+    HalpSendIpi(Processor->ApicId, HALP_INT_DISPATCH_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
+    __atomic_add_fetch(&CurrentProcessor->DispatchIpiCount, 1, __ATOMIC_RELAXED);
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function notifies another processor that some event has happend.
+ *     This function handles a pending DISPATCH notification; This runs either from the dispatch
+ *     interrupt, or from the idle loop (for notifications that skipped the interrupt). We expect
+ *     to be at DISPATCH.
  *
  * PARAMETERS:
- *     Processor - Which processor to notify.
- *     TargetIrql - At which IRQL the event happened (this defines which interrupt vector will be
- *                  invoked).
+ *     None.
  *
  * RETURN VALUE:
  *     None.
  *-----------------------------------------------------------------------------------------------*/
-void HalpNotifyProcessor(KeProcessor *Processor, KeIrql TargetIrql) {
-    if (TargetIrql == KE_IRQL_ALERT) {
-        HalpSendIpi(Processor->ApicId, HALP_INT_ALERT_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
-    } else {
-        HalpSendIpi(Processor->ApicId, HALP_INT_DISPATCH_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
-    }
+void HalpHandleDispatch(void) {
+    /* Clear the flag before looking at anything, so that whatever gets queued after this point
+     * sends a new notification. */
+    __atomic_store_n(&KeGetCurrentProcessor()->DispatchPending, 0, __ATOMIC_SEQ_CST);
+    KiProcessWorkQueue();
+    PspProcessQueue();
 }
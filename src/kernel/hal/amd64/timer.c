@@ -5,6 +5,8 @@
 #include <kernel/evp.h>
 #include <kernel/halp.h>
 #include <kernel/kd.h>
+#include <kernel/ke.h>
+#include <os/intrin.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,6 +15,8 @@ bool HalpTimerInitialized = false;
 
 static uint64_t ActiveFrequency = 0;
 static uint64_t (*ActiveTicks)(void) = NULL;
+static bool TscDeadlineActive = false;
+static uint64_t TscTicksPerTick = 0;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -95,13 +99,92 @@ void HalpInitializeApicTimer(void) {
         Accum += UINT32_MAX - HalpReadLapicRegister(HALP_APIC_TIMER_CCR_REG);
     }
 
-    /* Now we can enable the LAPIC in periodic mode. */
+    /* Save the period (we need it whenever the tick is restarted); The TSC-deadline mode can only
+     * be used if the TSC is the active timer source (as that's what the tick period got measured
+     * against). */
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    Processor->TimerPeriod = Accum / 5;
+    if (HalpTscActive && (HalpPlatformFeatures & HALP_FEATURE_TSC_DEADLINE)) {
+        TscDeadlineActive = true;
+        TscTicksPerTick = Ticks;
+    }
+
+    /* Now we can enable the LAPIC in periodic mode; The tick count starts from here (which is
+     * what we use to catch up after the tick gets stopped). */
+    HalpWriteLapicRegister(HALP_APIC_TIMER_DCR_REG, 0);
+    HalpSetPeriodicTimer();
+    Processor->TickBaseTime = HalGetTimerTicks();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function switches the per-CPU event timer into one-shot mode, firing once after the
+ *     given amount of ticks have elapsed. Deadlines further out than what the timer can handle are
+ *     silently clamped (the caller should just stop the tick again if it wakes up too early).
+ *
+ * PARAMETERS:
+ *     Ticks - How many ticks (EVP_TICK_PERIOD) until the timer interrupt should fire.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpSetTimerDeadline(uint64_t Ticks) {
+    KeProcessor *Processor = KeGetCurrentProcessor();
     HalpApicLvtRecord Record = {0};
     Record.Vector = HALP_INT_TIMER_VECTOR;
-    Record.Periodic = 1;
+
+    if (TscDeadlineActive) {
+        uint64_t Delta = UINT64_MAX;
+        if (Ticks < UINT64_MAX / TscTicksPerTick) {
+            Delta = Ticks * TscTicksPerTick;
+        }
+
+        uint64_t Deadline = HalpGetTscTicks();
+        Deadline = Delta < UINT64_MAX - Deadline ? Deadline + Delta : UINT64_MAX;
+
+        /* The LVT write needs to be visible before the deadline is armed, otherwise the MSR write
+         * might get lost. */
+        Record.TimerMode = HALP_APIC_TIMER_MODE_TSC_DEADLINE;
+        HalpWriteLapicRegister(HALP_APIC_LVTT_REG, Record.RawData);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        WriteMsr(HALP_MSR_TSC_DEADLINE, Deadline);
+        return;
+    }
+
+    uint64_t Count = UINT32_MAX;
+    if (Ticks < UINT32_MAX / Processor->TimerPeriod) {
+        Count = Ticks * Processor->TimerPeriod;
+    }
+
+    Record.TimerMode = HALP_APIC_TIMER_MODE_ONE_SHOT;
     HalpWriteLapicRegister(HALP_APIC_LVTT_REG, Record.RawData);
-    HalpWriteLapicRegister(HALP_APIC_TIMER_DCR_REG, 0);
-    HalpWriteLapicRegister(HALP_APIC_TIMER_ICR_REG, Accum / 5);
+    HalpWriteLapicRegister(HALP_APIC_TIMER_ICR_REG, Count);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function switches the per-CPU event timer (back) into periodic mode, firing once every
+ *     tick.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpSetPeriodicTimer(void) {
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    HalpApicLvtRecord Record = {0};
+    Record.Vector = HALP_INT_TIMER_VECTOR;
+    Record.TimerMode = HALP_APIC_TIMER_MODE_PERIODIC;
+
+    /* Make sure no old deadline is still armed (it would fire a spurious tick otherwise). */
+    if (TscDeadlineActive) {
+        WriteMsr(HALP_MSR_TSC_DEADLINE, 0);
+    }
+
+    HalpWriteLapicRegister(HALP_APIC_LVTT_REG, Record.RawData);
+    HalpWriteLapicRegister(HALP_APIC_TIMER_ICR_REG, Processor->TimerPeriod);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -0,0 +1,314 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <kernel/halp.h>
+#include <kernel/ke.h>
+#include <kernel/mm.h>
+#include <os/intrin.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern bool HalpSmpInitializationComplete;
+
+uint64_t HalpTlbShootdownsSent = 0;
+uint64_t HalpTlbShootdownsAvoided = 0;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function invalidates the whole TLB of the current processor.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FlushLocalTlb(void) {
+    __asm__ volatile("mov %%cr3, %%rax; mov %%rax, %%cr3;" : : : "%rax", "memory");
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function invalidates a range of pages in the TLB of the current processor, falling
+ *     back to a full flush if the range is big enough that INVLPG'ing each page would be slower.
+ *
+ * PARAMETERS:
+ *     Start - First virtual address to invalidate.
+ *     Pages - How many pages to invalidate.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpFlushLocalTlbRange(uint64_t Start, uint64_t Pages) {
+    if (Pages > HALP_TLB_FLUSH_THRESHOLD) {
+        FlushLocalTlb();
+        return;
+    }
+
+    for (uint64_t Page = 0; Page < Pages; Page++) {
+        __asm__ volatile("invlpg (%0)" : : "r"(Start + (Page << MM_PAGE_SHIFT)) : "memory");
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function processes all pending TLB invalidations queued to the current processor. We
+ *     expect to be called either at IPI IRQL, or with interrupts disabled.
+ *
+ * PARAMETERS:
+ *     Processor - Pointer to the current processor structure.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void DrainFlushList(KeProcessor *Processor) {
+    KeAcquireSpinLockAtCurrentIrql(&Processor->TlbFlushLock);
+
+    if (Processor->TlbFlushAll) {
+        FlushLocalTlb();
+    } else {
+        for (uint32_t i = 0; i < Processor->TlbFlushCount; i++) {
+            HalpFlushLocalTlbRange(
+                Processor->TlbFlushList[i].Start, Processor->TlbFlushList[i].Pages);
+        }
+    }
+
+    /* Everything up to the current request ticket is now gone from our TLB. */
+    Processor->TlbFlushAll = false;
+    Processor->TlbFlushCount = 0;
+    __atomic_store_n(&Processor->TlbFlushCompleted, Processor->TlbFlushRequested, __ATOMIC_RELEASE);
+    KeReleaseSpinLockAtCurrentIrql(&Processor->TlbFlushLock);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function appends an invalidation request into the flush list of another processor.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor should do the invalidation.
+ *     Start - First virtual address to invalidate.
+ *     Pages - How many pages to invalidate.
+ *     FlushAll - Set this if the whole TLB should be invalidated.
+ *
+ * RETURN VALUE:
+ *     Ticket that can be compared against Processor->TlbFlushCompleted to know when the request
+ *     is done.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t QueueFlush(KeProcessor *Processor, uint64_t Start, uint64_t Pages, bool FlushAll) {
+    /* The lock needs to be held at IPI IRQL, otherwise we could deadlock against our own
+     * shootdown handler (if someone else is holding our lock). */
+    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->TlbFlushLock, KE_IRQL_IPI);
+
+    /* Requests that don't fit into the list just get merged into a full flush (which is also what
+     * the target would do for big ranges anyways). */
+    if (FlushAll || Pages > HALP_TLB_FLUSH_THRESHOLD ||
+        Processor->TlbFlushCount >= HALP_TLB_FLUSH_LIST_SIZE) {
+        Processor->TlbFlushAll = true;
+    } else if (!Processor->TlbFlushAll) {
+        Processor->TlbFlushList[Processor->TlbFlushCount].Start = Start;
+        Processor->TlbFlushList[Processor->TlbFlushCount].Pages = Pages;
+        Processor->TlbFlushCount++;
+    }
+
+    uint64_t Ticket = __atomic_add_fetch(&Processor->TlbFlushRequested, 1, __ATOMIC_SEQ_CST);
+    KeReleaseSpinLockAndLowerIrql(&Processor->TlbFlushLock, OldIrql);
+    return Ticket;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if the given processor already invalidated everything up to (and
+ *     including) the given ticket, or if it's in lazy TLB mode (in which case it'll invalidate
+ *     everything before touching any memory that could be affected by the invalidation).
+ *
+ *     The lazy TLB shortcut only works for leaf entries; The processor can still walk the page
+ *     tables (speculatively) while idle, so it might use stale paging-structure cache entries to
+ *     access page tables that were already freed (and reused).
+ *
+ * PARAMETERS:
+ *     Processor - Which processor to check.
+ *     Ticket - Value previously returned by QueueFlush.
+ *     FlushAll - Set this if the request might have freed page tables (HALP_TLB_FLUSH_ALL).
+ *
+ * RETURN VALUE:
+ *     true if the processor has no stale entries left for this request, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool IsFlushComplete(KeProcessor *Processor, uint64_t Ticket, bool FlushAll) {
+    return __atomic_load_n(&Processor->TlbFlushCompleted, __ATOMIC_ACQUIRE) >= Ticket ||
+           (!FlushAll && __atomic_load_n(&Processor->TlbLazy, __ATOMIC_SEQ_CST));
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function invalidates a range of pages on all processors that might have it cached.
+ *     Processors in lazy TLB mode (idle, and not touching any kernel memory) don't get an IPI for
+ *     leaf invalidations (but they still do for full flushes), and neither do processors that
+ *     already have a shootdown IPI pending (they'll pick up this request when handling it).
+ *
+ * PARAMETERS:
+ *     VirtualAddress - First virtual address to invalidate.
+ *     Size - Size in bytes of the range to invalidate.
+ *     Flags - HALP_TLB_FLUSH_ALL if the whole TLB should be invalidated (such as after freeing a
+ *             page table), and/or HALP_TLB_FLUSH_ASYNC if we shouldn't wait for the other
+ *             processors to finish the invalidation (use HalpWaitTlbFlush before reusing the
+ *             range in that case).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpFlushTlb(void *VirtualAddress, uint64_t Size, int Flags) {
+    uint64_t Start = (uint64_t)VirtualAddress & ~(MM_PAGE_SIZE - 1);
+    uint64_t End = ((uint64_t)VirtualAddress + Size + MM_PAGE_SIZE - 1) & ~(MM_PAGE_SIZE - 1);
+    uint64_t Pages = (End - Start) >> MM_PAGE_SHIFT;
+    bool FlushAll = (Flags & HALP_TLB_FLUSH_ALL) != 0;
+
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+
+    if (FlushAll) {
+        FlushLocalTlb();
+    } else {
+        HalpFlushLocalTlbRange(Start, Pages);
+    }
+
+    /* No need for any shootdowns if we're still too early in the initailization phase (this also
+     * runs before the GS base is set up, so don't touch the processor block before this). */
+    if (!HalpSmpInitializationComplete) {
+        KeLowerIrql(OldIrql);
+        return;
+    }
+
+    KeProcessor *Processor = KeGetCurrentProcessor();
+
+    /* Queue the request on everyone, and IPI only the processors that need it; We handle the
+     * processors in batches of 64, so that we can keep the wait tickets on the stack. */
+    for (uint32_t Base = 0; Base < HalpOnlineProcessorCount; Base += 64) {
+        uint64_t Tickets[64];
+        uint64_t WaitMask = 0;
+
+        for (uint32_t i = Base; i < HalpOnlineProcessorCount && i < Base + 64; i++) {
+            KeProcessor *TargetProcessor = HalpProcessorList[i];
+            if (TargetProcessor == Processor) {
+                continue;
+            }
+
+            Tickets[i - Base] = QueueFlush(TargetProcessor, Start, Pages, FlushAll);
+
+            /* Lazy processors will flush before leaving the lazy state (unless we're freeing
+             * page tables, see IsFlushComplete), and processors that already have an IPI on the
+             * way will drain our request together with the others. */
+            if ((!FlushAll && __atomic_load_n(&TargetProcessor->TlbLazy, __ATOMIC_SEQ_CST)) ||
+                __atomic_exchange_n(&TargetProcessor->TlbFlushIpiPending, 1, __ATOMIC_SEQ_CST)) {
+                __atomic_fetch_add(&HalpTlbShootdownsAvoided, 1, __ATOMIC_RELAXED);
+            } else {
+                HalpSendIpi(
+                    TargetProcessor->ApicId, HALP_INT_TLB_VECTOR, HALP_APIC_ICR_DELIVERY_FIXED);
+                __atomic_fetch_add(&HalpTlbShootdownsSent, 1, __ATOMIC_RELAXED);
+            }
+
+            WaitMask |= 1ull << (i - Base);
+        }
+
+        if (Flags & HALP_TLB_FLUSH_ASYNC) {
+            continue;
+        }
+
+        while (WaitMask) {
+            for (uint64_t Mask = WaitMask; Mask; Mask &= Mask - 1) {
+                uint32_t Index = __builtin_ctzll(Mask);
+                if (IsFlushComplete(HalpProcessorList[Base + Index], Tickets[Index], FlushAll)) {
+                    WaitMask &= ~(1ull << Index);
+                }
+            }
+
+            PauseProcessor();
+        }
+    }
+
+    KeLowerIrql(OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function waits until all invalidations queued so far (including asynchronous ones) are
+ *     finished on all processors. This is only meant for asynchronous leaf invalidations (full
+ *     flushes should be done synchronously).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpWaitTlbFlush(void) {
+    if (!HalpSmpInitializationComplete) {
+        return;
+    }
+
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        KeProcessor *TargetProcessor = HalpProcessorList[i];
+        if (TargetProcessor == Processor) {
+            continue;
+        }
+
+        uint64_t Ticket = __atomic_load_n(&TargetProcessor->TlbFlushRequested, __ATOMIC_ACQUIRE);
+        while (!IsFlushComplete(TargetProcessor, Ticket, false)) {
+            PauseProcessor();
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function handles an incoming TLB shootdown IPI.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpHandleTlbFlush(void) {
+    /* Clear the pending flag before draining, so that anyone queueing after we're done with the
+     * list sends a new IPI. */
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    __atomic_store_n(&Processor->TlbFlushIpiPending, 0, __ATOMIC_SEQ_CST);
+    DrainFlushList(Processor);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function puts the current processor into lazy TLB mode; Shootdowns will skip us while
+ *     in this mode, and only update our flush list. This should only be called with interrupts
+ *     disabled, and the caller must not touch anything other than the processor blocks (and other
+ *     always mapped kernel data) until HalpLeaveLazyTlb is called.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpEnterLazyTlb(void) {
+    __atomic_store_n(&KeGetCurrentProcessor()->TlbLazy, 1, __ATOMIC_SEQ_CST);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function leaves lazy TLB mode, processing any invalidations that were queued in the
+ *     meantime.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpLeaveLazyTlb(void) {
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    __atomic_store_n(&Processor->TlbLazy, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&Processor->TlbFlushCompleted, __ATOMIC_ACQUIRE) !=
+        __atomic_load_n(&Processor->TlbFlushRequested, __ATOMIC_ACQUIRE)) {
+        DrainFlushList(Processor);
+    }
+}
@@ -0,0 +1,334 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <cpuid.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
+#include <kernel/ke.h>
+#include <stdint.h>
+
+#ifndef NDEBUG
+static uint32_t TestSmtShift = 0;
+static uint32_t TestCacheShift = 0;
+static uint32_t TestPackageShift = 0;
+#endif /* NDEBUG */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets how many APIC ID bits are needed to give each of the given amount of
+ *     items an unique ID.
+ *
+ * PARAMETERS:
+ *     Count - How many items we need to fit.
+ *
+ * RETURN VALUE:
+ *     Amount of bits.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t GetShiftForCount(uint32_t Count) {
+    return Count > 1 ? 32 - __builtin_clz(Count - 1) : 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if we're running on an AMD (or Hygon) processor; These have their own
+ *     topology leaves, and leave the Intel-only ones (such as the cache parameters) reserved.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     true if this is an AMD-compatible processor, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool IsAmdProcessor(void) {
+    uint32_t Eax, Ebx, Ecx, Edx;
+    __cpuid(HALP_CPUID_MAX_LEAF, Eax, Ebx, Ecx, Edx);
+
+    /* "AuthenticAMD" and "HygonGenuine" (split across EBX, EDX, ECX). */
+    return (Ebx == 0x68747541 && Edx == 0x69746E65 && Ecx == 0x444D4163) ||
+           (Ebx == 0x6F677948 && Edx == 0x6E65476E && Ecx == 0x656E6975);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if the AMD cache parameters leaf is available (it's only valid with the
+ *     topology extensions bit set).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     true if we can use the extended cache parameters leaf, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool HasExtendedCacheParameters(void) {
+    uint32_t Eax, Ebx, Ecx, Edx;
+
+    if (HalpPlatformMaxExtendedLeaf < HALP_CPUID_EXTENDED_CACHE_PARAMETERS) {
+        return false;
+    }
+
+    __cpuid(HALP_CPUID_EXTENDED_PROCESSOR_INFO, Eax, Ebx, Ecx, Edx);
+    return Ecx & (1 << 22);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function collects how many low APIC ID bits identify the logical processor inside its
+ *     core, and inside its package.
+ *
+ * PARAMETERS:
+ *     SmtShift - Output; Shift to get the core part of the APIC ID.
+ *     PackageShift - Output; Shift to get the package part of the APIC ID.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void GetTopologyShifts(uint32_t *SmtShift, uint32_t *PackageShift) {
+    uint32_t Eax, Ebx, Ecx, Edx;
+
+    /* Prefer the V2 extended topology leaf, followed by the original one; Both of them enumerate
+     * each level (with the last valid level giving us the package shift). */
+    uint32_t Leaf = 0;
+    if (HalpPlatformMaxLeaf >= HALP_CPUID_EXTENDED_TOPOLOGY) {
+        __get_cpuid_count(HALP_CPUID_EXTENDED_TOPOLOGY, 0, &Eax, &Ebx, &Ecx, &Edx);
+        if (Ebx) {
+            Leaf = HALP_CPUID_EXTENDED_TOPOLOGY;
+        }
+    }
+
+    if (!Leaf && HalpPlatformMaxLeaf >= HALP_CPUID_TOPOLOGY) {
+        __get_cpuid_count(HALP_CPUID_TOPOLOGY, 0, &Eax, &Ebx, &Ecx, &Edx);
+        if (Ebx) {
+            Leaf = HALP_CPUID_TOPOLOGY;
+        }
+    }
+
+    *SmtShift = 0;
+    *PackageShift = 0;
+
+    if (Leaf) {
+        for (uint32_t SubLeaf = 0;; SubLeaf++) {
+            __get_cpuid_count(Leaf, SubLeaf, &Eax, &Ebx, &Ecx, &Edx);
+            uint32_t Type = (Ecx >> 8) & 0xFF;
+            if (Type == HALP_TOPOLOGY_LEVEL_INVALID) {
+                break;
+            } else if (Type == HALP_TOPOLOGY_LEVEL_SMT) {
+                *SmtShift = Eax & 0x1F;
+            }
+
+            *PackageShift = Eax & 0x1F;
+        }
+
+        return;
+    }
+
+    /* Otherwise, fallback to the legacy logical/core counts (which are only valid if the HTT bit
+     * is set). */
+    __cpuid(HALP_CPUID_PROCESSOR_INFO, Eax, Ebx, Ecx, Edx);
+    if (!(Edx & (1 << 28))) {
+        return;
+    }
+
+    uint32_t LogicalCount = (Ebx >> 16) & 0xFF;
+
+    /* The cache parameters leaf is reserved on AMD; Instead, the address sizes leaf has the
+     * amount of logical processors in the package (and maybe the exact amount of APIC ID bits it
+     * uses), while the L1 cache is shared by all threads of a core. */
+    if (IsAmdProcessor()) {
+        if (HalpPlatformMaxExtendedLeaf >= HALP_CPUID_ADDRESS_SIZES) {
+            __cpuid(HALP_CPUID_ADDRESS_SIZES, Eax, Ebx, Ecx, Edx);
+            uint32_t ApicIdSize = (Ecx >> 12) & 0x0F;
+            *PackageShift = ApicIdSize ? ApicIdSize : GetShiftForCount((Ecx & 0xFF) + 1);
+        } else {
+            *PackageShift = GetShiftForCount(LogicalCount);
+        }
+
+        if (HasExtendedCacheParameters()) {
+            __get_cpuid_count(HALP_CPUID_EXTENDED_CACHE_PARAMETERS, 0, &Eax, &Ebx, &Ecx, &Edx);
+            if (Eax & 0x1F) {
+                *SmtShift = GetShiftForCount(((Eax >> 14) & 0xFFF) + 1);
+            }
+        }
+
+        if (*SmtShift > *PackageShift) {
+            *SmtShift = *PackageShift;
+        }
+
+        return;
+    }
+
+    uint32_t CoreCount = 1;
+    if (HalpPlatformMaxLeaf >= HALP_CPUID_CACHE_PARAMETERS) {
+        __get_cpuid_count(HALP_CPUID_CACHE_PARAMETERS, 0, &Eax, &Ebx, &Ecx, &Edx);
+        if (Eax & 0x1F) {
+            CoreCount = (Eax >> 26) + 1;
+        }
+    }
+
+    *PackageShift = GetShiftForCount(LogicalCount);
+    uint32_t CoreShift = GetShiftForCount(CoreCount);
+    *SmtShift = *PackageShift > CoreShift ? *PackageShift - CoreShift : 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function collects how many low APIC ID bits identify the logical processor inside the
+ *     group sharing its last level cache.
+ *
+ * PARAMETERS:
+ *     PackageShift - Fallback value if we can't find any cache information.
+ *
+ * RETURN VALUE:
+ *     Shift to get the cache part of the APIC ID.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t GetCacheShift(uint32_t PackageShift) {
+    uint32_t Eax, Ebx, Ecx, Edx;
+
+    /* Intel uses the deterministic cache parameters leaf, while AMD has its own copy of it in the
+     * extended range (with the same layout). */
+    uint32_t Leaf = 0;
+    bool Amd = IsAmdProcessor();
+    if (!Amd && HalpPlatformMaxLeaf >= HALP_CPUID_CACHE_PARAMETERS) {
+        __get_cpuid_count(HALP_CPUID_CACHE_PARAMETERS, 0, &Eax, &Ebx, &Ecx, &Edx);
+        if (Eax & 0x1F) {
+            Leaf = HALP_CPUID_CACHE_PARAMETERS;
+        }
+    }
+
+    if (!Leaf && Amd && HasExtendedCacheParameters()) {
+        __get_cpuid_count(HALP_CPUID_EXTENDED_CACHE_PARAMETERS, 0, &Eax, &Ebx, &Ecx, &Edx);
+        if (Eax & 0x1F) {
+            Leaf = HALP_CPUID_EXTENDED_CACHE_PARAMETERS;
+        }
+    }
+
+    if (!Leaf) {
+        return PackageShift;
+    }
+
+    uint32_t HighestLevel = 0;
+    uint32_t SharingCount = 0;
+    for (uint32_t SubLeaf = 0;; SubLeaf++) {
+        __get_cpuid_count(Leaf, SubLeaf, &Eax, &Ebx, &Ecx, &Edx);
+        if (!(Eax & 0x1F)) {
+            break;
+        }
+
+        uint32_t Level = (Eax >> 5) & 0x07;
+        if (Level > HighestLevel) {
+            HighestLevel = Level;
+            SharingCount = ((Eax >> 14) & 0xFFF) + 1;
+        }
+    }
+
+    uint32_t CacheShift = GetShiftForCount(SharingCount);
+    return CacheShift < PackageShift ? CacheShift : PackageShift;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function fills in the topology IDs (core, last level cache, and package) of all
+ *     processors; Two processors with the same ID share that level. This should only be called
+ *     after all processors are online (so that their APIC IDs are valid).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpInitializeTopology(void) {
+    uint32_t SmtShift, PackageShift;
+    GetTopologyShifts(&SmtShift, &PackageShift);
+    uint32_t CacheShift = GetCacheShift(PackageShift);
+    if (CacheShift < SmtShift) {
+        CacheShift = SmtShift;
+    }
+
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        KeProcessor *Processor = HalpProcessorList[i];
+        Processor->CoreId = Processor->ApicId >> SmtShift;
+        Processor->CacheId = Processor->ApicId >> CacheShift;
+        Processor->PackageId = Processor->ApicId >> PackageShift;
+    }
+
+    KdPrint(
+        KD_TYPE_TRACE,
+        "topology shifts: smt = %u, cache = %u, package = %u\n",
+        SmtShift,
+        CacheShift,
+        PackageShift);
+
+#ifndef NDEBUG
+    TestSmtShift = SmtShift;
+    TestCacheShift = CacheShift;
+    TestPackageShift = PackageShift;
+#endif /* NDEBUG */
+}
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function validates the topology IDs of all processors (debug builds only); The levels
+ *     should nest (SMT siblings share a cache, and cache siblings share a package), no two
+ *     processors should have the same APIC ID, and no level can have more members than its shift
+ *     allows. This should be called right after HalpInitializeTopology.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpTestTopology(void) {
+    if (TestSmtShift > TestCacheShift || TestCacheShift > TestPackageShift) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE, TestSmtShift, TestCacheShift, TestPackageShift, 0);
+    }
+
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        KeProcessor *Processor = HalpProcessorList[i];
+        uint32_t CoreSiblings = 0;
+        uint32_t CacheSiblings = 0;
+        uint32_t PackageSiblings = 0;
+
+        for (uint32_t j = 0; j < HalpOnlineProcessorCount; j++) {
+            KeProcessor *Other = HalpProcessorList[j];
+            if (i != j && Processor->ApicId == Other->ApicId) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, j, Processor->ApicId, 0);
+            }
+
+            /* Sharing any level means sharing everything above it. */
+            bool SameCore = Processor->CoreId == Other->CoreId;
+            bool SameCache = Processor->CacheId == Other->CacheId;
+            bool SamePackage = Processor->PackageId == Other->PackageId;
+            if ((SameCore && !SameCache) || (SameCache && !SamePackage)) {
+                KeFatalError(
+                    KE_PANIC_SELF_TEST_FAILURE, Processor->ApicId, Other->ApicId, SameCore, 1);
+            }
+
+            CoreSiblings += SameCore;
+            CacheSiblings += SameCache;
+            PackageSiblings += SamePackage;
+        }
+
+        if (CoreSiblings > 1u << TestSmtShift || CacheSiblings > 1u << TestCacheShift ||
+            PackageSiblings > 1u << TestPackageShift) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                Processor->ApicId,
+                CoreSiblings,
+                CacheSiblings,
+                PackageSiblings);
+        }
+
+        KdPrint(
+            KD_TYPE_TRACE,
+            "processor %u: apic = %u, core = %u, cache = %u, package = %u\n",
+            i,
+            Processor->ApicId,
+            Processor->CoreId,
+            Processor->CacheId,
+            Processor->PackageId);
+    }
+}
+#endif /* NDEBUG */
@@ -0,0 +1,225 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <cpuid.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
+#include <kernel/ke.h>
+#include <kernel/mm.h>
+#include <os/intrin.h>
+#include <stdint.h>
+
+/* XSAVEOPT and XSAVES skip anything the processor thinks wasn't modified since the last XRSTOR
+ * from the same address, which is only safe if the buffer still holds what that XRSTOR loaded; We
+ * remember which processor last saved/restored each buffer to be sure that's the case. */
+typedef struct {
+    KeProcessor *LastProcessor;
+    char Data[];
+} StateBuffer;
+
+static uint64_t StateMask = 0;
+static uint32_t StateSize = 0;
+static bool Compacted = false;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function aligns a buffer returned by HalpAllocateExtendedState to the boundary required
+ *     by the XSAVE instructions.
+ *
+ * PARAMETERS:
+ *     Buffer - Which buffer to align.
+ *
+ * RETURN VALUE:
+ *     Start of the XSAVE area inside the buffer.
+ *-----------------------------------------------------------------------------------------------*/
+static void *GetStateArea(void *Buffer) {
+    uint64_t Data = (uint64_t)((StateBuffer *)Buffer)->Data;
+    return (void *)((Data + HALP_XSTATE_ALIGNMENT - 1) & ~(HALP_XSTATE_ALIGNMENT - 1));
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function enables XSAVE on the current processor, and loads XCR0 with every extended
+ *     state component that we know how to handle. The first call (on the BSP) also decides which
+ *     components to use, and how large the XSAVE areas need to be.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpInitializeExtendedState(void) {
+    if (!(HalpPlatformFeatures & HALP_FEATURE_XSAVE)) {
+        return;
+    }
+
+    /* XSETBV (and any AVX instruction) faults unless OSXSAVE is set. */
+    uint64_t Cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(Cr4));
+    __asm__ volatile("mov %0, %%cr4" : : "r"(Cr4 | HALP_CR4_OSXSAVE) : "memory");
+
+    uint32_t Eax, Ebx, Ecx, Edx;
+    if (!StateMask) {
+        /* AVX-512 needs all three of its components (opmask, upper ZMM0-15, and ZMM16-31) enabled
+         * together. */
+        __get_cpuid_count(HALP_CPUID_EXTENDED_STATE, 0, &Eax, &Ebx, &Ecx, &Edx);
+        uint64_t Supported = ((uint64_t)Edx << 32) | Eax;
+        uint64_t Mask = HALP_XSTATE_X87 | HALP_XSTATE_SSE;
+
+        if (HalpPlatformFeatures & HALP_FEATURE_AVX) {
+            Mask |= HALP_XSTATE_AVX;
+        }
+
+        if ((HalpPlatformFeatures & HALP_FEATURE_AVX512F) &&
+            (Supported & HALP_XSTATE_AVX512) == HALP_XSTATE_AVX512) {
+            Mask |= HALP_XSTATE_AVX512;
+        }
+
+        StateMask = Mask & Supported;
+    }
+
+    __asm__ volatile("xsetbv"
+                     :
+                     : "c"(0), "a"((uint32_t)StateMask), "d"((uint32_t)(StateMask >> 32))
+                     : "memory");
+
+    /* We don't use any supervisor components, so make sure XSAVES doesn't try saving them. */
+    if (HalpPlatformFeatures & HALP_FEATURE_XSAVES) {
+        WriteMsr(HALP_MSR_XSS, 0);
+    }
+
+    /* The size CPUID reports depends on the current XCR0 (and on the compacted format for XSAVES),
+     * so we can only grab it after the XSETBV. We only go with the compacted format if we also
+     * have XSAVEC, as saving into a buffer we don't own needs a non-optimized save. */
+    if (!StateSize) {
+        Compacted = (HalpPlatformFeatures & HALP_FEATURE_XSAVES) &&
+                    (HalpPlatformFeatures & HALP_FEATURE_XSAVEC);
+        __get_cpuid_count(
+            HALP_CPUID_EXTENDED_STATE,
+            Compacted ? 1 : 0,
+            &Eax,
+            &Ebx,
+            &Ecx,
+            &Edx);
+        StateSize = Ebx;
+        KdPrint(
+            KD_TYPE_TRACE,
+            "extended state mask: %016llx, size: %u bytes\n",
+            StateMask,
+            StateSize);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates a buffer large enough to hold all enabled extended state
+ *     components.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Pointer to the buffer, or NULL if XSAVE isn't supported/we're out of memory.
+ *-----------------------------------------------------------------------------------------------*/
+void *HalpAllocateExtendedState(void) {
+    if (!StateSize) {
+        return NULL;
+    }
+
+    void *Buffer = MmAllocatePool(
+        sizeof(StateBuffer) + StateSize + HALP_XSTATE_ALIGNMENT - 1, MM_POOL_TAG_EXTENDED_STATE);
+    if (!Buffer) {
+        return NULL;
+    }
+
+    /* The pool already zeroed the XSAVE header for us (so XRSTOR will just load the initial state
+     * on the first restore), and the owner (so a buffer reusing the address of a freed one never
+     * gets an optimized save); But XRSTORS only accepts the compacted format, so we need to set
+     * that up in XCOMP_BV. */
+    if (Compacted) {
+        uint64_t *Header = (uint64_t *)((char *)GetStateArea(Buffer) + HALP_XSTATE_HEADER_OFFSET);
+        Header[1] = HALP_XSTATE_COMPACTED | StateMask;
+    }
+
+    return Buffer;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function frees a buffer allocated by HalpAllocateExtendedState.
+ *
+ * PARAMETERS:
+ *     Buffer - Which buffer to free.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpFreeExtendedState(void *Buffer) {
+    MmFreePool(Buffer, MM_POOL_TAG_EXTENDED_STATE);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function saves the extended state of the current processor. XSAVES and XSAVEOPT skip
+ *     any component that is still in its initial state, or that wasn't modified since the last
+ *     restore from the same buffer, so we use them whenever the last XRSTOR of this processor came
+ *     from this same buffer (and no one else saved into it since); Otherwise, we fall back to
+ *     XSAVEC/XSAVE. This needs to be called at DISPATCH or above.
+ *
+ * PARAMETERS:
+ *     Buffer - Buffer allocated by HalpAllocateExtendedState.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpSaveExtendedState(void *Buffer) {
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    StateBuffer *Header = Buffer;
+    void *Area = GetStateArea(Buffer);
+    uint32_t Low = StateMask;
+    uint32_t High = StateMask >> 32;
+    bool Owner = Processor->ExtendedStateOwner == Buffer && Header->LastProcessor == Processor;
+
+    if (Owner && Compacted) {
+        __asm__ volatile("xsaves64 (%0)" : : "r"(Area), "a"(Low), "d"(High) : "memory");
+    } else if (Owner && (HalpPlatformFeatures & HALP_FEATURE_XSAVEOPT)) {
+        __asm__ volatile("xsaveopt64 (%0)" : : "r"(Area), "a"(Low), "d"(High) : "memory");
+    } else if (Compacted) {
+        __asm__ volatile("xsavec64 (%0)" : : "r"(Area), "a"(Low), "d"(High) : "memory");
+    } else {
+        __asm__ volatile("xsave64 (%0)" : : "r"(Area), "a"(Low), "d"(High) : "memory");
+    }
+
+    Header->LastProcessor = Processor;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function loads the extended state of the current processor from a buffer previously
+ *     filled by HalpSaveExtendedState (or zeroed by HalpAllocateExtendedState, which resets all
+ *     components into their initial state), and makes the buffer the owner of the processor's
+ *     extended state. This needs to be called at DISPATCH or above.
+ *
+ * PARAMETERS:
+ *     Buffer - Buffer allocated by HalpAllocateExtendedState.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void HalpRestoreExtendedState(void *Buffer) {
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    StateBuffer *Header = Buffer;
+    void *Area = GetStateArea(Buffer);
+    uint32_t Low = StateMask;
+    uint32_t High = StateMask >> 32;
+
+    if (Compacted) {
+        __asm__ volatile("xrstors64 (%0)" : : "r"(Area), "a"(Low), "d"(High) : "memory");
+    } else {
+        __asm__ volatile("xrstor64 (%0)" : : "r"(Area), "a"(Low), "d"(High) : "memory");
+    }
+
+    Processor->ExtendedStateOwner = Buffer;
+    Header->LastProcessor = Processor;
+}
@@ -11,6 +11,7 @@
 
 #define HALP_EARLY_MAP_START 0xFFFF800000000000
 #define HALP_EARLY_MAP_PAGES 0x1000
+#define HALP_EARLY_MAP_SPLIT_PAGE 2
 
 #define HALP_FEATURE_HYPERVISOR (1ull << 0)
 #define HALP_FEATURE_HYBRID (1ull << 1)
@@ -59,23 +60,54 @@
 #define HALP_FEATURE_SMEP (1ull << 44)
 #define HALP_FEATURE_UMIP (1ull << 45)
 #define HALP_FEATURE_WAITPKG (1ull << 46)
+#define HALP_FEATURE_TSC_DEADLINE (1ull << 47)
+#define HALP_FEATURE_MWAIT_BREAK (1ull << 48)
+#define HALP_FEATURE_XSAVEOPT (1ull << 49)
+#define HALP_FEATURE_XSAVES (1ull << 50)
+#define HALP_FEATURE_AVX512F (1ull << 51)
+#define HALP_FEATURE_XSAVEC (1ull << 52)
 
 #define HALP_CPUID_MAX_LEAF 0x00000000
 #define HALP_CPUID_PROCESSOR_INFO 0x00000001
+#define HALP_CPUID_CACHE_PARAMETERS 0x00000004
+#define HALP_CPUID_MONITOR 0x00000005
 #define HALP_CPUID_EXTENDED_FEATURES 0x00000007
+#define HALP_CPUID_TOPOLOGY 0x0000000B
+#define HALP_CPUID_EXTENDED_STATE 0x0000000D
 #define HALP_CPUID_TSC_FREQUENCY 0x00000015
 #define HALP_CPUID_PROCESSOR_FREQUENCY 0x00000016
+#define HALP_CPUID_EXTENDED_TOPOLOGY 0x0000001F
 
 #define HALP_CPUID_MAX_EXTENDED_LEAF 0x80000000
 #define HALP_CPUID_EXTENDED_PROCESSOR_INFO 0x80000001
 #define HALP_CPUID_EXTENDED_PROCESSOR_BRAND(Part) (0x80000002 + (Part))
 #define HALP_CPUID_PPM_INFO 0x80000007
+#define HALP_CPUID_ADDRESS_SIZES 0x80000008
+#define HALP_CPUID_EXTENDED_CACHE_PARAMETERS 0x8000001D
+
+#define HALP_TOPOLOGY_LEVEL_INVALID 0
+#define HALP_TOPOLOGY_LEVEL_SMT 1
 
 #define HALP_MSR_TSC 0x00000010
 #define HALP_MSR_APIC 0x0000001B
+#define HALP_MSR_TSC_DEADLINE 0x000006E0
 #define HALP_MSR_APIC_REG(Number) (0x00000800 + ((Number) >> 4))
+#define HALP_MSR_XSS 0x00000DA0
+#define HALP_MSR_GS_BASE 0xC0000101
 #define HALP_MSR_KERNEL_GS_BASE 0xC0000102
 
+#define HALP_RFLAGS_IF 0x200
+
+#define HALP_CR4_OSXSAVE (1ull << 18)
+
+#define HALP_XSTATE_X87 0x01
+#define HALP_XSTATE_SSE 0x02
+#define HALP_XSTATE_AVX 0x04
+#define HALP_XSTATE_AVX512 0xE0
+#define HALP_XSTATE_COMPACTED (1ull << 63)
+#define HALP_XSTATE_ALIGNMENT 64
+#define HALP_XSTATE_HEADER_OFFSET 512
+
 #define HALP_INT_ALERT_IRQL 2
 #define HALP_INT_FASTFAIL_IRQL 2
 #define HALP_INT_DISPATCH_IRQL 3
@@ -88,8 +120,13 @@
 #define HALP_INT_DISPATCH_VECTOR 0x30
 #define HALP_INT_TIMER_VECTOR 0xD0
 #define HALP_INT_IPI_VECTOR 0xE0
+#define HALP_INT_TLB_VECTOR 0xE1
 #define HALP_INT_SPURIOUS_VECTOR 0xFF
 
+#define HALP_TLB_FLUSH_THRESHOLD 32
+#define HALP_TLB_FLUSH_ALL 0x01
+#define HALP_TLB_FLUSH_ASYNC 0x02
+
 #define HALP_LAPIC_RECORD 0
 #define HALP_IOAPIC_RECORD 1
 #define HALP_IOAPIC_SOURCE_OVERRIDE_RECORD 2
@@ -144,6 +181,10 @@
 
 #define HALP_APIC_VER_MAX_LVT(v) ((((v) >> 16) & 0xFF) + 1)
 
+#define HALP_APIC_TIMER_MODE_ONE_SHOT 0x00
+#define HALP_APIC_TIMER_MODE_PERIODIC 0x01
+#define HALP_APIC_TIMER_MODE_TSC_DEADLINE 0x02
+
 #define HALP_APIC_ICR_DELIVERY_FIXED 0x00
 #define HALP_APIC_ICR_DELIVERY_LOW_PRI 0x01
 #define HALP_APIC_ICR_DELIVERY_SMI 0x02
@@ -35,6 +35,8 @@ uint32_t HalpReadLapicId(void);
 void HalpSendIpi(uint32_t Target, uint8_t Vector, uint8_t DeliveryMode);
 void HalpSendEoi(void);
 
+bool HalpRequestSoftwareInterrupt(KeProcessor *Processor, KeIrql Irql);
+
 void HalpInitializeIoapic(void);
 bool HalpTranslateIrq(uint8_t Irq, uint8_t *Gsi, uint8_t *PinPolarity, uint8_t *TriggerMode);
 void HalpEnableGsi(uint8_t Gsi, uint8_t Vector, uint8_t PinPolarity, uint8_t TriggerMode);
@@ -52,7 +54,23 @@ void HalpSetActiveTimer(uint64_t Frequency, uint64_t (*GetTicks)(void));
 void HalpInitializeTimer(void);
 void HalpInitializeApicTimer(void);
 
+void HalpInitializeExtendedState(void);
+
 void HalpInitializeSmp(void);
+void HalpInitializeTopology(void);
+
+#ifndef NDEBUG
+void HalpTestTopology(void);
+void HalpBenchmarkIrql(void);
+#endif /* NDEBUG */
+
+extern uint64_t HalpTlbShootdownsSent;
+extern uint64_t HalpTlbShootdownsAvoided;
+
+void HalpFlushLocalTlbRange(uint64_t Start, uint64_t Pages);
+void HalpFlushTlb(void *VirtualAddress, uint64_t Size, int Flags);
+void HalpWaitTlbFlush(void);
+void HalpHandleTlbFlush(void);
 
 #ifdef __cplusplus
 }
@@ -20,7 +20,8 @@ typedef union {
         uint64_t Dirty : 1;
         uint64_t PageSize : 1;
         uint64_t Global : 1;
-        uint64_t Available0 : 2;
+        uint64_t SplitReserved : 1;
+        uint64_t Available0 : 1;
         uint64_t Pat : 1;
         uint64_t Address : 40;
         uint64_t Available1 : 7;
@@ -190,8 +191,8 @@ typedef union {
         uint32_t Remote : 1;
         uint32_t TriggerMode : 1;
         uint32_t Masked : 1;
-        uint32_t Periodic : 1;
-        uint32_t Reserved1 : 14;
+        uint32_t TimerMode : 2;
+        uint32_t Reserved1 : 13;
     };
     uint32_t RawData;
 } HalpApicLvtRecord;
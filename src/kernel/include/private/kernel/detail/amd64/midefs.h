@@ -8,8 +8,13 @@
 
 #define MI_PFN_START 0xFFFF800002000000
 
-#define MI_POOL_BITMAP_START 0xFFFF800001000000
+#define MI_POOL_RANGE_START 0xFFFF800001000000
+#define MI_POOL_RANGE_SIZE 0x1000000
 #define MI_POOL_START 0xFFFF908000000000
 #define MI_POOL_MAX_SIZE 0x2000000000
 
+#define MI_LARGE_PAGE_SHIFT 21
+#define MI_LARGE_PAGE_SIZE (1ull << MI_LARGE_PAGE_SHIFT)
+#define MI_LARGE_PAGE_PAGES (MI_LARGE_PAGE_SIZE >> MM_PAGE_SHIFT)
+
 #endif /* _KERNEL_DETAIL_AMD64_MIDEFS_H_ */
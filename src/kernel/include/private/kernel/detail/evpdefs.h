@@ -15,5 +15,17 @@
 /* clang-format on */
 
 #define EVP_TICK_PERIOD (1 * EV_MILLISECS)
+#define EVP_MAX_STOPPED_TICKS (EV_SECS / EVP_TICK_PERIOD)
+
+#define EVP_MUTEX_SPIN_LIMIT 4096
+#define EVP_MUTEX_MAX_BACKOFF 256
+
+#define EVP_PUSH_LOCK_EXCLUSIVE 0x01
+#define EVP_PUSH_LOCK_WAITING 0x02
+#define EVP_PUSH_LOCK_LIST_LOCKED 0x04
+#define EVP_PUSH_LOCK_SHARE_SHIFT 4
+#define EVP_PUSH_LOCK_SHARE_INCREMENT (1ull << EVP_PUSH_LOCK_SHARE_SHIFT)
+#define EVP_PUSH_LOCK_POINTER_MASK (~0x0Full)
+#define EVP_PUSH_LOCK_SPIN_COUNT 1024
 
 #endif /* _KERNEL_DETAIL_EVPDEFS_H_ */
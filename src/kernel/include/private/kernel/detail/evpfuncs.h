@@ -8,6 +8,7 @@
 
 #include <kernel/detail/evfuncs.h>
 #include <kernel/detail/evtypes.h>
+#include <kernel/detail/ketypes.h>
 
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, evpfuncs.h))
@@ -19,8 +20,22 @@
 extern "C" {
 #endif /* __cplusplus */
 
-void EvpWakeSingleThread(EvHeader *Header);
+void *EvpWakeSingleThread(EvHeader *Header);
 void EvpWakeAllThreads(EvHeader *Header);
+bool EvpWaitForHeader(EvHeader *Header, uint64_t Timeout);
+
+bool EvpTryAcquireMutex(EvMutex *Mutex);
+
+void EvpStopTick(KeProcessor *Processor);
+void EvpRestartTick(KeProcessor *Processor, bool TimerFired);
+
+#ifndef NDEBUG
+void EvpTestPushLocks(void);
+void EvpTestWaits(void);
+void EvpBenchmarkBroadcast(void);
+void EvpBenchmarkMutex(void);
+void EvpBenchmarkEventLoop(void);
+#endif /* NDEBUG */
 
 #ifdef __cplusplus
 }
@@ -14,4 +14,13 @@
 #endif /* __has__include */
 /* clang-format on */
 
+typedef struct {
+    RtDList ListHeader;
+    EvHeader *Header;
+    void *Thread;
+    uint32_t Index;
+    bool WaitAll;
+    bool Linked;
+} EvpWaitBlock;
+
 #endif /* _KERNEL_DETAIL_EVPTYPES_H_ */
@@ -49,10 +49,18 @@ bool HalpMapNonContiguousPages(
     uint64_t Size,
     int Flags);
 void HalpUnmapPages(void *VirtualAddress, uint64_t Size);
+void HalpZeroPages(void *VirtualAddress, uint64_t Size);
 
-void HalpBroadcastIpi(void);
 void HalpBroadcastFreeze(void);
 void HalpNotifyProcessor(KeProcessor *Processor, KeIrql TargetIrql);
+void HalpHandleDispatch(void);
+
+void HalpEnterLazyTlb(void);
+void HalpLeaveLazyTlb(void);
+
+void HalpSetTimerDeadline(uint64_t Ticks);
+void HalpSetPeriodicTimer(void);
+void HalpWaitForInterrupt(volatile uint32_t *WakeFlag);
 
 void *HalpEnterCriticalSection(void);
 void HalpLeaveCriticalSection(void *Context);
@@ -65,6 +73,11 @@ void HalpInitializeContext(
     void *Parameter);
 void HalpSwitchContext(HalContextFrame *CurrentContext, HalContextFrame *TargetContext);
 
+void *HalpAllocateExtendedState(void);
+void HalpFreeExtendedState(void *Buffer);
+void HalpSaveExtendedState(void *Buffer);
+void HalpRestoreExtendedState(void *Buffer);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -29,11 +29,22 @@
 #define KDP_DEBUG_PACKET_READ_PHYSICAL_REQ 0x03
 #define KDP_DEBUG_PACKET_READ_VIRTUAL_REQ 0x04
 #define KDP_DEBUG_PACKET_READ_PORT_REQ 0x05
+#define KDP_DEBUG_PACKET_QUERY_POOL_TAGS_REQ 0x07
+#define KDP_DEBUG_PACKET_QUERY_PROCESSORS_REQ 0x08
+#define KDP_DEBUG_PACKET_QUERY_LOCKS_REQ 0x09
 
 #define KDP_DEBUG_PACKET_CONNECT_ACK 0x80
 #define KDP_DEBUG_PACKET_READ_PHYSICAL_ACK 0x83
 #define KDP_DEBUG_PACKET_READ_VIRTUAL_ACK 0x84
 #define KDP_DEBUG_PACKET_READ_PORT_ACK 0x85
+#define KDP_DEBUG_PACKET_QUERY_POOL_TAGS_ACK 0x87
+#define KDP_DEBUG_PACKET_QUERY_PROCESSORS_ACK 0x88
+#define KDP_DEBUG_PACKET_QUERY_LOCKS_ACK 0x89
+
+/* These should fit (along with the ack header) in the 1KiB response buffer. */
+#define KDP_DEBUG_POOL_TAGS_PER_PACKET 24
+#define KDP_DEBUG_PROCESSORS_PER_PACKET 10
+#define KDP_DEBUG_LOCKS_PER_PACKET 20
 
 /* Should this be in here, or somewhere else? */
 
@@ -89,4 +89,16 @@ typedef struct __attribute__((packed)) {
     uint32_t Value;
 } KdpDebugReadPortAckPacket;
 
+typedef struct __attribute__((packed)) {
+    uint8_t Type;
+    uint32_t Start;
+} KdpDebugQueryReqPacket;
+
+typedef struct __attribute__((packed)) {
+    uint8_t Type;
+    uint32_t Start;
+    uint32_t Count;
+    uint32_t Total;
+} KdpDebugQueryAckPacket;
+
 #endif /* _KERNEL_DETAIL_KDPTYPES_H_ */
@@ -23,6 +23,17 @@ void KiSaveBootStartDrivers(KiLoaderBlock *LoaderBlock);
 void KiRunBootStartDrivers(void);
 void KiDumpSymbol(void *Address);
 
+#ifdef KE_LOCK_STATISTICS
+void KiInitializeLockStatistics(void);
+#endif /* KE_LOCK_STATISTICS */
+
+#ifndef NDEBUG
+void KiTestQueuedSpinLocks(void);
+void KiBenchmarkIpis(void);
+void KiBenchmarkSpinLocks(void);
+void KiBenchmarkContextSwitches(void);
+#endif /* NDEBUG */
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
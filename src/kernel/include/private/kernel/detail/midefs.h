@@ -18,6 +18,7 @@
 #define MI_MAP_EXEC 0x02
 #define MI_MAP_WC 0x04
 #define MI_MAP_UC 0x08
+#define MI_MAP_LARGE 0x10
 
 #define MI_DESCR_FREE 0x00
 #define MI_DESCR_PAGE_MAP 0x01
@@ -31,10 +32,46 @@
 #define MI_PAGE_ENTRY(Base) (MiPageList[(uint64_t)(Base) >> MM_PAGE_SHIFT])
 #define MI_PAGE_BASE(Entry) ((uint64_t)((Entry) - MiPageList) << MM_PAGE_SHIFT)
 
+#define MI_PAGE_MAX_ORDER 10
+#define MI_PAGE_ORDER_COUNT (MI_PAGE_MAX_ORDER + 1)
+#define MI_PAGE_LIST_END 0xFFFFFFFF
+
+#define MI_BLOCK_ANY 0x00
+#define MI_BLOCK_DIRTY 0x01
+#define MI_BLOCK_ZEROED 0x02
+
+#define MI_PAGE_ZONE_DMA 0
+#define MI_PAGE_ZONE_DMA32 1
+#define MI_PAGE_ZONE_NORMAL 2
+#define MI_PAGE_ZONE_COUNT 3
+#define MI_PAGE_ZONE_DMA_LIMIT 0x1000
+#define MI_PAGE_ZONE_DMA32_LIMIT 0x100000
+
 #define MI_PROCESSOR_PAGE_CACHE_MAX_SIZE 256
 #define MI_PROCESSOR_PAGE_CACHE_MIN_SIZE 16
 #define MI_PROCESSOR_PAGE_CACHE_BATCH_SIZE 32
 
 #define MI_PROCESSOR_POOL_CACHE_MAX_SIZE 256
 
+#define MI_POOL_PAGE_CACHE_MAX_SIZE 64
+#define MI_POOL_SPACE_CACHE_BATCH_SIZE 8
+#define MI_POOL_RANGE_RESERVE (MM_POOL_SPACE_CACHE_SIZE * 4)
+#define MI_POOL_RANGE_FREE_RESERVE 16
+#define MI_POOL_EMPTY_SEGMENT_RESERVE 2
+#define MI_POOL_TRIM_WATERMARK_SHIFT 5
+
+#define MI_POOL_TRACKER_FOLD_COUNT 64
+#define MI_POOL_TRACKER_FOLD_BYTES 65536
+
+#define MI_LOOKASIDE_MIN_DEPTH 4
+#define MI_LOOKASIDE_MAX_DEPTH 256
+#define MI_LOOKASIDE_DEPOT_SCALE 4
+#define MI_LOOKASIDE_ADJUST_INTERVAL 256
+#define MI_LOOKASIDE_GROW_MISS_SHIFT 3
+
+#define MI_ZERO_PAGE_BATCH_SIZE 64
+#define MI_ZERO_PAGE_TARGET 4096
+#define MI_ZERO_PAGE_BUSY_DELAY 10000000
+#define MI_ZERO_PAGE_FULL_DELAY 100000000
+
 #endif /* _KERNEL_DETAIL_MIDEFS_H_ */
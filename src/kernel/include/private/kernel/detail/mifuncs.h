@@ -7,6 +7,7 @@
 #define _KERNEL_DETAIL_MIFUNCS_H_
 
 #include <kernel/detail/kitypes.h>
+#include <kernel/detail/midefs.h>
 #include <kernel/detail/mitypes.h>
 #include <kernel/detail/mmfuncs.h>
 
@@ -32,18 +33,41 @@ extern uint64_t MiTotalGraphicsPages;
 extern uint64_t MiTotalPtePages;
 extern uint64_t MiTotalPfnPages;
 extern uint64_t MiTotalPoolPages;
+extern uint64_t MiTotalZeroedPages;
+extern uint64_t MiZeroedBytesOffloaded;
+extern uint64_t MiFreeAreaBlocks[MI_PAGE_ORDER_COUNT];
 extern RtSList MiPoolTagListHead[256];
+extern uint64_t MiPoolTrimWatermark;
 
 void MiInitializeEarlyPageAllocator(KiLoaderBlock *LoaderBlock);
 void MiInitializePageAllocator(void);
 void MiReleaseBootRegions(void);
 uint64_t MiAllocateEarlyPages(uint32_t Pages);
+uint64_t MiTryAllocateZeroedPage(void);
+void MiCreateZeroPageThread(void);
+
+#ifndef NDEBUG
+void MiTestPageAllocator(void);
+void MiBenchmarkPageAllocator(void);
+#endif /* NDEBUG */
 
 void MiInitializePool(void);
+void MiInitializePoolSpace(uint64_t PoolPages);
 void *MiAllocatePoolSpace(uint32_t Pages);
+void *MiAllocateAlignedPoolSpace(uint32_t Pages);
 void MiFreePoolSpace(void *Base, uint32_t Pages);
-void *MiAllocatePoolPages(uint32_t Pages);
+void MiTrimPoolSpace(void);
+void *MiAllocatePoolPages(uint32_t Pages, bool *Zeroed);
 uint32_t MiFreePoolPages(void *Base);
+void MiTrimPoolPages(void);
+void MiTrimPool(void);
+
+#ifndef NDEBUG
+void MiTestPoolReclaim(void);
+void MiBenchmarkPool(void);
+void MiTestLookasideList(void);
+void MiTestPoolSpace(void);
+#endif /* NDEBUG */
 
 void MiInitializePoolTracker(void);
 uint8_t MiGetTagHash(const char Tag[4]);
@@ -6,8 +6,10 @@
 #ifndef _KERNEL_DETAIL_MITYPES_H_
 #define _KERNEL_DETAIL_MITYPES_H_
 
+#include <kernel/detail/ketypes.h>
 #include <kernel/detail/mmtypes.h>
 #include <rt/atomic.h>
+#include <rt/avltree.h>
 #include <rt/list.h>
 
 /* clang-format off */
@@ -24,23 +26,37 @@ typedef struct {
 } MiMemoryDescriptor;
 
 typedef struct {
-    RtSList ListHeader;
+    union {
+        RtSList ListHeader;
+        struct {
+            uint32_t NextFree;
+            uint32_t PreviousFree;
+        };
+    };
     union {
         struct {
             uint32_t Used : 1;
             uint32_t PoolItem : 1;
             uint32_t PoolBase : 1;
-            uint32_t Padding : 29;
+            uint32_t FreeBlock : 1;
+            uint32_t Order : 4;
+            uint32_t Zeroed : 1;
+            uint32_t RegionItem : 1;
+            uint32_t Padding : 22;
         };
         uint32_t Flags;
     };
-    uint32_t Pages;
+    union {
+        uint32_t Pages;
+        uint32_t ZeroedPages;
+    };
     char Tag[4];
 } MiPageEntry;
 
 typedef struct {
     RtSList ListHeader;
     char Tag[4];
+    uint32_t Index;
     uint64_t Allocations;
     uint64_t AllocatedBytes;
     uint64_t MaxAllocations;
@@ -48,4 +64,31 @@ typedef struct {
     uint64_t Padding;
 } MiPoolTrackerHeader;
 
+typedef struct {
+    RtSList ListHeader;
+    MmLookasideList *List;
+} MiLookasideHeader;
+
+typedef struct {
+    union {
+        RtSList ListHeader;
+        RtAvlNode AddressNode;
+    };
+    RtAvlNode SizeNode;
+    uint64_t Base;
+    uint64_t Pages;
+} MiPoolSpaceRange;
+
+struct MmLookasideList {
+    size_t Size;
+    char Tag[4];
+    uint32_t Index;
+    uint32_t Depth;
+    void (*Constructor)(void *);
+    void (*Destructor)(void *);
+    KeSpinLock DepotLock;
+    RtSList DepotListHead;
+    uint32_t DepotCount;
+};
+
 #endif /* _KERNEL_DETAIL_MITYPES_H_ */
@@ -25,6 +25,11 @@ extern ObType ObpThreadType;
 
 void ObpInitializeRootDirectory(void);
 
+#ifndef NDEBUG
+void ObpBenchmarkObjects(void);
+void ObpBenchmarkDirectory(void);
+#endif /* NDEBUG */
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -26,6 +26,7 @@ typedef struct {
     ObpDirectoryEntry *Parent;
     uint32_t References;
     char Tag[4];
+    bool FromLookaside;
 } ObpObject;
 
 #endif /* _KERNEL_DETAIL_OBPTYPES_H_ */
@@ -17,6 +17,22 @@
 
 #define PSP_DEFAULT_TICKS ((10 * EV_MILLISECS) / EVP_TICK_PERIOD)
 
+#define PSP_WAIT_PRIORITY_BOOST 2
+
 #define PSP_LOAD_BALANCE_BIAS 30
+#define PSP_LOAD_BALANCE_HYSTERESIS 2
+
+#define PSP_DISTANCE_CORE 0
+#define PSP_DISTANCE_CACHE 1
+#define PSP_DISTANCE_PACKAGE 2
+#define PSP_DISTANCE_SYSTEM 3
+#define PSP_DISTANCE_COUNT 4
+
+#define PSP_IDLE_POLL_COUNT 16
+
+#define PSP_CACHE_HOT_TICKS ((2 * EV_MILLISECS) / EVP_TICK_PERIOD)
+#define PSP_MAX_STEAL_COUNT 16
+
+#define PSP_WAKE_GROUP_COUNT 16
 
 #endif /* _KERNEL_DETAIL_PSPDEFS_H_ */
@@ -22,7 +22,17 @@ extern "C" {
 void PspCreateIdleThread(void);
 void PspCreateSystemThread(void);
 
+void PspInsertReadyThread(KeProcessor *Processor, PsThread *Thread, bool Front);
+int PspSpliceReadyThreads(KeProcessor *Processor, RtDList *ThreadList, bool Front);
+PsThread *PspPopReadyThread(KeProcessor *Processor);
+void PspRemoveReadyThread(KeProcessor *Processor, PsThread *Thread);
+bool PspRequeueReadyThread(KeProcessor *Processor, PsThread *Thread, uint8_t Priority);
+uint64_t PspStealReadyThreads(
+    KeProcessor *Processor,
+    KeProcessor *DestinationProcessor,
+    RtDList *StolenList);
 void PspQueueThread(PsThread *Thread, bool EventQueue);
+void PspQueueThreads(RtDList *ThreadList, bool EventQueue);
 void PspSetupThreadWait(KeProcessor *Processor, PsThread *Thread, uint64_t Time);
 void PspSuspendExecution(
     KeProcessor *Processor,
@@ -36,7 +46,19 @@ void PspSwitchThreads(
     uint8_t Type,
     KeIrql OldIrql);
 
-RtAvlCompareResult PspCompareWaitThreads(RtAvlNode *FirstStruct, RtAvlNode *SecondStruct);
+#ifndef NDEBUG
+void PspTestWaitWheel(void);
+void PspBenchmarkWaitWheel(void);
+void PspTestThreadAffinity(void);
+void PspTestPlacement(void);
+void PspTestStealOrder(void);
+void PspTestWakeupLatency(void);
+#endif /* NDEBUG */
+
+void PspInitializeWaitWheel(PsWaitWheel *Wheel);
+void PspInsertWaitThread(KeProcessor *Processor, PsThread *Thread);
+void PspRemoveWaitThread(KeProcessor *Processor, PsThread *Thread);
+void PspCollectExpiredWaits(KeProcessor *Processor, RtDList *ExpiredList);
 
 void PspProcessAlertQueue(void);
 void PspDeletePoolAlerts(PsThread *Thread);
@@ -6,7 +6,10 @@
 #ifndef _KERNEL_DETAIL_PSPINLINE_H_
 #define _KERNEL_DETAIL_PSPINLINE_H_
 
+#include <kernel/detail/kefuncs.h>
+#include <kernel/detail/ketypes.h>
 #include <kernel/detail/psinline.h>
+#include <kernel/detail/pspdefs.h>
 
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, pspinline.h))
@@ -14,4 +17,59 @@
 #endif /* __has__include */
 /* clang-format on */
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the priority of the most important thread queued in the given processor.
+ *     Unless the processor lock is held, this is only a hint.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor to check.
+ *
+ * RETURN VALUE:
+ *     Highest queued priority, or -1 if the processor has no queued threads.
+ *-----------------------------------------------------------------------------------------------*/
+static inline int PspGetHighestReadyPriority(KeProcessor *Processor) {
+    uint32_t Summary = __atomic_load_n(&Processor->ReadySummary, __ATOMIC_RELAXED);
+    return Summary ? 31 - __builtin_clz(Summary) : -1;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets how far apart two processors are in the topology (the lowest level
+ *     they share).
+ *
+ * PARAMETERS:
+ *     Source - First processor.
+ *     Target - Second processor.
+ *
+ * RETURN VALUE:
+ *     One of the PSP_DISTANCE_* values.
+ *-----------------------------------------------------------------------------------------------*/
+static inline int PspGetProcessorDistance(KeProcessor *Source, KeProcessor *Target) {
+    if (Source->CoreId == Target->CoreId) {
+        return PSP_DISTANCE_CORE;
+    } else if (Source->CacheId == Target->CacheId) {
+        return PSP_DISTANCE_CACHE;
+    } else if (Source->PackageId == Target->PackageId) {
+        return PSP_DISTANCE_PACKAGE;
+    } else {
+        return PSP_DISTANCE_SYSTEM;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if the given thread is allowed to run in the given processor.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread to check.
+ *     Processor - Which processor to check.
+ *
+ * RETURN VALUE:
+ *     true if the processor is in the thread affinity mask, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static inline bool PspIsProcessorAllowed(PsThread *Thread, KeProcessor *Processor) {
+    return KeGetAffinityBit(&Thread->Affinity, Processor->Number);
+}
+
 #endif /* _KERNEL_DETAIL_PSPINLINE_H_ */
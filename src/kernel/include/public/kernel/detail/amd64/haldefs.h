@@ -28,4 +28,6 @@
 #define IDT_TYPE_INT 0x0E
 #define IDT_TYPE_TRAP 0x0F
 
+#define HALP_TLB_FLUSH_LIST_SIZE 16
+
 #endif /* _KERNEL_DETAIL_AMD64_HALDEFS_H_ */
@@ -0,0 +1,23 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* IWYU pragma: private, include <kernel/hal.h> */
+
+#ifndef _KERNEL_DETAIL_AMD64_HALFUNCS_H_
+#define _KERNEL_DETAIL_AMD64_HALFUNCS_H_
+
+#include <kernel/detail/amd64/ketypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Slow path of KeSetIrql (for when there's something pending at the IRQL we're lowering out of);
+ * Use KeLowerIrql instead of calling this directly. */
+void HalLowerIrql(KeIrql NewIrql);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _KERNEL_DETAIL_AMD64_HALFUNCS_H_ */
@@ -148,4 +148,9 @@ typedef struct __attribute__((packed)) {
     uint64_t Base;
 } HalpIdtDescriptor;
 
+typedef struct {
+    uint64_t Start;
+    uint64_t Pages;
+} HalpTlbFlushEntry;
+
 #endif /* _KERNEL_DETAIL_AMD64_HALTYPES_H_ */
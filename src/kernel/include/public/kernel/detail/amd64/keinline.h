@@ -6,8 +6,34 @@
 #ifndef _KERNEL_DETAIL_AMD64_KEINLINE_H_
 #define _KERNEL_DETAIL_AMD64_KEINLINE_H_
 
+#include <kernel/detail/amd64/halfuncs.h>
 #include <kernel/detail/amd64/ketypes.h>
 #include <os/amd64/intrin.h>
+#include <stddef.h>
+
+/* Helper to read a single (up to 64-bits) field out of the current processor's KeProcessor struct.
+ * The GS base always points to the processor struct, so this should be a single instruction, and
+ * should be safe to use from any IRQL (as long as the caller is fine with the result being stale
+ * if we get migrated to another processor right after the read). */
+#define KE_READ_PROCESSOR_FIELD(Field)                           \
+    ({                                                           \
+        __typeof__(((KeProcessor *)0)->Field) Value;             \
+        __asm__ volatile("mov %%gs:%c1, %0"                      \
+                         : "=r"(Value)                           \
+                         : "i"(offsetof(KeProcessor, Field)));   \
+        Value;                                                   \
+    })
+
+/* Helper to write a single (up to 64-bits) field into the current processor's KeProcessor struct;
+ * Same as above, this is a single instruction, so we can't get migrated halfway through it. */
+#define KE_WRITE_PROCESSOR_FIELD(Field, NewValue)                        \
+    ({                                                                   \
+        __typeof__(((KeProcessor *)0)->Field) Value = (NewValue);        \
+        __asm__ volatile("mov %0, %%gs:%c1"                              \
+                         :                                               \
+                         : "r"(Value), "i"(offsetof(KeProcessor, Field)) \
+                         : "memory");                                    \
+    })
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -20,15 +46,16 @@
  *     Current IRQL level.
  *-----------------------------------------------------------------------------------------------*/
 static inline KeIrql KeGetIrql(void) {
-    KeIrql Irql;
-    __asm__ volatile("mov %%cr8, %0" : "=r"(Irql) : : "memory");
-    return Irql;
+    return KE_READ_PROCESSOR_FIELD(Irql);
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function forcefully sets the current IRQL level, you should only use this if you
  *     REALLY know what you're doing, or you WILL break something.
+ *     The IRQL is lazy (we only keep it in the processor struct); The hardware IRQL only gets
+ *     raised once an interrupt arrives that should have been masked, so we only need to go into
+ *     the HAL if that happened, or if a software interrupt got pending while we were raised.
  *
  * PARAMETERS:
  *     NewIrql - Target IRQL level.
@@ -37,7 +64,11 @@ static inline KeIrql KeGetIrql(void) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 static inline void KeSetIrql(KeIrql NewIrql) {
-    __asm__ volatile("mov %0, %%cr8" : : "r"(NewIrql) : "memory");
+    KE_WRITE_PROCESSOR_FIELD(Irql, NewIrql);
+    if (KE_READ_PROCESSOR_FIELD(HardwareIrql) > NewIrql ||
+        KE_READ_PROCESSOR_FIELD(PendingSoftwareInterrupts) >> (NewIrql + 1)) {
+        HalLowerIrql(NewIrql);
+    }
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -51,7 +82,50 @@ static inline void KeSetIrql(KeIrql NewIrql) {
  *     Pointer to the processor struct.
  *-----------------------------------------------------------------------------------------------*/
 static inline KeProcessor *KeGetCurrentProcessor(void) {
-    return (KeProcessor *)ReadMsr(0xC0000102);
+    return KE_READ_PROCESSOR_FIELD(Self);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the index of the current processor (without going through the processor
+ *     struct pointer).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Index of the current processor.
+ *-----------------------------------------------------------------------------------------------*/
+static inline uint32_t KeGetCurrentProcessorNumber(void) {
+    return KE_READ_PROCESSOR_FIELD(Number);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets a pointer to the thread currently running on this processor.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Pointer to the thread struct.
+ *-----------------------------------------------------------------------------------------------*/
+static inline struct PsThread *KeGetCurrentThread(void) {
+    return KE_READ_PROCESSOR_FIELD(CurrentThread);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the base (lowest address) of the stack we're currently running on.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Base address of the current stack.
+ *-----------------------------------------------------------------------------------------------*/
+static inline char *KeGetCurrentStackBase(void) {
+    return KE_READ_PROCESSOR_FIELD(StackBase);
 }
 
 #endif /* _KERNEL_DETAIL_AMD64_KEINLINE_H_ */
@@ -6,27 +6,81 @@
 #ifndef _KERNEL_DETAIL_AMD64_KETYPES_H_
 #define _KERNEL_DETAIL_AMD64_KETYPES_H_
 
+#include <kernel/detail/kedefs.h>
 #include <stdint.h>
 
 /* We need to define these beforehand (because pstypes.h uses them). */
 typedef uint64_t KeIrql;
 typedef volatile uint64_t KeSpinLock;
 
+typedef struct {
+    uint64_t Size;
+    volatile uint64_t Bits[KE_MAX_PROCESSORS / 64];
+} KeAffinity;
+
+/* Queued (MCS) spin locks make each waiter spin on its own (usually stack allocated) node, and
+ * hand the lock over in FIFO order; The owner field lets the release find the current node. */
+typedef struct KeLockQueueNode {
+    struct KeLockQueueNode *volatile Next;
+    volatile bool Locked;
+} KeLockQueueNode;
+
+typedef struct {
+    KeLockQueueNode *volatile Tail;
+    KeLockQueueNode *Owner;
+} KeQueuedSpinLock;
+
+/* Lock statistics are keyed by the return address of whoever acquired the lock (instead of by the
+ * lock itself), as most locks are either embedded into something or allocated on demand. */
+typedef struct {
+    uint64_t Site;
+    uint64_t AcquireCount;
+    uint64_t ContentionCount;
+    uint64_t SpinCycles;
+    uint64_t MaxHoldCycles;
+} KeLockStatistics;
+
+typedef struct {
+    const volatile void *Lock;
+    uint64_t Site;
+    uint64_t AcquireTicks;
+} KeHeldLock;
+
+struct KeIpiRequest;
 struct PsThread;
 
+#include <kernel/detail/amd64/haldefs.h>
 #include <kernel/detail/amd64/haltypes.h>
-#include <kernel/detail/kedefs.h>
 #include <kernel/detail/mmdefs.h>
+#include <kernel/detail/mmtypes.h>
+#include <kernel/detail/psdefs.h>
 #include <kernel/detail/pstypes.h>
 
+/* This only gets allocated when the kernel is built with KE_LOCK_STATISTICS; The processor struct
+ * only holds a pointer to it, so its layout doesn't depend on the build option. */
 typedef struct {
-    KeSpinLock Lock;
+    KeLockStatistics Entries[KE_LOCK_STATISTICS_SIZE];
+    KeHeldLock HeldLocks[KE_LOCK_STATISTICS_DEPTH];
+    uint32_t HeldLockCount;
+} KeLockStatisticsTable;
+
+typedef struct KeProcessor {
+    /* This needs to stay at offset 0 (we always read it out of %gs:0 to get the processor
+     * struct). */
+    struct KeProcessor *Self;
+    /* This needs to stay at offset 8 (the interrupt entry code saves it straight out of %gs:8). */
+    KeIrql Irql;
+    KeQueuedSpinLock Lock;
     uint32_t Number;
     uint32_t ApicId;
+    uint32_t CoreId;
+    uint32_t CacheId;
+    uint32_t PackageId;
     RtDList WorkQueue;
-    RtAvlTree WaitTree;
+    PsWaitWheel WaitWheel;
     uint64_t ClosestWaitTick;
-    RtDList ThreadQueue;
+    RtDList ThreadQueue[PS_PRIORITY_COUNT];
+    uint32_t ReadySummary;
     RtDList TerminationQueue;
     struct PsThread *CurrentThread;
     struct PsThread *IdleThread;
@@ -40,8 +94,10 @@ typedef struct {
     uint64_t FreePageListSize;
     RtSList FreePoolPageListHead[4];
     uint64_t FreePoolPageListSize[4];
+    uint64_t PoolPageCacheGeneration;
     RtSList FreePoolBlockListHead[MM_POOL_BLOCK_COUNT];
     uint64_t FreePoolBlockListSize[MM_POOL_BLOCK_COUNT];
+    uint64_t PoolBlockCacheGeneration;
     char *StackBase;
     char *StackLimit;
     char SystemStack[KE_STACK_SIZE] __attribute__((aligned(MM_PAGE_SIZE)));
@@ -53,6 +109,43 @@ typedef struct {
     HalpIdtEntry IdtEntries[256];
     RtDList InterruptList[256];
     uint8_t InterruptUsage[256];
+    KeSpinLock IpiQueueLock;
+    uint32_t IpiQueueHead;
+    uint32_t IpiQueueCount;
+    struct KeIpiRequest *IpiQueue[KE_IPI_QUEUE_SIZE];
+    KeSpinLock TlbFlushLock;
+    volatile uint64_t TlbFlushRequested;
+    volatile uint64_t TlbFlushCompleted;
+    volatile uint8_t TlbFlushIpiPending;
+    volatile uint8_t TlbLazy;
+    bool TlbFlushAll;
+    uint32_t TlbFlushCount;
+    HalpTlbFlushEntry TlbFlushList[HALP_TLB_FLUSH_LIST_SIZE];
+    MmPoolTrackerShard PoolTrackerShards[MM_POOL_TRACKER_SHARD_COUNT];
+    MmLookasideMagazine LookasideMagazines[MM_LOOKASIDE_LIST_COUNT];
+    uint64_t PoolSpaceCache[4][MM_POOL_SPACE_CACHE_SIZE];
+    uint32_t PoolSpaceCacheSize[4];
+    uint64_t PoolSpaceCacheGeneration;
+    uint32_t TimerPeriod;
+    uint64_t TickBaseTime;
+    bool TickStopped;
+    uint32_t StealCursor;
+    uint64_t StealCount;
+    uint64_t StolenThreadCount;
+    volatile uint32_t DispatchPending;
+    volatile uint8_t IdlePolling;
+    uint64_t DispatchIpiCount;
+    uint64_t SuppressedDispatchIpiCount;
+    void *ExtendedStateOwner;
+    uint64_t SwitchStartTicks;
+    bool SwitchSavedExtendedState;
+    uint64_t ContextSwitchCount;
+    uint64_t ContextSwitchCycles;
+    uint64_t ExtendedStateSwitchCount;
+    uint64_t ExtendedStateSwitchCycles;
+    KeIrql HardwareIrql;
+    volatile uint32_t PendingSoftwareInterrupts;
+    KeLockStatisticsTable *LockStatistics;
 } KeProcessor;
 
 #endif /* _KERNEL_DETAIL_AMD64_KETYPES_H_ */
@@ -14,6 +14,9 @@
 
 #define EV_TIMEOUT_UNLIMITED ((uint64_t)-1)
 
+#define EV_MAX_WAIT_OBJECTS 16
+#define EV_WAIT_TIMED_OUT ((uint32_t)-1)
+
 #define EV_MICROSECS 1000ull
 #define EV_MILLISECS 1000000ull
 #define EV_SECS 1000000000ull
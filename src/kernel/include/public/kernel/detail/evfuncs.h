@@ -27,7 +27,21 @@ bool EvTryAcquireMutex(EvMutex *Mutex);
 bool EvAcquireMutex(EvMutex *Mutex, uint64_t Timeout);
 void EvReleaseMutex(EvMutex *Mutex);
 
+void EvAcquirePushLockShared(EvPushLock *Lock);
+void EvAcquirePushLockExclusive(EvPushLock *Lock);
+void EvReleasePushLockShared(EvPushLock *Lock);
+void EvReleasePushLockExclusive(EvPushLock *Lock);
+KeIrql EvAcquireSpinPushLockShared(EvPushLock *Lock);
+KeIrql EvAcquireSpinPushLockExclusive(EvPushLock *Lock);
+void EvReleaseSpinPushLockShared(EvPushLock *Lock, KeIrql OldIrql);
+void EvReleaseSpinPushLockExclusive(EvPushLock *Lock, KeIrql OldIrql);
+void EvAcquireSpinPushLockSharedAtCurrentIrql(EvPushLock *Lock);
+void EvAcquireSpinPushLockExclusiveAtCurrentIrql(EvPushLock *Lock);
+void EvReleaseSpinPushLockSharedAtCurrentIrql(EvPushLock *Lock);
+void EvReleaseSpinPushLockExclusiveAtCurrentIrql(EvPushLock *Lock);
+
 bool EvWaitForObject(void *Object, uint64_t Timeout);
+uint32_t EvWaitForMultipleObjects(uint32_t Count, void **Objects, bool WaitAll, uint64_t Timeout);
 
 #ifdef __cplusplus
 }
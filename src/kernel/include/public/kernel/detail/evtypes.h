@@ -15,6 +15,8 @@
 #endif /* __has__include */
 /* clang-format on */
 
+typedef volatile uintptr_t EvPushLock;
+
 typedef struct {
     uint8_t Type;
     KeSpinLock Lock;
@@ -32,6 +34,8 @@ typedef struct {
     uint64_t Recursion;
     uint64_t Contention;
     void *Owner;
+    void *AcquireSite;
+    uint64_t AcquireTicks;
 } EvMutex;
 
 #endif /* _KERNEL_DETAIL_EVTYPES_H_ */
@@ -16,6 +16,16 @@
 
 #define KE_STACK_SIZE 16384
 
+#define KE_IPI_QUEUE_SIZE 16
+#define KE_IPI_WAIT 0x01
+
+/* Size of the per-processor lock statistics tables (only used when the kernel is built with
+ * KE_LOCK_STATISTICS); The depth limits how many nested spin locks we can measure the hold time
+ * of. */
+#define KE_LOCK_STATISTICS_SHIFT 8
+#define KE_LOCK_STATISTICS_SIZE (1 << KE_LOCK_STATISTICS_SHIFT)
+#define KE_LOCK_STATISTICS_DEPTH 16
+
 #define KE_EVENT_TYPE_NONE 0
 #define KE_EVENT_TYPE_FREEZE 1
 
@@ -37,7 +47,10 @@
 #define KE_PANIC_MUTEX_RECURSION_LIMIT 15
 #define KE_PANIC_BAD_OBJECT_REFERENCE_COUNT 16
 #define KE_PANIC_THREAD_OWNS_MUTEX 17
-#define KE_PANIC_COUNT 18
+#define KE_PANIC_SELF_TEST_FAILURE 18
+#define KE_PANIC_NO_PAGES_AVAILABLE 19
+#define KE_PANIC_TOO_MANY_WAIT_OBJECTS 20
+#define KE_PANIC_COUNT 21
 
 #define KE_PANIC_PARAMETER_OUT_OF_RESOURCES 0x0000000000000000
 
@@ -7,6 +7,7 @@
 #define _KERNEL_DETAIL_KEFUNCS_H_
 
 #include <kernel/detail/ketypes.h>
+#include <stddef.h>
 
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, kefuncs.h))
@@ -22,6 +23,7 @@ void KeInitializeWork(KeWork *Work, void (*Routine)(void *), void *Context);
 bool KeQueueWork(KeWork *Work, bool HighPriority);
 
 void KeInitializeAffinity(KeAffinity *Mask);
+void KeInitializeEmptyAffinity(KeAffinity *Mask);
 bool KeGetAffinityBit(KeAffinity *Mask, uint32_t Number);
 void KeSetAffinityBit(KeAffinity *Mask, uint32_t Number);
 void KeClearAffinityBit(KeAffinity *Mask, uint32_t Number);
@@ -31,8 +33,23 @@ uint64_t KeCountAffinitySetBits(KeAffinity *Mask);
 uint64_t KeCountAffinityClearBits(KeAffinity *Mask);
 
 void KeSynchronizeProcessors(volatile uint64_t *State);
+void KeInitializeIpiRequest(KeIpiRequest *Request, void (*Routine)(void *), void *Parameter);
+uint32_t KeRequestIpi(KeAffinity *Targets, KeIpiRequest *Request, int Flags);
 void KeRequestIpiRoutine(void (*Routine)(void *), void *Parameter);
 
+size_t KeQueryLockStatistics(KeLockInformation *Buffer, size_t Start, size_t Count);
+
+bool KeSaveExtendedState(KeExtendedState *State);
+void KeRestoreExtendedState(KeExtendedState *State);
+
+/* These are only called by the lock inlines when built with KE_LOCK_STATISTICS (and they don't
+ * record anything unless the kernel itself was built with it). */
+uint64_t KiGetLockTicks(void);
+void KiRecordLockAcquire(const volatile void *Lock, uint64_t StartTicks);
+void KiRecordLockRelease(const volatile void *Lock);
+void KiRecordLockSite(void *Site, uint64_t StartTicks);
+void KiRecordLockHold(void *Site, uint64_t AcquireTicks);
+
 [[noreturn]] void KeFatalError(
     uint32_t Message,
     uint64_t Parameter1,
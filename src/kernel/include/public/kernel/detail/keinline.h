@@ -7,6 +7,7 @@
 #define _KERNEL_DETAIL_KEINLINE_H_
 
 #include <kernel/detail/kefuncs.h>
+#include <stddef.h>
 
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, keinline.h))
@@ -67,8 +68,16 @@ static inline void KeLowerIrql(KeIrql NewIrql) {
  *     true on success, false otherwise.
  *-----------------------------------------------------------------------------------------------*/
 static inline bool KeTryAcquireSpinLockAtCurrentIrql(KeSpinLock *Lock) {
-    return !__atomic_load_n(Lock, __ATOMIC_RELAXED) &&
-           !(__atomic_fetch_or(Lock, 0x01, __ATOMIC_ACQUIRE) & 0x01);
+    bool Acquired = !__atomic_load_n(Lock, __ATOMIC_RELAXED) &&
+                    !(__atomic_fetch_or(Lock, 0x01, __ATOMIC_ACQUIRE) & 0x01);
+
+#ifdef KE_LOCK_STATISTICS
+    if (Acquired) {
+        KiRecordLockAcquire(Lock, 0);
+    }
+#endif /* KE_LOCK_STATISTICS */
+
+    return Acquired;
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -83,6 +92,16 @@ static inline bool KeTryAcquireSpinLockAtCurrentIrql(KeSpinLock *Lock) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 static inline void KeAcquireSpinLockAtCurrentIrql(KeSpinLock *Lock) {
+#ifdef KE_LOCK_STATISTICS
+    /* Uncontended acquisitions get recorded by the try itself; Otherwise, measure how long we end
+     * up spinning. */
+    if (KeTryAcquireSpinLockAtCurrentIrql(Lock)) {
+        return;
+    }
+
+    uint64_t StartTicks = KiGetLockTicks();
+#endif /* KE_LOCK_STATISTICS */
+
     while (true) {
         if (!(__atomic_fetch_or(Lock, 0x01, __ATOMIC_ACQUIRE) & 0x01)) {
             break;
@@ -92,6 +111,10 @@ static inline void KeAcquireSpinLockAtCurrentIrql(KeSpinLock *Lock) {
             PauseProcessor();
         }
     }
+
+#ifdef KE_LOCK_STATISTICS
+    KiRecordLockAcquire(Lock, StartTicks);
+#endif /* KE_LOCK_STATISTICS */
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -122,6 +145,10 @@ static inline KeIrql KeAcquireSpinLockAndRaiseIrql(KeSpinLock *Lock, KeIrql NewI
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 static inline void KeReleaseSpinLockAtCurrentIrql(KeSpinLock *Lock) {
+#ifdef KE_LOCK_STATISTICS
+    KiRecordLockRelease(Lock);
+#endif /* KE_LOCK_STATISTICS */
+
     __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
 }
 
@@ -155,4 +182,177 @@ static inline bool KeTestSpinLockAtCurrentIrql(KeSpinLock *Lock) {
     return __atomic_load_n(Lock, __ATOMIC_RELAXED) != 0;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gives a single attempt at acquiring a queued spin lock. We do not check or try
+ *     to raise the current IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Struct containing the lock.
+ *     Node - Queue node for this acquisition; This needs to stay alive until the lock is released.
+ *
+ * RETURN VALUE:
+ *     true on success, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static inline bool KeTryAcquireQueuedSpinLockAtCurrentIrql(
+    KeQueuedSpinLock *Lock,
+    KeLockQueueNode *Node) {
+    KeLockQueueNode *Expected = NULL;
+    Node->Next = NULL;
+
+    if (__atomic_load_n(&Lock->Tail, __ATOMIC_RELAXED) ||
+        !__atomic_compare_exchange_n(
+            &Lock->Tail,
+            &Expected,
+            Node,
+            false,
+            __ATOMIC_ACQUIRE,
+            __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    Lock->Owner = Node;
+
+#ifdef KE_LOCK_STATISTICS
+    KiRecordLockAcquire(Lock, 0);
+#endif /* KE_LOCK_STATISTICS */
+
+    return true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the queued spin lock, waiting (spinning only on our own node) if
+ *     necessary. Waiters get the lock in the order they arrived. We do not check or try to raise
+ *     the current IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Struct containing the lock.
+ *     Node - Queue node for this acquisition; This needs to stay alive until the lock is released.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static inline void KeAcquireQueuedSpinLockAtCurrentIrql(
+    KeQueuedSpinLock *Lock,
+    KeLockQueueNode *Node) {
+#ifdef KE_LOCK_STATISTICS
+    if (KeTryAcquireQueuedSpinLockAtCurrentIrql(Lock, Node)) {
+        return;
+    }
+
+    uint64_t StartTicks = KiGetLockTicks();
+#endif /* KE_LOCK_STATISTICS */
+
+    Node->Next = NULL;
+    Node->Locked = true;
+
+    KeLockQueueNode *Previous = __atomic_exchange_n(&Lock->Tail, Node, __ATOMIC_ACQ_REL);
+    if (Previous) {
+        __atomic_store_n(&Previous->Next, Node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&Node->Locked, __ATOMIC_ACQUIRE)) {
+            PauseProcessor();
+        }
+    }
+
+    Lock->Owner = Node;
+
+#ifdef KE_LOCK_STATISTICS
+    KiRecordLockAcquire(Lock, StartTicks);
+#endif /* KE_LOCK_STATISTICS */
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function raises the IRQL, and acquires the queued spin lock, waiting if necessary.
+ *
+ * PARAMETERS:
+ *     Lock - Struct containing the lock.
+ *     Node - Queue node for this acquisition; This needs to stay alive until the lock is released.
+ *     NewIrql - Target we should raise the IRQL to.
+ *
+ * RETURN VALUE:
+ *     Previous IRQL value.
+ *-----------------------------------------------------------------------------------------------*/
+static inline KeIrql KeAcquireQueuedSpinLockAndRaiseIrql(
+    KeQueuedSpinLock *Lock,
+    KeLockQueueNode *Node,
+    KeIrql NewIrql) {
+    KeIrql OldIrql = KeRaiseIrql(NewIrql);
+    KeAcquireQueuedSpinLockAtCurrentIrql(Lock, Node);
+    return OldIrql;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases a given queued spin lock, handing it directly to the next waiter (if
+ *     any). We do not check or try to lower the current IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Struct containing the lock.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static inline void KeReleaseQueuedSpinLockAtCurrentIrql(KeQueuedSpinLock *Lock) {
+#ifdef KE_LOCK_STATISTICS
+    KiRecordLockRelease(Lock);
+#endif /* KE_LOCK_STATISTICS */
+
+    KeLockQueueNode *Node = Lock->Owner;
+    KeLockQueueNode *Next = __atomic_load_n(&Node->Next, __ATOMIC_ACQUIRE);
+
+    /* Nobody seems to be waiting, try going straight back to unlocked; If that fails, someone
+     * already swapped themselves in as the tail, and we just need to wait for them to link up. */
+    if (!Next) {
+        KeLockQueueNode *Expected = Node;
+        if (__atomic_compare_exchange_n(
+                &Lock->Tail,
+                &Expected,
+                NULL,
+                false,
+                __ATOMIC_RELEASE,
+                __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        while (!(Next = __atomic_load_n(&Node->Next, __ATOMIC_ACQUIRE))) {
+            PauseProcessor();
+        }
+    }
+
+    __atomic_store_n(&Next->Locked, false, __ATOMIC_RELEASE);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function releases a given queued spin lock and lowers the IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Struct containing the lock.
+ *     NewIrql - At which IRQL KeAcquireQueuedSpinLock was called.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static inline void KeReleaseQueuedSpinLockAndLowerIrql(KeQueuedSpinLock *Lock, KeIrql NewIrql) {
+    KeReleaseQueuedSpinLockAtCurrentIrql(Lock);
+    KeLowerIrql(NewIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if a queued spin lock is currently in use. We do not check the current
+ *     IRQL.
+ *
+ * PARAMETERS:
+ *     Lock - Struct containing the lock.
+ *
+ * RETURN VALUE:
+ *     true if we're locked, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static inline bool KeTestQueuedSpinLockAtCurrentIrql(KeQueuedSpinLock *Lock) {
+    return __atomic_load_n(&Lock->Tail, __ATOMIC_RELAXED) != NULL;
+}
+
 #endif /* _KERNEL_DETAIL_KEINLINE_H_ */
@@ -31,9 +31,19 @@ typedef struct {
     bool Queued;
 } KeWork;
 
+typedef struct KeIpiRequest {
+    void (*Routine)(void *);
+    void *Parameter;
+    volatile uint64_t Pending;
+} KeIpiRequest;
+
+typedef struct {
+    uint32_t Processor;
+    KeLockStatistics Statistics;
+} KeLockInformation;
+
 typedef struct {
-    uint64_t Size;
-    volatile uint64_t Bits[KE_MAX_PROCESSORS / 64];
-} KeAffinity;
+    void *SavedState;
+} KeExtendedState;
 
 #endif /* _KERNEL_DETAIL_KETYPES_H_ */
@@ -32,6 +32,7 @@
 #define MM_POOL_TAG_THREAD_ALERT "ALRT"
 #define MM_POOL_TAG_KERNEL_STACK "KSTK"
 #define MM_POOL_TAG_EVENT "EVNT"
+#define MM_POOL_TAG_EXTENDED_STATE "XSAV"
 
 /* This is only required to be defined here instead of midefs.h becase ketypes.h uses it. */
 #define MM_POOL_SMALL_SHIFT (4)
@@ -53,4 +54,8 @@
 
 #define MM_POOL_BLOCK_COUNT (MM_POOL_SMALL_COUNT + MM_POOL_MEDIUM_COUNT + MM_POOL_LARGE_COUNT)
 
+#define MM_POOL_TRACKER_SHARD_COUNT 256
+#define MM_POOL_SPACE_CACHE_SIZE 16
+#define MM_LOOKASIDE_LIST_COUNT 32
+
 #endif /* _KERNEL_DETAIL_MMDEFS_H_ */
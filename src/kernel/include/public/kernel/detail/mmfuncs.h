@@ -6,6 +6,7 @@
 #ifndef _KERNEL_DETAIL_MMFUNCS_H_
 #define _KERNEL_DETAIL_MMFUNCS_H_
 
+#include <kernel/detail/mmtypes.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -20,13 +21,26 @@ extern "C" {
 #endif /* __cplusplus */
 
 uint64_t MmAllocateSinglePage();
+uint64_t MmAllocateZeroedPage(void);
 void MmFreeSinglePage(uint64_t PhysicalAddress);
+uint64_t MmAllocateContiguousPages(uint64_t Count, uint64_t Alignment, uint64_t MaxAddress);
+void MmFreeContiguousPages(uint64_t PhysicalAddress, uint64_t Count);
 
 void *MmMapSpace(int Type, uint64_t PhysicalAddress, size_t Size);
 void MmUnmapSpace(void *VirtualAddress, size_t Size);
 
 void *MmAllocatePool(size_t Size, const char Tag[4]);
 void MmFreePool(void *Base, const char Tag[4]);
+size_t MmQueryPoolTags(MmPoolTagInformation *Buffer, size_t Start, size_t Count);
+
+MmLookasideList *MmCreateLookasideList(
+    size_t Size,
+    const char Tag[4],
+    uint32_t Depth,
+    void (*Constructor)(void *),
+    void (*Destructor)(void *));
+void *MmAllocateFromLookasideList(MmLookasideList *List);
+void MmFreeToLookasideList(MmLookasideList *List, void *Base);
 
 #ifdef __cplusplus
 }
@@ -6,10 +6,37 @@
 #ifndef _KERNEL_DETAIL_MMTYPES_H_
 #define _KERNEL_DETAIL_MMTYPES_H_
 
+#include <rt/list.h>
+#include <stdint.h>
+
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, mmtypes.h))
 #include ARCH_MAKE_INCLUDE_PATH(kernel/detail, mmtypes.h)
 #endif /* __has__include */
 /* clang-format on */
 
+typedef struct {
+    int64_t Allocations;
+    int64_t AllocatedBytes;
+} MmPoolTrackerShard;
+
+typedef struct {
+    RtSList ListHead;
+    uint32_t Count;
+    uint32_t LowCount;
+    uint32_t Depth;
+    uint32_t Allocations;
+    uint32_t Misses;
+} MmLookasideMagazine;
+
+typedef struct MmLookasideList MmLookasideList;
+
+typedef struct {
+    char Tag[4];
+    uint64_t Allocations;
+    uint64_t AllocatedBytes;
+    uint64_t MaxAllocations;
+    uint64_t MaxAllocatedBytes;
+} MmPoolTagInformation;
+
 #endif /* _KERNEL_DETAIL_MMTYPES_H_ */
@@ -6,7 +6,9 @@
 #ifndef _KERNEL_DETAIL_OBTYPES_H_
 #define _KERNEL_DETAIL_OBTYPES_H_
 
+#include <kernel/detail/evtypes.h>
 #include <kernel/detail/ketypes.h>
+#include <kernel/detail/mmtypes.h>
 #include <kernel/detail/obdefs.h>
 
 /* clang-format off */
@@ -19,11 +21,14 @@ typedef struct {
     const char *Name;
     uint64_t Size;
     void (*Delete)(void *);
+    uint32_t LookasideDepth;
+    const char *LookasideTag;
+    MmLookasideList *Lookaside;
 } ObType;
 
 typedef struct {
     RtDList HashHeads[32];
-    KeSpinLock Lock;
+    EvPushLock Lock;
 } ObDirectory;
 
 #endif /* _KERNEL_DETAIL_OBTYPES_H_ */
@@ -20,6 +20,19 @@
 #define PS_STATE_SUSPENDED 6
 #define PS_STATE_TERMINATED 7
 
+#define PS_PRIORITY_COUNT 32
+#define PS_PRIORITY_LOWEST 0
+#define PS_PRIORITY_NORMAL 8
+#define PS_PRIORITY_REALTIME 16
+#define PS_PRIORITY_HIGHEST (PS_PRIORITY_COUNT - 1)
+
+#define PS_IDEAL_PROCESSOR_NONE 0xFFFFFFFF
+
+#define PS_WAIT_WHEEL_LEVELS 4
+#define PS_WAIT_WHEEL_SHIFT 6
+#define PS_WAIT_WHEEL_SLOTS (1 << PS_WAIT_WHEEL_SHIFT)
+#define PS_WAIT_WHEEL_MASK (PS_WAIT_WHEEL_SLOTS - 1)
+
 #define PS_WAIT_COMPLETION_NONE 0
 #define PS_WAIT_COMPLETION_SIGNAL 1
 #define PS_WAIT_COMPLETION_TIMEOUT 2
@@ -6,7 +6,9 @@
 #ifndef _KERNEL_DETAIL_PSFUNCS_H_
 #define _KERNEL_DETAIL_PSFUNCS_H_
 
+#include <kernel/detail/ketypes.h>
 #include <kernel/detail/pstypes.h>
+#include <stddef.h>
 
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, psfuncs.h))
@@ -23,6 +25,11 @@ bool PsResumeThread(PsThread *Thread);
 [[noreturn]] void PsTerminateThread(void);
 void PsYieldThread(void);
 void PsDelayThread(uint64_t Time);
+bool PsSetThreadPriority(PsThread *Thread, uint8_t Priority);
+bool PsSetThreadAffinity(PsThread *Thread, KeAffinity *Affinity);
+bool PsSetIdealProcessor(PsThread *Thread, uint32_t Number);
+
+size_t PsQueryProcessors(PsProcessorInformation *Buffer, size_t Start, size_t Count);
 
 void PsInitializeAlert(PsAlert *Alert, uint64_t Flags, void (*Routine)(void *), void *Context);
 bool PsQueueAlert(PsThread *Thread, PsAlert *Alert);
@@ -26,7 +26,7 @@
  *     Pointer to the thread struct.
  *-----------------------------------------------------------------------------------------------*/
 static inline PsThread *PsGetCurrentThread(void) {
-    return KeGetCurrentProcessor()->CurrentThread;
+    return KeGetCurrentThread();
 }
 
 #endif /* _KERNEL_DETAIL_PSINLINE_H_ */
@@ -7,6 +7,8 @@
 #define _KERNEL_DETAIL_PSTYPES_H_
 
 #include <kernel/detail/haltypes.h>
+#include <kernel/detail/kedefs.h>
+#include <kernel/detail/psdefs.h>
 
 /* clang-format off */
 #if __has_include(ARCH_MAKE_INCLUDE_PATH(kernel/detail, pstypes.h))
@@ -25,25 +27,39 @@ typedef struct PsThread {
     } EventHeader;
     RtDList ListHeader;
     RtDList OwnedMutexList;
-    RtDList WaitListHeader;
-    RtAvlNode WaitTreeNode;
+    RtDList WaitWheelHeader;
     KeSpinLock AlertLock;
     RtSList AlertList;
     bool AlertListBlocked;
     uint8_t State;
+    uint8_t BasePriority;
+    uint8_t Priority;
+    uint8_t ReadyPriority;
     uint64_t ExpirationTicks;
     uint64_t WaitTicks;
-    void *WaitObject;
+    uint64_t LastRunTick;
+    uint32_t WaitIndex;
     uint8_t WaitCompletion;
-    bool WaitListLinked;
-    bool WaitTreeLinked;
+    bool WaitWheelLinked;
     void *Processor;
+    void *ReadyProcessor;
+    uint32_t IdealProcessor;
+    KeAffinity Affinity;
     char *Stack;
     char *StackLimit;
     char *AllocatedStack;
+    void *ExtendedState;
+    uint32_t ExtendedStateDepth;
     HalContextFrame ContextFrame;
 } PsThread;
 
+typedef struct {
+    uint64_t CurrentTick;
+    uint64_t Count;
+    uint64_t Occupied[PS_WAIT_WHEEL_LEVELS];
+    RtDList Slots[PS_WAIT_WHEEL_LEVELS][PS_WAIT_WHEEL_SLOTS];
+} PsWaitWheel;
+
 typedef struct {
     RtSList ListHeader;
     void (*Routine)(void *);
@@ -52,4 +68,17 @@ typedef struct {
     bool PoolAllocated;
 } PsAlert;
 
+typedef struct {
+    uint32_t Number;
+    uint64_t ThreadCount;
+    uint64_t StealCount;
+    uint64_t StolenThreadCount;
+    uint64_t DispatchIpiCount;
+    uint64_t SuppressedDispatchIpiCount;
+    uint64_t ContextSwitchCount;
+    uint64_t ContextSwitchCycles;
+    uint64_t ExtendedStateSwitchCount;
+    uint64_t ExtendedStateSwitchCycles;
+} PsProcessorInformation;
+
 #endif /* _KERNEL_DETAIL_PSTYPES_H_ */
@@ -4,7 +4,9 @@
 #include <kernel/halp.h>
 #include <kernel/kd.h>
 #include <kernel/kdp.h>
+#include <kernel/ke.h>
 #include <kernel/mm.h>
+#include <kernel/ps.h>
 #include <os/intrin.h>
 #include <rt/except.h>
 #include <stdint.h>
@@ -22,6 +24,9 @@ extern uint16_t KdpDebuggerPort;
 extern bool KdpDebuggerConnected;
 
 static char Buffer[1024] = {0};
+static MmPoolTagInformation PoolTagBuffer[KDP_DEBUG_POOL_TAGS_PER_PACKET] = {0};
+static PsProcessorInformation ProcessorBuffer[KDP_DEBUG_PROCESSORS_PER_PACKET] = {0};
+static KeLockInformation LockBuffer[KDP_DEBUG_LOCKS_PER_PACKET] = {0};
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -370,6 +375,74 @@ static void ParseReadPortPacket(KdpDebugReadPortReqPacket *Packet, uint32_t Leng
         sizeof(KdpDebugReadPortAckPacket));
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function handles a received request to dump one of the kernel statistics tables (pool
+ *     tag usage, per-processor scheduler statistics, or lock statistics).
+ *
+ * PARAMETERS:
+ *     Packet - Header of the packet.
+ *     Length - Size of the packet.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ParseQueryPacket(KdpDebugQueryReqPacket *Packet, uint32_t Length) {
+    if (Length < sizeof(KdpDebugQueryReqPacket)) {
+        KdPrint(KD_TYPE_TRACE, "ignoring invalid debug query packet of size %u\n", Length);
+        return;
+    }
+
+    /* We can only fit a few entries in each response, so the debugger will keep requesting the
+     * next chunk until it has all of them (the lock statistics will report zero entries if the
+     * kernel wasn't built with them). */
+    uint8_t Type;
+    void *Entries;
+    size_t EntrySize;
+    uint32_t MaxCount;
+    size_t Total;
+    if (Packet->Type == KDP_DEBUG_PACKET_QUERY_POOL_TAGS_REQ) {
+        Type = KDP_DEBUG_PACKET_QUERY_POOL_TAGS_ACK;
+        Entries = PoolTagBuffer;
+        EntrySize = sizeof(MmPoolTagInformation);
+        MaxCount = KDP_DEBUG_POOL_TAGS_PER_PACKET;
+        Total = MmQueryPoolTags(PoolTagBuffer, Packet->Start, MaxCount);
+    } else if (Packet->Type == KDP_DEBUG_PACKET_QUERY_PROCESSORS_REQ) {
+        Type = KDP_DEBUG_PACKET_QUERY_PROCESSORS_ACK;
+        Entries = ProcessorBuffer;
+        EntrySize = sizeof(PsProcessorInformation);
+        MaxCount = KDP_DEBUG_PROCESSORS_PER_PACKET;
+        Total = PsQueryProcessors(ProcessorBuffer, Packet->Start, MaxCount);
+    } else {
+        Type = KDP_DEBUG_PACKET_QUERY_LOCKS_ACK;
+        Entries = LockBuffer;
+        EntrySize = sizeof(KeLockInformation);
+        MaxCount = KDP_DEBUG_LOCKS_PER_PACKET;
+        Total = KeQueryLockStatistics(LockBuffer, Packet->Start, MaxCount);
+    }
+
+    uint32_t Count = 0;
+    if (Packet->Start < Total) {
+        Count = Total - Packet->Start < MaxCount ? Total - Packet->Start : MaxCount;
+    }
+
+    /* The payload isn't aligned in the packet, so we need to go through a temporary buffer. */
+    KdpDebugQueryAckPacket *ResponsePacket = (KdpDebugQueryAckPacket *)Buffer;
+    ResponsePacket->Type = Type;
+    ResponsePacket->Start = Packet->Start;
+    ResponsePacket->Count = Count;
+    ResponsePacket->Total = Total;
+    memcpy(ResponsePacket + 1, Entries, Count * EntrySize);
+
+    KdpSendUdpPacket(
+        KdpDebuggerHardwareAddress,
+        KdpDebuggerProtocolAddress,
+        KdpDebuggeePort,
+        KdpDebuggerPort,
+        ResponsePacket,
+        sizeof(KdpDebugQueryAckPacket) + Count * EntrySize);
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function handles any received debug packets after the early initialization stage
@@ -420,6 +493,10 @@ static void ParseLatePacket(
         ParseReadVirtualPacket((KdpDebugReadAddressPacket *)Packet, Length);
     } else if (Packet->Type == KDP_DEBUG_PACKET_READ_PORT_REQ) {
         ParseReadPortPacket((KdpDebugReadPortReqPacket *)Packet, Length);
+    } else if (Packet->Type == KDP_DEBUG_PACKET_QUERY_POOL_TAGS_REQ ||
+               Packet->Type == KDP_DEBUG_PACKET_QUERY_PROCESSORS_REQ ||
+               Packet->Type == KDP_DEBUG_PACKET_QUERY_LOCKS_REQ) {
+        ParseQueryPacket((KdpDebugQueryReqPacket *)Packet, Length);
     } else {
         KdPrint(KD_TYPE_TRACE, "ignoring invalid debug packet of type %u\n", Packet->Type);
     }
@@ -28,6 +28,21 @@ void KeInitializeAffinity(KeAffinity *Mask) {
     }
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function initializes an affinity mask, with no processors set.
+ *
+ * PARAMETERS:
+ *     Mask - Which affinity mask struct to initialize.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KeInitializeEmptyAffinity(KeAffinity *Mask) {
+    Mask->Size = HalpOnlineProcessorCount;
+    memset((void *)Mask->Bits, 0, sizeof(Mask->Bits));
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function queries about the specified processor in the affinity mask.
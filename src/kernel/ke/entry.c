@@ -2,6 +2,7 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <crt_impl/rand.h>
+#include <kernel/evp.h>
 #include <kernel/halp.h>
 #include <kernel/kd.h>
 #include <kernel/kdp.h>
@@ -9,6 +10,7 @@
 #include <kernel/ki.h>
 #include <kernel/mi.h>
 #include <kernel/mm.h>
+#include <kernel/obp.h>
 #include <kernel/psp.h>
 #include <kernel/vidp.h>
 #include <os/intrin.h>
@@ -77,6 +79,32 @@ static void InitializeBootProcessor(KiLoaderBlock *LoaderBlock) {
     KiSaveBootStartDrivers(LoaderBlock);
     MiReleaseBootRegions();
 
+#ifndef NDEBUG
+    /* Debug builds also stress the buddy allocator before anything else gets a chance to allocate
+     * contiguous pages (a broken merge would otherwise only show up as slow fragmentation). */
+    MiTestPageAllocator();
+
+    /* The per-processor page caches sit in front of the buddy allocator so that order-0
+     * allocations stay cheap; Print both paths so that a regression shows up. */
+    MiBenchmarkPageAllocator();
+
+    /* Same for the pool; Freed segments only go back to the page allocator past the reserve (or
+     * when we're low on memory), which nothing else during boot would exercise. */
+    MiTestPoolReclaim();
+
+    /* And the lookaside magazines should actually absorb a steady working set, while still giving
+     * back what an idle list doesn't need. */
+    MiTestLookasideList();
+
+    /* The pool space trees need every free to merge back with its neighbours, or the pool would
+     * slowly run out of large enough (and large page aligned) ranges. */
+    MiTestPoolSpace();
+
+    /* Allocate/free pairs hit the per-processor state a few times each (processor block, block
+     * caches, tag shards), so print how much one costs (to compare across builds). */
+    MiBenchmarkPool();
+#endif /* NDEBUG */
+
     /* It should now be safe to wrap up the HAL initialization (which will also bring up the
      * secondary processors). */
     HalpInitializeBootProcessor();
@@ -86,6 +114,12 @@ static void InitializeBootProcessor(KiLoaderBlock *LoaderBlock) {
         KdPrint(KD_TYPE_INFO, "%u processors online\n", HalpOnlineProcessorCount);
     }
 
+    /* The lock statistics tables come from the pool, and there's one per processor, so this is the
+     * earliest point where we can start recording. */
+#ifdef KE_LOCK_STATISTICS
+    KiInitializeLockStatistics();
+#endif /* KE_LOCK_STATISTICS */
+
     /* At last, get the scheduler up so that we can get out of the system/boot stack, and into the
      * initial system thread. */
     PspCreateIdleThread();
@@ -155,6 +189,81 @@ static void InitializeApplicationProcessor(KeProcessor *Processor) {
  *     Does not return.
  *-----------------------------------------------------------------------------------------------*/
 [[noreturn]] void KiContinueSystemStartup(void *) {
+    /* Start clearing free pages in the background (now that the scheduler is up). */
+    MiCreateZeroPageThread();
+
+#ifndef NDEBUG
+    /* Debug builds also push a lot of timers through a private wait wheel, as the higher levels
+     * (and cascading down from them) only get exercised by long timeouts during normal use. */
+    PspTestWaitWheel();
+
+    /* Arming and cancelling should be constant time no matter how many timers there are; Print
+     * the per-timer costs over 100k of them. */
+    PspBenchmarkWaitWheel();
+
+    /* Pinned threads should also stay put no matter how much they sleep/yield (or how idle the
+     * other processors are); Work stealing and wakeups are the easiest places to get this wrong. */
+    PspTestThreadAffinity();
+
+    /* Placement and stealing should always prefer the closest processors (same core, then same
+     * cache, then same package); Check both against the topology we enumerated. */
+    PspTestPlacement();
+    PspTestStealOrder();
+
+    /* Priority wakeups should preempt CPU-bound threads right away (instead of waiting for them
+     * to use up their quantum); Measure how long that takes under load. */
+    PspTestWakeupLatency();
+
+    /* The push locks only take their slow paths (chaining wait blocks, handing over to a mix of
+     * shared and exclusive waiters) under real contention, so force some on every processor. */
+    EvpTestPushLocks();
+
+    /* Directory lookups only take the push lock shared, so they should scale with the amount of
+     * readers; Print the lookup throughput from 1 up to 32 of them. */
+    ObpBenchmarkDirectory();
+
+    /* The queued spin locks hand over to the next waiter in line, which is only exercised when
+     * every processor fights over the same lock at once (including the try path). */
+    KiTestQueuedSpinLocks();
+
+    /* Print the IPI round trip latency (rerun with different processor counts to see how it
+     * scales). */
+    KiBenchmarkIpis();
+
+    /* And how the queued spin locks hold up against plain spin locks as more processors fight
+     * over the same lock. */
+    KiBenchmarkSpinLocks();
+
+    /* Raising and lowering the IRQL should be cheap now that it's lazy (no CR8 writes); Print
+     * it against the CR8 writes it replaced, plus the cost of the timer tick. */
+    HalpBenchmarkIrql();
+
+    /* Wait-all has to take everything (mutexes included) at once or nothing at all, even when it
+     * gets woken up by only part of the objects; Exercise that against a helper thread, and then
+     * race a few threads over the same mutexes. */
+    EvpTestWaits();
+
+    /* Waking up a lot of threads at once should only need (at most) one dispatch IPI per
+     * processor; Print how long a broadcast to 64 waiters takes (and how many IPIs it sent). */
+    EvpBenchmarkBroadcast();
+
+    /* Spinning on a mutex whose owner is running should save a context switch (and a wakeup IPI)
+     * per contended acquire; Print both modes under increasing contention. */
+    EvpBenchmarkMutex();
+
+    /* A single thread waiting on several sources (shutdown, work, timeout) should be about as
+     * cheap as a thread per source; Print the work item round trip and the wait-any fast path. */
+    EvpBenchmarkEventLoop();
+
+    /* Switches only save the vector registers for threads inside an extended state section;
+     * Print how much a switch costs with and without that. */
+    KiBenchmarkContextSwitches();
+
+    /* The hot object types come from per-type lookaside lists instead of the pool; Print how much
+     * that saves per mutex (and how fast we can churn through whole threads). */
+    ObpBenchmarkObjects();
+#endif /* NDEBUG */
+
     /* Get all of the required boot modules up; This should let us load the remaining drivers from
      * the disk. */
     KiRunBootStartDrivers();
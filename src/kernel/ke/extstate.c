@@ -0,0 +1,226 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <kernel/ev.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
+#include <kernel/ke.h>
+#include <kernel/ob.h>
+#include <kernel/ps.h>
+
+#ifndef NDEBUG
+#define BENCHMARK_SWITCHES 4096
+#define BENCHMARK_DELAY (10 * EV_MILLISECS)
+
+static EvSignal *BenchmarkStart = NULL;
+static bool BenchmarkExtendedState = false;
+#endif /* NDEBUG */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function starts a section of kernel code that uses vector registers (beyond the
+ *     XMM registers that interrupt handlers already preserve); It should always be paired with
+ *     KeRestoreExtendedState, and it can only be used at or below DISPATCH.
+ *
+ * PARAMETERS:
+ *     State - Output; Anything we need to undo the section in KeRestoreExtendedState.
+ *
+ * RETURN VALUE:
+ *     true if the section can use the extended state, false otherwise (either because the
+ *     processor has no extended state support, or because we're out of memory); The caller
+ *     should fall back to scalar code (and skip KeRestoreExtendedState) on failure.
+ *-----------------------------------------------------------------------------------------------*/
+bool KeSaveExtendedState(KeExtendedState *State) {
+    KeIrql Irql = KeGetIrql();
+    if (Irql > KE_IRQL_DISPATCH) {
+        KeFatalError(KE_PANIC_IRQL_NOT_LESS_OR_EQUAL, Irql, KE_IRQL_DISPATCH, 0, 0);
+    }
+
+    PsThread *Thread = PsGetCurrentThread();
+    State->SavedState = NULL;
+
+    /* The thread only gets a save area after its first section (most threads never need one);
+     * Someone interrupting us might also race us into allocating it, so only one of us gets to
+     * keep theirs. */
+    if (!Thread->ExtendedState) {
+        void *Buffer = HalpAllocateExtendedState();
+        if (!Buffer) {
+            return false;
+        }
+
+        void *Expected = NULL;
+        if (!__atomic_compare_exchange_n(
+                &Thread->ExtendedState,
+                &Expected,
+                Buffer,
+                false,
+                __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED)) {
+            HalpFreeExtendedState(Buffer);
+        }
+    }
+
+    /* Nested sections in the same thread don't need to save anything, as the calling convention
+     * already makes everything but the low half of XMM6-15 volatile across calls (and the compiler
+     * preserves those for us). Above PASSIVE though, we might have interrupted another section,
+     * and its registers are still live. The temporary area never gets the optimized (owner only)
+     * XSAVE forms, as it was just allocated; We still need to stay in this processor until the
+     * save is done though. */
+    if (Thread->ExtendedStateDepth && Irql >= KE_IRQL_ALERT) {
+        State->SavedState = HalpAllocateExtendedState();
+        if (!State->SavedState) {
+            return false;
+        }
+
+        KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+        HalpSaveExtendedState(State->SavedState);
+        KeLowerIrql(OldIrql);
+    }
+
+    Thread->ExtendedStateDepth++;
+    return true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function ends a section started by KeSaveExtendedState (restoring the registers of any
+ *     section we might have interrupted).
+ *
+ * PARAMETERS:
+ *     State - Same value passed to KeSaveExtendedState.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KeRestoreExtendedState(KeExtendedState *State) {
+    if (State->SavedState) {
+        KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+        HalpRestoreExtendedState(State->SavedState);
+        KeLowerIrql(OldIrql);
+        HalpFreeExtendedState(State->SavedState);
+        State->SavedState = NULL;
+    }
+
+    PsGetCurrentThread()->ExtendedStateDepth--;
+}
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the context switch benchmark threads; Once started, we
+ *     keep yielding to the other benchmark thread (optionally from inside an extended state
+ *     section).
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void RunSwitchBenchmark(void *) {
+    EvWaitForObject(BenchmarkStart, EV_TIMEOUT_UNLIMITED);
+
+    KeExtendedState State;
+    bool Saved = BenchmarkExtendedState && KeSaveExtendedState(&State);
+
+    for (uint32_t i = 0; i < BENCHMARK_SWITCHES; i++) {
+        PsYieldThread();
+    }
+
+    if (Saved) {
+        KeRestoreExtendedState(&State);
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function runs a single round of the context switch benchmark.
+ *
+ * PARAMETERS:
+ *     ExtendedState - Whether the threads should be inside an extended state section.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunSwitchBenchmarkRound(bool ExtendedState) {
+    /* Pin both threads to the last processor (which should be the least busy one during boot). */
+    KeProcessor *Processor = HalpProcessorList[HalpOnlineProcessorCount - 1];
+    KeAffinity Affinity;
+    KeInitializeEmptyAffinity(&Affinity);
+    KeSetAffinityBit(&Affinity, Processor->Number);
+
+    BenchmarkExtendedState = ExtendedState;
+    EvClearSignal(BenchmarkStart);
+
+    PsThread *Threads[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        Threads[i] = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, RunSwitchBenchmark, NULL);
+        if (!Threads[i] || !PsSetThreadAffinity(Threads[i], &Affinity)) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, ExtendedState, i, 0, 0);
+        }
+
+        PsResumeThread(Threads[i]);
+    }
+
+    /* Give both threads some time to block on the start signal, so that they start together. */
+    PsDelayThread(BENCHMARK_DELAY);
+
+    uint64_t Count = __atomic_load_n(&Processor->ContextSwitchCount, __ATOMIC_RELAXED);
+    uint64_t Cycles = __atomic_load_n(&Processor->ContextSwitchCycles, __ATOMIC_RELAXED);
+    uint64_t ExtendedCount =
+        __atomic_load_n(&Processor->ExtendedStateSwitchCount, __ATOMIC_RELAXED);
+    uint64_t ExtendedCycles =
+        __atomic_load_n(&Processor->ExtendedStateSwitchCycles, __ATOMIC_RELAXED);
+    EvSetSignal(BenchmarkStart);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        EvWaitForObject(Threads[i], EV_TIMEOUT_UNLIMITED);
+        ObDereferenceObject(Threads[i]);
+    }
+
+    Count = __atomic_load_n(&Processor->ContextSwitchCount, __ATOMIC_RELAXED) - Count;
+    Cycles = __atomic_load_n(&Processor->ContextSwitchCycles, __ATOMIC_RELAXED) - Cycles;
+    ExtendedCount =
+        __atomic_load_n(&Processor->ExtendedStateSwitchCount, __ATOMIC_RELAXED) - ExtendedCount;
+    ExtendedCycles =
+        __atomic_load_n(&Processor->ExtendedStateSwitchCycles, __ATOMIC_RELAXED) - ExtendedCycles;
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "context switch benchmark (%s): %llu switches, %llu cycles per switch, %llu with "
+        "extended state (%llu cycles per switch)\n",
+        ExtendedState ? "extended state" : "no extended state",
+        Count,
+        Count ? Cycles / Count : 0,
+        ExtendedCount,
+        ExtendedCount ? ExtendedCycles / ExtendedCount : 0);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures the cost of a context switch (debug builds only), by having two
+ *     threads pinned to the same processor yield to each other, first outside and then inside an
+ *     extended state section; The difference is what saving/restoring the vector registers costs
+ *     us. The results are only printed (nothing fails). This should be called after all
+ *     processors are online, from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiBenchmarkContextSwitches(void) {
+    BenchmarkStart = EvCreateSignal();
+    if (!BenchmarkStart) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    RunSwitchBenchmarkRound(false);
+    RunSwitchBenchmarkRound(true);
+
+    ObDereferenceObject(BenchmarkStart);
+}
+#endif /* NDEBUG */
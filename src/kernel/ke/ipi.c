@@ -2,16 +2,29 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <os/intrin.h>
 #include <stddef.h>
 #include <stdint.h>
 
-static KeSpinLock Lock = {0};
-static void (*TargetRoutine)(void *) = NULL;
-static void *TargetParameter = NULL;
-static volatile uint64_t EarlyBarrier = 0;
-static volatile uint64_t LateBarrier = 0;
+/* Rendezvous requests wrap the caller routine, so that every processor can wait for the others
+ * before running it. */
+typedef struct {
+    KeIpiRequest Request;
+    void (*Routine)(void *);
+    void *Parameter;
+    uint64_t Participants;
+    volatile uint64_t Arrived;
+} RendezvousRequest;
+
+extern bool HalpSmpInitializationComplete;
+
+static KeSpinLock RendezvousLock = {0};
+
+#ifndef NDEBUG
+#define BENCHMARK_ROUNDS 64
+#endif /* NDEBUG */
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -33,7 +46,153 @@ void KeSynchronizeProcessors(volatile uint64_t *State) {
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function requests all processors to run a routine at KE_IRQL_IPI.
+ *     This function initializes an IPI request, so that it can be passed to KeRequestIpi.
+ *
+ * PARAMETERS:
+ *     Request - Which request to initialize.
+ *     Routine - Which routine should run on the target processors.
+ *     Parameter - Parameter to the routine.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KeInitializeIpiRequest(KeIpiRequest *Request, void (*Routine)(void *), void *Parameter) {
+    Request->Routine = Routine;
+    Request->Parameter = Parameter;
+    Request->Pending = 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function inserts a request into the IPI queue of the target processor. If the same
+ *     request is already queued (and hasn't started running yet), we just coalesce with it.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor should run the request.
+ *     Request - Which request to queue.
+ *
+ * RETURN VALUE:
+ *     true if the target needs to be interrupted, false if it already has an IPI on the way.
+ *-----------------------------------------------------------------------------------------------*/
+static bool QueueRequest(KeProcessor *Processor, KeIpiRequest *Request) {
+    while (true) {
+        /* The queue gets drained at IPI IRQL, so we need to be at the same level while holding
+         * its lock. */
+        KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->IpiQueueLock, KE_IRQL_IPI);
+
+        for (uint32_t i = 0; i < Processor->IpiQueueCount; i++) {
+            if (Processor->IpiQueue[(Processor->IpiQueueHead + i) % KE_IPI_QUEUE_SIZE] ==
+                Request) {
+                KeReleaseSpinLockAndLowerIrql(&Processor->IpiQueueLock, OldIrql);
+                return false;
+            }
+        }
+
+        if (Processor->IpiQueueCount < KE_IPI_QUEUE_SIZE) {
+            __atomic_add_fetch(&Request->Pending, 1, __ATOMIC_RELAXED);
+            Processor->IpiQueue[(Processor->IpiQueueHead + Processor->IpiQueueCount) %
+                                KE_IPI_QUEUE_SIZE] = Request;
+
+            /* Only the first request in the queue needs to send the IPI, the target handles
+             * everything queued up until it empties the queue. */
+            bool NeedsIpi = !Processor->IpiQueueCount++;
+            KeReleaseSpinLockAndLowerIrql(&Processor->IpiQueueLock, OldIrql);
+            return NeedsIpi;
+        }
+
+        /* The queue is full, wait until the target makes some progress (we should still be
+         * accepting IPIs ourselves, so we can't deadlock against the target). */
+        KeReleaseSpinLockAndLowerIrql(&Processor->IpiQueueLock, OldIrql);
+        PauseProcessor();
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function requests a set of processors to run a routine at KE_IRQL_IPI. This should be
+ *     called at SYNCH IRQL or below.
+ *
+ * PARAMETERS:
+ *     Targets - Which processors should run the routine; The current processor can also be
+ *               included (in which case the routine runs before we return). Before SMP
+ *               initialization, only the current processor (if it's included) runs the routine.
+ *     Request - Previously initialized IPI request; If KE_IPI_WAIT isn't set, this needs to stay
+ *               valid until the request is complete (Request->Pending is zero).
+ *     Flags - KE_IPI_WAIT to wait until all target processors finished running the routine.
+ *
+ * RETURN VALUE:
+ *     How many processors we actually had to interrupt (not counting the current processor, or
+ *     processors that we coalesced with).
+ *-----------------------------------------------------------------------------------------------*/
+uint32_t KeRequestIpi(KeAffinity *Targets, KeIpiRequest *Request, int Flags) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_SYNCH);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    bool RunLocally =
+        !HalpSmpInitializationComplete && KeGetAffinityBit(Targets, Processor->Number);
+    uint32_t Interrupted = 0;
+
+    if (HalpSmpInitializationComplete) {
+        for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+            if (!KeGetAffinityBit(Targets, i)) {
+                continue;
+            }
+
+            KeProcessor *TargetProcessor = HalpProcessorList[i];
+            if (TargetProcessor == Processor) {
+                RunLocally = true;
+            } else if (QueueRequest(TargetProcessor, Request)) {
+                HalpNotifyProcessor(TargetProcessor, KE_IRQL_IPI);
+                Interrupted++;
+            }
+        }
+    }
+
+    /* Run our own copy while the other processors are handling theirs. */
+    if (RunLocally) {
+        KeSetIrql(KE_IRQL_IPI);
+        Request->Routine(Request->Parameter);
+        KeSetIrql(KE_IRQL_SYNCH);
+    }
+
+    /* We're still below IPI IRQL, so we'll handle any IPIs sent to us while we wait (which
+     * prevents deadlocks with other processors waiting on us). */
+    if (Flags & KE_IPI_WAIT) {
+        while (__atomic_load_n(&Request->Pending, __ATOMIC_ACQUIRE)) {
+            PauseProcessor();
+        }
+    }
+
+    KeLowerIrql(OldIrql);
+    return Interrupted;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function waits (at IPI IRQL) until all processors taking part in a rendezvous got here,
+ *     and runs the caller routine.
+ *
+ * PARAMETERS:
+ *     Parameter - Rendezvous request.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunRendezvous(void *Parameter) {
+    RendezvousRequest *Rendezvous = Parameter;
+
+    __atomic_add_fetch(&Rendezvous->Arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&Rendezvous->Arrived, __ATOMIC_ACQUIRE) != Rendezvous->Participants) {
+        PauseProcessor();
+    }
+
+    Rendezvous->Routine(Rendezvous->Parameter);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function requests all processors to run a routine at KE_IRQL_IPI, all at the same time
+ *     (nobody starts running the routine until every processor is inside the IPI handler), waiting
+ *     until all of them are done. This should be called at SYNCH IRQL or below.
  *
  * PARAMETERS:
  *     Routine - Which routine to run.
@@ -43,32 +202,28 @@ void KeSynchronizeProcessors(volatile uint64_t *State) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 void KeRequestIpiRoutine(void (*Routine)(void *), void *Parameter) {
-    /* Lock ourselves out of trying to execute multiple IPIs at the same time (because the global
-     * state only allows for one IPI at a time). */
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Lock, KE_IRQL_SYNCH);
-
-    /* Initialize the synchronization state. */
-    TargetRoutine = Routine;
-    TargetParameter = Parameter;
-    __atomic_store_n(&EarlyBarrier, 0, __ATOMIC_RELEASE);
-    __atomic_store_n(&LateBarrier, 0, __ATOMIC_RELEASE);
-
-    /* Interrupt all processors into the IPI handler. */
-    HalpBroadcastIpi();
-
-    /* Synchronize all processors before running anything. */
-    KeSynchronizeProcessors(&EarlyBarrier);
-    KeSetIrql(KE_IRQL_IPI);
-    Routine(Parameter);
-
-    /* And synchronize afterwards as well. */
-    KeSynchronizeProcessors(&LateBarrier);
-    KeReleaseSpinLockAndLowerIrql(&Lock, OldIrql);
+    /* Two rendezvous at the same time would deadlock (each processor would be stuck at IPI IRQL
+     * waiting for processors that are stuck in the other one), so only let one run at a time; We
+     * still accept IPIs while waiting for the lock. */
+    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&RendezvousLock, KE_IRQL_SYNCH);
+
+    /* Before SMP initialization, only the current processor is going to take part. */
+    KeAffinity Targets;
+    RendezvousRequest Rendezvous;
+    KeInitializeAffinity(&Targets);
+    KeInitializeIpiRequest(&Rendezvous.Request, RunRendezvous, &Rendezvous);
+    Rendezvous.Routine = Routine;
+    Rendezvous.Parameter = Parameter;
+    Rendezvous.Participants = HalpSmpInitializationComplete ? HalpOnlineProcessorCount : 1;
+    Rendezvous.Arrived = 0;
+
+    KeRequestIpi(&Targets, &Rendezvous.Request, KE_IPI_WAIT);
+    KeReleaseSpinLockAndLowerIrql(&RendezvousLock, OldIrql);
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function handles an incoming IPI request.
+ *     This function handles an incoming IPI request, running everything in our IPI queue.
  *
  * PARAMETERS:
  *     None.
@@ -77,9 +232,131 @@ void KeRequestIpiRoutine(void (*Routine)(void *), void *Parameter) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 void KiHandleIpi(void) {
-    /* No need for a full SynchronizeProcessors after running the target routine, we're just
-     * supposed to notify the starting processor that we finished. */
-    KeSynchronizeProcessors(&EarlyBarrier);
-    TargetRoutine(TargetParameter);
-    __atomic_fetch_add(&LateBarrier, 1, __ATOMIC_RELEASE);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+
+    while (true) {
+        KeAcquireSpinLockAtCurrentIrql(&Processor->IpiQueueLock);
+        if (!Processor->IpiQueueCount) {
+            KeReleaseSpinLockAtCurrentIrql(&Processor->IpiQueueLock);
+            break;
+        }
+
+        /* Unlink the request before running it, so that anyone requesting it again while we're
+         * running gets it rerun (instead of coalescing into us). */
+        KeIpiRequest *Request = Processor->IpiQueue[Processor->IpiQueueHead];
+        Processor->IpiQueueHead = (Processor->IpiQueueHead + 1) % KE_IPI_QUEUE_SIZE;
+        Processor->IpiQueueCount--;
+        KeReleaseSpinLockAtCurrentIrql(&Processor->IpiQueueLock);
+
+        /* The request might not be valid anymore after we decrement the pending count (if its
+         * sender was waiting on it), so don't touch it after that. */
+        Request->Routine(Request->Parameter);
+        __atomic_sub_fetch(&Request->Pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the (empty) routine used by the IPI benchmark.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void BenchmarkRoutine(void *) {
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function sends an empty IPI request (waiting for it) a few times, and measures how
+ *     long each round trip took.
+ *
+ * PARAMETERS:
+ *     Targets - Which processors should run the request.
+ *     Total - Output; Sum of all round trip times (in TSC cycles).
+ *     Max - Input/Output; Worst round trip time so far (in TSC cycles).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void MeasureRoundTrips(KeAffinity *Targets, uint64_t *Total, uint64_t *Max) {
+    KeIpiRequest Request;
+    KeInitializeIpiRequest(&Request, BenchmarkRoutine, NULL);
+
+    for (uint32_t i = 0; i < BENCHMARK_ROUNDS; i++) {
+        uint64_t Start = HalpGetTscTicks();
+        KeRequestIpi(Targets, &Request, KE_IPI_WAIT);
+        uint64_t Cycles = HalpGetTscTicks() - Start;
+
+        *Total += Cycles;
+        if (Cycles > *Max) {
+            *Max = Cycles;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures the IPI round trip latency (debug builds only): A single target at a
+ *     time (going through every other processor), every other processor at once, and a full
+ *     rendezvous. The results are only printed (nothing fails); Run this under different
+ *     processor counts to see how the latency scales. This should be called after all processors
+ *     are online.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiBenchmarkIpis(void) {
+    if (HalpOnlineProcessorCount < 2) {
+        KdPrint(KD_TYPE_DEBUG, "ipi benchmark: skipped (only one processor online)\n");
+        return;
+    }
+
+    /* Stay on the same processor for the whole thing (so that we never target ourselves). */
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    uint32_t Number = KeGetCurrentProcessor()->Number;
+
+    KeAffinity Targets;
+    uint64_t UnicastTotal = 0;
+    uint64_t UnicastMax = 0;
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        if (i != Number) {
+            KeInitializeEmptyAffinity(&Targets);
+            KeSetAffinityBit(&Targets, i);
+            MeasureRoundTrips(&Targets, &UnicastTotal, &UnicastMax);
+        }
+    }
+
+    uint64_t BroadcastTotal = 0;
+    uint64_t BroadcastMax = 0;
+    KeInitializeAffinity(&Targets);
+    KeClearAffinityBit(&Targets, Number);
+    MeasureRoundTrips(&Targets, &BroadcastTotal, &BroadcastMax);
+
+    KeLowerIrql(OldIrql);
+
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_ROUNDS; i++) {
+        KeRequestIpiRoutine(BenchmarkRoutine, NULL);
+    }
+
+    uint64_t RendezvousCycles = (HalpGetTscTicks() - Start) / BENCHMARK_ROUNDS;
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "ipi benchmark (%u processors): unicast %llu/%llu, broadcast %llu/%llu, rendezvous %llu "
+        "cycles (average/worst case)\n",
+        HalpOnlineProcessorCount,
+        UnicastTotal / ((uint64_t)(HalpOnlineProcessorCount - 1) * BENCHMARK_ROUNDS),
+        UnicastMax,
+        BroadcastTotal / BENCHMARK_ROUNDS,
+        BroadcastMax,
+        RendezvousCycles);
 }
+#endif /* NDEBUG */
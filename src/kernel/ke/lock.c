@@ -0,0 +1,538 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <kernel/halp.h>
+#include <kernel/ke.h>
+#include <kernel/kd.h>
+#include <kernel/ki.h>
+#include <kernel/mm.h>
+#include <os/intrin.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* This only gets set once every processor has its statistics table; Kernels built without
+ * KE_LOCK_STATISTICS never allocate the tables (so the recording functions below are just no-ops
+ * for them). */
+static bool Enabled = false;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds (or creates) the statistics entry for the given call site in the
+ *     processor table. This should only be called inside a critical section.
+ *
+ * PARAMETERS:
+ *     Table - Statistics table of the current processor.
+ *     Site - Return address of whoever acquired the lock.
+ *
+ * RETURN VALUE:
+ *     Pointer to the entry, or NULL if the table is already full.
+ *-----------------------------------------------------------------------------------------------*/
+static KeLockStatistics *FindSite(KeLockStatisticsTable *Table, uint64_t Site) {
+    /* Fibonacci hashing; The low bits of a return address don't vary much between call sites, so
+     * we want to use the high bits of the product instead. */
+    uint64_t Hash = (Site * 0x9E3779B97F4A7C15ull) >> (64 - KE_LOCK_STATISTICS_SHIFT);
+
+    for (uint32_t i = 0; i < KE_LOCK_STATISTICS_SIZE; i++) {
+        KeLockStatistics *Entry = &Table->Entries[(Hash + i) & (KE_LOCK_STATISTICS_SIZE - 1)];
+        if (Entry->Site == Site) {
+            return Entry;
+        } else if (!Entry->Site) {
+            Entry->Site = Site;
+            return Entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function updates the acquisition counters for the given call site. This should only be
+ *     called inside a critical section.
+ *
+ * PARAMETERS:
+ *     Table - Statistics table of the current processor.
+ *     Site - Return address of whoever acquired the lock.
+ *     StartTicks - When we started waiting for the lock, or 0 if it wasn't contended.
+ *     EndTicks - When we finally got the lock.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void UpdateSite(
+    KeLockStatisticsTable *Table,
+    uint64_t Site,
+    uint64_t StartTicks,
+    uint64_t EndTicks) {
+    KeLockStatistics *Entry = FindSite(Table, Site);
+    if (!Entry) {
+        return;
+    }
+
+    Entry->AcquireCount++;
+    if (StartTicks) {
+        Entry->ContentionCount++;
+        Entry->SpinCycles += EndTicks - StartTicks;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function updates the maximum hold time for the given call site. This should only be
+ *     called inside a critical section.
+ *
+ * PARAMETERS:
+ *     Table - Statistics table of the current processor.
+ *     Site - Return address of whoever acquired the lock.
+ *     HoldTicks - For how long the lock was held.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void UpdateHoldTime(KeLockStatisticsTable *Table, uint64_t Site, uint64_t HoldTicks) {
+    KeLockStatistics *Entry = FindSite(Table, Site);
+    if (Entry && HoldTicks > Entry->MaxHoldCycles) {
+        Entry->MaxHoldCycles = HoldTicks;
+    }
+}
+
+#ifdef KE_LOCK_STATISTICS
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates the statistics table of each processor, and starts recording lock
+ *     statistics. This should be called after all processors are online; Anything acquired before
+ *     that point just doesn't get recorded.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiInitializeLockStatistics(void) {
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        KeProcessor *Processor = HalpProcessorList[i];
+        Processor->LockStatistics =
+            MmAllocatePool(sizeof(KeLockStatisticsTable), MM_POOL_TAG_PROCESSOR);
+        if (!Processor->LockStatistics) {
+            KdPrint(KD_TYPE_ERROR, "failed to allocate the lock statistics tables\n");
+            return;
+        }
+    }
+
+    __atomic_store_n(&Enabled, true, __ATOMIC_RELEASE);
+}
+#endif /* KE_LOCK_STATISTICS */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function reads the current time stamp for the lock statistics.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Current TSC value.
+ *-----------------------------------------------------------------------------------------------*/
+uint64_t KiGetLockTicks(void) {
+    return HalpGetTscTicks();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function records a spin lock acquisition (keyed by our return address, which should be
+ *     inside whoever inlined the acquire function), and starts tracking its hold time.
+ *
+ * PARAMETERS:
+ *     Lock - Which lock was just acquired.
+ *     StartTicks - When we started waiting for the lock, or 0 if it wasn't contended.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiRecordLockAcquire(const volatile void *Lock, uint64_t StartTicks) {
+    if (!__atomic_load_n(&Enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    uint64_t Site = (uint64_t)__builtin_return_address(0);
+    void *Context = HalpEnterCriticalSection();
+    KeLockStatisticsTable *Table = KeGetCurrentProcessor()->LockStatistics;
+    uint64_t Ticks = HalpGetTscTicks();
+
+    UpdateSite(Table, Site, StartTicks, Ticks);
+
+    /* Deeper nesting than this is rare enough that we just don't measure the hold time. */
+    if (Table->HeldLockCount < KE_LOCK_STATISTICS_DEPTH) {
+        KeHeldLock *HeldLock = &Table->HeldLocks[Table->HeldLockCount++];
+        HeldLock->Lock = Lock;
+        HeldLock->Site = Site;
+        HeldLock->AcquireTicks = Ticks;
+    }
+
+    HalpLeaveCriticalSection(Context);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function stops tracking the hold time of a spin lock that is about to be released.
+ *
+ * PARAMETERS:
+ *     Lock - Which lock is being released.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiRecordLockRelease(const volatile void *Lock) {
+    if (!__atomic_load_n(&Enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    void *Context = HalpEnterCriticalSection();
+    KeLockStatisticsTable *Table = KeGetCurrentProcessor()->LockStatistics;
+
+    /* Locks are usually (but not always) released in the reverse order, so search from the top;
+     * Not finding it just means we weren't tracking it. */
+    for (uint32_t i = Table->HeldLockCount; i > 0; i--) {
+        KeHeldLock *HeldLock = &Table->HeldLocks[i - 1];
+        if (HeldLock->Lock != Lock) {
+            continue;
+        }
+
+        UpdateHoldTime(Table, HeldLock->Site, HalpGetTscTicks() - HeldLock->AcquireTicks);
+
+        for (uint32_t j = i; j < Table->HeldLockCount; j++) {
+            Table->HeldLocks[j - 1] = Table->HeldLocks[j];
+        }
+
+        Table->HeldLockCount--;
+        break;
+    }
+
+    HalpLeaveCriticalSection(Context);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function records a lock acquisition for an explicit call site; This is used by locks
+ *     that can be held across context switches (and as such, track their own hold time).
+ *
+ * PARAMETERS:
+ *     Site - Return address of whoever acquired the lock.
+ *     StartTicks - When we started waiting for the lock, or 0 if it wasn't contended.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiRecordLockSite(void *Site, uint64_t StartTicks) {
+    if (!__atomic_load_n(&Enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    void *Context = HalpEnterCriticalSection();
+    UpdateSite(
+        KeGetCurrentProcessor()->LockStatistics, (uint64_t)Site, StartTicks, HalpGetTscTicks());
+    HalpLeaveCriticalSection(Context);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function records the hold time of a lock acquired through KiRecordLockSite.
+ *
+ * PARAMETERS:
+ *     Site - Return address of whoever acquired the lock.
+ *     AcquireTicks - When the lock was acquired.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiRecordLockHold(void *Site, uint64_t AcquireTicks) {
+    if (!__atomic_load_n(&Enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    void *Context = HalpEnterCriticalSection();
+    UpdateHoldTime(
+        KeGetCurrentProcessor()->LockStatistics, (uint64_t)Site, HalpGetTscTicks() - AcquireTicks);
+    HalpLeaveCriticalSection(Context);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function collects the lock statistics of all online processors (one entry per call
+ *     site per processor). Nothing is ever recorded unless the kernel was built with
+ *     KE_LOCK_STATISTICS.
+ *
+ * PARAMETERS:
+ *     Buffer - Output; Where to store the information about each call site.
+ *     Start - Index of the first entry we should collect.
+ *     Count - How many entries the buffer can hold.
+ *
+ * RETURN VALUE:
+ *     How many entries exist (which might be more than what we stored in the buffer).
+ *-----------------------------------------------------------------------------------------------*/
+size_t KeQueryLockStatistics(KeLockInformation *Buffer, size_t Start, size_t Count) {
+    size_t Total = 0;
+
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        KeProcessor *Processor = HalpProcessorList[i];
+        if (!Processor->LockStatistics) {
+            continue;
+        }
+
+        for (uint32_t j = 0; j < KE_LOCK_STATISTICS_SIZE; j++) {
+            KeLockStatistics *Entry = &Processor->LockStatistics->Entries[j];
+            if (!Entry->Site) {
+                continue;
+            }
+
+            if (Total >= Start && Total - Start < Count) {
+                Buffer[Total - Start].Processor = Processor->Number;
+                Buffer[Total - Start].Statistics = *Entry;
+            }
+
+            Total++;
+        }
+    }
+
+    return Total;
+}
+
+#ifndef NDEBUG
+#define TEST_ITERATIONS 4096
+#define BENCHMARK_ACQUIRES 4096
+
+/* Which lock (and how many processors) the lock contention benchmark should use. */
+typedef struct {
+    bool Queued;
+    uint32_t Processors;
+} BenchmarkParameters;
+
+static KeQueuedSpinLock TestLock = {0};
+static volatile uint64_t TestOwner = 0;
+static volatile uint64_t TestCounter = 0;
+static KeSpinLock BenchmarkLock = {0};
+static uint64_t BenchmarkMaxCycles = 0;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function hammers the self-test queued lock from one processor, making sure nobody else
+ *     is ever inside the lock together with us. This runs on every processor at the same time (at
+ *     IPI IRQL, so we can't get preempted while holding the lock).
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunQueuedLockTest(void *) {
+    uint64_t Number = KeGetCurrentProcessor()->Number + 1;
+
+    for (uint32_t i = 0; i < TEST_ITERATIONS; i++) {
+        KeLockQueueNode Node;
+
+        /* Mix in the try path, so that it also races against the queued waiters. */
+        if (i & 1) {
+            while (!KeTryAcquireQueuedSpinLockAtCurrentIrql(&TestLock, &Node)) {
+                PauseProcessor();
+            }
+        } else {
+            KeAcquireQueuedSpinLockAtCurrentIrql(&TestLock, &Node);
+        }
+
+        uint64_t Owner = __atomic_exchange_n(&TestOwner, Number, __ATOMIC_RELAXED);
+        if (Owner || TestLock.Owner != &Node) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                Owner,
+                Number,
+                (uint64_t)TestLock.Owner,
+                (uint64_t)&Node);
+        }
+
+        /* Not atomic on purpose; Any lost update means two processors were inside the lock. */
+        uint64_t Counter = TestCounter;
+        PauseProcessor();
+        TestCounter = Counter + 1;
+
+        Owner = __atomic_exchange_n(&TestOwner, 0, __ATOMIC_RELAXED);
+        if (Owner != Number) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Owner, Number, Counter, i);
+        }
+
+        KeReleaseQueuedSpinLockAtCurrentIrql(&TestLock);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function exercises the queued spin locks (debug builds only); It first checks the
+ *     uncontended paths on the current processor, and then has every processor fight over the same
+ *     lock, making sure no increment done inside the lock ever gets lost. This should be called
+ *     after all processors are online.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiTestQueuedSpinLocks(void) {
+    KeLockQueueNode First;
+    KeLockQueueNode Second;
+
+    /* Nobody else knows about the lock yet, so the try path should always succeed on the first
+     * attempt (and fail while we're still holding it). */
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    if (KeTestQueuedSpinLockAtCurrentIrql(&TestLock) ||
+        !KeTryAcquireQueuedSpinLockAtCurrentIrql(&TestLock, &First) ||
+        TestLock.Owner != &First || !KeTestQueuedSpinLockAtCurrentIrql(&TestLock) ||
+        KeTryAcquireQueuedSpinLockAtCurrentIrql(&TestLock, &Second)) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            (uint64_t)TestLock.Tail,
+            (uint64_t)TestLock.Owner,
+            (uint64_t)&First,
+            (uint64_t)&Second);
+    }
+
+    KeReleaseQueuedSpinLockAtCurrentIrql(&TestLock);
+    KeAcquireQueuedSpinLockAtCurrentIrql(&TestLock, &Second);
+    if (TestLock.Owner != &Second || TestLock.Tail != &Second) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            (uint64_t)TestLock.Tail,
+            (uint64_t)TestLock.Owner,
+            (uint64_t)&First,
+            (uint64_t)&Second);
+    }
+
+    KeReleaseQueuedSpinLockAtCurrentIrql(&TestLock);
+    KeLowerIrql(OldIrql);
+
+    TestCounter = 0;
+    KeRequestIpiRoutine(RunQueuedLockTest, NULL);
+
+    uint64_t Expected = (uint64_t)HalpOnlineProcessorCount * TEST_ITERATIONS;
+    if (TestCounter != Expected || KeTestQueuedSpinLockAtCurrentIrql(&TestLock)) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            TestCounter,
+            Expected,
+            (uint64_t)TestLock.Tail,
+            (uint64_t)TestLock.Owner);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function hammers either the self-test queued lock or a plain spin lock from one
+ *     processor, recording the worst case acquire latency. This runs on every processor at the
+ *     same time (at IPI IRQL), but only the first few processors take part.
+ *
+ * PARAMETERS:
+ *     Parameter - Benchmark parameters.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RunLockBenchmark(void *Parameter) {
+    BenchmarkParameters *Parameters = Parameter;
+    if (KeGetCurrentProcessor()->Number >= Parameters->Processors) {
+        return;
+    }
+
+    uint64_t MaxCycles = 0;
+    for (uint32_t i = 0; i < BENCHMARK_ACQUIRES; i++) {
+        KeLockQueueNode Node;
+
+        uint64_t Start = HalpGetTscTicks();
+        if (Parameters->Queued) {
+            KeAcquireQueuedSpinLockAtCurrentIrql(&TestLock, &Node);
+        } else {
+            KeAcquireSpinLockAtCurrentIrql(&BenchmarkLock);
+        }
+
+        uint64_t Cycles = HalpGetTscTicks() - Start;
+        if (Cycles > MaxCycles) {
+            MaxCycles = Cycles;
+        }
+
+        TestCounter++;
+
+        if (Parameters->Queued) {
+            KeReleaseQueuedSpinLockAtCurrentIrql(&TestLock);
+        } else {
+            KeReleaseSpinLockAtCurrentIrql(&BenchmarkLock);
+        }
+    }
+
+    uint64_t Current = __atomic_load_n(&BenchmarkMaxCycles, __ATOMIC_RELAXED);
+    while (Current < MaxCycles) {
+        if (__atomic_compare_exchange_n(
+                &BenchmarkMaxCycles,
+                &Current,
+                MaxCycles,
+                true,
+                __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function compares the queued spin locks against the plain (test-and-set) spin locks
+ *     under contention (debug builds only), from 2 processors up to every online processor. The
+ *     throughput and worst case acquire latency get printed (nothing fails). This should be called
+ *     after all processors are online.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void KiBenchmarkSpinLocks(void) {
+    if (HalpOnlineProcessorCount < 2) {
+        KdPrint(KD_TYPE_DEBUG, "lock benchmark: skipped (only one processor online)\n");
+        return;
+    }
+
+    for (uint32_t Processors = 2;; Processors *= 2) {
+        if (Processors > HalpOnlineProcessorCount) {
+            Processors = HalpOnlineProcessorCount;
+        }
+
+        for (int Queued = 0; Queued < 2; Queued++) {
+            BenchmarkParameters Parameters = {.Queued = Queued, .Processors = Processors};
+            TestCounter = 0;
+            BenchmarkMaxCycles = 0;
+
+            uint64_t Start = HalpGetTscTicks();
+            KeRequestIpiRoutine(RunLockBenchmark, &Parameters);
+            uint64_t Cycles = HalpGetTscTicks() - Start;
+
+            uint64_t Expected = (uint64_t)Processors * BENCHMARK_ACQUIRES;
+            if (TestCounter != Expected) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TestCounter, Expected, Queued, 0);
+            }
+
+            KdPrint(
+                KD_TYPE_DEBUG,
+                "lock benchmark (%u processors, %s): %llu cycles per acquire/release, %llu "
+                "cycles worst case acquire\n",
+                Processors,
+                Queued ? "queued" : "test-and-set",
+                Cycles / Expected,
+                BenchmarkMaxCycles);
+        }
+
+        if (Processors == HalpOnlineProcessorCount) {
+            break;
+        }
+    }
+}
+#endif /* NDEBUG */
@@ -44,6 +44,9 @@ static const char *Messages[] = {
     "MUTEX_RECURSION_LIMIT",
     "BAD_OBJECT_REFERENCE_COUNT",
     "THREAD_OWNS_MUTEX",
+    "SELF_TEST_FAILURE",
+    "NO_PAGES_AVAILABLE",
+    "TOO_MANY_WAIT_OBJECTS",
 };
 
 static KeSpinLock Lock = {0};
@@ -56,9 +56,11 @@ bool KeQueueWork(KeWork *Work, bool HighPriority) {
     }
 
     /* If we're not high priority, we'll be depending on the timer interrupt to periodically clean
-     * up the work queue, otherwise, we want to trigger a dispatch interrupt ASAP! */
+     * up the work queue, otherwise, we want to trigger a dispatch interrupt ASAP! The same goes if
+     * the tick is stopped (as the timer interrupt might not come for a while). */
+    bool NotifyProcessor = HighPriority || Processor->TickStopped;
     KeLowerIrql(OldIrql);
-    if (HighPriority) {
+    if (NotifyProcessor) {
         HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
     }
 
@@ -0,0 +1,448 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <kernel/ke.h>
+#include <kernel/mi.h>
+#include <kernel/mm.h>
+#include <os/containing_record.h>
+#include <rt/list.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t NextLookasideIndex = 0;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function runs the destructor for and returns a chain of objects back to the pool.
+ *
+ * PARAMETERS:
+ *     List - Which list the objects belong to.
+ *     ListHead - Chain of objects to release.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ReleaseObjects(MmLookasideList *List, RtSList *ListHead) {
+    while (ListHead->Next) {
+        MiLookasideHeader *Header =
+            CONTAINING_RECORD(RtPopSList(ListHead), MiLookasideHeader, ListHeader);
+        if (List->Destructor) {
+            List->Destructor(Header + 1);
+        }
+
+        MmFreePool(Header, List->Tag);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function moves objects from the current processor's magazine into the shared depot,
+ *     releasing anything that doesn't fit in the depot back to the pool. We expect to be called at
+ *     DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     List - Which list the magazine belongs to.
+ *     Magazine - Current processor's magazine.
+ *     Count - How many objects to move out of the magazine.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FlushMagazine(MmLookasideList *List, MmLookasideMagazine *Magazine, uint32_t Count) {
+    RtSList ReleaseListHead = {0};
+    uint32_t DepotLimit = List->Depth * MI_LOOKASIDE_DEPOT_SCALE;
+
+    KeAcquireSpinLockAtCurrentIrql(&List->DepotLock);
+    while (Count-- && Magazine->ListHead.Next) {
+        RtSList *ListHeader = RtPopSList(&Magazine->ListHead);
+        Magazine->Count--;
+
+        if (List->DepotCount < DepotLimit) {
+            RtPushSList(&List->DepotListHead, ListHeader);
+            List->DepotCount++;
+        } else {
+            RtPushSList(&ReleaseListHead, ListHeader);
+        }
+    }
+
+    KeReleaseSpinLockAtCurrentIrql(&List->DepotLock);
+    ReleaseObjects(List, &ReleaseListHead);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function grabs a batch of objects from the shared depot into the current processor's
+ *     magazine. We expect to be called at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     List - Which list the magazine belongs to.
+ *     Magazine - Current processor's magazine.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RefillMagazine(MmLookasideList *List, MmLookasideMagazine *Magazine) {
+    /* Only take half of our depth, so that the next few frees don't immediately overflow the
+     * magazine back into the depot. */
+    uint32_t Count = Magazine->Depth >> 1;
+    if (!Count) {
+        Count = 1;
+    }
+
+    KeAcquireSpinLockAtCurrentIrql(&List->DepotLock);
+    while (Count-- && List->DepotListHead.Next) {
+        RtPushSList(&Magazine->ListHead, RtPopSList(&List->DepotListHead));
+        List->DepotCount--;
+        Magazine->Count++;
+    }
+
+    KeReleaseSpinLockAtCurrentIrql(&List->DepotLock);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function adjusts the depth of the current processor's magazine based on how often we
+ *     had to go to the depot (or the pool) in the last interval, and on how much of the magazine
+ *     was actually used. We expect to be called at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     List - Which list the magazine belongs to.
+ *     Magazine - Current processor's magazine.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void AdjustMagazine(MmLookasideList *List, MmLookasideMagazine *Magazine) {
+    /* Missing often means the magazine is too small for how hot this list is; Never missing while
+     * at least half of the magazine sat unused for the whole interval means we're holding onto
+     * more objects than we need (checking only for the misses would make a working set that
+     * exactly fits the magazine bounce between two depths forever). */
+    if (Magazine->Misses > Magazine->Allocations >> MI_LOOKASIDE_GROW_MISS_SHIFT) {
+        if (Magazine->Depth < MI_LOOKASIDE_MAX_DEPTH) {
+            Magazine->Depth <<= 1;
+        }
+    } else if (!Magazine->Misses && Magazine->LowCount >= Magazine->Depth >> 1 &&
+               Magazine->Depth > MI_LOOKASIDE_MIN_DEPTH) {
+        Magazine->Depth >>= 1;
+        if (Magazine->Count > Magazine->Depth) {
+            FlushMagazine(List, Magazine, Magazine->Count - Magazine->Depth);
+        }
+    }
+
+    Magazine->Allocations = 0;
+    Magazine->Misses = 0;
+    Magazine->LowCount = Magazine->Count;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the current processor's magazine for the given list (initializing it if
+ *     this is the first time this processor uses the list). We expect to be called at DISPATCH
+ *     IRQL.
+ *
+ * PARAMETERS:
+ *     List - Which list we want the magazine of.
+ *
+ * RETURN VALUE:
+ *     Pointer to the magazine, or NULL if we ran out of magazine slots for this list.
+ *-----------------------------------------------------------------------------------------------*/
+static MmLookasideMagazine *GetMagazine(MmLookasideList *List) {
+    if (List->Index >= MM_LOOKASIDE_LIST_COUNT) {
+        return NULL;
+    }
+
+    MmLookasideMagazine *Magazine = &KeGetCurrentProcessor()->LookasideMagazines[List->Index];
+    if (!Magazine->Depth) {
+        Magazine->Depth = List->Depth;
+    }
+
+    return Magazine;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function creates a new cache of fixed size objects. Lists are meant to live as long
+ *     as the system does, so there is no way to delete them.
+ *
+ * PARAMETERS:
+ *     Size - Size of each object.
+ *     Tag - Name/identifier to be attached to the objects (in the pool).
+ *     Depth - How many free objects each processor should initially cache; This will be adjusted
+ *             automatically based on how often the cache misses.
+ *     Constructor - Optional; Routine to run once when the object is first allocated from the
+ *                   pool (if this is not set, the objects will be cleared on every allocation
+ *                   instead).
+ *     Destructor - Optional; Routine to run before the object is returned to the pool. This might
+ *                  be called at DISPATCH IRQL.
+ *
+ * RETURN VALUE:
+ *     Pointer to the list, or NULL if we failed to allocate it.
+ *-----------------------------------------------------------------------------------------------*/
+MmLookasideList *MmCreateLookasideList(
+    size_t Size,
+    const char Tag[4],
+    uint32_t Depth,
+    void (*Constructor)(void *),
+    void (*Destructor)(void *)) {
+    MmLookasideList *List = MmAllocatePool(sizeof(MmLookasideList), MM_POOL_TAG_POOL);
+    if (!List) {
+        return NULL;
+    }
+
+    if (Depth < MI_LOOKASIDE_MIN_DEPTH) {
+        Depth = MI_LOOKASIDE_MIN_DEPTH;
+    } else if (Depth > MI_LOOKASIDE_MAX_DEPTH) {
+        Depth = MI_LOOKASIDE_MAX_DEPTH;
+    }
+
+    /* Lists past the magazine limit still work, but they'll only have the (locked) depot. */
+    List->Size = Size;
+    memcpy(List->Tag, Tag, 4);
+    List->Index = __atomic_fetch_add(&NextLookasideIndex, 1, __ATOMIC_RELAXED);
+    List->Depth = Depth;
+    List->Constructor = Constructor;
+    List->Destructor = Destructor;
+    return List;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates an object from the given lookaside list.
+ *
+ * PARAMETERS:
+ *     List - Which list to allocate from.
+ *
+ * RETURN VALUE:
+ *     Pointer to the object (either cleared or in the state the constructor left it), or NULL if
+ *     the cache was empty and we failed to allocate a new one.
+ *-----------------------------------------------------------------------------------------------*/
+void *MmAllocateFromLookasideList(MmLookasideList *List) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    MmLookasideMagazine *Magazine = GetMagazine(List);
+    RtSList *ListHeader = NULL;
+
+    /* The magazine is only ever touched by its own processor (and we're at DISPATCH), so this
+     * doesn't need any locks unless we need to go to the depot. */
+    if (Magazine) {
+        Magazine->Allocations++;
+        if (!Magazine->ListHead.Next) {
+            Magazine->Misses++;
+            RefillMagazine(List, Magazine);
+        }
+
+        ListHeader = RtPopSList(&Magazine->ListHead);
+        if (ListHeader) {
+            Magazine->Count--;
+        }
+
+        if (Magazine->Count < Magazine->LowCount) {
+            Magazine->LowCount = Magazine->Count;
+        }
+
+        if (Magazine->Allocations >= MI_LOOKASIDE_ADJUST_INTERVAL) {
+            AdjustMagazine(List, Magazine);
+        }
+    } else {
+        KeAcquireSpinLockAtCurrentIrql(&List->DepotLock);
+        ListHeader = RtPopSList(&List->DepotListHead);
+        if (ListHeader) {
+            List->DepotCount--;
+        }
+
+        KeReleaseSpinLockAtCurrentIrql(&List->DepotLock);
+    }
+
+    KeLowerIrql(OldIrql);
+
+    if (ListHeader) {
+        MiLookasideHeader *Header = CONTAINING_RECORD(ListHeader, MiLookasideHeader, ListHeader);
+        if (!List->Constructor) {
+            memset(Header + 1, 0, List->Size);
+        }
+
+        return Header + 1;
+    }
+
+    /* Nothing cached anywhere, fallback to the pool (which already clears the memory). */
+    MiLookasideHeader *Header = MmAllocatePool(sizeof(MiLookasideHeader) + List->Size, List->Tag);
+    if (!Header) {
+        return NULL;
+    }
+
+    Header->List = List;
+    if (List->Constructor) {
+        List->Constructor(Header + 1);
+    }
+
+    return Header + 1;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns an object back to the lookaside list it was allocated from.
+ *
+ * PARAMETERS:
+ *     List - Which list the object was allocated from.
+ *     Base - Start of the object.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MmFreeToLookasideList(MmLookasideList *List, void *Base) {
+    MiLookasideHeader *Header = (MiLookasideHeader *)Base - 1;
+    if (Header->List != List || Header->ListHeader.Next) {
+        KeFatalError(
+            KE_PANIC_BAD_POOL_HEADER,
+            (uint64_t)Base,
+            (uint64_t)Header->List,
+            (uint64_t)List,
+            *(uint32_t *)List->Tag);
+    }
+
+    /* Don't cache anything if we're low on memory (same as the pool itself). */
+    RtSList ReleaseListHead = {0};
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    MmLookasideMagazine *Magazine = GetMagazine(List);
+    if (__atomic_load_n(&MiTotalFreePages, __ATOMIC_RELAXED) < MiPoolTrimWatermark) {
+        RtPushSList(&ReleaseListHead, &Header->ListHeader);
+    } else if (Magazine) {
+        /* Make space by moving half of the magazine into the depot (so that we don't bounce
+         * between the magazine and the depot on every alloc/free pair). */
+        if (Magazine->Count >= Magazine->Depth) {
+            FlushMagazine(List, Magazine, (Magazine->Depth + 1) >> 1);
+        }
+
+        RtPushSList(&Magazine->ListHead, &Header->ListHeader);
+        Magazine->Count++;
+    } else {
+        KeAcquireSpinLockAtCurrentIrql(&List->DepotLock);
+        if (List->DepotCount < List->Depth * MI_LOOKASIDE_DEPOT_SCALE) {
+            RtPushSList(&List->DepotListHead, &Header->ListHeader);
+            List->DepotCount++;
+        } else {
+            RtPushSList(&ReleaseListHead, &Header->ListHeader);
+        }
+
+        KeReleaseSpinLockAtCurrentIrql(&List->DepotLock);
+    }
+
+    KeLowerIrql(OldIrql);
+    ReleaseObjects(List, &ReleaseListHead);
+}
+
+#ifndef NDEBUG
+#define TEST_WORKING_SET 64
+
+static uint32_t TestConstructed = 0;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function counts how many objects the self-test list had to get from the pool.
+ *
+ * PARAMETERS:
+ *     Base - Object being constructed.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ConstructTestObject(void *Base) {
+    (void)Base;
+    TestConstructed++;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates and frees a working set of objects from the self-test list a few
+ *     times, counting how many allocations were served straight from the magazine.
+ *
+ * PARAMETERS:
+ *     List - Self-test list.
+ *     WorkingSet - How many objects to keep allocated at the same time.
+ *     Rounds - How many times to allocate and free the whole working set.
+ *
+ * RETURN VALUE:
+ *     How many allocations hit the magazine.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t RunTestRounds(MmLookasideList *List, uint32_t WorkingSet, uint32_t Rounds) {
+    MmLookasideMagazine *Magazine = &KeGetCurrentProcessor()->LookasideMagazines[List->Index];
+    void *Objects[TEST_WORKING_SET];
+    uint32_t Hits = 0;
+
+    for (uint32_t Round = 0; Round < Rounds; Round++) {
+        for (uint32_t i = 0; i < WorkingSet; i++) {
+            Hits += Magazine->Count != 0;
+            Objects[i] = MmAllocateFromLookasideList(List);
+            if (!Objects[i]) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Round, i, WorkingSet, 0);
+            }
+        }
+
+        for (uint32_t i = 0; i < WorkingSet; i++) {
+            MmFreeToLookasideList(List, Objects[i]);
+        }
+    }
+
+    return Hits;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function tests the magazine hit rates (debug builds only): A working set that fits the
+ *     initial depth should always hit after the first round, a bigger one should grow the magazine
+ *     until at most 1/8 of the allocations miss, and a tiny one should shrink it back down. The
+ *     test list gives its magazine slot back at the end, so this should be called before anyone
+ *     else can create a list (and before the other processors are up).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTestLookasideList(void) {
+    MmLookasideList *List = MmCreateLookasideList(32, MM_POOL_TAG_POOL, 0, ConstructTestObject, NULL);
+    if (!List || List->Index >= MM_LOOKASIDE_LIST_COUNT) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)List, NextLookasideIndex, 0, 0);
+    }
+
+    MmLookasideMagazine *Magazine = &KeGetCurrentProcessor()->LookasideMagazines[List->Index];
+
+    /* The first round can only come from the pool, but after that, everything should be sitting
+     * in the magazine. */
+    uint32_t Hits = RunTestRounds(List, MI_LOOKASIDE_MIN_DEPTH, 1);
+    if (Hits || TestConstructed != MI_LOOKASIDE_MIN_DEPTH) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, MI_LOOKASIDE_MIN_DEPTH, Hits, TestConstructed, 0);
+    }
+
+    Hits = RunTestRounds(List, MI_LOOKASIDE_MIN_DEPTH, 64);
+    if (Hits != MI_LOOKASIDE_MIN_DEPTH * 64 || TestConstructed != MI_LOOKASIDE_MIN_DEPTH) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, MI_LOOKASIDE_MIN_DEPTH, Hits, TestConstructed, 1);
+    }
+
+    /* A bigger working set should make the magazine grow; Give it a few adjustment intervals to
+     * settle, and then the miss rate should stay under the growth threshold. */
+    RunTestRounds(List, TEST_WORKING_SET, 64);
+    Hits = RunTestRounds(List, TEST_WORKING_SET, 16);
+    uint32_t Allocations = TEST_WORKING_SET * 16;
+    if (Magazine->Depth <= MI_LOOKASIDE_MIN_DEPTH ||
+        Allocations - Hits > Allocations >> MI_LOOKASIDE_GROW_MISS_SHIFT) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TEST_WORKING_SET, Hits, Magazine->Depth, 0);
+    }
+
+    /* And once the list goes almost idle, the magazine should shrink back to the minimum depth
+     * (giving back what it no longer needs). */
+    RunTestRounds(List, 1, MI_LOOKASIDE_ADJUST_INTERVAL * 8);
+    if (Magazine->Depth != MI_LOOKASIDE_MIN_DEPTH || Magazine->Count > Magazine->Depth) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 1, Magazine->Depth, Magazine->Count, 0);
+    }
+
+    /* Lists can't usually be deleted, but nobody else knows about this one, so we can release
+     * everything and give its magazine slot back. */
+    ReleaseObjects(List, &Magazine->ListHead);
+    ReleaseObjects(List, &List->DepotListHead);
+    memset(Magazine, 0, sizeof(MmLookasideMagazine));
+    __atomic_store_n(&NextLookasideIndex, List->Index, __ATOMIC_RELAXED);
+    MmFreePool(List, MM_POOL_TAG_POOL);
+}
+#endif /* NDEBUG */
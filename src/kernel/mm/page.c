@@ -1,11 +1,15 @@
 /* SPDX-FileCopyrightText: (C) 2023-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <crt_impl/rand.h>
 #include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/ki.h>
 #include <kernel/mi.h>
 #include <kernel/mm.h>
+#include <kernel/ob.h>
+#include <kernel/ps.h>
 #include <os/containing_record.h>
 #include <rt/list.h>
 #include <stddef.h>
@@ -13,11 +17,20 @@
 #include <string.h>
 
 static RtDList *LoaderDescriptors = NULL;
+static uint32_t FreeAreaListHead[MI_PAGE_ZONE_COUNT][MI_PAGE_ORDER_COUNT];
+static uint32_t FreeAreaListTail[MI_PAGE_ZONE_COUNT][MI_PAGE_ORDER_COUNT];
+static uint64_t PageCount = 0;
+
+static const uint64_t ZoneLimit[MI_PAGE_ZONE_COUNT] = {
+    [MI_PAGE_ZONE_DMA] = MI_PAGE_ZONE_DMA_LIMIT,
+    [MI_PAGE_ZONE_DMA32] = MI_PAGE_ZONE_DMA32_LIMIT,
+    [MI_PAGE_ZONE_NORMAL] = UINT64_MAX,
+};
 
 RtDList MiMemoryDescriptorListHead;
 MiPageEntry *MiPageList = NULL;
-RtSList MiFreePageListHead;
-KeSpinLock MiPageListLock = {0};
+uint64_t MiFreeAreaBlocks[MI_PAGE_ORDER_COUNT] = {0};
+KeQueuedSpinLock MiPageListLock = {0};
 uint64_t MiTotalManagedPages = 0;
 uint64_t MiTotalUnmanagedPages = 0;
 uint64_t MiTotalReservedPages = 0;
@@ -29,7 +42,8 @@ uint64_t MiTotalGraphicsPages = 0;
 uint64_t MiTotalPtePages = 0;
 uint64_t MiTotalPfnPages = 0;
 uint64_t MiTotalPoolPages = 0;
-static uint64_t MiPageCount = 0;
+uint64_t MiTotalZeroedPages = 0;
+uint64_t MiZeroedBytesOffloaded = 0;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -54,6 +68,306 @@ static uint64_t GetLowReservedPages(MiMemoryDescriptor *Entry) {
     return EndPage - Entry->BasePage;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds which zone a page belongs to. Zone limits are aligned to the biggest
+ *     block size, so a block never crosses zones (and the buddy never needs to check for it).
+ *
+ * PARAMETERS:
+ *     Page - Page index.
+ *
+ * RETURN VALUE:
+ *     Zone index.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t GetZone(uint64_t Page) {
+    uint32_t Zone = MI_PAGE_ZONE_DMA;
+    while (Page >= ZoneLimit[Zone]) {
+        Zone++;
+    }
+
+    return Zone;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function counts how many pages inside a (not yet inserted) block have already been
+ *     cleared by the zero page thread.
+ *
+ * PARAMETERS:
+ *     Page - Page index of the first page in the block.
+ *     Order - Power-of-two size of the block (in pages).
+ *
+ * RETURN VALUE:
+ *     How many zeroed pages the block has.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t CountZeroedPages(uint64_t Page, uint32_t Order) {
+    uint32_t ZeroedPages = 0;
+    for (uint64_t i = 0; i < 1ull << Order; i++) {
+        ZeroedPages += MiPageList[Page + i].Zeroed;
+    }
+
+    return ZeroedPages;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function inserts a free block into the free area list of its zone and order. Blocks
+ *     with dirty pages go to the head of the list, while fully zeroed blocks go to the tail, so
+ *     that we can find either kind without walking the list. The page list lock is expected to be
+ *     held by the caller.
+ *
+ * PARAMETERS:
+ *     Page - Page index of the first page in the block.
+ *     Order - Power-of-two size of the block (in pages).
+ *     ZeroedPages - How many pages inside the block are already zeroed.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void InsertFreeBlock(uint64_t Page, uint32_t Order, uint32_t ZeroedPages) {
+    uint32_t Zone = GetZone(Page);
+    MiPageEntry *Entry = &MiPageList[Page];
+
+#ifndef NDEBUG
+    /* Debug builds validate the whole block instead of only its head; A misaligned block, or a
+     * page in use inside a free block, means someone corrupted the PFN database (or freed pages
+     * twice). */
+    for (uint64_t i = 0; i < 1ull << Order; i++) {
+        if ((Page & ((1ull << Order) - 1)) || Entry[i].Used || Entry[i].PoolItem ||
+            Entry[i].FreeBlock) {
+            KeFatalError(KE_PANIC_BAD_PFN_HEADER, MI_PAGE_BASE(&Entry[i]), Entry[i].Flags, 0, 0);
+        }
+    }
+
+    if (ZeroedPages != CountZeroedPages(Page, Order)) {
+        KeFatalError(KE_PANIC_BAD_PFN_HEADER, MI_PAGE_BASE(Entry), Entry->Flags, ZeroedPages, 0);
+    }
+#endif /* NDEBUG */
+
+    Entry->FreeBlock = 1;
+    Entry->Order = Order;
+    Entry->ZeroedPages = ZeroedPages;
+
+    /* The links are page indices instead of pointers (this is what keeps the page entry at 24
+     * bytes), so we need to patch up the neighbours by hand. */
+    uint32_t *ListHead = &FreeAreaListHead[Zone][Order];
+    uint32_t *ListTail = &FreeAreaListTail[Zone][Order];
+    if (ZeroedPages == 1u << Order) {
+        Entry->NextFree = MI_PAGE_LIST_END;
+        Entry->PreviousFree = *ListTail;
+        if (*ListTail != MI_PAGE_LIST_END) {
+            MiPageList[*ListTail].NextFree = Page;
+        } else {
+            *ListHead = Page;
+        }
+
+        *ListTail = Page;
+    } else {
+        Entry->NextFree = *ListHead;
+        Entry->PreviousFree = MI_PAGE_LIST_END;
+        if (*ListHead != MI_PAGE_LIST_END) {
+            MiPageList[*ListHead].PreviousFree = Page;
+        } else {
+            *ListTail = Page;
+        }
+
+        *ListHead = Page;
+    }
+
+    MiFreeAreaBlocks[Order]++;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function removes a free block from the free area list it currently lives in. The page
+ *     list lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Entry - Page entry for the first page in the block.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RemoveFreeBlock(MiPageEntry *Entry) {
+    uint32_t Zone = GetZone(Entry - MiPageList);
+
+    if (Entry->PreviousFree != MI_PAGE_LIST_END) {
+        MiPageList[Entry->PreviousFree].NextFree = Entry->NextFree;
+    } else {
+        FreeAreaListHead[Zone][Entry->Order] = Entry->NextFree;
+    }
+
+    if (Entry->NextFree != MI_PAGE_LIST_END) {
+        MiPageList[Entry->NextFree].PreviousFree = Entry->PreviousFree;
+    } else {
+        FreeAreaListTail[Zone][Entry->Order] = Entry->PreviousFree;
+    }
+
+    MiFreeAreaBlocks[Entry->Order]--;
+    Entry->FreeBlock = 0;
+    Entry->Order = 0;
+    Entry->ZeroedPages = 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns a naturally aligned block to the buddy allocator, merging it with its
+ *     buddy for as long as the buddy is also a free block of the same order. Zeroed and dirty
+ *     blocks merge just the same (the per-page zeroed bit is what survives the merge). The page
+ *     list lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Page - Page index of the first page in the block.
+ *     Order - Power-of-two size of the block (in pages).
+ *     ZeroedPages - How many pages inside the block are already zeroed.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FreeBlock(uint64_t Page, uint32_t Order, uint32_t ZeroedPages) {
+    while (Order < MI_PAGE_MAX_ORDER) {
+        uint64_t BuddyPage = Page ^ (1ull << Order);
+        if (BuddyPage >= PageCount) {
+            break;
+        }
+
+        /* Only the head of a free block has FreeBlock set, so anything else (used pages, pages
+         * sitting in a processor cache, or the inside of a bigger block) stops the merge. */
+        MiPageEntry *Buddy = &MiPageList[BuddyPage];
+        if (!Buddy->FreeBlock || Buddy->Order != Order) {
+            break;
+        }
+
+        ZeroedPages += Buddy->ZeroedPages;
+        RemoveFreeBlock(Buddy);
+        Page &= ~(1ull << Order);
+        Order++;
+    }
+
+    InsertFreeBlock(Page, Order, ZeroedPages);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns an arbitrary range of pages to the buddy allocator, splitting it into
+ *     the largest naturally aligned blocks possible. The page list lock is expected to be held by
+ *     the caller.
+ *
+ * PARAMETERS:
+ *     StartPage - First page of the range.
+ *     EndPage - Page right after the end of the range.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FreeRange(uint64_t StartPage, uint64_t EndPage) {
+    while (StartPage < EndPage) {
+        uint32_t Order = MI_PAGE_MAX_ORDER;
+        if (StartPage && (uint32_t)__builtin_ctzll(StartPage) < Order) {
+            Order = __builtin_ctzll(StartPage);
+        }
+
+        while ((1ull << Order) > EndPage - StartPage) {
+            Order--;
+        }
+
+        FreeBlock(StartPage, Order, CountZeroedPages(StartPage, Order));
+        StartPage += 1ull << Order;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function takes a block of the given order out of the buddy allocator, splitting a
+ *     larger block if required. When splitting, we keep whichever half has dirty pages, so that
+ *     zeroed pages stay in the free lists for as long as possible. The page list lock is expected
+ *     to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Order - Power-of-two size of the block (in pages).
+ *     LimitPage - The block must end at or before this page; Only zones that end before this
+ *                 page get used, so this is effectively rounded down to a zone limit.
+ *     Type - MI_BLOCK_ANY to prefer dirty blocks (but take zeroed ones as well), MI_BLOCK_DIRTY
+ *            to only take blocks with at least one dirty page, or MI_BLOCK_ZEROED to only take
+ *            fully zeroed blocks.
+ *     Zeroed - Output; Set to true if all pages in the block are zeroed.
+ *
+ * RETURN VALUE:
+ *     Page entry for the first page of the block, or NULL if no block fits.
+ *-----------------------------------------------------------------------------------------------*/
+static MiPageEntry *AllocateBlock(uint32_t Order, uint64_t LimitPage, int Type, bool *Zeroed) {
+    /* Try the highest zone first, so that low memory is kept for whoever actually needs it. We
+     * never look inside a zone that crosses the limit (that would need a walk through the whole
+     * free list). */
+    for (uint32_t Zone = MI_PAGE_ZONE_COUNT; Zone-- > 0;) {
+        uint64_t ZoneEnd = ZoneLimit[Zone] < PageCount ? ZoneLimit[Zone] : PageCount;
+        if (ZoneEnd > LimitPage) {
+            continue;
+        }
+
+        for (uint32_t CurrentOrder = Order; CurrentOrder <= MI_PAGE_MAX_ORDER; CurrentOrder++) {
+            /* Dirty blocks live at the head and zeroed ones at the tail, so looking at a single
+             * entry is enough to know if the list has what we want. */
+            uint32_t Page = Type == MI_BLOCK_ZEROED ? FreeAreaListTail[Zone][CurrentOrder]
+                                                    : FreeAreaListHead[Zone][CurrentOrder];
+            if (Page == MI_PAGE_LIST_END) {
+                continue;
+            }
+
+            uint32_t ZeroedPages = MiPageList[Page].ZeroedPages;
+            bool FullyZeroed = ZeroedPages == 1u << CurrentOrder;
+            if ((Type == MI_BLOCK_DIRTY && FullyZeroed) ||
+                (Type == MI_BLOCK_ZEROED && !FullyZeroed)) {
+                continue;
+            }
+
+            RemoveFreeBlock(&MiPageList[Page]);
+            while (CurrentOrder > Order) {
+                CurrentOrder--;
+
+                /* Mixed blocks are the only ones where we need to actually look at the pages to
+                 * know how the zeroed pages are split between the halves. */
+                uint32_t HalfPages = 1u << CurrentOrder;
+                uint32_t LowZeroedPages = 0;
+                if (ZeroedPages == 2 * HalfPages) {
+                    LowZeroedPages = HalfPages;
+                } else if (ZeroedPages) {
+                    LowZeroedPages = CountZeroedPages(Page, CurrentOrder);
+                }
+
+                uint32_t HighZeroedPages = ZeroedPages - LowZeroedPages;
+                if (LowZeroedPages == HalfPages && HighZeroedPages < HalfPages) {
+                    InsertFreeBlock(Page, CurrentOrder, LowZeroedPages);
+                    Page += HalfPages;
+                    ZeroedPages = HighZeroedPages;
+                } else {
+                    InsertFreeBlock(Page + HalfPages, CurrentOrder, HighZeroedPages);
+                    ZeroedPages = LowZeroedPages;
+                }
+            }
+
+            /* Whatever we hand out isn't free anymore, so the zeroed bits need to go away (the
+             * caller gets told if it can skip clearing the pages). */
+            MiPageEntry *Entry = &MiPageList[Page];
+            if (ZeroedPages) {
+                for (uint64_t i = 0; i < 1ull << Order; i++) {
+                    Entry[i].Zeroed = 0;
+                }
+
+                __atomic_sub_fetch(&MiTotalZeroedPages, ZeroedPages, __ATOMIC_RELAXED);
+            }
+
+            if (Zeroed) {
+                *Zeroed = ZeroedPages == 1u << Order;
+            }
+
+            return Entry;
+        }
+    }
+
+    return NULL;
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function allocates a given amount of contiguous pages directly from the osloader
@@ -198,6 +512,13 @@ void MiInitializePageAllocator(void) {
         }
     }
 
+    /* The free lists link pages by their 32-bit index, so anything past that can't be managed (this
+     * only matters past 16TiB of physical memory). */
+    if (MaxAddressablePage > MI_PAGE_LIST_END) {
+        KdPrint(KD_TYPE_ERROR, "ignoring physical memory above 16TiB\n");
+        MaxAddressablePage = MI_PAGE_LIST_END;
+    }
+
     /* Grab some physical memory and map it for the PFN database. This should be the last place we
      * need EarlyAllocatePages. */
     if (!MaxAddressablePage || MaxAddressablePage > UINT64_MAX / sizeof(MiPageEntry)) {
@@ -241,7 +562,7 @@ void MiInitializePageAllocator(void) {
     }
 
     MiPageList = (void *)MI_PFN_START;
-    MiPageCount = MaxAddressablePage;
+    PageCount = MaxAddressablePage;
     MiTotalPfnPages = Pages;
 
     /* Setup the page allocator (marking the free pages as free). */
@@ -250,6 +571,13 @@ void MiInitializePageAllocator(void) {
         MiPageList[Page].Used = 1;
     }
 
+    for (int Zone = 0; Zone < MI_PAGE_ZONE_COUNT; Zone++) {
+        for (int Order = 0; Order < MI_PAGE_ORDER_COUNT; Order++) {
+            FreeAreaListHead[Zone][Order] = MI_PAGE_LIST_END;
+            FreeAreaListTail[Zone][Order] = MI_PAGE_LIST_END;
+        }
+    }
+
     for (RtDList *ListHeader = LoaderDescriptors->Next; ListHeader != LoaderDescriptors;
          ListHeader = ListHeader->Next) {
         MiMemoryDescriptor *Entry = CONTAINING_RECORD(ListHeader, MiMemoryDescriptor, ListHeader);
@@ -263,10 +591,15 @@ void MiInitializePageAllocator(void) {
 
         uint64_t StartPage = Entry->BasePage < 0x10 ? 0x10 : Entry->BasePage;
         uint64_t EndPage = Entry->BasePage + Entry->PageCount;
+        if (EndPage > PageCount) {
+            EndPage = StartPage > PageCount ? StartPage : PageCount;
+        }
+
         for (uint64_t Page = StartPage; Page < EndPage; Page++) {
             MiPageList[Page].Used = 0;
-            RtPushSList(&MiFreePageListHead, &MiPageList[Page].ListHeader);
         }
+
+        FreeRange(StartPage, EndPage);
     }
 
     /* We're forced to initialize the pool trackers before continuing (or we'll crash when trying to
@@ -321,6 +654,10 @@ void MiReleaseBootRegions(void) {
 
         uint64_t StartPage = Entry->BasePage < 0x10 ? 0x10 : Entry->BasePage;
         uint64_t EndPage = Entry->BasePage + Entry->PageCount;
+        if (EndPage > PageCount) {
+            EndPage = StartPage > PageCount ? StartPage : PageCount;
+        }
+
         for (uint64_t Page = StartPage; Page < EndPage; Page++) {
             MiPageEntry *PageEntry = &MiPageList[Page];
             if (!PageEntry->Used || PageEntry->PoolItem || PageEntry->PoolBase) {
@@ -329,9 +666,14 @@ void MiReleaseBootRegions(void) {
             }
 
             PageEntry->Used = 0;
-            RtPushSList(&MiFreePageListHead, &PageEntry->ListHeader);
         }
 
+        KeLockQueueNode LockNode;
+        KeIrql OldIrql =
+            KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+        FreeRange(StartPage, EndPage);
+        KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+
         uint64_t ReleasedPages = EndPage - StartPage;
         MiTotalUsedPages -= ReleasedPages;
         MiTotalFreePages += ReleasedPages;
@@ -358,23 +700,28 @@ uint64_t MmAllocateSinglePage() {
     /* Trigger a cache refill if it's the first allocation we're doing (or if we dropped below the
      * lower limit). */
     if (Processor->FreePageListSize < MI_PROCESSOR_PAGE_CACHE_MIN_SIZE) {
-        KeAcquireSpinLockAtCurrentIrql(&MiPageListLock);
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&MiPageListLock, &LockNode);
 
         for (int i = 0; i < MI_PROCESSOR_PAGE_CACHE_BATCH_SIZE; i++) {
-            RtSList *ListHeader = RtPopSList(&MiFreePageListHead);
-            if (!ListHeader) {
+            /* Only the first order-0 allocation should need to split a block; the remaining
+             * halves stay at the head of the lower order lists for the next iterations. Dirty
+             * pages get used first, but pre-zeroed pages are still free pages (so we'll dip into
+             * them before failing). */
+            MiPageEntry *Entry = AllocateBlock(0, UINT64_MAX, MI_BLOCK_ANY, NULL);
+            if (!Entry) {
                 break;
             }
 
             /* The main allocation path is expected to check for the validity of the pages it pops,
              * so we just add them to the list here. */
-            RtPushSList(&Processor->FreePageListHead, ListHeader);
+            RtPushSList(&Processor->FreePageListHead, &Entry->ListHeader);
             Processor->FreePageListSize++;
             __atomic_add_fetch(&MiTotalCachedPages, 1, __ATOMIC_RELAXED);
             __atomic_sub_fetch(&MiTotalFreePages, 1, __ATOMIC_RELAXED);
         }
 
-        KeReleaseSpinLockAtCurrentIrql(&MiPageListLock);
+        KeReleaseQueuedSpinLockAtCurrentIrql(&MiPageListLock);
     }
 
     /* Now we should just be able to pop from the local cache (if that fails, the system is out of
@@ -392,7 +739,7 @@ uint64_t MmAllocateSinglePage() {
 
     /* Make sure the flags make sense (if not, we probably have a corrupted PFN free list). */
     MiPageEntry *Entry = CONTAINING_RECORD(ListHeader, MiPageEntry, ListHeader);
-    if (Entry->Used || Entry->PoolItem) {
+    if (Entry->Used || Entry->PoolItem || Entry->FreeBlock || Entry->Zeroed) {
         KeFatalError(KE_PANIC_BAD_PFN_HEADER, MI_PAGE_BASE(Entry), Entry->Flags, 0, 0);
     }
 
@@ -431,11 +778,571 @@ void MmFreeSinglePage(uint64_t PhysicalAddress) {
         return;
     }
 
-    /* Otherwise, append the page to the global free page list (we do need the global lock for
+    /* Otherwise, give the page back to the buddy allocator (we do need the global lock for
      * this). */
-    KeAcquireSpinLockAtCurrentIrql(&MiPageListLock);
-    RtPushSList(&MiFreePageListHead, &Entry->ListHeader);
-    KeReleaseSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&MiPageListLock, &LockNode);
+    FreeBlock(Entry - MiPageList, 0, 0);
+    KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
     __atomic_sub_fetch(&MiTotalUsedPages, 1, __ATOMIC_RELAXED);
     __atomic_add_fetch(&MiTotalFreePages, 1, __ATOMIC_RELAXED);
 }
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function tries allocating a physically contiguous range of pages.
+ *
+ * PARAMETERS:
+ *     Count - How many pages we need.
+ *     Alignment - Required alignment (in bytes) of the physical base address; This should be a
+ *                 power of two, and anything below the page size is treated as page alignment.
+ *     MaxAddress - Highest physical address the range may touch, or 0 for no limit; This gets
+ *                  rounded down to the nearest zone limit (16MiB or 4GiB).
+ *
+ * RETURN VALUE:
+ *     Physical address of the first page, or 0 on failure.
+ *-----------------------------------------------------------------------------------------------*/
+uint64_t MmAllocateContiguousPages(uint64_t Count, uint64_t Alignment, uint64_t MaxAddress) {
+    if (!Count || Count > (1ull << MI_PAGE_MAX_ORDER) || (Alignment & (Alignment - 1))) {
+        return 0;
+    }
+
+    /* Buddy blocks are naturally aligned to their own size, so the alignment just becomes a
+     * lower bound for the order we need to allocate. */
+    uint32_t Order = 0;
+    while ((1ull << Order) < Count) {
+        Order++;
+    }
+
+    if (Alignment > MM_PAGE_SIZE) {
+        uint32_t AlignmentOrder = __builtin_ctzll(Alignment) - MM_PAGE_SHIFT;
+        if (AlignmentOrder > MI_PAGE_MAX_ORDER) {
+            return 0;
+        } else if (AlignmentOrder > Order) {
+            Order = AlignmentOrder;
+        }
+    }
+
+    uint64_t LimitPage = UINT64_MAX;
+    if (MaxAddress) {
+        LimitPage = (MaxAddress >> MM_PAGE_SHIFT) + 1;
+    }
+
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+    MiPageEntry *Entry = AllocateBlock(Order, LimitPage, MI_BLOCK_ANY, NULL);
+    if (!Entry) {
+        KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+        return 0;
+    }
+
+    /* Make sure the flags make sense (if not, we probably have a corrupted PFN free list), and
+     * return whatever we don't need from the tail of the block. */
+    uint64_t Page = Entry - MiPageList;
+    for (uint64_t i = 0; i < Count; i++) {
+        if (Entry[i].Used || Entry[i].PoolItem || Entry[i].FreeBlock) {
+            KeFatalError(KE_PANIC_BAD_PFN_HEADER, MI_PAGE_BASE(&Entry[i]), Entry[i].Flags, 0, 0);
+        }
+
+        Entry[i].Used = 1;
+    }
+
+    FreeRange(Page + Count, Page + (1ull << Order));
+    KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+    __atomic_sub_fetch(&MiTotalFreePages, Count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&MiTotalUsedPages, Count, __ATOMIC_RELAXED);
+    return MI_PAGE_BASE(Entry);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns a physically contiguous range of pages to the buddy allocator.
+ *
+ * PARAMETERS:
+ *     PhysicalAddress - Physical address of the first page.
+ *     Count - How many pages are in the range.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MmFreeContiguousPages(uint64_t PhysicalAddress, uint64_t Count) {
+    uint64_t Page = PhysicalAddress >> MM_PAGE_SHIFT;
+    if (!Count) {
+        return;
+    }
+
+    /* Use MmFreePool to free big pool allocations, instead of us! */
+    MiPageEntry *Entry = &MiPageList[Page];
+    for (uint64_t i = 0; i < Count; i++) {
+        if (!Entry[i].Used || Entry[i].PoolItem) {
+            KeFatalError(
+                KE_PANIC_BAD_PFN_HEADER,
+                PhysicalAddress + (i << MM_PAGE_SHIFT),
+                Entry[i].Flags,
+                0,
+                0);
+        }
+
+        Entry[i].Used = 0;
+    }
+
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+    FreeRange(Page, Page + Count);
+    KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+    __atomic_sub_fetch(&MiTotalUsedPages, Count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&MiTotalFreePages, Count, __ATOMIC_RELAXED);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function tries allocating a physical memory page that has already been cleared by the
+ *     zero page thread, without falling back to clearing one ourselves.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Physical address of the allocated page, or 0 if no pre-zeroed page was available.
+ *-----------------------------------------------------------------------------------------------*/
+uint64_t MiTryAllocateZeroedPage(void) {
+    if (!__atomic_load_n(&MiTotalZeroedPages, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+    MiPageEntry *Entry = AllocateBlock(0, UINT64_MAX, MI_BLOCK_ZEROED, NULL);
+    KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+    if (!Entry) {
+        return 0;
+    }
+
+    /* Make sure the flags make sense (if not, we probably have a corrupted PFN free list). */
+    if (Entry->Used || Entry->PoolItem || Entry->FreeBlock) {
+        KeFatalError(KE_PANIC_BAD_PFN_HEADER, MI_PAGE_BASE(Entry), Entry->Flags, 0, 0);
+    }
+
+    Entry->Used = 1;
+    __atomic_sub_fetch(&MiTotalFreePages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&MiTotalUsedPages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&MiZeroedBytesOffloaded, MM_PAGE_SIZE, __ATOMIC_RELAXED);
+    return MI_PAGE_BASE(Entry);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates a physical memory page that is guaranteed to be filled with zeroes.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Physical address of the allocated page, or 0 on failure.
+ *-----------------------------------------------------------------------------------------------*/
+uint64_t MmAllocateZeroedPage(void) {
+    uint64_t PhysicalAddress = MiTryAllocateZeroedPage();
+    if (PhysicalAddress) {
+        return PhysicalAddress;
+    }
+
+    /* Nothing pre-zeroed was available, so clear a normal page ourselves (using the early map, as
+     * we have no other place to access the page from). */
+    PhysicalAddress = MmAllocateSinglePage();
+    if (!PhysicalAddress) {
+        return 0;
+    }
+
+    void *VirtualAddress = HalpMapEarlyMemory(PhysicalAddress, MM_PAGE_SIZE, MI_MAP_WRITE);
+    if (!VirtualAddress) {
+        MmFreeSinglePage(PhysicalAddress);
+        return 0;
+    }
+
+    memset(VirtualAddress, 0, MM_PAGE_SIZE);
+    HalpUnmapEarlyMemory(VirtualAddress, MM_PAGE_SIZE);
+    return PhysicalAddress;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function runs in the background, taking dirty free pages out of the buddy allocator,
+ *     clearing them, and giving them back marked as zeroed (they merge with their buddies like
+ *     any other free page, so this never fragments the free lists).
+ *
+ * PARAMETERS:
+ *     Window - Virtual space reserved for mapping the pages we're clearing.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void ZeroPageThread(void *Window) {
+    uint64_t Pages[MI_ZERO_PAGE_BATCH_SIZE];
+
+    while (true) {
+        /* We're also the closest thing we have to a memory balancing thread, so make sure the
+         * pool gives back whatever it is caching once free memory gets low. */
+        if (__atomic_load_n(&MiTotalFreePages, __ATOMIC_RELAXED) < MiPoolTrimWatermark) {
+            MiTrimPool();
+        }
+
+        /* We already run at the lowest priority, but also back off whenever anything else is
+         * waiting to run on this processor (so that we don't round-robin with other low priority
+         * threads). */
+        if (__atomic_load_n(&MiTotalZeroedPages, __ATOMIC_RELAXED) >= MI_ZERO_PAGE_TARGET) {
+            PsDelayThread(MI_ZERO_PAGE_FULL_DELAY);
+            continue;
+        } else if (__atomic_load_n(&KeGetCurrentProcessor()->ThreadCount, __ATOMIC_RELAXED)) {
+            PsDelayThread(MI_ZERO_PAGE_BUSY_DELAY);
+            continue;
+        }
+
+        /* Grab the batch directly from the buddy allocator (not the processor caches), so that
+         * we only ever clear pages nobody is using. */
+        uint32_t Count = 0;
+        KeLockQueueNode LockNode;
+        KeIrql OldIrql =
+            KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+        while (Count < MI_ZERO_PAGE_BATCH_SIZE) {
+            MiPageEntry *Entry = AllocateBlock(0, UINT64_MAX, MI_BLOCK_DIRTY, NULL);
+            if (!Entry) {
+                break;
+            }
+
+            Pages[Count++] = MI_PAGE_BASE(Entry);
+        }
+
+        KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+
+        /* Map the whole batch at once, so that we only need a single shootdown when unmapping
+         * it. */
+        uint64_t Size = (uint64_t)Count << MM_PAGE_SHIFT;
+        bool Mapped = Count && HalpMapNonContiguousPages(Window, Pages, Size, MI_MAP_WRITE);
+        if (Mapped) {
+            HalpZeroPages(Window, Size);
+            HalpUnmapPages(Window, Size);
+        }
+
+        OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+        for (uint32_t i = 0; i < Count; i++) {
+            MiPageEntry *Entry = &MI_PAGE_ENTRY(Pages[i]);
+            Entry->Zeroed = Mapped;
+            FreeBlock(Entry - MiPageList, 0, Mapped);
+        }
+
+        /* The counter needs to be updated in the same critical section that links the pages;
+         * Otherwise, an allocation could consume (and subtract) them before we add, underflowing
+         * the counter. */
+        if (Mapped) {
+            __atomic_add_fetch(&MiTotalZeroedPages, Count, __ATOMIC_RELAXED);
+        }
+
+        KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+
+        if (!Mapped) {
+            PsDelayThread(MI_ZERO_PAGE_BUSY_DELAY);
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function creates the background zero page thread. This should be called once the
+ *     scheduler is up.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiCreateZeroPageThread(void) {
+    void *Window = MiAllocatePoolSpace(MI_ZERO_PAGE_BATCH_SIZE);
+    if (!Window) {
+        KdPrint(KD_TYPE_ERROR, "failed to reserve the zero page thread window\n");
+        return;
+    }
+
+    PsThread *Thread = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, ZeroPageThread, Window);
+    if (!Thread) {
+        KdPrint(KD_TYPE_ERROR, "failed to create the zero page thread\n");
+        MiFreePoolSpace(Window, MI_ZERO_PAGE_BATCH_SIZE);
+        return;
+    }
+
+    /* Zeroing is purely opportunistic, so it should never get in the way of anyone else. */
+    PsSetThreadPriority(Thread, PS_PRIORITY_LOWEST);
+    PsResumeThread(Thread);
+
+    /* Only the scheduler needs to hold a reference to the thread. */
+    ObDereferenceObject(Thread);
+}
+
+#ifndef NDEBUG
+#define TEST_RANGES 64
+#define TEST_ROUNDS 4096
+#define TEST_REPORTS 8
+#define BENCHMARK_PAIRS 4096
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function counts how many pages are sitting in the buddy allocator free lists. The
+ *     page list lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Amount of free pages across all orders.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t CountFreeBlockPages(void) {
+    uint64_t Pages = 0;
+
+    for (uint32_t Order = 0; Order < MI_PAGE_ORDER_COUNT; Order++) {
+        Pages += MiFreeAreaBlocks[Order] << Order;
+    }
+
+    return Pages;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function prints how fragmented the buddy allocator free lists currently are: The
+ *     amount of free blocks, the largest order with any free block, and how many of the free
+ *     pages are sitting in blocks too small for a 64KiB (order 4) allocation.
+ *
+ * PARAMETERS:
+ *     Round - Which stress test round we're at.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void PrintFragmentation(uint32_t Round) {
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+
+    uint64_t Blocks = 0;
+    uint64_t Pages = 0;
+    uint64_t SmallPages = 0;
+    uint32_t LargestOrder = 0;
+    for (uint32_t Order = 0; Order < MI_PAGE_ORDER_COUNT; Order++) {
+        Blocks += MiFreeAreaBlocks[Order];
+        Pages += MiFreeAreaBlocks[Order] << Order;
+        if (Order < 4) {
+            SmallPages += MiFreeAreaBlocks[Order] << Order;
+        }
+
+        if (MiFreeAreaBlocks[Order]) {
+            LargestOrder = Order;
+        }
+    }
+
+    KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "page allocator round %u: %llu free blocks, largest order %u, %llu/%llu free pages below "
+        "order 4\n",
+        Round,
+        Blocks,
+        LargestOrder,
+        SmallPages,
+        Pages);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function stress tests the buddy allocator (debug builds only). It randomly allocates
+ *     and frees contiguous ranges (of random sizes, alignments and zone limits), making sure every
+ *     split tail gets accounted for while the free lists are fragmented, and that freeing
+ *     everything coalesces the free lists back into the exact same blocks we started with. How
+ *     fragmented the free lists are gets printed at a few points along the way. This should be
+ *     called before anything else can allocate contiguous pages.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTestPageAllocator(void) {
+    uint64_t Bases[TEST_RANGES] = {0};
+    uint64_t Counts[TEST_RANGES] = {0};
+    uint64_t FreeBlocks[MI_PAGE_ORDER_COUNT];
+    uint64_t FreePages = MiTotalFreePages;
+    uint64_t FreeBlockPages = CountFreeBlockPages();
+    uint64_t UsedPages = 0;
+
+    memcpy(FreeBlocks, MiFreeAreaBlocks, sizeof(FreeBlocks));
+
+    for (uint32_t Round = 0; Round < TEST_ROUNDS; Round++) {
+        if (!(Round % (TEST_ROUNDS / TEST_REPORTS))) {
+            PrintFragmentation(Round);
+        }
+
+        uint32_t i = __rand64() % TEST_RANGES;
+        if (Bases[i]) {
+            MmFreeContiguousPages(Bases[i], Counts[i]);
+            UsedPages -= Counts[i];
+            Bases[i] = 0;
+        } else {
+            /* Most sizes aren't a power of two (so the tails get split off and freed on every
+             * allocation), and some of the ranges also need to be aligned above their own size, or
+             * come from the low zones. */
+            uint64_t Random = __rand64();
+            uint64_t Count = (((Random >> 8) & 0xFFFF) % (1ull << (Random % 7))) + 1;
+            uint64_t Alignment = (Random >> 24) & 3 ? 0 : MM_PAGE_SIZE << ((Random >> 26) % 10);
+            uint64_t MaxAddress = (Random >> 32) & 7 ? 0 : 0xFFFFFFFF;
+
+            /* Low memory might be all used up (by the firmware/loader), so it's fine if the limited
+             * allocations fail, as long as the unlimited ones don't. */
+            uint64_t Base = MmAllocateContiguousPages(Count, Alignment, MaxAddress);
+            if (!Base) {
+                if (!MaxAddress) {
+                    KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Round, Count, Alignment, UsedPages);
+                }
+
+                continue;
+            }
+
+            uint64_t End = Base + (Count << MM_PAGE_SHIFT);
+            if ((Alignment && (Base & (Alignment - 1))) || (MaxAddress && End - 1 > MaxAddress)) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Round, Base, Count, Alignment);
+            }
+
+            for (uint64_t Page = 0; Page < Count; Page++) {
+                MiPageEntry *Entry = &MI_PAGE_ENTRY(Base + (Page << MM_PAGE_SHIFT));
+                if (!Entry->Used || Entry->FreeBlock) {
+                    KeFatalError(KE_PANIC_BAD_PFN_HEADER, MI_PAGE_BASE(Entry), Entry->Flags, 0, 0);
+                }
+            }
+
+            for (uint32_t j = 0; j < TEST_RANGES; j++) {
+                if (Bases[j] && Base < Bases[j] + (Counts[j] << MM_PAGE_SHIFT) && Bases[j] < End) {
+                    KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Round, Base, Bases[j], Count);
+                }
+            }
+
+            Bases[i] = Base;
+            Counts[i] = Count;
+            UsedPages += Count;
+        }
+
+        /* Whatever we're not holding right now should be back in the free lists (even if it's
+         * split into smaller blocks). */
+        KeLockQueueNode LockNode;
+        KeIrql OldIrql =
+            KeAcquireQueuedSpinLockAndRaiseIrql(&MiPageListLock, &LockNode, KE_IRQL_DISPATCH);
+        uint64_t CurrentFreeBlockPages = CountFreeBlockPages();
+        KeReleaseQueuedSpinLockAndLowerIrql(&MiPageListLock, OldIrql);
+
+        if (CurrentFreeBlockPages + UsedPages != FreeBlockPages ||
+            MiTotalFreePages + UsedPages != FreePages) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                Round,
+                CurrentFreeBlockPages,
+                MiTotalFreePages,
+                UsedPages);
+        }
+    }
+
+    for (uint32_t i = 0; i < TEST_RANGES; i++) {
+        if (Bases[i]) {
+            MmFreeContiguousPages(Bases[i], Counts[i]);
+        }
+    }
+
+    /* Now punch holes into a single block by hand: Freeing every other page leaves nothing that
+     * can merge, and freeing the rest should merge everything back into the original block. */
+    uint64_t Base = MmAllocateContiguousPages(TEST_RANGES, 0, 0);
+    if (!Base) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, TEST_ROUNDS, TEST_RANGES, 0, 0);
+    }
+
+    uint64_t SinglePageBlocks = MiFreeAreaBlocks[0];
+    for (uint64_t Page = 0; Page < TEST_RANGES; Page += 2) {
+        MmFreeContiguousPages(Base + (Page << MM_PAGE_SHIFT), 1);
+    }
+
+    if (MiFreeAreaBlocks[0] != SinglePageBlocks + TEST_RANGES / 2) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE, TEST_ROUNDS, Base, MiFreeAreaBlocks[0], SinglePageBlocks);
+    }
+
+    for (uint64_t Page = 1; Page < TEST_RANGES; Page += 2) {
+        MmFreeContiguousPages(Base + (Page << MM_PAGE_SHIFT), 1);
+    }
+
+    /* Every buddy should have merged back, which means we should have exactly the same amount of
+     * blocks in every order as before. */
+    for (uint32_t Order = 0; Order < MI_PAGE_ORDER_COUNT; Order++) {
+        if (MiFreeAreaBlocks[Order] != FreeBlocks[Order] || MiTotalFreePages != FreePages) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                Order,
+                MiFreeAreaBlocks[Order],
+                FreeBlocks[Order],
+                MiTotalFreePages);
+        }
+    }
+
+    PrintFragmentation(TEST_ROUNDS);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures how long an order-0 allocate/free pair takes (debug builds only),
+ *     both through the per-processor page cache (MmAllocateSinglePage), and straight through the
+ *     buddy allocator (a single page MmAllocateContiguousPages). The results are only printed
+ *     (nothing fails).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiBenchmarkPageAllocator(void) {
+    /* Warm up the processor cache first, so that we don't measure the initial refill. */
+    uint64_t Page = MmAllocateSinglePage();
+    if (!Page) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    MmFreeSinglePage(Page);
+
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_PAIRS; i++) {
+        Page = MmAllocateSinglePage();
+        if (!Page) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 0, 0, 0);
+        }
+
+        MmFreeSinglePage(Page);
+    }
+
+    uint64_t CacheCycles = (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS;
+
+    Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_PAIRS; i++) {
+        Page = MmAllocateContiguousPages(1, 0, 0);
+        if (!Page) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 1, 0, 0);
+        }
+
+        MmFreeContiguousPages(Page, 1);
+    }
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "page allocator benchmark: %llu cycles per cached order-0 pair, %llu cycles per buddy "
+        "order-0 pair\n",
+        CacheCycles,
+        (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS);
+}
+#endif /* NDEBUG */
@@ -2,11 +2,11 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/mi.h>
 #include <kernel/mm.h>
 #include <os/containing_record.h>
-#include <rt/bitmap.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,16 +15,24 @@
 typedef struct {
     RtSList ListHeader;
     char Tag[4];
-    uint32_t Head;
+    uint16_t Head;
+    uint16_t Offset;
 } BlockHeader;
 
-static RtSList FreeBlockList[MM_POOL_BLOCK_COUNT] = {0};
-static KeSpinLock FreeBlockLock[MM_POOL_BLOCK_COUNT] = {0};
+typedef struct {
+    RtDList ListHeader;
+    RtSList FreeListHead;
+    uint32_t FreeCount;
+    uint32_t BlockCount;
+} SegmentHeader;
+
+static RtDList SegmentList[MM_POOL_BLOCK_COUNT] = {0};
+static uint32_t EmptySegmentCount[MM_POOL_BLOCK_COUNT] = {0};
+static KeQueuedSpinLock FreeBlockLock[MM_POOL_BLOCK_COUNT] = {0};
+static uint64_t DrainGeneration = 0;
 
-uint64_t *MiPoolBitmapBuffer = NULL;
-RtBitmap MiPoolBitmap = {0};
-uint64_t MiPoolBitmapHint = 0;
 RtSList MiPoolTagListHead[256] = {0};
+uint64_t MiPoolTrimWatermark = 0;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -95,6 +103,91 @@ static uint64_t GetHeadPages(uint32_t Head) {
     return MM_POOL_LARGE_PAGES;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns a small block back into the segment it was carved from, releasing the
+ *     whole segment back to the pool page allocator once it is completely free. We expect to be
+ *     called at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     Header - Header of the block.
+ *     Trim - Set this to release the segment even if we haven't reached the amount of empty
+ *            segments we want to keep around.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ReturnBlock(BlockHeader *Header, bool Trim) {
+    uint32_t Head = Header->Head;
+    SegmentHeader *Segment = (SegmentHeader *)((char *)Header - Header->Offset);
+    bool Release = false;
+
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head], &LockNode);
+    if (Segment->FreeCount >= Segment->BlockCount) {
+        KeFatalError(
+            KE_PANIC_BAD_POOL_HEADER,
+            (uint64_t)Header,
+            Segment->FreeCount,
+            Segment->BlockCount,
+            Head);
+    }
+
+    RtPushSList(&Segment->FreeListHead, &Header->ListHeader);
+    bool WasFull = !Segment->FreeCount++;
+
+    /* Partially used segments are kept at the front of the list (so that we fill them up before
+     * touching the empty ones), while empty segments go to the back (so that trimming them is
+     * easy). */
+    if (Segment->FreeCount != Segment->BlockCount) {
+        if (WasFull) {
+            RtPushDList(&SegmentList[Head], &Segment->ListHeader);
+        }
+    } else {
+        if (!WasFull) {
+            RtUnlinkDList(&Segment->ListHeader);
+        }
+
+        if (Trim || EmptySegmentCount[Head] >= MI_POOL_EMPTY_SEGMENT_RESERVE) {
+            Release = true;
+        } else {
+            RtAppendDList(&SegmentList[Head], &Segment->ListHeader);
+            EmptySegmentCount[Head]++;
+        }
+    }
+
+    KeReleaseQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
+
+    if (Release) {
+        MiFreePoolPages(Segment);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns everything in the given processor's block cache back to the segments
+ *     (releasing any segments that become empty). This should be called at DISPATCH, on the
+ *     processor that owns the cache.
+ *
+ * PARAMETERS:
+ *     Processor - Current processor.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void DrainBlockCache(KeProcessor *Processor) {
+    Processor->PoolBlockCacheGeneration = __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED);
+
+    for (uint32_t Head = 0; Head < MM_POOL_BLOCK_COUNT; Head++) {
+        while (Processor->FreePoolBlockListHead[Head].Next) {
+            BlockHeader *Header = CONTAINING_RECORD(
+                RtPopSList(&Processor->FreePoolBlockListHead[Head]), BlockHeader, ListHeader);
+            Processor->FreePoolBlockListSize[Head]--;
+            ReturnBlock(Header, true);
+        }
+    }
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function sets up the kernel pool allocator.
@@ -114,35 +207,69 @@ void MiInitializePool(void) {
         PoolSize = MI_POOL_MAX_SIZE;
     }
 
-    /* Grab some physical memory and map it for the pool bitmap. */
-    uint64_t PoolPages = PoolSize >> MM_PAGE_SHIFT;
-    uint64_t Size = ((PoolPages + 63) >> 6) << 3;
-    uint64_t Pages = (Size + MM_PAGE_SIZE - 1) >> MM_PAGE_SHIFT;
-    uint64_t PhysicalAddress = MiAllocateEarlyPages(Pages);
-    if (!PhysicalAddress) {
-        KeFatalError(
-            KE_PANIC_KERNEL_INITIALIZATION_FAILURE,
-            KE_PANIC_PARAMETER_POOL_INITIALIZATION_FAILURE,
-            KE_PANIC_PARAMETER_OUT_OF_RESOURCES,
-            0,
-            0);
+    /* The virtual space allocator only needs to know how big the pool is. */
+    MiInitializePoolSpace(PoolSize >> MM_PAGE_SHIFT);
+
+    for (uint32_t Head = 0; Head < MM_POOL_BLOCK_COUNT; Head++) {
+        RtInitializeDList(&SegmentList[Head]);
     }
 
-    if (!HalpMapContiguousPages(
-            (void *)MI_POOL_BITMAP_START, PhysicalAddress, Pages << MM_PAGE_SHIFT, MI_MAP_WRITE)) {
-        KeFatalError(
-            KE_PANIC_KERNEL_INITIALIZATION_FAILURE,
-            KE_PANIC_PARAMETER_POOL_INITIALIZATION_FAILURE,
-            KE_PANIC_PARAMETER_OUT_OF_RESOURCES,
-            0,
-            0);
+    /* Once free memory drops below this point, we stop caching anything that is freed, and start
+     * giving back whatever the pool is holding onto. */
+    MiPoolTrimWatermark = MiTotalManagedPages >> MI_POOL_TRIM_WATERMARK_SHIFT;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns as much of the memory cached by the pool as possible back to the page
+ *     allocator; This should be called when we're running low on free memory.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTrimPool(void) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+
+    /* We can only flush our own block cache right now (the other processors' caches are
+     * lock-free, and only touched by their owners), so ask everyone else to drain theirs on their
+     * next pool call. */
+    __atomic_add_fetch(&DrainGeneration, 1, __ATOMIC_RELAXED);
+    DrainBlockCache(KeGetCurrentProcessor());
+
+    for (uint32_t Head = 0; Head < MM_POOL_BLOCK_COUNT; Head++) {
+        /* Empty segments are always at the back of the list, so we can stop as soon as we find
+         * anything in use. */
+        while (true) {
+            SegmentHeader *Segment = NULL;
+            KeLockQueueNode LockNode;
+            KeAcquireQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head], &LockNode);
+            if (SegmentList[Head].Prev != &SegmentList[Head]) {
+                Segment = CONTAINING_RECORD(SegmentList[Head].Prev, SegmentHeader, ListHeader);
+                if (Segment->FreeCount == Segment->BlockCount) {
+                    RtUnlinkDList(&Segment->ListHeader);
+                    EmptySegmentCount[Head]--;
+                } else {
+                    Segment = NULL;
+                }
+            }
+
+            KeReleaseQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
+            if (!Segment) {
+                break;
+            }
+
+            MiFreePoolPages(Segment);
+        }
     }
 
-    /* And clear up the bitmap (as, unlike MmAllocatePool, doing Allocate+MapPages doesn't clean the
-     * memory). */
-    MiPoolBitmapBuffer = (void *)MI_POOL_BITMAP_START;
-    RtInitializeBitmap(&MiPoolBitmap, MiPoolBitmapBuffer, PoolPages);
-    RtClearAllBits(&MiPoolBitmap);
+    /* The segments we just released might have landed on the page caches (if we weren't low on
+     * memory anymore), so trim those last (along with the virtual space they were using). */
+    MiTrimPoolPages();
+    MiTrimPoolSpace();
+    KeLowerIrql(OldIrql);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -169,14 +296,18 @@ void *MmAllocatePool(size_t Size, const char Tag[4]) {
      * won't cache it). */
     if (Size > MM_POOL_LARGE_MAX) {
         uint32_t Pages = (Size + MM_PAGE_SIZE - 1) >> MM_PAGE_SHIFT;
-        void *Base = MiAllocatePoolPages(Pages);
+        bool Zeroed = false;
+        void *Base = MiAllocatePoolPages(Pages, &Zeroed);
 
         if (Base) {
-            /* Tag the allocation and try to account for it in the pool tracker. */
+            /* Tag the allocation and try to account for it in the pool tracker; We only need to
+             * clear the memory if the zero page thread didn't do it for us already. */
             memcpy(MI_PAGE_ENTRY(HalpGetPhysicalAddress(Base)).Tag, Tag, 4);
             MiAddPoolTracker(Pages << MM_PAGE_SHIFT, Tag);
             KeLowerIrql(OldIrql);
-            memset(Base, 0, Pages << MM_PAGE_SHIFT);
+            if (!Zeroed) {
+                memset(Base, 0, Pages << MM_PAGE_SHIFT);
+            }
         } else {
             KeLowerIrql(OldIrql);
         }
@@ -198,6 +329,11 @@ void *MmAllocatePool(size_t Size, const char Tag[4]) {
     uint64_t FullSize = HeadSize + sizeof(BlockHeader);
     KeProcessor *Processor = KeGetCurrentProcessor();
 
+    if (Processor->PoolBlockCacheGeneration !=
+        __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED)) {
+        DrainBlockCache(Processor);
+    }
+
     /* We already checked the Head value, and so, we should be sure now that this ain't
      * overflowing... */
     /* NOLINTNEXTLINE(clang-analyzer-security.ArrayBound) */
@@ -219,16 +355,28 @@ void *MmAllocatePool(size_t Size, const char Tag[4]) {
         return Header + 1;
     }
 
-    KeAcquireSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
-    if (FreeBlockList[Head].Next) {
+    /* The first segment in the list always has a free block (if there are any segments at all),
+     * and we always prefer the partially used ones over the empty ones. */
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head], &LockNode);
+    if (SegmentList[Head].Next != &SegmentList[Head]) {
+        SegmentHeader *Segment =
+            CONTAINING_RECORD(SegmentList[Head].Next, SegmentHeader, ListHeader);
+        if (Segment->FreeCount == Segment->BlockCount) {
+            EmptySegmentCount[Head]--;
+        }
+
         BlockHeader *Header =
-            CONTAINING_RECORD(RtPopSList(&FreeBlockList[Head]), BlockHeader, ListHeader);
+            CONTAINING_RECORD(RtPopSList(&Segment->FreeListHead), BlockHeader, ListHeader);
+        if (!--Segment->FreeCount) {
+            RtUnlinkDList(&Segment->ListHeader);
+        }
 
         if (Header->Head != Head) {
             KeFatalError(KE_PANIC_BAD_POOL_HEADER, (uint64_t)Header, Header->Head, Head, 0);
         }
 
-        KeReleaseSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
+        KeReleaseQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
         memcpy(Header->Tag, Tag, 4);
         MiAddPoolTracker(FullSize, Tag);
         KeLowerIrql(OldIrql);
@@ -236,34 +384,54 @@ void *MmAllocatePool(size_t Size, const char Tag[4]) {
         memset(Header + 1, 0, HeadSize);
         return Header + 1;
     }
-    KeReleaseSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
+    KeReleaseQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
 
     /* Allocate some extra space, and carve it into a bunch of Head-sized elements. */
-    char *StartAddress = MiAllocatePoolPages(HeadPages);
+    char *StartAddress = MiAllocatePoolPages(HeadPages, NULL);
     if (!StartAddress) {
         KeLowerIrql(OldIrql);
         return NULL;
     }
 
-    /* Split the pages into equal sized chunks; This can have some waste depending on the chosen
-     * bucket sizes, especially because we need to skip anything that would accidentally align
-     * the result base to a page (that is reserved for large allocations), so make sure to
-     * tune the min/max/shift values, possibly even the amount of bucket classes! */
-    KeAcquireSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
-    for (uint64_t i = 1; i < (HeadPages << MM_PAGE_SHIFT) / FullSize; i++) {
-        BlockHeader *Header = (BlockHeader *)(StartAddress + i * FullSize);
-        if (((uint64_t)(Header + 1) & (MM_PAGE_SIZE - 1))) {
-            Header->Head = Head;
-            RtPushSList(&FreeBlockList[Head], &Header->ListHeader);
+    /* Split the pages (after the segment header) into equal sized chunks; This can have some waste
+     * depending on the chosen bucket sizes, especially because we need to skip anything that
+     * would accidentally align the result base to a page (that is reserved for large
+     * allocations), so make sure to tune the min/max/shift values, possibly even the amount of
+     * bucket classes! */
+    SegmentHeader *Segment = (SegmentHeader *)StartAddress;
+    Segment->FreeListHead.Next = NULL;
+    Segment->FreeCount = 0;
+    Segment->BlockCount = 0;
+
+    BlockHeader *Header = NULL;
+    uint64_t SegmentSize = (uint64_t)HeadPages << MM_PAGE_SHIFT;
+    for (uint64_t Offset = sizeof(SegmentHeader); Offset + FullSize <= SegmentSize;
+         Offset += FullSize) {
+        BlockHeader *Block = (BlockHeader *)(StartAddress + Offset);
+        if (!((uint64_t)(Block + 1) & (MM_PAGE_SIZE - 1))) {
+            continue;
+        }
+
+        Block->Head = Head;
+        Block->Offset = Offset;
+        Segment->BlockCount++;
+
+        /* The first block should be ours. */
+        if (!Header) {
+            Header = Block;
+            Header->ListHeader.Next = NULL;
+        } else {
+            RtPushSList(&Segment->FreeListHead, &Block->ListHeader);
+            Segment->FreeCount++;
         }
     }
 
-    KeReleaseSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
+    if (Segment->FreeCount) {
+        KeAcquireQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head], &LockNode);
+        RtPushDList(&SegmentList[Head], &Segment->ListHeader);
+        KeReleaseQueuedSpinLockAtCurrentIrql(&FreeBlockLock[Head]);
+    }
 
-    /* The first block was skipped as it should be ours. */
-    BlockHeader *Header = (BlockHeader *)StartAddress;
-    Header->Head = Head;
-    Header->ListHeader.Next = NULL;
     memcpy(Header->Tag, Tag, 4);
     MiAddPoolTracker(FullSize, Tag);
     KeLowerIrql(OldIrql);
@@ -317,7 +485,8 @@ void MmFreePool(void *Base, const char Tag[4]) {
 
     BlockHeader *Header = (BlockHeader *)Base - 1;
     if ((memcmp(Tag, MM_POOL_TAG_NONE, 4) != 0 && memcmp(Header->Tag, Tag, 4) != 0) ||
-        Header->Head >= MM_POOL_BLOCK_COUNT || Header->ListHeader.Next) {
+        Header->Head >= MM_POOL_BLOCK_COUNT || Header->Offset < sizeof(SegmentHeader) ||
+        Header->ListHeader.Next) {
         KeFatalError(
             KE_PANIC_BAD_POOL_HEADER,
             (uint64_t)Header,
@@ -327,10 +496,18 @@ void MmFreePool(void *Base, const char Tag[4]) {
     }
 
     /* If we haven't overflow the local cache yet, just directly push to it (as it doesn't need any
-     * locks). */
+     * locks); We skip the cache if we're low on memory, as blocks in it keep their segments
+     * alive. */
     uint64_t FullSize = GetHeadSize(Header->Head) + sizeof(BlockHeader);
     KeProcessor *Processor = KeGetCurrentProcessor();
-    if (Processor->FreePoolBlockListSize[Header->Head] < MI_PROCESSOR_POOL_CACHE_MAX_SIZE) {
+    if (Processor->PoolBlockCacheGeneration !=
+        __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED)) {
+        DrainBlockCache(Processor);
+    }
+
+    bool Trim = __atomic_load_n(&MiTotalFreePages, __ATOMIC_RELAXED) < MiPoolTrimWatermark;
+    if (!Trim &&
+        Processor->FreePoolBlockListSize[Header->Head] < MI_PROCESSOR_POOL_CACHE_MAX_SIZE) {
         RtPushSList(&Processor->FreePoolBlockListHead[Header->Head], &Header->ListHeader);
         MiRemovePoolTracker(FullSize, Tag);
         Processor->FreePoolBlockListSize[Header->Head]++;
@@ -338,11 +515,228 @@ void MmFreePool(void *Base, const char Tag[4]) {
         return;
     }
 
-    /* TODO: At some point, we really should be returning this memory to the big pool allocator
-     * (in case the whole segment is free). */
-    KeAcquireSpinLockAtCurrentIrql(&FreeBlockLock[Header->Head]);
-    RtPushSList(&FreeBlockList[Header->Head], &Header->ListHeader);
-    KeReleaseSpinLockAtCurrentIrql(&FreeBlockLock[Header->Head]);
+    /* Otherwise, return it to its segment (which might release the whole segment). */
     MiRemovePoolTracker(FullSize, Tag);
+    ReturnBlock(Header, Trim);
     KeLowerIrql(OldIrql);
 }
+
+#ifndef NDEBUG
+#define TEST_SEGMENTS (MI_POOL_EMPTY_SEGMENT_RESERVE + 3)
+#define TEST_BLOCKS 256
+#define BENCHMARK_PAIRS 4096
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the segment a (self-test) pool block was carved from.
+ *
+ * PARAMETERS:
+ *     Base - Start of the block (as returned by MmAllocatePool).
+ *
+ * RETURN VALUE:
+ *     Segment header.
+ *-----------------------------------------------------------------------------------------------*/
+static SegmentHeader *GetTestSegment(void *Base) {
+    BlockHeader *Header = (BlockHeader *)Base - 1;
+    return (SegmentHeader *)((char *)Header - Header->Offset);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if a segment is still owned by its bucket (linked into the segment
+ *     list), and makes sure the empty segment count didn't go over what we expect.
+ *
+ * PARAMETERS:
+ *     Head - Bucket index.
+ *     Segment - Which segment to look for.
+ *     EmptySegments - How many empty segments the bucket should be holding.
+ *
+ * RETURN VALUE:
+ *     true if the segment is in the list, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool CheckTestSegment(uint32_t Head, SegmentHeader *Segment, uint32_t EmptySegments) {
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&FreeBlockLock[Head], &LockNode, KE_IRQL_DISPATCH);
+    bool Found = false;
+    uint32_t Count = 0;
+
+    for (RtDList *ListHeader = SegmentList[Head].Next; ListHeader != &SegmentList[Head];
+         ListHeader = ListHeader->Next) {
+        SegmentHeader *Entry = CONTAINING_RECORD(ListHeader, SegmentHeader, ListHeader);
+        Found |= Entry == Segment;
+        Count += Entry->FreeCount == Entry->BlockCount;
+    }
+
+    KeReleaseQueuedSpinLockAndLowerIrql(&FreeBlockLock[Head], OldIrql);
+
+    if (Count != EmptySegments || EmptySegmentCount[Head] != EmptySegments) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE, Head, Count, EmptySegmentCount[Head], EmptySegments);
+    }
+
+    return Found;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function tests when the pool gives fully free segments back (debug builds only): Only
+ *     MI_POOL_EMPTY_SEGMENT_RESERVE empty segments should be kept per bucket, everything should be
+ *     released right away once we're below the trim watermark, and MiTrimPool should release the
+ *     reserve as well. This should be called before any other processor or thread can touch the
+ *     pool.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTestPoolReclaim(void) {
+    /* The biggest bucket has the fewest blocks per segment, so it takes the fewest allocations to
+     * own a few segments. */
+    uint32_t Head = MM_POOL_BLOCK_COUNT - 1;
+    void *Blocks[TEST_BLOCKS];
+    SegmentHeader *Segments[TEST_SEGMENTS];
+    uint32_t BlockCount = 0;
+    uint32_t SegmentCount = 0;
+
+    /* Start with nothing cached, so every allocation comes from a segment, and so that we know
+     * the bucket has no empty segments. */
+    MiTrimPool();
+    CheckTestSegment(Head, NULL, 0);
+
+    /* Partially used segments get filled first, so keep going until we have a few segments that
+     * were freshly carved for us (every block in them is ours). */
+    while (SegmentCount < TEST_SEGMENTS) {
+        if (BlockCount >= TEST_BLOCKS) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Head, BlockCount, SegmentCount, 0);
+        }
+
+        void *Base = MmAllocatePool(GetHeadSize(Head), MM_POOL_TAG_POOL);
+        if (!Base || ((BlockHeader *)Base - 1)->Head != Head) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Head, (uint64_t)Base, BlockCount, 0);
+        }
+
+        Blocks[BlockCount++] = Base;
+
+        SegmentHeader *Segment = GetTestSegment(Base);
+        uint32_t Owned = 0;
+        for (uint32_t i = 0; i < BlockCount; i++) {
+            Owned += GetTestSegment(Blocks[i]) == Segment;
+        }
+
+        if (Owned == Segment->BlockCount) {
+            Segments[SegmentCount++] = Segment;
+        }
+    }
+
+    /* Give back every segment except for the last one, block by block, bypassing the processor
+     * cache; Only the first few should be kept around, the rest should go straight back to the
+     * page allocator. */
+    for (uint32_t i = 0; i < TEST_SEGMENTS - 1; i++) {
+        for (uint32_t j = 0; j < BlockCount; j++) {
+            if (Blocks[j] && GetTestSegment(Blocks[j]) == Segments[i]) {
+                BlockHeader *Header = (BlockHeader *)Blocks[j] - 1;
+                KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+                MiRemovePoolTracker(GetHeadSize(Head) + sizeof(BlockHeader), MM_POOL_TAG_POOL);
+                ReturnBlock(Header, false);
+                KeLowerIrql(OldIrql);
+                Blocks[j] = NULL;
+            }
+        }
+
+        uint32_t EmptySegments =
+            i < MI_POOL_EMPTY_SEGMENT_RESERVE ? i + 1 : MI_POOL_EMPTY_SEGMENT_RESERVE;
+        if (CheckTestSegment(Head, Segments[i], EmptySegments) !=
+            (i < MI_POOL_EMPTY_SEGMENT_RESERVE)) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Head, i, (uint64_t)Segments[i], 0);
+        }
+    }
+
+    /* Below the watermark, the normal free path should skip the processor cache, and release the
+     * last segment even though it's over the reserve. */
+    uint64_t TrimWatermark = MiPoolTrimWatermark;
+    MiPoolTrimWatermark = UINT64_MAX;
+
+    for (uint32_t j = 0; j < BlockCount; j++) {
+        if (Blocks[j] && GetTestSegment(Blocks[j]) == Segments[TEST_SEGMENTS - 1]) {
+            MmFreePool(Blocks[j], MM_POOL_TAG_POOL);
+            Blocks[j] = NULL;
+        }
+    }
+
+    MiPoolTrimWatermark = TrimWatermark;
+
+    if (KeGetCurrentProcessor()->FreePoolBlockListSize[Head] ||
+        CheckTestSegment(Head, Segments[TEST_SEGMENTS - 1], MI_POOL_EMPTY_SEGMENT_RESERVE)) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            Head,
+            KeGetCurrentProcessor()->FreePoolBlockListSize[Head],
+            (uint64_t)Segments[TEST_SEGMENTS - 1],
+            0);
+    }
+
+    /* And trimming should get rid of the reserve as well. */
+    MiTrimPool();
+    for (uint32_t i = 0; i < MI_POOL_EMPTY_SEGMENT_RESERVE; i++) {
+        if (CheckTestSegment(Head, Segments[i], 0)) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Head, i, (uint64_t)Segments[i], 0);
+        }
+    }
+
+    for (uint32_t j = 0; j < BlockCount; j++) {
+        if (Blocks[j]) {
+            MmFreePool(Blocks[j], MM_POOL_TAG_POOL);
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures how long an allocate/free pair takes on the common path (debug builds
+ *     only), for one size out of each bucket class, plus one size that goes straight into the
+ *     pool page allocator. Each size gets warmed up first, so that we measure the processor cache
+ *     path, instead of the first segment carve. The results are only printed (nothing fails).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiBenchmarkPool(void) {
+    static const uint64_t Sizes[] = {
+        64,
+        MM_POOL_MEDIUM_MIN + 256,
+        MM_POOL_LARGE_MAX,
+        MM_PAGE_SIZE,
+    };
+
+    for (uint32_t i = 0; i < sizeof(Sizes) / sizeof(*Sizes); i++) {
+        void *Base = MmAllocatePool(Sizes[i], MM_POOL_TAG_POOL);
+        if (!Base) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Sizes[i], 0, 0, 0);
+        }
+
+        MmFreePool(Base, MM_POOL_TAG_POOL);
+
+        uint64_t Start = HalpGetTscTicks();
+        for (uint32_t j = 0; j < BENCHMARK_PAIRS; j++) {
+            Base = MmAllocatePool(Sizes[i], MM_POOL_TAG_POOL);
+            if (!Base) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Sizes[i], j, 0, 0);
+            }
+
+            MmFreePool(Base, MM_POOL_TAG_POOL);
+        }
+
+        KdPrint(
+            KD_TYPE_DEBUG,
+            "pool benchmark: %llu cycles per %llu byte allocate/free pair\n",
+            (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS,
+            Sizes[i]);
+    }
+}
+#endif /* NDEBUG */
@@ -5,61 +5,344 @@
 #include <kernel/ke.h>
 #include <kernel/mi.h>
 #include <kernel/mm.h>
-#include <rt/bitmap.h>
+#include <os/containing_record.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
 
-extern RtBitmap MiPoolBitmap;
-extern uint64_t MiPoolBitmapHint;
-
 static RtSList FreeLists[4] = {0};
+static uint32_t FreeListSize[4] = {0};
 static KeSpinLock FreeListLock[4] = {0};
-static KeSpinLock BitmapLock = {0};
+static uint64_t DrainGeneration = 0;
+
+/* Large page regions; The first page of each region holds this header (and is never handed
+ * out), and the rest gets carved into small allocations. Freed allocations go back into the free
+ * map, and the large page only gets unmapped once the whole region is free again. */
+typedef struct {
+    RtDList ListHeader;
+    uint64_t PhysicalAddress;
+    uint32_t FreePages;
+    uint64_t FreeMap[MI_LARGE_PAGE_PAGES / 64];
+} PoolRegion;
+
+static KeSpinLock RegionLock = {0};
+static RtDList RegionList = {&RegionList, &RegionList};
+static uint32_t RegionCount = 0;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function directly allocates some virtual space that isn't mapped to any physical page.
+ *     This function searches the free map of a large page region for a run of free pages. The
+ *     region lock is expected to be held by the caller.
  *
  * PARAMETERS:
- *     Pages - How many pages we need.
+ *     Region - Which region to search.
+ *     Pages - How many contiguous pages we need.
  *
  * RETURN VALUE:
- *     New virtual address (nothing mapped yet), or NULL on failure.
+ *     Index of the first page of the run, or 0 if there is no big enough run (the first page is
+ *     the header, so it can never be a valid result).
  *-----------------------------------------------------------------------------------------------*/
-void *MiAllocatePoolSpace(uint32_t Pages) {
-    if (!Pages) {
+static uint32_t FindRegionRun(PoolRegion *Region, uint32_t Pages) {
+    uint32_t RunStart = 0;
+    uint32_t RunPages = 0;
+
+    for (uint32_t i = 1; i < MI_LARGE_PAGE_PAGES; i++) {
+        /* Skip whole words without any free pages. */
+        if (!(i & 63) && !Region->FreeMap[i >> 6]) {
+            RunPages = 0;
+            i += 63;
+            continue;
+        }
+
+        if (!(Region->FreeMap[i >> 6] & (1ull << (i & 63)))) {
+            RunPages = 0;
+            continue;
+        }
+
+        if (!RunPages++) {
+            RunStart = i;
+        }
+
+        if (RunPages == Pages) {
+            return RunStart;
+        }
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function marks a range of pages inside a large page region as used or free. The region
+ *     lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Region - Which region the pages belong to.
+ *     Start - Index of the first page.
+ *     Pages - How many pages to mark.
+ *     Free - true if the pages are being freed, false if they're being allocated.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void MarkRegionRun(PoolRegion *Region, uint32_t Start, uint32_t Pages, bool Free) {
+    for (uint32_t i = Start; i < Start + Pages; i++) {
+        bool IsFree = (Region->FreeMap[i >> 6] & (1ull << (i & 63))) != 0;
+        if (IsFree == Free) {
+            KeFatalError(
+                KE_PANIC_BAD_PFN_HEADER,
+                Region->PhysicalAddress + ((uint64_t)i << MM_PAGE_SHIFT),
+                MI_PAGE_ENTRY(Region->PhysicalAddress + ((uint64_t)i << MM_PAGE_SHIFT)).Flags,
+                0,
+                0);
+        }
+
+        Region->FreeMap[i >> 6] ^= 1ull << (i & 63);
+    }
+
+    if (Free) {
+        Region->FreePages += Pages;
+    } else {
+        Region->FreePages -= Pages;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function grabs and maps a new large page region. The region lock is expected to be
+ *     held by the caller.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     New region, or NULL if we couldn't get enough contiguous memory for one.
+ *-----------------------------------------------------------------------------------------------*/
+static PoolRegion *CreateRegion(void) {
+    /* We need both the virtual and the physical addresses to be aligned (which might fail if the
+     * physical memory is too fragmented). */
+    PoolRegion *Region = MiAllocateAlignedPoolSpace(MI_LARGE_PAGE_PAGES);
+    if (!Region) {
+        return NULL;
+    }
+
+    uint64_t PhysicalAddress =
+        MmAllocateContiguousPages(MI_LARGE_PAGE_PAGES, MI_LARGE_PAGE_SIZE, 0);
+    if (!PhysicalAddress) {
+        MiFreePoolSpace(Region, MI_LARGE_PAGE_PAGES);
+        return NULL;
+    }
+
+    if (!HalpMapContiguousPages(
+            Region, PhysicalAddress, MI_LARGE_PAGE_SIZE, MI_MAP_WRITE | MI_MAP_LARGE)) {
+        MmFreeContiguousPages(PhysicalAddress, MI_LARGE_PAGE_PAGES);
+        MiFreePoolSpace(Region, MI_LARGE_PAGE_PAGES);
         return NULL;
     }
 
-    /* We just need the bitmap lock, and then it's as simple as doing a bitmap search. */
-    KeAcquireSpinLockAtCurrentIrql(&BitmapLock);
-    uint64_t Index = RtFindClearBitsAndSet(&MiPoolBitmap, MiPoolBitmapHint, Pages);
-    if (Index != (uint64_t)-1) {
-        MiPoolBitmapHint = Index + Pages;
+    /* Everything but the header page starts out free. */
+    Region->PhysicalAddress = PhysicalAddress;
+    Region->FreePages = MI_LARGE_PAGE_PAGES - 1;
+    for (uint32_t i = 0; i < MI_LARGE_PAGE_PAGES / 64; i++) {
+        Region->FreeMap[i] = UINT64_MAX;
     }
 
-    KeReleaseSpinLockAtCurrentIrql(&BitmapLock);
-    return Index != (uint64_t)-1 ? (void *)(MI_POOL_START + (Index << MM_PAGE_SHIFT)) : NULL;
+    Region->FreeMap[0] &= ~1ull;
+    RtPushDList(&RegionList, &Region->ListHeader);
+    RegionCount++;
+    return Region;
 }
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function returns back a virtual memory range we're not using anymore.
+ *     This function carves a small allocation out of one of the large page regions, grabbing a
+ *     new region if required. We expect to be called at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     Pages - How many pages we need (should be less than a large page).
+ *
+ * RETURN VALUE:
+ *     Virtual (mapped) pointer to the allocated space, or NULL if we couldn't get a new region.
+ *-----------------------------------------------------------------------------------------------*/
+static void *CarveRegion(uint32_t Pages) {
+    KeAcquireSpinLockAtCurrentIrql(&RegionLock);
+
+    /* The list only has regions with free pages left (most recently used first). */
+    PoolRegion *Region = NULL;
+    uint32_t Start = 0;
+    for (RtDList *ListHeader = RegionList.Next; ListHeader != &RegionList;
+         ListHeader = ListHeader->Next) {
+        PoolRegion *Entry = CONTAINING_RECORD(ListHeader, PoolRegion, ListHeader);
+        if (Entry->FreePages >= Pages) {
+            Start = FindRegionRun(Entry, Pages);
+            if (Start) {
+                Region = Entry;
+                break;
+            }
+        }
+    }
+
+    if (!Region) {
+        Region = CreateRegion();
+        if (!Region) {
+            KeReleaseSpinLockAtCurrentIrql(&RegionLock);
+            return NULL;
+        }
+
+        Start = 1;
+    }
+
+    MarkRegionRun(Region, Start, Pages, false);
+    if (!Region->FreePages) {
+        RtUnlinkDList(&Region->ListHeader);
+    }
+
+    /* The pages are already marked as used (by MmAllocateContiguousPages), we just need to mark
+     * them as part of the pool (and of the region). */
+    uint64_t PhysicalAddress = Region->PhysicalAddress + ((uint64_t)Start << MM_PAGE_SHIFT);
+    MiPageEntry *Entry = &MI_PAGE_ENTRY(PhysicalAddress);
+    for (uint32_t i = 0; i < Pages; i++) {
+        Entry[i].PoolItem = 1;
+        Entry[i].RegionItem = 1;
+    }
+
+    Entry->PoolBase = 1;
+    Entry->Pages = Pages;
+    KeReleaseSpinLockAtCurrentIrql(&RegionLock);
+
+    __atomic_fetch_add(&MiTotalPoolPages, Pages, __ATOMIC_RELAXED);
+    return (char *)Region + ((uint64_t)Start << MM_PAGE_SHIFT);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns an allocation carved out of a large page region back into the
+ *     region's free map, releasing the whole region once it becomes completely free (as long as
+ *     it isn't the last region left). We expect to be called at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     Base - First virtual address of the allocation.
+ *     Pages - How many pages the allocation has.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ReturnToRegion(void *Base, uint32_t Pages) {
+    PoolRegion *Region = (PoolRegion *)((uint64_t)Base & ~(MI_LARGE_PAGE_SIZE - 1));
+    uint32_t Start = ((uint64_t)Base - (uint64_t)Region) >> MM_PAGE_SHIFT;
+    MiPageEntry *Entry =
+        &MI_PAGE_ENTRY(Region->PhysicalAddress + ((uint64_t)Start << MM_PAGE_SHIFT));
+
+    for (uint32_t i = 0; i < Pages; i++) {
+        if (!Entry[i].Used || !Entry[i].PoolItem || !Entry[i].RegionItem) {
+            KeFatalError(
+                KE_PANIC_BAD_PFN_HEADER,
+                Region->PhysicalAddress + ((uint64_t)(Start + i) << MM_PAGE_SHIFT),
+                Entry[i].Flags,
+                0,
+                0);
+        }
+
+        Entry[i].PoolBase = 0;
+        Entry[i].PoolItem = 0;
+        Entry[i].RegionItem = 0;
+    }
+
+    KeAcquireSpinLockAtCurrentIrql(&RegionLock);
+
+    if (!Region->FreePages) {
+        RtPushDList(&RegionList, &Region->ListHeader);
+    }
+
+    MarkRegionRun(Region, Start, Pages, true);
+
+    /* Keep the last region around even if it's empty, so that alloc/free churn around a single
+     * allocation doesn't keep mapping and unmapping large pages. */
+    bool Release = Region->FreePages == MI_LARGE_PAGE_PAGES - 1 && RegionCount > 1;
+    if (Release) {
+        RtUnlinkDList(&Region->ListHeader);
+        RegionCount--;
+    }
+
+    KeReleaseSpinLockAtCurrentIrql(&RegionLock);
+    __atomic_fetch_sub(&MiTotalPoolPages, Pages, __ATOMIC_RELAXED);
+
+    /* The whole large page is inside the range, so this drops it without ever splitting it. */
+    if (Release) {
+        uint64_t PhysicalAddress = Region->PhysicalAddress;
+        HalpUnmapPages(Region, MI_LARGE_PAGE_SIZE);
+        MmFreeContiguousPages(PhysicalAddress, MI_LARGE_PAGE_PAGES);
+        MiFreePoolSpace(Region, MI_LARGE_PAGE_PAGES);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function unmaps and returns all pages of an already validated pool allocation back to
+ *     the page allocator (bypassing the caches).
  *
  * PARAMETERS:
  *     Base - First virtual address of the allocation.
- *     Pages - How many pages we're returning.
+ *     Pages - How many pages the allocation has.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void ReleasePoolPages(void *Base, uint32_t Pages) {
+    /* Allocations carved out of a large page region go back into it (instead of splitting the
+     * large page). */
+    uint64_t PhysicalAddress = HalpGetPhysicalAddress(Base);
+    MiPageEntry *PageEntry = &MI_PAGE_ENTRY(PhysicalAddress);
+    if (PageEntry->RegionItem) {
+        ReturnToRegion(Base, Pages);
+        return;
+    }
+
+    /* Otherwise, start by freeing the base/first block. */
+    PageEntry->PoolBase = 0;
+    PageEntry->PoolItem = 0;
+    MmFreeSinglePage(PhysicalAddress);
+
+    /* And follow up by validating and freeing up the remaining memory. */
+    for (uint32_t i = 1; i < Pages; i++) {
+        PhysicalAddress = HalpGetPhysicalAddress((char *)Base + (i << MM_PAGE_SHIFT));
+        PageEntry = &MI_PAGE_ENTRY(PhysicalAddress);
+        if (!PageEntry->Used || !PageEntry->PoolItem) {
+            KeFatalError(KE_PANIC_BAD_PFN_HEADER, PhysicalAddress, PageEntry->Flags, 0, 0);
+        }
+
+        PageEntry->PoolItem = 0;
+        MmFreeSinglePage(PhysicalAddress);
+    }
+
+    /* And wrap up by unmapping and returning the whole range. */
+    HalpUnmapPages(Base, Pages << MM_PAGE_SHIFT);
+    MiFreePoolSpace(Base, Pages);
+    __atomic_fetch_sub(&MiTotalPoolPages, Pages, __ATOMIC_RELAXED);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns everything in the given processor's small allocation caches back to
+ *     the page allocator. This should be called at DISPATCH, on the processor that owns the
+ *     caches.
+ *
+ * PARAMETERS:
+ *     Processor - Current processor.
  *
  * RETURN VALUE:
  *     None.
  *-----------------------------------------------------------------------------------------------*/
-void MiFreePoolSpace(void *Base, uint32_t Pages) {
-    uint64_t Index = ((uint64_t)Base - MI_POOL_START) >> MM_PAGE_SHIFT;
-    KeAcquireSpinLockAtCurrentIrql(&BitmapLock);
-    RtClearBits(&MiPoolBitmap, Index, Pages);
-    MiPoolBitmapHint = Index;
-    KeReleaseSpinLockAtCurrentIrql(&BitmapLock);
+static void DrainPageCache(KeProcessor *Processor) {
+    Processor->PoolPageCacheGeneration = __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED);
+
+    for (uint32_t Pages = 1; Pages <= 4; Pages++) {
+        while (Processor->FreePoolPageListHead[Pages - 1].Next) {
+            void *Base = RtPopSList(&Processor->FreePoolPageListHead[Pages - 1]);
+            Processor->FreePoolPageListSize[Pages - 1]--;
+            ReleasePoolPages(Base, Pages);
+        }
+    }
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -69,11 +352,17 @@ void MiFreePoolSpace(void *Base, uint32_t Pages) {
  *
  * PARAMETERS:
  *     Pages - How many pages we need.
+ *     Zeroed - Optional; Set this if the caller needs the memory cleared, it'll be set to true if
+ *              all the pages came pre-zeroed (and the caller can skip clearing them).
  *
  * RETURN VALUE:
  *     Virtual (mapped) pointer to the allocated space, or NULL if we failed to allocate it.
  *-----------------------------------------------------------------------------------------------*/
-void *MiAllocatePoolPages(uint32_t Pages) {
+void *MiAllocatePoolPages(uint32_t Pages, bool *Zeroed) {
+    if (Zeroed) {
+        *Zeroed = false;
+    }
+
     if (!Pages) {
         return NULL;
     }
@@ -83,6 +372,11 @@ void *MiAllocatePoolPages(uint32_t Pages) {
     if (Pages <= 4) {
         /* Start by checking in the per-processor list (as that's lock-free). */
         KeProcessor *Processor = KeGetCurrentProcessor();
+        if (Processor->PoolPageCacheGeneration !=
+            __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED)) {
+            DrainPageCache(Processor);
+        }
+
         RtSList *ListHeader = RtPopSList(&Processor->FreePoolPageListHead[Pages - 1]);
 
         /* And if that fails, try grabbing something out of the global list (that needs a lock). */
@@ -91,6 +385,10 @@ void *MiAllocatePoolPages(uint32_t Pages) {
         } else {
             KeAcquireSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
             ListHeader = RtPopSList(&FreeLists[Pages - 1]);
+            if (ListHeader) {
+                FreeListSize[Pages - 1]--;
+            }
+
             KeReleaseSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
         }
 
@@ -106,35 +404,81 @@ void *MiAllocatePoolPages(uint32_t Pages) {
         }
     }
 
-    /* Otherwise, we need to grab more virtual space. */
-    void *VirtualAddress = MiAllocatePoolSpace(Pages);
+    /* Pre-zeroed pages are preferred over large pages if the caller is going to clear the memory
+     * (the large page paths are never pre-zeroed). */
+    bool PreferZeroed = Zeroed && __atomic_load_n(&MiTotalZeroedPages, __ATOMIC_RELAXED) >= Pages;
+    bool AllZeroed = true;
+
+    /* Anything smaller than a large page gets carved out of a shared large page region (to save
+     * on TLB entries), as long as we can find enough contiguous physical memory for one. */
+    if (Pages < MI_LARGE_PAGE_PAGES && !PreferZeroed) {
+        void *VirtualAddress = CarveRegion(Pages);
+        if (VirtualAddress) {
+            return VirtualAddress;
+        }
+    }
+
+    /* Otherwise, we need to grab more virtual space (aligned to a large page if the allocation is
+     * big enough to use them). */
+    bool UseLargePages = Pages >= MI_LARGE_PAGE_PAGES && !PreferZeroed;
+    char *VirtualAddress =
+        UseLargePages ? MiAllocateAlignedPoolSpace(Pages) : MiAllocatePoolSpace(Pages);
     if (!VirtualAddress) {
         return NULL;
     }
 
     uint32_t AllocatedPages = 0;
-    for (uint64_t Offset = 0; Offset < Pages << MM_PAGE_SHIFT; Offset += MM_PAGE_SIZE) {
-        uint64_t PhysicalAddress = MmAllocateSinglePage();
-        if (!PhysicalAddress) {
-            break;
+    while (AllocatedPages < Pages) {
+        char *Target = VirtualAddress + ((uint64_t)AllocatedPages << MM_PAGE_SHIFT);
+        uint64_t PhysicalAddress = 0;
+        uint32_t ChunkPages = 1;
+
+        /* Try backing each full large page sized chunk with a real large page first. */
+        if (UseLargePages && Pages - AllocatedPages >= MI_LARGE_PAGE_PAGES) {
+            PhysicalAddress = MmAllocateContiguousPages(MI_LARGE_PAGE_PAGES, MI_LARGE_PAGE_SIZE, 0);
+            if (PhysicalAddress) {
+                if (!HalpMapContiguousPages(
+                        Target, PhysicalAddress, MI_LARGE_PAGE_SIZE, MI_MAP_WRITE | MI_MAP_LARGE)) {
+                    MmFreeContiguousPages(PhysicalAddress, MI_LARGE_PAGE_PAGES);
+                    break;
+                }
+
+                ChunkPages = MI_LARGE_PAGE_PAGES;
+                AllZeroed = false;
+            }
         }
 
-        if (!HalpMapContiguousPages(
-                VirtualAddress + Offset, PhysicalAddress, MM_PAGE_SIZE, MI_MAP_WRITE)) {
-            MmFreeSinglePage(PhysicalAddress);
-            break;
+        /* Otherwise, map a single page (pre-zeroed if possible). */
+        if (!PhysicalAddress) {
+            PhysicalAddress = PreferZeroed ? MiTryAllocateZeroedPage() : 0;
+            if (!PhysicalAddress) {
+                PhysicalAddress = MmAllocateSinglePage();
+                AllZeroed = false;
+            }
+
+            if (!PhysicalAddress) {
+                break;
+            }
+
+            if (!HalpMapContiguousPages(Target, PhysicalAddress, MM_PAGE_SIZE, MI_MAP_WRITE)) {
+                MmFreeSinglePage(PhysicalAddress);
+                break;
+            }
         }
 
         /* Mark the pages of the pool as such. */
         MiPageEntry *Entry = &MI_PAGE_ENTRY(PhysicalAddress);
-        Entry->Used = 1;
-        Entry->PoolItem = 1;
-        if (!Offset) {
+        for (uint32_t i = 0; i < ChunkPages; i++) {
+            Entry[i].Used = 1;
+            Entry[i].PoolItem = 1;
+        }
+
+        if (!AllocatedPages) {
             Entry->PoolBase = 1;
             Entry->Pages = Pages;
         }
 
-        AllocatedPages++;
+        AllocatedPages += ChunkPages;
     }
 
     /* And clean it up if we failed to map (or allocate) something. */
@@ -156,6 +500,10 @@ void *MiAllocatePoolPages(uint32_t Pages) {
         return NULL;
     }
 
+    if (Zeroed) {
+        *Zeroed = AllZeroed;
+    }
+
     __atomic_fetch_add(&MiTotalPoolPages, Pages, __ATOMIC_RELAXED);
     return VirtualAddress;
 }
@@ -180,44 +528,73 @@ uint32_t MiFreePoolPages(void *Base) {
     }
 
     /* For small (up to 4 pages) blocks, cache this entry as is in their respective buckets (rather
-     * than returning the memory). TODO: Should we limit the size of the global cache? Or leave it
-     * uncapped, and return the memory (or part of it) if our memory usage is above a certain
-     * point? */
-    if (Pages <= 4) {
+     * than returning the memory), as long as the caches aren't full, and we're not running low on
+     * free memory. */
+    if (Pages <= 4 && __atomic_load_n(&MiTotalFreePages, __ATOMIC_RELAXED) >= MiPoolTrimWatermark) {
         KeProcessor *Processor = KeGetCurrentProcessor();
+        if (Processor->PoolPageCacheGeneration !=
+            __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED)) {
+            DrainPageCache(Processor);
+        }
 
         if (Processor->FreePoolPageListSize[Pages - 1] < MI_PROCESSOR_POOL_CACHE_MAX_SIZE) {
             RtPushSList(&Processor->FreePoolPageListHead[Pages - 1], Base);
             Processor->FreePoolPageListSize[Pages - 1]++;
-        } else {
-            KeAcquireSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
+            return Pages;
+        }
+
+        bool Cached = false;
+        KeAcquireSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
+        if (FreeListSize[Pages - 1] < MI_POOL_PAGE_CACHE_MAX_SIZE) {
             RtPushSList(&FreeLists[Pages - 1], Base);
-            KeReleaseSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
+            FreeListSize[Pages - 1]++;
+            Cached = true;
         }
 
-        return Pages;
+        KeReleaseSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
+        if (Cached) {
+            return Pages;
+        }
     }
 
-    /* Otherwise, start by freeing the base/first block (and unmapping it). */
-    PageEntry->PoolBase = 0;
-    PageEntry->PoolItem = 0;
-    MmFreeSinglePage(PhysicalAddress);
+    ReleasePoolPages(Base, Pages);
+    return Pages;
+}
 
-    /* And follow up by validating and freeing up the remaining memory. */
-    for (uint32_t i = 1; i < Pages; i++) {
-        PhysicalAddress = HalpGetPhysicalAddress((char *)Base + (i << MM_PAGE_SHIFT));
-        PageEntry = &MI_PAGE_ENTRY(PhysicalAddress);
-        if (!PageEntry->Used || !PageEntry->PoolItem) {
-            KeFatalError(KE_PANIC_BAD_PFN_HEADER, PhysicalAddress, PageEntry->Flags, 0, 0);
-        }
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns everything cached in the global small allocation caches (and in the
+ *     current processor's caches) back to the page allocator; The other processors drain their
+ *     own caches on their next small allocation or free. We expect to be called at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTrimPoolPages(void) {
+    /* The local caches are only ever touched by their owners, so we can only drain ours right
+     * now. */
+    __atomic_add_fetch(&DrainGeneration, 1, __ATOMIC_RELAXED);
+    DrainPageCache(KeGetCurrentProcessor());
 
-        PageEntry->PoolItem = 0;
-        MmFreeSinglePage(PhysicalAddress);
-    }
+    for (uint32_t Pages = 1; Pages <= 4; Pages++) {
+        /* For the global one, only hold the lock while popping (as releasing the pages might
+         * need a TLB shootdown). */
+        while (true) {
+            KeAcquireSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
+            void *Base = RtPopSList(&FreeLists[Pages - 1]);
+            if (Base) {
+                FreeListSize[Pages - 1]--;
+            }
 
-    /* And wrap up by unmapping and returning the whole range. */
-    HalpUnmapPages(Base, Pages << MM_PAGE_SHIFT);
-    MiFreePoolSpace(Base, Pages);
-    __atomic_fetch_sub(&MiTotalPoolPages, Pages, __ATOMIC_RELAXED);
-    return Pages;
+            KeReleaseSpinLockAtCurrentIrql(&FreeListLock[Pages - 1]);
+            if (!Base) {
+                break;
+            }
+
+            ReleasePoolPages(Base, Pages);
+        }
+    }
 }
@@ -0,0 +1,857 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <crt_impl/rand.h>
+#include <kernel/halp.h>
+#include <kernel/ke.h>
+#include <kernel/mi.h>
+#include <kernel/mm.h>
+#include <os/containing_record.h>
+#include <rt/avltree.h>
+#include <rt/list.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static KeSpinLock RangeLock = {0};
+static RtAvlTree AddressTree = {0};
+static RtAvlTree SizeTree = {0};
+static RtSList FreeRangeListHead = {0};
+static uint64_t FreeRangeCount = 0;
+static KeSpinLock GrowLock = {0};
+static uint64_t RangePages = 0;
+static uint64_t TotalPages = 0;
+static uint64_t DrainGeneration = 0;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function compares two free ranges by their base address.
+ *
+ * PARAMETERS:
+ *     FirstStruct - Range already inside the tree.
+ *     SecondStruct - Range we're searching for/inserting.
+ *
+ * RETURN VALUE:
+ *     Which direction the search should go.
+ *-----------------------------------------------------------------------------------------------*/
+static RtAvlCompareResult CompareAddress(RtAvlNode *FirstStruct, RtAvlNode *SecondStruct) {
+    MiPoolSpaceRange *First = CONTAINING_RECORD(FirstStruct, MiPoolSpaceRange, AddressNode);
+    MiPoolSpaceRange *Second = CONTAINING_RECORD(SecondStruct, MiPoolSpaceRange, AddressNode);
+
+    if (First->Base < Second->Base) {
+        return RT_AVL_COMPARE_RESULT_RIGHT;
+    } else if (First->Base > Second->Base) {
+        return RT_AVL_COMPARE_RESULT_LEFT;
+    } else {
+        return RT_AVL_COMPARE_RESULT_EQUAL;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function compares two free ranges by their size (using the base address to break any
+ *     ties, so that all keys are unique).
+ *
+ * PARAMETERS:
+ *     FirstStruct - Range already inside the tree.
+ *     SecondStruct - Range we're searching for/inserting.
+ *
+ * RETURN VALUE:
+ *     Which direction the search should go.
+ *-----------------------------------------------------------------------------------------------*/
+static RtAvlCompareResult CompareSize(RtAvlNode *FirstStruct, RtAvlNode *SecondStruct) {
+    MiPoolSpaceRange *First = CONTAINING_RECORD(FirstStruct, MiPoolSpaceRange, SizeNode);
+    MiPoolSpaceRange *Second = CONTAINING_RECORD(SecondStruct, MiPoolSpaceRange, SizeNode);
+
+    if (First->Pages < Second->Pages) {
+        return RT_AVL_COMPARE_RESULT_RIGHT;
+    } else if (First->Pages > Second->Pages) {
+        return RT_AVL_COMPARE_RESULT_LEFT;
+    } else {
+        return CompareAddress(&First->AddressNode, &Second->AddressNode);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function makes sure we have enough unused range descriptors for the next operation on
+ *     the trees, mapping new pages of descriptors if required. This should be called without the
+ *     range lock (so that the range lock is never held while we're calling into the page
+ *     allocator or touching the page tables).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     false if we're still short on descriptors and couldn't map any more of them, true otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool ReserveRangeDescriptors(void) {
+    if (__atomic_load_n(&FreeRangeCount, __ATOMIC_RELAXED) >= MI_POOL_RANGE_RESERVE) {
+        return true;
+    }
+
+    /* Only one processor grows the descriptor space at a time; Everyone else can keep using the
+     * trees while we map the new page. */
+    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&GrowLock, KE_IRQL_DISPATCH);
+
+    while (__atomic_load_n(&FreeRangeCount, __ATOMIC_RELAXED) < MI_POOL_RANGE_RESERVE &&
+           ((RangePages + 1) << MM_PAGE_SHIFT) <= MI_POOL_RANGE_SIZE) {
+        /* The descriptors need to be usable before the page allocator is up (as we need at least
+         * one during initialization). */
+        char *VirtualAddress = (char *)MI_POOL_RANGE_START + (RangePages << MM_PAGE_SHIFT);
+        uint64_t PhysicalAddress = MiPageList ? MmAllocateSinglePage() : MiAllocateEarlyPages(1);
+        if (!PhysicalAddress) {
+            break;
+        }
+
+        if (!HalpMapContiguousPages(VirtualAddress, PhysicalAddress, MM_PAGE_SIZE, MI_MAP_WRITE)) {
+            if (MiPageList) {
+                MmFreeSinglePage(PhysicalAddress);
+            }
+
+            break;
+        }
+
+        MiPoolSpaceRange *Ranges = (MiPoolSpaceRange *)VirtualAddress;
+        uint64_t Count = MM_PAGE_SIZE / sizeof(MiPoolSpaceRange);
+        KeAcquireSpinLockAtCurrentIrql(&RangeLock);
+
+        for (uint64_t i = 0; i < Count; i++) {
+            RtPushSList(&FreeRangeListHead, &Ranges[i].ListHeader);
+        }
+
+        __atomic_add_fetch(&FreeRangeCount, Count, __ATOMIC_RELAXED);
+        KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+        RangePages++;
+    }
+
+    bool Reserved = __atomic_load_n(&FreeRangeCount, __ATOMIC_RELAXED) >= MI_POOL_RANGE_RESERVE;
+    KeReleaseSpinLockAndLowerIrql(&GrowLock, OldIrql);
+    return Reserved;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function acquires the range lock, making sure we have at least the given amount of
+ *     unused range descriptors once we own it. Other processors might use up the descriptors we
+ *     reserved before we get the lock, so we keep reserving (and retrying) until we either own
+ *     the lock with enough descriptors, or the descriptor space can't grow anymore.
+ *
+ * PARAMETERS:
+ *     Needed - How many unused descriptors we need.
+ *
+ * RETURN VALUE:
+ *     true if we have enough descriptors, false otherwise (the lock is owned either way).
+ *-----------------------------------------------------------------------------------------------*/
+static bool AcquireRangeLock(uint64_t Needed) {
+    while (true) {
+        bool Reserved = ReserveRangeDescriptors();
+        KeAcquireSpinLockAtCurrentIrql(&RangeLock);
+        if (FreeRangeCount >= Needed) {
+            return true;
+        } else if (!Reserved) {
+            return false;
+        }
+
+        KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function grabs an unused range descriptor. The range lock is expected to be held by the
+ *     caller.
+ *
+ * PARAMETERS:
+ *     Free - Set this if the descriptor is for returning a range; Only those can use the last
+ *            MI_POOL_RANGE_FREE_RESERVE descriptors (so that frees never need to leak space).
+ *
+ * RETURN VALUE:
+ *     Pointer to the descriptor, or NULL if we ran out of reserved descriptors.
+ *-----------------------------------------------------------------------------------------------*/
+static MiPoolSpaceRange *AllocateRangeDescriptor(bool Free) {
+    if (!Free && FreeRangeCount <= MI_POOL_RANGE_FREE_RESERVE) {
+        return NULL;
+    }
+
+    RtSList *ListHeader = RtPopSList(&FreeRangeListHead);
+    if (!ListHeader) {
+        return NULL;
+    }
+
+    __atomic_sub_fetch(&FreeRangeCount, 1, __ATOMIC_RELAXED);
+    return CONTAINING_RECORD(ListHeader, MiPoolSpaceRange, ListHeader);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns a range descriptor we're not using anymore. The range lock is expected
+ *     to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Range - Which descriptor to return.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FreeRangeDescriptor(MiPoolSpaceRange *Range) {
+    RtPushSList(&FreeRangeListHead, &Range->ListHeader);
+    __atomic_add_fetch(&FreeRangeCount, 1, __ATOMIC_RELAXED);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds the smallest free range that still fits the given amount of pages. The
+ *     range lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Pages - How many pages we need.
+ *
+ * RETURN VALUE:
+ *     Pointer to the range, or NULL if there are none big enough.
+ *-----------------------------------------------------------------------------------------------*/
+static MiPoolSpaceRange *FindBestFit(uint64_t Pages) {
+    MiPoolSpaceRange *BestRange = NULL;
+    RtAvlNode *Node = SizeTree.Root;
+
+    while (Node) {
+        MiPoolSpaceRange *Range = CONTAINING_RECORD(Node, MiPoolSpaceRange, SizeNode);
+        if (Range->Pages >= Pages) {
+            BestRange = Range;
+            Node = Node->Left;
+        } else {
+            Node = Node->Right;
+        }
+    }
+
+    return BestRange;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds the free ranges directly before and after the given page. The range
+ *     lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Base - Which page we're searching around.
+ *     Previous - Output; Last range starting before the page (or NULL if there is none).
+ *     Next - Output; First range starting after the page (or NULL if there is none).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FindNeighbours(uint64_t Base, MiPoolSpaceRange **Previous, MiPoolSpaceRange **Next) {
+    RtAvlNode *Node = AddressTree.Root;
+
+    *Previous = NULL;
+    *Next = NULL;
+
+    while (Node) {
+        MiPoolSpaceRange *Range = CONTAINING_RECORD(Node, MiPoolSpaceRange, AddressNode);
+        if (Range->Base < Base) {
+            *Previous = Range;
+            Node = Node->Right;
+        } else {
+            *Next = Range;
+            Node = Node->Left;
+        }
+    }
+}
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function validates a free range we just inserted or resized, making sure it's inside
+ *     the pool, doesn't overlap or touch its neighbours (touching ranges should have been merged),
+ *     and that both trees still agree on how many ranges we have. The range lock is expected to be
+ *     held by the caller.
+ *
+ * PARAMETERS:
+ *     Range - Which range to validate.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckRange(MiPoolSpaceRange *Range) {
+    MiPoolSpaceRange *Previous;
+    MiPoolSpaceRange *Next;
+    FindNeighbours(Range->Base, &Previous, &Next);
+
+    if (!Range->Pages || Range->Base + Range->Pages > TotalPages || Next != Range ||
+        (Previous && Previous->Base + Previous->Pages >= Range->Base) ||
+        RtQuerySizeAvlTree(&AddressTree) != RtQuerySizeAvlTree(&SizeTree)) {
+        KeFatalError(
+            KE_PANIC_BAD_POOL_HEADER,
+            Range->Base,
+            Range->Pages,
+            Previous ? Previous->Base + Previous->Pages : 0,
+            TotalPages);
+    }
+
+    FindNeighbours(Range->Base + 1, &Previous, &Next);
+    if (Next && Range->Base + Range->Pages >= Next->Base) {
+        KeFatalError(KE_PANIC_BAD_POOL_HEADER, Range->Base, Range->Pages, Next->Base, TotalPages);
+    }
+}
+#endif /* NDEBUG */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates a range of pages from the trees. The range lock is expected to be
+ *     held by the caller.
+ *
+ * PARAMETERS:
+ *     Pages - How many pages we need.
+ *     Alignment - Alignment (in pages, and a power of two) of the first page.
+ *
+ * RETURN VALUE:
+ *     Index of the first page (relative to the pool start), or -1 on failure.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t AllocateRange(uint64_t Pages, uint64_t Alignment) {
+    MiPoolSpaceRange *Range = FindBestFit(Pages + Alignment - 1);
+    if (!Range) {
+        return (uint64_t)-1;
+    }
+
+    uint64_t Base = (Range->Base + Alignment - 1) & ~(Alignment - 1);
+    uint64_t HeadPages = Base - Range->Base;
+    uint64_t TailPages = Range->Base + Range->Pages - Base - Pages;
+
+    /* Splitting the range in two is the only case where we need a new descriptor, so grab it
+     * before we start modifying the trees. */
+    MiPoolSpaceRange *TailRange = NULL;
+    if (HeadPages && TailPages) {
+        TailRange = AllocateRangeDescriptor(false);
+        if (!TailRange) {
+            return (uint64_t)-1;
+        }
+    }
+
+    RtRemoveAvlTree(&SizeTree, &Range->SizeNode);
+
+    if (!HeadPages && !TailPages) {
+        RtRemoveAvlTree(&AddressTree, &Range->AddressNode);
+        FreeRangeDescriptor(Range);
+        return Base;
+    }
+
+    /* Shrinking the range doesn't change its position relative to the other ranges, so we only
+     * need to reinsert it into the size tree. */
+    if (!HeadPages) {
+        Range->Base += Pages;
+        Range->Pages = TailPages;
+    } else {
+        Range->Pages = HeadPages;
+    }
+
+    RtInsertAvlTree(&SizeTree, &Range->SizeNode);
+
+    if (TailRange) {
+        TailRange->Base = Base + Pages;
+        TailRange->Pages = TailPages;
+        RtInsertAvlTree(&AddressTree, &TailRange->AddressNode);
+        RtInsertAvlTree(&SizeTree, &TailRange->SizeNode);
+    }
+
+#ifndef NDEBUG
+    CheckRange(Range);
+    if (TailRange) {
+        CheckRange(TailRange);
+    }
+#endif /* NDEBUG */
+
+    return Base;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns a range of pages into the trees, merging it with its neighbours where
+ *     possible. The range lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Base - Index of the first page (relative to the pool start).
+ *     Pages - How many pages we're returning.
+ *
+ * RETURN VALUE:
+ *     true if the range was returned, false if we would need a new descriptor but ran out of them.
+ *-----------------------------------------------------------------------------------------------*/
+static bool FreeRange(uint64_t Base, uint64_t Pages) {
+    MiPoolSpaceRange *Previous;
+    MiPoolSpaceRange *Next;
+    FindNeighbours(Base, &Previous, &Next);
+
+#ifndef NDEBUG
+    /* Overlapping any free range means this is a double free (or a bogus range). */
+    if (Base + Pages > TotalPages || (Previous && Previous->Base + Previous->Pages > Base) ||
+        (Next && Base + Pages > Next->Base)) {
+        KeFatalError(
+            KE_PANIC_BAD_POOL_HEADER,
+            Base,
+            Pages,
+            Previous ? Previous->Base + Previous->Pages : 0,
+            Next ? Next->Base : TotalPages);
+    }
+#endif /* NDEBUG */
+
+    MiPoolSpaceRange *Range;
+    bool MergePrevious = Previous && Previous->Base + Previous->Pages == Base;
+    bool MergeNext = Next && Base + Pages == Next->Base;
+
+    if (MergePrevious && MergeNext) {
+        RtRemoveAvlTree(&SizeTree, &Next->SizeNode);
+        RtRemoveAvlTree(&AddressTree, &Next->AddressNode);
+        RtRemoveAvlTree(&SizeTree, &Previous->SizeNode);
+        Previous->Pages += Pages + Next->Pages;
+        RtInsertAvlTree(&SizeTree, &Previous->SizeNode);
+        FreeRangeDescriptor(Next);
+        Range = Previous;
+    } else if (MergePrevious) {
+        RtRemoveAvlTree(&SizeTree, &Previous->SizeNode);
+        Previous->Pages += Pages;
+        RtInsertAvlTree(&SizeTree, &Previous->SizeNode);
+        Range = Previous;
+    } else if (MergeNext) {
+        RtRemoveAvlTree(&SizeTree, &Next->SizeNode);
+        Next->Base = Base;
+        Next->Pages += Pages;
+        RtInsertAvlTree(&SizeTree, &Next->SizeNode);
+        Range = Next;
+    } else {
+        Range = AllocateRangeDescriptor(true);
+        if (!Range) {
+            return false;
+        }
+
+        Range->Base = Base;
+        Range->Pages = Pages;
+        RtInsertAvlTree(&AddressTree, &Range->AddressNode);
+        RtInsertAvlTree(&SizeTree, &Range->SizeNode);
+    }
+
+#ifndef NDEBUG
+    CheckRange(Range);
+#endif /* NDEBUG */
+
+    return true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns everything in the given processor's virtual space caches back to the
+ *     trees (so that it can be merged and used by the other processors). This should be called at
+ *     DISPATCH, on the processor that owns the caches.
+ *
+ * PARAMETERS:
+ *     Processor - Current processor.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void DrainCaches(KeProcessor *Processor) {
+    Processor->PoolSpaceCacheGeneration = __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED);
+    AcquireRangeLock(1);
+
+    /* Anything we can't get a descriptor for just stays on the cache for now. */
+    for (uint32_t i = 0; i < 4; i++) {
+        uint32_t *CacheSize = &Processor->PoolSpaceCacheSize[i];
+        while (*CacheSize && FreeRange(Processor->PoolSpaceCache[i][*CacheSize - 1], i + 1)) {
+            (*CacheSize)--;
+        }
+    }
+
+    KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates a range of pages from the trees, draining the per-processor caches
+ *     and trying again if nothing big enough was free. This should be called at DISPATCH.
+ *
+ * PARAMETERS:
+ *     Pages - How many pages we need.
+ *     Alignment - Alignment (in pages, and a power of two) of the first page.
+ *
+ * RETURN VALUE:
+ *     Index of the first page (relative to the pool start), or -1 on failure.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t AllocateRangeOrDrain(uint64_t Pages, uint64_t Alignment) {
+    AcquireRangeLock(MI_POOL_RANGE_FREE_RESERVE + 1);
+    uint64_t Base = AllocateRange(Pages, Alignment);
+    KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+    if (Base != (uint64_t)-1) {
+        return Base;
+    }
+
+    /* The space we need might be split across the per-processor caches; We can only drain our own
+     * (they're lock-free), so give ours back right now, and ask everyone else to do the same on
+     * their next pool space call. */
+    __atomic_add_fetch(&DrainGeneration, 1, __ATOMIC_RELAXED);
+    DrainCaches(KeGetCurrentProcessor());
+
+    AcquireRangeLock(MI_POOL_RANGE_FREE_RESERVE + 1);
+    Base = AllocateRange(Pages, Alignment);
+    KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+    return Base;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function sets up the free range trees for the pool virtual space.
+ *
+ * PARAMETERS:
+ *     PoolPages - Size of the pool space in pages.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiInitializePoolSpace(uint64_t PoolPages) {
+    RtInitializeAvlTree(&AddressTree, CompareAddress);
+    RtInitializeAvlTree(&SizeTree, CompareSize);
+    TotalPages = PoolPages;
+
+    /* The whole pool starts as a single free range. */
+    ReserveRangeDescriptors();
+    MiPoolSpaceRange *Range = AllocateRangeDescriptor(true);
+    if (!Range) {
+        KeFatalError(
+            KE_PANIC_KERNEL_INITIALIZATION_FAILURE,
+            KE_PANIC_PARAMETER_POOL_INITIALIZATION_FAILURE,
+            KE_PANIC_PARAMETER_OUT_OF_RESOURCES,
+            0,
+            0);
+    }
+
+    Range->Base = 0;
+    Range->Pages = PoolPages;
+    RtInsertAvlTree(&AddressTree, &Range->AddressNode);
+    RtInsertAvlTree(&SizeTree, &Range->SizeNode);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function directly allocates some virtual space that isn't mapped to any physical page.
+ *
+ * PARAMETERS:
+ *     Pages - How many pages we need.
+ *
+ * RETURN VALUE:
+ *     New virtual address (nothing mapped yet), or NULL on failure.
+ *-----------------------------------------------------------------------------------------------*/
+void *MiAllocatePoolSpace(uint32_t Pages) {
+    if (!Pages) {
+        return NULL;
+    }
+
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    uint64_t Base = (uint64_t)-1;
+
+    if (Processor->PoolSpaceCacheGeneration !=
+        __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED)) {
+        DrainCaches(Processor);
+    }
+
+    /* Small allocations go through the per-processor cache first (which is lock-free); When it's
+     * empty, refill it with a whole batch at once, so that we take the range lock less often. */
+    if (Pages <= 4) {
+        uint64_t *Cache = Processor->PoolSpaceCache[Pages - 1];
+        uint32_t *CacheSize = &Processor->PoolSpaceCacheSize[Pages - 1];
+
+        if (!*CacheSize) {
+            AcquireRangeLock(MI_POOL_RANGE_FREE_RESERVE + 1);
+            Base = AllocateRange(Pages * MI_POOL_SPACE_CACHE_BATCH_SIZE, 1);
+            KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+
+            if (Base != (uint64_t)-1) {
+                for (uint32_t i = MI_POOL_SPACE_CACHE_BATCH_SIZE; i > 0; i--) {
+                    Cache[(*CacheSize)++] = Base + (i - 1) * Pages;
+                }
+            }
+        }
+
+        if (*CacheSize) {
+            Base = Cache[--(*CacheSize)];
+            KeLowerIrql(OldIrql);
+            return (void *)(MI_POOL_START + (Base << MM_PAGE_SHIFT));
+        }
+    }
+
+    Base = AllocateRangeOrDrain(Pages, 1);
+    KeLowerIrql(OldIrql);
+    return Base != (uint64_t)-1 ? (void *)(MI_POOL_START + (Base << MM_PAGE_SHIFT)) : NULL;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function allocates some virtual space aligned to the large page size (so that it can be
+ *     backed by large pages).
+ *
+ * PARAMETERS:
+ *     Pages - How many pages we need.
+ *
+ * RETURN VALUE:
+ *     New virtual address (nothing mapped yet), or NULL on failure.
+ *-----------------------------------------------------------------------------------------------*/
+void *MiAllocateAlignedPoolSpace(uint32_t Pages) {
+    if (!Pages) {
+        return NULL;
+    }
+
+    /* The pool start itself is large page aligned, so aligning the page index is enough. */
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    uint64_t Base = AllocateRangeOrDrain(Pages, MI_LARGE_PAGE_PAGES);
+    KeLowerIrql(OldIrql);
+    return Base != (uint64_t)-1 ? (void *)(MI_POOL_START + (Base << MM_PAGE_SHIFT)) : NULL;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns back a virtual memory range we're not using anymore.
+ *
+ * PARAMETERS:
+ *     Base - First virtual address of the allocation.
+ *     Pages - How many pages we're returning.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiFreePoolSpace(void *Base, uint32_t Pages) {
+    if (!Pages) {
+        return;
+    }
+
+    uint64_t Index = ((uint64_t)Base - MI_POOL_START) >> MM_PAGE_SHIFT;
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+
+    if (Processor->PoolSpaceCacheGeneration !=
+        __atomic_load_n(&DrainGeneration, __ATOMIC_RELAXED)) {
+        DrainCaches(Processor);
+    }
+
+    /* Small ranges go back into the per-processor cache; If it's full, give half of it back to
+     * the trees (so that the other processors can use it). */
+    if (Pages <= 4) {
+        uint64_t *Cache = Processor->PoolSpaceCache[Pages - 1];
+        uint32_t *CacheSize = &Processor->PoolSpaceCacheSize[Pages - 1];
+
+        if (*CacheSize >= MM_POOL_SPACE_CACHE_SIZE) {
+            AcquireRangeLock(1);
+            while (*CacheSize > MM_POOL_SPACE_CACHE_SIZE / 2 &&
+                   FreeRange(Cache[*CacheSize - 1], Pages)) {
+                (*CacheSize)--;
+            }
+
+            KeReleaseSpinLockAtCurrentIrql(&RangeLock);
+        }
+
+        if (*CacheSize < MM_POOL_SPACE_CACHE_SIZE) {
+            Cache[(*CacheSize)++] = Index;
+            KeLowerIrql(OldIrql);
+            return;
+        }
+    }
+
+    /* Allocations can never use the last few descriptors, so unless the descriptor space is
+     * completely exhausted, we should always be able to return the range (instead of leaking
+     * it). */
+    AcquireRangeLock(1);
+    if (!FreeRange(Index, Pages)) {
+        KeFatalError(KE_PANIC_NO_PAGES_AVAILABLE, Index, Pages, FreeRangeCount, RangePages);
+    }
+
+    KeReleaseSpinLockAndLowerIrql(&RangeLock, OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns the current processor's cached virtual space back to the trees (and
+ *     asks the other processors to do the same on their next pool space call); This should be
+ *     called when we're running low on memory.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTrimPoolSpace(void) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    __atomic_add_fetch(&DrainGeneration, 1, __ATOMIC_RELAXED);
+    DrainCaches(KeGetCurrentProcessor());
+    KeLowerIrql(OldIrql);
+}
+
+#ifndef NDEBUG
+#define TEST_SLOTS 64
+#define TEST_ROUNDS 2048
+#define TEST_CHECK_INTERVAL 64
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function walks both free range trees, making sure the address tree is sorted, inside
+ *     the pool, and fully merged, and that the size tree is sorted and holds the exact same
+ *     ranges. The range lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     How many pages are free in the trees.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t CheckTrees(void) {
+    RtAvlNode *RestartKey = NULL;
+    MiPoolSpaceRange *Previous = NULL;
+    uint64_t FreePages = 0;
+
+    for (RtAvlNode *Node = RtEnumerateAvlTree(&AddressTree, &RestartKey); Node;
+         Node = RtEnumerateAvlTree(&AddressTree, &RestartKey)) {
+        MiPoolSpaceRange *Range = CONTAINING_RECORD(Node, MiPoolSpaceRange, AddressNode);
+        if (!Range->Pages || Range->Base + Range->Pages > TotalPages ||
+            (Previous && Previous->Base + Previous->Pages >= Range->Base)) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                Range->Base,
+                Range->Pages,
+                Previous ? Previous->Base + Previous->Pages : 0,
+                TotalPages);
+        }
+
+        FreePages += Range->Pages;
+        Previous = Range;
+    }
+
+    /* The size tree is sorted by size first (and base second), and should see every range we just
+     * saw on the address tree (a missed update there would make the best fit search go wrong). */
+    uint64_t SizePages = 0;
+    RestartKey = NULL;
+    Previous = NULL;
+
+    for (RtAvlNode *Node = RtEnumerateAvlTree(&SizeTree, &RestartKey); Node;
+         Node = RtEnumerateAvlTree(&SizeTree, &RestartKey)) {
+        MiPoolSpaceRange *Range = CONTAINING_RECORD(Node, MiPoolSpaceRange, SizeNode);
+        if (Previous && (Previous->Pages > Range->Pages ||
+                         (Previous->Pages == Range->Pages && Previous->Base >= Range->Base))) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE,
+                Previous->Base,
+                Previous->Pages,
+                Range->Base,
+                Range->Pages);
+        }
+
+        SizePages += Range->Pages;
+        Previous = Range;
+    }
+
+    if (SizePages != FreePages ||
+        RtQuerySizeAvlTree(&AddressTree) != RtQuerySizeAvlTree(&SizeTree)) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            FreePages,
+            SizePages,
+            RtQuerySizeAvlTree(&AddressTree),
+            RtQuerySizeAvlTree(&SizeTree));
+    }
+
+    return FreePages;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function exercises the pool virtual space allocator (debug builds only), randomly
+ *     mixing cached, direct and large page aligned allocations and frees, making sure they are
+ *     inside the pool, properly aligned, and don't overlap, that the trees stay consistent the
+ *     whole time, and that freeing everything (and draining the caches) merges it back into the
+ *     exact same free ranges we started with. This should be called during boot, before the other
+ *     processors are online.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void MiTestPoolSpace(void) {
+    uint64_t Bases[TEST_SLOTS] = {0};
+    uint32_t Sizes[TEST_SLOTS] = {0};
+
+    /* Start from a clean slate, so that the final state is directly comparable. */
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    DrainCaches(KeGetCurrentProcessor());
+    KeAcquireSpinLockAtCurrentIrql(&RangeLock);
+    uint64_t FreePages = CheckTrees();
+    int RangeCount = RtQuerySizeAvlTree(&AddressTree);
+    KeReleaseSpinLockAndLowerIrql(&RangeLock, OldIrql);
+
+    for (uint32_t Round = 0; Round < TEST_ROUNDS; Round++) {
+        uint32_t Slot = __rand64() % TEST_SLOTS;
+
+        if (Sizes[Slot]) {
+            MiFreePoolSpace((void *)Bases[Slot], Sizes[Slot]);
+            Sizes[Slot] = 0;
+        } else {
+            /* Half of the allocations are small enough to go through the per-processor caches,
+             * the rest are split between direct and large page aligned ones. */
+            uint64_t Type = __rand64() % 4;
+            uint64_t Alignment = MM_PAGE_SIZE;
+
+            if (Type < 2) {
+                Sizes[Slot] = __rand64() % 4 + 1;
+                Bases[Slot] = (uint64_t)MiAllocatePoolSpace(Sizes[Slot]);
+            } else if (Type == 2) {
+                Sizes[Slot] = __rand64() % 256 + 5;
+                Bases[Slot] = (uint64_t)MiAllocatePoolSpace(Sizes[Slot]);
+            } else {
+                Sizes[Slot] = __rand64() % (MI_LARGE_PAGE_PAGES * 2) + 1;
+                Bases[Slot] = (uint64_t)MiAllocateAlignedPoolSpace(Sizes[Slot]);
+                Alignment = MI_LARGE_PAGE_SIZE;
+            }
+
+            uint64_t Size = (uint64_t)Sizes[Slot] << MM_PAGE_SHIFT;
+            if (Bases[Slot] < MI_POOL_START ||
+                Bases[Slot] + Size > MI_POOL_START + (TotalPages << MM_PAGE_SHIFT) ||
+                (Bases[Slot] & (Alignment - 1))) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Bases[Slot], Sizes[Slot], Alignment, 0);
+            }
+
+            for (uint32_t i = 0; i < TEST_SLOTS; i++) {
+                if (i != Slot && Sizes[i] &&
+                    Bases[Slot] < Bases[i] + ((uint64_t)Sizes[i] << MM_PAGE_SHIFT) &&
+                    Bases[i] < Bases[Slot] + Size) {
+                    KeFatalError(
+                        KE_PANIC_SELF_TEST_FAILURE, Bases[Slot], Sizes[Slot], Bases[i], Sizes[i]);
+                }
+            }
+        }
+
+        if (!(Round % TEST_CHECK_INTERVAL)) {
+            OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+            KeAcquireSpinLockAtCurrentIrql(&RangeLock);
+            CheckTrees();
+            KeReleaseSpinLockAndLowerIrql(&RangeLock, OldIrql);
+        }
+    }
+
+    for (uint32_t i = 0; i < TEST_SLOTS; i++) {
+        if (Sizes[i]) {
+            MiFreePoolSpace((void *)Bases[i], Sizes[i]);
+        }
+    }
+
+    OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    DrainCaches(KeGetCurrentProcessor());
+    KeAcquireSpinLockAtCurrentIrql(&RangeLock);
+
+    uint64_t FinalFreePages = CheckTrees();
+    if (FinalFreePages != FreePages || RtQuerySizeAvlTree(&AddressTree) != RangeCount) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            FreePages,
+            FinalFreePages,
+            RangeCount,
+            RtQuerySizeAvlTree(&AddressTree));
+    }
+
+    KeReleaseSpinLockAndLowerIrql(&RangeLock, OldIrql);
+}
+#endif /* NDEBUG */
@@ -1,6 +1,7 @@
 /* SPDX-FileCopyrightText: (C) 2023-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <kernel/halp.h>
 #include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/mi.h>
@@ -15,6 +16,7 @@ static RtSList FreeList = {0};
 static KeSpinLock FreeListLock = {0};
 static KeSpinLock TagListLock[256] = {0};
 static MiPoolTrackerHeader *PoolTracker = NULL;
+static uint32_t NextShardIndex = 0;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
@@ -30,7 +32,7 @@ void MiInitializePoolTracker(void) {
     /* The initial tracker (which tracks the pool allocations themselves) is considered not
      * optional, and we'll just panic if it fails to be allocated. There should be no need to hold
      * the tag lock here, as SMP support isn't online yet. */
-    MiPoolTrackerHeader *Headers = MiAllocatePoolPages(1);
+    MiPoolTrackerHeader *Headers = MiAllocatePoolPages(1, NULL);
     if (!Headers) {
         KeFatalError(
             KE_PANIC_KERNEL_INITIALIZATION_FAILURE,
@@ -51,6 +53,7 @@ void MiInitializePoolTracker(void) {
     uint8_t PoolTagHash = MiGetTagHash(MM_POOL_TAG_POOL);
     PoolTracker = &Headers[0];
     memcpy(PoolTracker->Tag, MM_POOL_TAG_POOL, 4);
+    PoolTracker->Index = NextShardIndex++;
     PoolTracker->Allocations = 1;
     PoolTracker->AllocatedBytes = MM_PAGE_SIZE;
     PoolTracker->MaxAllocations = 1;
@@ -99,6 +102,40 @@ MiPoolTrackerHeader *MiFindTracker(const char Tag[4]) {
     return NULL;
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function moves the counters accumulated in the current processor's shard into the
+ *     global counters of the tracker, updating the max usage along the way. We expect to be called
+ *     at DISPATCH IRQL.
+ *
+ * PARAMETERS:
+ *     Tracker - Which tracker the shard belongs to.
+ *     Shard - Current processor's shard for the tracker.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FoldShard(MiPoolTrackerHeader *Tracker, MmPoolTrackerShard *Shard) {
+    /* Only we ever write to our own shard, but MmQueryPoolTags might be reading it at the same
+     * time, so use atomic (but relaxed/uncontended) accesses. */
+    int64_t Allocations = __atomic_exchange_n(&Shard->Allocations, 0, __ATOMIC_RELAXED);
+    int64_t AllocatedBytes = __atomic_exchange_n(&Shard->AllocatedBytes, 0, __ATOMIC_RELAXED);
+
+    /* The global counters can go temporarily negative (if the frees were folded before the
+     * allocations on another processor), so make sure to not update the max usage with those. */
+    int64_t TotalAllocations =
+        __atomic_add_fetch(&Tracker->Allocations, Allocations, __ATOMIC_RELAXED);
+    int64_t TotalAllocatedBytes =
+        __atomic_add_fetch(&Tracker->AllocatedBytes, AllocatedBytes, __ATOMIC_RELAXED);
+    if (TotalAllocations > 0) {
+        __atomic_fetch_max(&Tracker->MaxAllocations, TotalAllocations, __ATOMIC_RELAXED);
+    }
+
+    if (TotalAllocatedBytes > 0) {
+        __atomic_fetch_max(&Tracker->MaxAllocatedBytes, TotalAllocatedBytes, __ATOMIC_RELAXED);
+    }
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function tries updating the tag tracker list with a new allocation, possibly allocating
@@ -135,6 +172,7 @@ void MiAddPoolTracker(size_t Size, const char Tag[4]) {
         if (ListHeader) {
             Match = CONTAINING_RECORD(ListHeader, MiPoolTrackerHeader, ListHeader);
             memcpy(Match->Tag, Tag, 4);
+            Match->Index = __atomic_fetch_add(&NextShardIndex, 1, __ATOMIC_RELAXED);
             RtPushSList(&MiPoolTagListHead[Hash], &Match->ListHeader);
             KeReleaseSpinLockAtCurrentIrql(&TagListLock[Hash]);
         }
@@ -144,15 +182,18 @@ void MiAddPoolTracker(size_t Size, const char Tag[4]) {
      * size of a page / size of a tag tracker); If we can't, just bail out without doing anything
      * (not a fatal error, just an inconvinence for debugging). */
     if (!Match) {
-        MiPoolTrackerHeader *Headers = MiAllocatePoolPages(1);
+        bool Zeroed = false;
+        MiPoolTrackerHeader *Headers = MiAllocatePoolPages(1, &Zeroed);
         if (!Headers) {
             KeReleaseSpinLockAtCurrentIrql(&TagListLock[Hash]);
             KdPrint(KD_TYPE_DEBUG, "failed to allocate the pool tracker for \"%4s\"\n", Tag);
             return;
         }
 
-        /* Cleanup everything by default. */
-        memset(Headers, 0, MM_PAGE_SIZE);
+        /* Cleanup everything by default (unless we got a pre-zeroed page). */
+        if (!Zeroed) {
+            memset(Headers, 0, MM_PAGE_SIZE);
+        }
 
         /* Then lock the free list and add everything (but the entry we'll use) to it. */
         KeAcquireSpinLockAtCurrentIrql(&FreeListLock);
@@ -165,6 +206,7 @@ void MiAddPoolTracker(size_t Size, const char Tag[4]) {
         /* And now we can grab and setup the caller's tag. */
         Match = &Headers[0];
         memcpy(Match->Tag, Tag, 4);
+        Match->Index = __atomic_fetch_add(&NextShardIndex, 1, __ATOMIC_RELAXED);
         RtPushSList(&MiPoolTagListHead[Hash], &Match->ListHeader);
         KeReleaseSpinLockAtCurrentIrql(&TagListLock[Hash]);
 
@@ -176,10 +218,26 @@ void MiAddPoolTracker(size_t Size, const char Tag[4]) {
         __atomic_fetch_add(&PoolTracker->MaxAllocatedBytes, MM_PAGE_SIZE, __ATOMIC_RELAXED);
     }
 
-    uint64_t Allocations = __atomic_add_fetch(&Match->Allocations, 1, __ATOMIC_RELAXED);
-    uint64_t AllocatedBytes = __atomic_add_fetch(&Match->AllocatedBytes, Size, __ATOMIC_RELAXED);
-    __atomic_fetch_max(&Match->MaxAllocations, Allocations, __ATOMIC_RELAXED);
-    __atomic_fetch_max(&Match->MaxAllocatedBytes, AllocatedBytes, __ATOMIC_RELAXED);
+    /* Trackers past the shard limit fall back to updating the global counters directly. */
+    if (Match->Index >= MM_POOL_TRACKER_SHARD_COUNT) {
+        uint64_t Allocations = __atomic_add_fetch(&Match->Allocations, 1, __ATOMIC_RELAXED);
+        uint64_t AllocatedBytes =
+            __atomic_add_fetch(&Match->AllocatedBytes, Size, __ATOMIC_RELAXED);
+        __atomic_fetch_max(&Match->MaxAllocations, Allocations, __ATOMIC_RELAXED);
+        __atomic_fetch_max(&Match->MaxAllocatedBytes, AllocatedBytes, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* Otherwise, just bump our own shard, and only touch the (shared) global counters once we've
+     * accumulated enough; This keeps the max usage accurate to within a fold per processor. */
+    MmPoolTrackerShard *Shard = &KeGetCurrentProcessor()->PoolTrackerShards[Match->Index];
+    int64_t Allocations = Shard->Allocations + 1;
+    int64_t AllocatedBytes = Shard->AllocatedBytes + Size;
+    __atomic_store_n(&Shard->Allocations, Allocations, __ATOMIC_RELAXED);
+    __atomic_store_n(&Shard->AllocatedBytes, AllocatedBytes, __ATOMIC_RELAXED);
+    if (Allocations >= MI_POOL_TRACKER_FOLD_COUNT || AllocatedBytes >= MI_POOL_TRACKER_FOLD_BYTES) {
+        FoldShard(Match, Shard);
+    }
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -199,8 +257,109 @@ void MiRemovePoolTracker(size_t Size, const char Tag[4]) {
     /* And don't bother with tag specific if MiAddPoolTracker failed to allocate the tag tracker
      * last time. */
     MiPoolTrackerHeader *Match = MiFindTracker(Tag);
-    if (Match) {
+    if (!Match) {
+        return;
+    } else if (Match->Index >= MM_POOL_TRACKER_SHARD_COUNT) {
         __atomic_fetch_sub(&Match->Allocations, 1, __ATOMIC_RELAXED);
         __atomic_fetch_sub(&Match->AllocatedBytes, Size, __ATOMIC_RELAXED);
+        return;
+    }
+
+    MmPoolTrackerShard *Shard = &KeGetCurrentProcessor()->PoolTrackerShards[Match->Index];
+    int64_t Allocations = Shard->Allocations - 1;
+    int64_t AllocatedBytes = Shard->AllocatedBytes - Size;
+    __atomic_store_n(&Shard->Allocations, Allocations, __ATOMIC_RELAXED);
+    __atomic_store_n(&Shard->AllocatedBytes, AllocatedBytes, __ATOMIC_RELAXED);
+    if (Allocations <= -MI_POOL_TRACKER_FOLD_COUNT ||
+        AllocatedBytes <= -MI_POOL_TRACKER_FOLD_BYTES) {
+        FoldShard(Match, Shard);
     }
 }
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function folds the global counters of a tracker together with all processor shards.
+ *
+ * PARAMETERS:
+ *     Tracker - Which tracker we're reading.
+ *     Information - Output; Where to store the current usage of the tracker.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void GetTrackerUsage(MiPoolTrackerHeader *Tracker, MmPoolTagInformation *Information) {
+    int64_t Allocations = __atomic_load_n(&Tracker->Allocations, __ATOMIC_RELAXED);
+    int64_t AllocatedBytes = __atomic_load_n(&Tracker->AllocatedBytes, __ATOMIC_RELAXED);
+
+    /* Before SMP initialization, only the boot processor exists (and it doesn't have an entry in
+     * the processor list yet). */
+    if (Tracker->Index < MM_POOL_TRACKER_SHARD_COUNT) {
+        uint32_t ProcessorCount = HalpProcessorList ? HalpProcessorCount : 1;
+        for (uint32_t i = 0; i < ProcessorCount; i++) {
+            KeProcessor *Processor =
+                HalpProcessorList ? HalpProcessorList[i] : KeGetCurrentProcessor();
+            if (!Processor) {
+                continue;
+            }
+
+            MmPoolTrackerShard *Shard = &Processor->PoolTrackerShards[Tracker->Index];
+            Allocations += __atomic_load_n(&Shard->Allocations, __ATOMIC_RELAXED);
+            AllocatedBytes += __atomic_load_n(&Shard->AllocatedBytes, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* The max usage is only updated when folding, so it might be slightly behind. */
+    memcpy(Information->Tag, Tracker->Tag, 4);
+    Information->Allocations = Allocations > 0 ? Allocations : 0;
+    Information->AllocatedBytes = AllocatedBytes > 0 ? AllocatedBytes : 0;
+    Information->MaxAllocations = __atomic_load_n(&Tracker->MaxAllocations, __ATOMIC_RELAXED);
+    Information->MaxAllocatedBytes = __atomic_load_n(&Tracker->MaxAllocatedBytes, __ATOMIC_RELAXED);
+    if (Information->MaxAllocations < Information->Allocations) {
+        Information->MaxAllocations = Information->Allocations;
+    }
+
+    if (Information->MaxAllocatedBytes < Information->AllocatedBytes) {
+        Information->MaxAllocatedBytes = Information->AllocatedBytes;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the current usage of the tags in the kernel pool. The tags are returned
+ *     in creation order (which new tags can only ever extend), so that the caller can query them
+ *     in smaller chunks without skipping or repeating any tag.
+ *
+ * PARAMETERS:
+ *     Buffer - Output; Where to store the usage of each tag. Entries for tags that are still being
+ *              created are left with an empty (zeroed) tag, and should be skipped by the caller.
+ *     Start - How many tags to skip before we start storing into the buffer.
+ *     Count - How many entries the buffer has.
+ *
+ * RETURN VALUE:
+ *     How many tags exist in total (which might be more than what fits in the buffer).
+ *-----------------------------------------------------------------------------------------------*/
+size_t MmQueryPoolTags(MmPoolTagInformation *Buffer, size_t Start, size_t Count) {
+    /* The tracker index doubles as the creation order, so snapshot how many we have before
+     * walking the lists (anything created after this shows up in the next query instead). */
+    size_t Total = __atomic_load_n(&NextShardIndex, __ATOMIC_ACQUIRE);
+    if (Start < Total) {
+        size_t Entries = Total - Start < Count ? Total - Start : Count;
+        memset(Buffer, 0, Entries * sizeof(MmPoolTagInformation));
+    }
+
+    /* Trackers are never removed from the tag lists, so we can walk them without locking (at
+     * worst, a tag that was just created won't be linked yet, and its entry stays empty). */
+    for (uint32_t Hash = 0; Hash < 256; Hash++) {
+        for (RtSList *ListHeader = MiPoolTagListHead[Hash].Next; ListHeader;
+             ListHeader = ListHeader->Next) {
+            MiPoolTrackerHeader *Tracker =
+                CONTAINING_RECORD(ListHeader, MiPoolTrackerHeader, ListHeader);
+            if (Tracker->Index >= Start && Tracker->Index < Total &&
+                Tracker->Index - Start < Count) {
+                GetTrackerUsage(Tracker, &Buffer[Tracker->Index - Start]);
+            }
+        }
+    }
+
+    return Total;
+}
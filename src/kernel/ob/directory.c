@@ -1,10 +1,14 @@
 /* SPDX-FileCopyrightText: (C) 2025-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <kernel/ev.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/mm.h>
 #include <kernel/ob.h>
 #include <kernel/obp.h>
+#include <kernel/ps.h>
 #include <os/containing_record.h>
 #include <rt/hash.h>
 #include <rt/list.h>
@@ -12,6 +16,21 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifndef NDEBUG
+#define BENCHMARK_DELAY (10 * EV_MILLISECS)
+#define BENCHMARK_ENTRIES 64
+#define BENCHMARK_LOOKUPS 4096
+#define BENCHMARK_MAX_READERS 32
+
+/* Directory (and start signal) shared between the lookup benchmark and its reader threads. */
+typedef struct {
+    ObDirectory *Directory;
+    EvSignal *Start;
+} BenchmarkState;
+
+static BenchmarkState Benchmark = {0};
+#endif /* NDEBUG */
+
 static KeSpinLock TreeLock = {0};
 
 /*-------------------------------------------------------------------------------------------------
@@ -60,7 +79,7 @@ static void DeleteRoutine(void *Object) {
     RtInitializeDList(&DetachedEntries);
 
     KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&TreeLock, KE_IRQL_DISPATCH);
-    KeAcquireSpinLockAtCurrentIrql(&Directory->Lock);
+    EvAcquireSpinPushLockExclusiveAtCurrentIrql(&Directory->Lock);
 
     for (size_t Head = 0; Head < 32; Head++) {
         while (Directory->HashHeads[Head].Next != &Directory->HashHeads[Head]) {
@@ -81,7 +100,7 @@ static void DeleteRoutine(void *Object) {
         }
     }
 
-    KeReleaseSpinLockAtCurrentIrql(&Directory->Lock);
+    EvReleaseSpinPushLockExclusiveAtCurrentIrql(&Directory->Lock);
     KeReleaseSpinLockAndLowerIrql(&TreeLock, OldIrql);
 
     while (DetachedEntries.Next != &DetachedEntries) {
@@ -182,7 +201,7 @@ bool ObInsertIntoDirectory(ObDirectory *Directory, const char *Name, void *Objec
     RtDList *Bucket = &Directory->HashHeads[Hash & 0x1F];
     bool Inserted = false;
     KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&TreeLock, KE_IRQL_DISPATCH);
-    KeAcquireSpinLockAtCurrentIrql(&Directory->Lock);
+    EvAcquireSpinPushLockExclusiveAtCurrentIrql(&Directory->Lock);
 
     /* Then validate sanity (no duplicates + no cycles), and we can insert. */
     bool Duplicate = false;
@@ -204,7 +223,7 @@ bool ObInsertIntoDirectory(ObDirectory *Directory, const char *Name, void *Objec
         Inserted = true;
     }
 
-    KeReleaseSpinLockAtCurrentIrql(&Directory->Lock);
+    EvReleaseSpinPushLockExclusiveAtCurrentIrql(&Directory->Lock);
     KeReleaseSpinLockAndLowerIrql(&TreeLock, OldIrql);
     if (!Inserted) {
         MmFreePool(Entry->Name, MM_POOL_TAG_OBJECT);
@@ -232,14 +251,14 @@ bool ObRemoveFromDirectory(ObDirectory *Directory, void *Object) {
     /* Just make sure we're not freeing any object that isn't properly part of the specified
      * directory. */
     KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&TreeLock, KE_IRQL_DISPATCH);
-    KeAcquireSpinLockAtCurrentIrql(&Directory->Lock);
+    EvAcquireSpinPushLockExclusiveAtCurrentIrql(&Directory->Lock);
     if (ObjectHeader->Parent && ObjectHeader->Parent->Parent == Directory) {
         DirectoryEntry = ObjectHeader->Parent;
         ObjectHeader->Parent = NULL;
         RtUnlinkDList(&DirectoryEntry->HashHeader);
     }
 
-    KeReleaseSpinLockAtCurrentIrql(&Directory->Lock);
+    EvReleaseSpinPushLockExclusiveAtCurrentIrql(&Directory->Lock);
     KeReleaseSpinLockAndLowerIrql(&TreeLock, OldIrql);
     if (!DirectoryEntry) {
         return false;
@@ -264,21 +283,22 @@ bool ObRemoveFromDirectory(ObDirectory *Directory, void *Object) {
  *     Either a pointer to the object if found, or NULL otherwise.
  *-----------------------------------------------------------------------------------------------*/
 void *ObLookupDirectoryEntryByName(ObDirectory *Directory, const char *Name) {
-    /* Lock up the directory, and just search directly on the bucket the name is contained. */
+    /* Lock up the directory (lookups only need shared access, so they don't serialize against
+     * each other), and just search directly on the bucket the name is contained. */
     uint32_t Hash = RtGetHash(Name, strlen(Name));
     RtDList *Bucket = &Directory->HashHeads[Hash & 0x1F];
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Directory->Lock, KE_IRQL_DISPATCH);
+    KeIrql OldIrql = EvAcquireSpinPushLockShared(&Directory->Lock);
 
     for (RtDList *ListHeader = Bucket->Next; ListHeader != Bucket; ListHeader = ListHeader->Next) {
         ObpDirectoryEntry *Entry = CONTAINING_RECORD(ListHeader, ObpDirectoryEntry, HashHeader);
         if (!strcmp(Entry->Name, Name)) {
             ObReferenceObject(Entry->Object);
-            KeReleaseSpinLockAndLowerIrql(&Directory->Lock, OldIrql);
+            EvReleaseSpinPushLockShared(&Directory->Lock, OldIrql);
             return Entry->Object;
         }
     }
 
-    KeReleaseSpinLockAndLowerIrql(&Directory->Lock, OldIrql);
+    EvReleaseSpinPushLockShared(&Directory->Lock, OldIrql);
     return NULL;
 }
 
@@ -313,7 +333,7 @@ void *ObLookupDirectoryEntryByIndex(
         *NameCapacity = 0;
     }
 
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Directory->Lock, KE_IRQL_DISPATCH);
+    KeIrql OldIrql = EvAcquireSpinPushLockShared(&Directory->Lock);
 
     /* Here we don't know which bucket the index is gonna fall, so we gotta iterate
      * entry-by-entry in each hash bucket. */
@@ -333,7 +353,7 @@ void *ObLookupDirectoryEntryByIndex(
                 size_t EntryNameSize = strlen(Entry->Name) + 1;
                 *NameCapacity = EntryNameSize;
                 if (NameSize < EntryNameSize) {
-                    KeReleaseSpinLockAndLowerIrql(&Directory->Lock, OldIrql);
+                    EvReleaseSpinPushLockShared(&Directory->Lock, OldIrql);
                     return NULL;
                 }
 
@@ -341,11 +361,136 @@ void *ObLookupDirectoryEntryByIndex(
             }
 
             ObReferenceObject(Entry->Object);
-            KeReleaseSpinLockAndLowerIrql(&Directory->Lock, OldIrql);
+            EvReleaseSpinPushLockShared(&Directory->Lock, OldIrql);
             return Entry->Object;
         }
     }
 
-    KeReleaseSpinLockAndLowerIrql(&Directory->Lock, OldIrql);
+    EvReleaseSpinPushLockShared(&Directory->Lock, OldIrql);
     return NULL;
 }
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function builds the name of one of the lookup benchmark entries.
+ *
+ * PARAMETERS:
+ *     Name - Output; Buffer for the name.
+ *     Index - Which entry we want the name of.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void GetBenchmarkName(char Name[8], uint32_t Index) {
+    memcpy(Name, "entry", 5);
+    Name[5] = '0' + Index / 10;
+    Name[6] = '0' + Index % 10;
+    Name[7] = 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the lookup benchmark readers; Once started, we keep
+ *     looking up entries by name (each reader starting at a different entry).
+ *
+ * PARAMETERS:
+ *     Parameter - Index of this reader.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void RunLookupBenchmark(void *Parameter) {
+    uint32_t Index = (uintptr_t)Parameter;
+    char Name[8];
+
+    EvWaitForObject(Benchmark.Start, EV_TIMEOUT_UNLIMITED);
+
+    for (uint32_t i = 0; i < BENCHMARK_LOOKUPS; i++) {
+        GetBenchmarkName(Name, (Index + i) % BENCHMARK_ENTRIES);
+        void *Object = ObLookupDirectoryEntryByName(Benchmark.Directory, Name);
+        if (!Object) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Index, i, 0, 0);
+        }
+
+        ObDereferenceObject(Object);
+    }
+
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures how directory lookups scale with the amount of readers (debug builds
+ *     only), going from 1 to 32 reader threads (spread over the processors) doing name lookups on
+ *     the same directory. The results are only printed (nothing fails). This should be called
+ *     after all processors are online, from a thread that is allowed to wait.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void ObpBenchmarkDirectory(void) {
+    Benchmark.Directory = ObCreateDirectory();
+    Benchmark.Start = EvCreateSignal();
+    if (!Benchmark.Directory || !Benchmark.Start) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    /* The directory keeps its own reference to every entry, so we can drop ours right away. */
+    for (uint32_t i = 0; i < BENCHMARK_ENTRIES; i++) {
+        char Name[8];
+        GetBenchmarkName(Name, i);
+
+        EvSignal *Signal = EvCreateSignal();
+        if (!Signal || !ObInsertIntoDirectory(Benchmark.Directory, Name, Signal)) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, (uint64_t)Signal, 0, 0);
+        }
+
+        ObDereferenceObject(Signal);
+    }
+
+    uint64_t Frequency = HalpGetTscFrequency();
+    for (uint32_t Readers = 1; Readers <= BENCHMARK_MAX_READERS; Readers *= 2) {
+        PsThread *Threads[BENCHMARK_MAX_READERS];
+
+        EvClearSignal(Benchmark.Start);
+        for (uint32_t i = 0; i < Readers; i++) {
+            Threads[i] = PsCreateThread(
+                PS_CREATE_THREAD_SUSPENDED, RunLookupBenchmark, (void *)(uintptr_t)i);
+            if (!Threads[i]) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Readers, i, 0, 0);
+            }
+
+            PsSetIdealProcessor(Threads[i], i % HalpOnlineProcessorCount);
+            PsResumeThread(Threads[i]);
+        }
+
+        /* Give everyone some time to block on the start signal, so that they all start
+         * together. */
+        PsDelayThread(BENCHMARK_DELAY);
+
+        uint64_t Start = HalpGetTscTicks();
+        EvSetSignal(Benchmark.Start);
+        for (uint32_t i = 0; i < Readers; i++) {
+            EvWaitForObject(Threads[i], EV_TIMEOUT_UNLIMITED);
+        }
+
+        uint64_t Cycles = HalpGetTscTicks() - Start;
+        for (uint32_t i = 0; i < Readers; i++) {
+            ObDereferenceObject(Threads[i]);
+        }
+
+        KdPrint(
+            KD_TYPE_DEBUG,
+            "directory lookup benchmark (%u readers): %llu lookups per millisecond\n",
+            Readers,
+            (uint64_t)Readers * BENCHMARK_LOOKUPS * (Frequency / 1000) / Cycles);
+    }
+
+    ObDereferenceObject(Benchmark.Directory);
+    ObDereferenceObject(Benchmark.Start);
+}
+#endif /* NDEBUG */
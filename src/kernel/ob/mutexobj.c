@@ -2,6 +2,7 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <kernel/ev.h>
+#include <kernel/mm.h>
 #include <kernel/ob.h>
 #include <stddef.h>
 
@@ -9,4 +10,6 @@ ObType ObpMutexType = {
     .Name = "Mutex",
     .Size = sizeof(EvMutex),
     .Delete = NULL,
+    .LookasideDepth = 32,
+    .LookasideTag = MM_POOL_TAG_EVENT,
 };
@@ -1,14 +1,60 @@
 /* SPDX-FileCopyrightText: (C) 2025-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <kernel/ev.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/mm.h>
 #include <kernel/ob.h>
 #include <kernel/obp.h>
+#include <kernel/ps.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+static KeSpinLock LookasideLock = {0};
+
+#ifndef NDEBUG
+#define BENCHMARK_PAIRS 4096
+#define BENCHMARK_THREADS 256
+#endif /* NDEBUG */
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the lookaside list for the given object type, creating it if this is the
+ *     first object of the type. The list is shared by every object of the type, so it's always
+ *     tagged with the type's own tag (not with the tag of whoever created the first object).
+ *
+ * PARAMETERS:
+ *     Type - Pointer to the type of the object.
+ *
+ * RETURN VALUE:
+ *     Pointer to the list, or NULL if the type doesn't use one (or we failed to create it).
+ *-----------------------------------------------------------------------------------------------*/
+static MmLookasideList *GetLookasideList(ObType *Type) {
+    MmLookasideList *List = __atomic_load_n(&Type->Lookaside, __ATOMIC_ACQUIRE);
+    if (List || !Type->LookasideDepth) {
+        return List;
+    }
+
+    /* Lists can't be deleted, so we need to make sure only one processor creates it. */
+    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&LookasideLock, KE_IRQL_DISPATCH);
+    List = Type->Lookaside;
+    if (!List) {
+        List = MmCreateLookasideList(
+            sizeof(ObpObject) + Type->Size,
+            Type->LookasideTag ? Type->LookasideTag : MM_POOL_TAG_OBJECT,
+            Type->LookasideDepth,
+            NULL,
+            NULL);
+        __atomic_store_n(&Type->Lookaside, List, __ATOMIC_RELEASE);
+    }
+
+    KeReleaseSpinLockAndLowerIrql(&LookasideLock, OldIrql);
+    return List;
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function allocates and sets up a new managed object pointer.
@@ -21,7 +67,9 @@
  *     Either the start of the usable object data/body, or NULL on failure.
  *-----------------------------------------------------------------------------------------------*/
 void *ObCreateObject(ObType *Type, char Tag[4]) {
-    ObpObject *Object = MmAllocatePool(sizeof(ObpObject) + Type->Size, Tag);
+    MmLookasideList *List = GetLookasideList(Type);
+    ObpObject *Object = List ? MmAllocateFromLookasideList(List)
+                             : MmAllocatePool(sizeof(ObpObject) + Type->Size, Tag);
     if (!Object) {
         return NULL;
     }
@@ -31,6 +79,7 @@ void *ObCreateObject(ObType *Type, char Tag[4]) {
     Object->Type = Type;
     Object->References = 1;
     memcpy(Object->Tag, Tag, 4);
+    Object->FromLookaside = List != NULL;
     return Object + 1;
 }
 
@@ -99,8 +148,121 @@ void ObDereferenceObject(void *Body) {
                 Object->Type->Delete(Body);
             }
 
-            MmFreePool(Object, Object->Tag);
+            if (Object->FromLookaside) {
+                MmFreeToLookasideList(Object->Type->Lookaside, Object);
+            } else {
+                MmFreePool(Object, Object->Tag);
+            }
         }
         return;
     }
 }
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the object creation benchmark threads; They exit
+ *     right away.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void BenchmarkThread(void *) {
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures how many cycles a create/delete pair of the given object type takes,
+ *     without initializing the object body (so the type shouldn't have a delete routine).
+ *
+ * PARAMETERS:
+ *     Type - Which type to create.
+ *
+ * RETURN VALUE:
+ *     Average cycles per pair.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t MeasureObjectPairs(ObType *Type) {
+    /* Warm up the lookaside magazine (if there is one) first. */
+    void *Object = ObCreateObject(Type, MM_POOL_TAG_OBJECT);
+    if (!Object) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)Type, 0, 0, 0);
+    }
+
+    ObDereferenceObject(Object);
+
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_PAIRS; i++) {
+        Object = ObCreateObject(Type, MM_POOL_TAG_OBJECT);
+        if (!Object) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)Type, i, 0, 0);
+        }
+
+        ObDereferenceObject(Object);
+    }
+
+    return (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures the object allocation rate (debug builds only): Bare mutex objects
+ *     with and without the type lookaside list, full EvCreateMutex/ObDereferenceObject pairs, and
+ *     full thread create/exit/delete rounds. The results are only printed (nothing fails). This
+ *     needs to run on a thread (as it waits for the threads it creates).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void ObpBenchmarkObjects(void) {
+    /* Same size as a mutex, but always allocated straight from the pool. */
+    ObType PoolType = {
+        .Name = "Mutex",
+        .Size = sizeof(EvMutex),
+        .Delete = NULL,
+    };
+
+    uint64_t PoolCycles = MeasureObjectPairs(&PoolType);
+    uint64_t LookasideCycles = MeasureObjectPairs(&ObpMutexType);
+
+    uint64_t Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_PAIRS; i++) {
+        EvMutex *Mutex = EvCreateMutex();
+        if (!Mutex) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 0, 0, 0);
+        }
+
+        ObDereferenceObject(Mutex);
+    }
+
+    uint64_t MutexCycles = (HalpGetTscTicks() - Start) / BENCHMARK_PAIRS;
+
+    /* The thread only gets freed once both us and the scheduler drop it, so wait for it to exit
+     * before dropping our reference (otherwise we'd just measure how fast we can queue threads). */
+    Start = HalpGetTscTicks();
+    for (uint32_t i = 0; i < BENCHMARK_THREADS; i++) {
+        PsThread *Thread = PsCreateThread(PS_CREATE_THREAD_DEFAULT, BenchmarkThread, NULL);
+        if (!Thread) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, 1, 0, 0);
+        }
+
+        EvWaitForObject(Thread, EV_TIMEOUT_UNLIMITED);
+        ObDereferenceObject(Thread);
+    }
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "object benchmark: %llu/%llu cycles per pool/lookaside mutex object pair, %llu cycles per "
+        "mutex create/delete, %llu cycles per thread create/exit/delete\n",
+        PoolCycles,
+        LookasideCycles,
+        MutexCycles,
+        (HalpGetTscTicks() - Start) / BENCHMARK_THREADS);
+}
+#endif /* NDEBUG */
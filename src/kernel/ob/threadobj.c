@@ -1,6 +1,7 @@
 /* SPDX-FileCopyrightText: (C) 2025-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <kernel/halp.h>
 #include <kernel/mm.h>
 #include <kernel/ob.h>
 #include <kernel/ps.h>
@@ -20,10 +21,16 @@ static void DeleteRoutine(void *Object) {
     if (Thread->AllocatedStack) {
         MmFreePool(Thread->AllocatedStack, MM_POOL_TAG_KERNEL_STACK);
     }
+
+    if (Thread->ExtendedState) {
+        HalpFreeExtendedState(Thread->ExtendedState);
+    }
 }
 
 ObType ObpThreadType = {
     .Name = "Thread",
     .Size = sizeof(PsThread),
     .Delete = DeleteRoutine,
+    .LookasideDepth = 16,
+    .LookasideTag = MM_POOL_TAG_THREAD,
 };
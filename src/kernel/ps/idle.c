@@ -1,7 +1,7 @@
 /* SPDX-FileCopyrightText: (C) 2023-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
-#include <crt_impl/rand.h>
+#include <kernel/evp.h>
 #include <kernel/halp.h>
 #include <kernel/kd.h>
 #include <kernel/ke.h>
@@ -16,66 +16,109 @@
 extern KeAffinity KiIdleProcessors;
 extern uint64_t PspGlobalThreadCount;
 
+#ifndef NDEBUG
+/* Every victim the steal order self-test saw us look at (in order). */
+static bool TestRecordVictims = false;
+static uint32_t TestVictimCount = 0;
+static KeProcessor *TestVictims[KE_MAX_PROCESSORS];
+#endif /* NDEBUG */
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function attempts to choose and steal a victim thread from another processor. We should
- *     only be called if no other threads are available for us to execute.
+ *     This function attempts to steal a batch of threads from a processor at the given topology
+ *     distance from us.
  *
  * PARAMETERS:
  *     Processor - Pointer to the current processor structure.
+ *     Distance - Which distance (PSP_DISTANCE_*) the victim processor should be at.
+ *     MinimumCount - How many threads the victim processor needs to have for us to steal any.
+ *     StolenList - Output; List where we should add the stolen threads.
  *
  * RETURN VALUE:
- *     None.
+ *     How many threads we stole.
  *-----------------------------------------------------------------------------------------------*/
-static PsThread *TrySteal(KeProcessor *Processor) {
-    /* Start the search at a random index so that there's less chance multiple idle processors will
-     * compete for the same lock. */
-    uint64_t StartIndex = __rand64() % HalpOnlineProcessorCount;
+static uint64_t
+TryStealAt(KeProcessor *Processor, int Distance, uint64_t MinimumCount, RtDList *StolenList) {
+    /* Start the search where we left off last time (every processor starts at a different index),
+     * so that there's less chance multiple idle processors will compete for the same lock. */
+    uint64_t StartIndex = Processor->StealCursor % HalpOnlineProcessorCount;
     uint64_t CurrentIndex = StartIndex;
 
     do {
         KeProcessor *TargetProcessor = HalpProcessorList[CurrentIndex];
-        if (TargetProcessor == Processor) {
-            CurrentIndex = (CurrentIndex + 1) % HalpOnlineProcessorCount;
+        CurrentIndex = (CurrentIndex + 1) % HalpOnlineProcessorCount;
+
+        if (TargetProcessor == Processor ||
+            PspGetProcessorDistance(Processor, TargetProcessor) != Distance) {
             continue;
         }
 
+#ifndef NDEBUG
+        if (TestRecordVictims) {
+            TestVictims[TestVictimCount++] = TargetProcessor;
+        }
+#endif /* NDEBUG */
+
         /* Don't bother if there doesn't seem to be any threads we can steal. */
-        if (__atomic_load_n(&TargetProcessor->ThreadCount, __ATOMIC_ACQUIRE) < 2) {
-            CurrentIndex = (CurrentIndex + 1) % HalpOnlineProcessorCount;
+        if (__atomic_load_n(&TargetProcessor->ThreadCount, __ATOMIC_ACQUIRE) < MinimumCount) {
             continue;
         }
 
         /* Try locking, but don't spin, just move onwards if we can't acquire it. */
         KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
-        if (!KeTryAcquireSpinLockAtCurrentIrql(&TargetProcessor->Lock)) {
+        KeLockQueueNode LockNode;
+        if (!KeTryAcquireQueuedSpinLockAtCurrentIrql(&TargetProcessor->Lock, &LockNode)) {
             KeLowerIrql(OldIrql);
-            CurrentIndex = (CurrentIndex + 1) % HalpOnlineProcessorCount;
             continue;
         }
 
         /* Just recheck the thread count to make sure we're not about to starve this processor (and
          * make it go idle). */
-        if (__atomic_load_n(&TargetProcessor->ThreadCount, __ATOMIC_ACQUIRE) < 2) {
-            KeReleaseSpinLockAndLowerIrql(&TargetProcessor->Lock, OldIrql);
-            CurrentIndex = (CurrentIndex + 1) % HalpOnlineProcessorCount;
-            continue;
+        uint64_t Count = 0;
+        if (__atomic_load_n(&TargetProcessor->ThreadCount, __ATOMIC_ACQUIRE) >= MinimumCount) {
+            Count = PspStealReadyThreads(TargetProcessor, Processor, StolenList);
         }
 
-        /* Attempt to grab the victim thread; After this, we can then unlock (and lower the IRQL),
-         * and return early if we already have something. */
-        RtDList *TargetThread = RtTruncateDList(&TargetProcessor->ThreadQueue);
-        __atomic_sub_fetch(&TargetProcessor->ThreadCount, 1, __ATOMIC_RELEASE);
-        __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
-        KeReleaseSpinLockAndLowerIrql(&TargetProcessor->Lock, OldIrql);
-        if (TargetThread != &TargetProcessor->ThreadQueue) {
-            return CONTAINING_RECORD(TargetThread, PsThread, ListHeader);
+        KeReleaseQueuedSpinLockAndLowerIrql(&TargetProcessor->Lock, OldIrql);
+        if (Count) {
+            Processor->StealCursor = CurrentIndex;
+            return Count;
         }
-
-        CurrentIndex = (CurrentIndex + 1) % HalpOnlineProcessorCount;
     } while (CurrentIndex != StartIndex);
 
-    return NULL;
+    Processor->StealCursor = StartIndex + 1;
+    return 0;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function attempts to choose and steal a batch of threads from another processor. We
+ *     should only be called if no other threads are available for us to execute.
+ *
+ * PARAMETERS:
+ *     Processor - Pointer to the current processor structure.
+ *     StolenList - Output; List where we should add the stolen threads.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void TrySteal(KeProcessor *Processor, RtDList *StolenList) {
+    /* Prefer stealing from the processors closest to us (as the threads will still have something
+     * left in the shared caches); Stealing from another package loses all of that, so only do it
+     * if the victim is considerably overloaded. */
+    for (int Distance = PSP_DISTANCE_CORE; Distance < PSP_DISTANCE_COUNT; Distance++) {
+        uint64_t MinimumCount = 2;
+        if (Distance == PSP_DISTANCE_SYSTEM) {
+            MinimumCount += PSP_LOAD_BALANCE_HYSTERESIS;
+        }
+
+        uint64_t Count = TryStealAt(Processor, Distance, MinimumCount, StolenList);
+        if (Count) {
+            __atomic_add_fetch(&Processor->StealCount, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&Processor->StolenThreadCount, Count, __ATOMIC_RELAXED);
+            return;
+        }
+    }
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -93,45 +136,182 @@ static PsThread *TrySteal(KeProcessor *Processor) {
      * processors). */
     KeProcessor *Processor = KeGetCurrentProcessor();
 
+    /* Set after a steal pass that found nothing (the threads queued elsewhere might be pinned,
+     * cache hot, or just not worth moving); Until we halt at least once, we shouldn't bail out of
+     * the polling loop just because other processors have threads queued. */
+    bool StealFailed = false;
+
     while (true) {
-        /* Let the processor rest for a bit before continuing. */
-        PauseProcessor();
+        /* Let the processor rest for a bit before continuing; We poll for new work with interrupts
+         * disabled and in lazy TLB mode (so that TLB shootdowns don't need to interrupt us), only
+         * opening a small window for pending interrupts after every few polls. While lazy, we
+         * must not touch anything but the processor blocks and the global thread count. */
+        void *Context = HalpEnterCriticalSection();
+        HalpEnterLazyTlb();
+
+        /* While polling, anyone notifying us can skip the dispatch interrupt, as we'll see the
+         * pending flag by ourselves; The polling flag needs to be visible before we check the
+         * pending flag (see HalpNotifyProcessor). */
+        __atomic_store_n(&Processor->IdlePolling, 1, __ATOMIC_SEQ_CST);
+
+        uint32_t Polls = 0;
+        while (PspGetHighestReadyPriority(Processor) < 0 &&
+               (StealFailed || __atomic_load_n(&PspGlobalThreadCount, __ATOMIC_RELAXED) < 2) &&
+               !__atomic_load_n(&Processor->DispatchPending, __ATOMIC_SEQ_CST)) {
+            PauseProcessor();
+            if (++Polls < PSP_IDLE_POLL_COUNT) {
+                continue;
+            }
+
+            /* Nothing showed up for a while; Unless there's dispatch work pending, stop the tick
+             * and halt until the next interrupt (or until someone queues a thread to us). Stopping
+             * the tick touches more than the processor block, so we can't be lazy while doing
+             * it (though the wait itself might be lazy again). We also can't see the pending flag
+             * while halted, so stop polling first. */
+            __atomic_store_n(&Processor->IdlePolling, 0, __ATOMIC_SEQ_CST);
+            HalpLeaveLazyTlb();
+            if (!__atomic_load_n(&Processor->DispatchPending, __ATOMIC_SEQ_CST) &&
+                Processor->WorkQueue.Next == &Processor->WorkQueue &&
+                Processor->TerminationQueue.Next == &Processor->TerminationQueue) {
+                EvpStopTick(Processor);
+                HalpEnterLazyTlb();
+                HalpWaitForInterrupt(&Processor->ReadySummary);
+                HalpLeaveLazyTlb();
+                EvpRestartTick(Processor, false);
+
+                /* Things might have changed while we were halted, so give stealing another go. */
+                StealFailed = false;
+            }
+
+            HalpLeaveCriticalSection(Context);
+            PauseProcessor();
+            Context = HalpEnterCriticalSection();
+            HalpEnterLazyTlb();
+            __atomic_store_n(&Processor->IdlePolling, 1, __ATOMIC_SEQ_CST);
+            Polls = 0;
+        }
+
+        __atomic_store_n(&Processor->IdlePolling, 0, __ATOMIC_SEQ_CST);
+        HalpLeaveLazyTlb();
+        HalpLeaveCriticalSection(Context);
+
+        /* Anyone who notified us while we were polling skipped the interrupt, so we need to run
+         * the dispatch handler ourselves. */
+        if (__atomic_load_n(&Processor->DispatchPending, __ATOMIC_SEQ_CST)) {
+            KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+            HalpHandleDispatch();
+            KeLowerIrql(OldIrql);
+        }
 
         /* If required, try and steal something from another processor. */
-        PsThread *TargetThread = NULL;
-        if (Processor->ThreadQueue.Next == &Processor->ThreadQueue) {
-            TargetThread = TrySteal(Processor);
+        RtDList StolenList;
+        RtInitializeDList(&StolenList);
+        if (PspGetHighestReadyPriority(Processor) < 0) {
+            TrySteal(Processor, &StolenList);
         }
 
-        /* Do we have any threads available to swap into? If not, then loop back (pause and
-         * retry). */
-        if (!TargetThread && Processor->ThreadQueue.Next == &Processor->ThreadQueue) {
+        /* Do we have any threads available to swap into? If not, then loop back (pause, and halt
+         * if nothing shows up for a while). */
+        if (StolenList.Next == &StolenList && PspGetHighestReadyPriority(Processor) < 0) {
+            StealFailed = true;
             continue;
         }
 
+        StealFailed = false;
+
         /* If we do, block preemption and get ready for a swap. */
-        KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
+        KeLockQueueNode LockNode;
+        KeIrql OldIrql =
+            KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
 
-        if (!TargetThread) {
-            RtDList *ListHeader = RtPopDList(&Processor->ThreadQueue);
-            if (ListHeader == &Processor->ThreadQueue) {
+        /* The first stolen thread is the one that would have run first in the victim, so run it
+         * straight away, and queue up the rest of the batch. */
+        PsThread *TargetThread = NULL;
+        RtDList *ListHeader = RtPopDList(&StolenList);
+        if (ListHeader != &StolenList) {
+            TargetThread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+            while ((ListHeader = RtPopDList(&StolenList)) != &StolenList) {
+                PspInsertReadyThread(
+                    Processor, CONTAINING_RECORD(ListHeader, PsThread, ListHeader), false);
+            }
+        } else {
+            TargetThread = PspPopReadyThread(Processor);
+            if (!TargetThread) {
                 /* Between the check and actually accesing the queue, someone stole our thread;
                  * We're idle so this really shouldn't have happened, but whatever, just unlock and
                  * keep on spinning. */
-                KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+                KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
                 KdPrint(
                     KD_TYPE_DEBUG,
                     "processor %u got its new thread stolen while idle\n",
                     Processor->Number);
                 continue;
             }
-
-            __atomic_sub_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
-            __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
-            TargetThread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
         }
 
         KeClearAffinityBit(&KiIdleProcessors, Processor->Number);
         PspSwitchThreads(Processor, Processor->IdleThread, TargetThread, PS_STATE_IDLE, OldIrql);
     }
 }
+
+#ifndef NDEBUG
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks the topology preference of the work stealing pass (debug builds only):
+ *     Victims should be visited by distance (same core, then same cache, then same package, then
+ *     everyone else), and, unless something got stolen along the way, every other processor should
+ *     be visited exactly once. Anything we do end up stealing just gets queued again.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspTestStealOrder(void) {
+    RtDList StolenList;
+    RtInitializeDList(&StolenList);
+
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+
+    TestVictimCount = 0;
+    TestRecordVictims = true;
+    TrySteal(Processor, &StolenList);
+    TestRecordVictims = false;
+
+    bool Stole = StolenList.Next != &StolenList;
+    if (Stole) {
+        PspQueueThreads(&StolenList, false);
+    }
+
+    KeLowerIrql(OldIrql);
+
+    int LastDistance = PSP_DISTANCE_CORE;
+    for (uint32_t i = 0; i < TestVictimCount; i++) {
+        KeProcessor *Victim = TestVictims[i];
+        int Distance = PspGetProcessorDistance(Processor, Victim);
+        if (Victim == Processor || Distance < LastDistance) {
+            KeFatalError(
+                KE_PANIC_SELF_TEST_FAILURE, Processor->Number, Victim->Number, Distance, i);
+        }
+
+        for (uint32_t j = 0; j < i; j++) {
+            if (TestVictims[j] == Victim) {
+                KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Processor->Number, Victim->Number, j, i);
+            }
+        }
+
+        LastDistance = Distance;
+    }
+
+    if (!Stole && TestVictimCount != HalpOnlineProcessorCount - 1) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            Processor->Number,
+            TestVictimCount,
+            HalpOnlineProcessorCount,
+            0);
+    }
+}
+#endif /* NDEBUG */
@@ -2,13 +2,13 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <kernel/ev.h>
+#include <kernel/evp.h>
 #include <kernel/halp.h>
 #include <kernel/ke.h>
 #include <kernel/ob.h>
 #include <kernel/ps.h>
 #include <kernel/psp.h>
 #include <os/containing_record.h>
-#include <rt/avltree.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -46,39 +46,288 @@ KeAffinity KiIdleProcessors;
 
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
- *     This function compares two threads in the wait tree based on their expiration tick.
+ *     This function adds a thread into the run queue matching its priority (and remembers where
+ *     it went, so that it can be found again while it's queued). This should be called with the
+ *     processor lock held.
  *
  * PARAMETERS:
- *     FirstStruct - The node currently in the tree.
- *     SecondStruct - The node we're trying to insert/find.
+ *     Processor - Which processor to add the thread to.
+ *     Thread - Which thread to add.
+ *     Front - Set this to true if the thread should run before others of the same priority.
  *
  * RETURN VALUE:
- *     Either EQUAL if the threads are equal, or LEFT/RIGHT depending on the insertion point.
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspInsertReadyThread(KeProcessor *Processor, PsThread *Thread, bool Front) {
+    uint8_t Priority = Thread->Priority;
+
+    if (Front) {
+        RtPushDList(&Processor->ThreadQueue[Priority], &Thread->ListHeader);
+    } else {
+        RtAppendDList(&Processor->ThreadQueue[Priority], &Thread->ListHeader);
+    }
+
+    Thread->ReadyPriority = Priority;
+    __atomic_store_n(&Thread->ReadyProcessor, Processor, __ATOMIC_RELAXED);
+
+    __atomic_or_fetch(&Processor->ReadySummary, 1u << Priority, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function adds a batch of threads into the run queues matching their priorities. The
+ *     threads should have already been accounted for in the processor and global thread counts
+ *     (so that the placement of the rest of the batch could see them). This should be called with
+ *     the processor lock held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor to add the threads to.
+ *     ThreadList - Threads to add (linked through their ListHeader); This will be left empty.
+ *     Front - Set this to true if the threads should run before others of the same priority.
+ *
+ * RETURN VALUE:
+ *     Highest priority out of the added threads, or -1 if the list was empty.
  *-----------------------------------------------------------------------------------------------*/
-RtAvlCompareResult PspCompareWaitThreads(RtAvlNode *FirstStruct, RtAvlNode *SecondStruct) {
-    PsThread *FirstThread = CONTAINING_RECORD(FirstStruct, PsThread, WaitTreeNode);
-    PsThread *SecondThread = CONTAINING_RECORD(SecondStruct, PsThread, WaitTreeNode);
+int PspSpliceReadyThreads(KeProcessor *Processor, RtDList *ThreadList, bool Front) {
+    int HighestPriority = -1;
+    uint32_t Summary = 0;
+
+    /* Going backwards when pushing into the front keeps the batch in its original order. */
+    while (true) {
+        RtDList *ListHeader = Front ? RtTruncateDList(ThreadList) : RtPopDList(ThreadList);
+        if (ListHeader == ThreadList) {
+            break;
+        }
+
+        PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+        uint8_t Priority = Thread->Priority;
+        if (Front) {
+            RtPushDList(&Processor->ThreadQueue[Priority], ListHeader);
+        } else {
+            RtAppendDList(&Processor->ThreadQueue[Priority], ListHeader);
+        }
+
+        Thread->ReadyPriority = Priority;
+        __atomic_store_n(&Thread->ReadyProcessor, Processor, __ATOMIC_RELAXED);
 
-    if (FirstThread->WaitTicks > SecondThread->WaitTicks) {
-        return RT_AVL_COMPARE_RESULT_LEFT;
+        Summary |= 1u << Priority;
+        if (Priority > HighestPriority) {
+            HighestPriority = Priority;
+        }
     }
 
-    if (FirstThread->WaitTicks < SecondThread->WaitTicks) {
-        return RT_AVL_COMPARE_RESULT_RIGHT;
+    __atomic_or_fetch(&Processor->ReadySummary, Summary, __ATOMIC_RELAXED);
+    return HighestPriority;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function removes the given run queue entry, updating the processor counters (and the
+ *     ready summary if the queue is now empty). This should be called with the processor lock
+ *     held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor the thread is queued in.
+ *     Priority - Which run queue the thread is queued in.
+ *     ListHeader - Entry that was just removed from said queue.
+ *
+ * RETURN VALUE:
+ *     Thread that owned the entry.
+ *-----------------------------------------------------------------------------------------------*/
+static PsThread *RemoveReadyThread(KeProcessor *Processor, int Priority, RtDList *ListHeader) {
+    RtDList *Queue = &Processor->ThreadQueue[Priority];
+    if (Queue->Next == Queue) {
+        __atomic_and_fetch(&Processor->ReadySummary, ~(1u << Priority), __ATOMIC_RELAXED);
     }
 
-    /* Do a tiebreaker with the thread struct addresses themselves, as we should be able to add
-     * multiple threads with the same expiration (as long as the threads themselves are
-     * different). */
-    if ((uintptr_t)FirstThread > (uintptr_t)SecondThread) {
-        return RT_AVL_COMPARE_RESULT_LEFT;
+    __atomic_sub_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
+
+    PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+    __atomic_store_n(&Thread->ReadyProcessor, NULL, __ATOMIC_RELAXED);
+    return Thread;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function takes a queued thread out of its run queue (so that it can be queued
+ *     somewhere else). This should be called with the processor lock held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor the thread is queued in.
+ *     Thread - Which thread to remove.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspRemoveReadyThread(KeProcessor *Processor, PsThread *Thread) {
+#ifndef NDEBUG
+    /* A thread that isn't in one of our run queues would corrupt the ready summary below. */
+    if (Thread->ReadyProcessor != Processor || Thread->State != PS_STATE_QUEUED ||
+        !(Processor->ReadySummary & (1u << Thread->ReadyPriority))) {
+        KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_QUEUED, 0, 0);
     }
+#endif /* NDEBUG */
+
+    RtUnlinkDList(&Thread->ListHeader);
+    RemoveReadyThread(Processor, Thread->ReadyPriority, &Thread->ListHeader);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function moves a queued thread into the back of the run queue matching the given
+ *     priority. This should be called with the processor lock held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor the thread is queued in.
+ *     Thread - Which thread to move.
+ *     Priority - New priority of the thread.
+ *
+ * RETURN VALUE:
+ *     true if the thread is now more important than whatever is running in the processor (and
+ *     the caller should notify it), false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+bool PspRequeueReadyThread(KeProcessor *Processor, PsThread *Thread, uint8_t Priority) {
+    PspRemoveReadyThread(Processor, Thread);
+    Thread->Priority = Priority;
+    PspInsertReadyThread(Processor, Thread, false);
+
+    PsThread *CurrentThread = Processor->CurrentThread;
+    return CurrentThread && CurrentThread != Processor->IdleThread &&
+           Priority > CurrentThread->Priority;
+}
 
-    if ((uintptr_t)FirstThread < (uintptr_t)SecondThread) {
-        return RT_AVL_COMPARE_RESULT_RIGHT;
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function grabs the highest priority thread queued in the given processor. This should
+ *     be called with the processor lock held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor to grab the thread from.
+ *
+ * RETURN VALUE:
+ *     Pointer to the thread, or NULL if the processor has no queued threads.
+ *-----------------------------------------------------------------------------------------------*/
+PsThread *PspPopReadyThread(KeProcessor *Processor) {
+    int Priority = PspGetHighestReadyPriority(Processor);
+    if (Priority < 0) {
+        return NULL;
     }
 
-    return RT_AVL_COMPARE_RESULT_EQUAL;
+    return RemoveReadyThread(Processor, Priority, RtPopDList(&Processor->ThreadQueue[Priority]));
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks if a queued thread can be moved into another processor during a
+ *     steal. This should be called with the victim processor lock held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor the thread is queued in.
+ *     DestinationProcessor - Which processor the thread would be going to.
+ *     Thread - Which thread to check.
+ *
+ * RETURN VALUE:
+ *     true if the thread can be stolen, false otherwise.
+ *-----------------------------------------------------------------------------------------------*/
+static bool CanStealThread(
+    KeProcessor *Processor,
+    KeProcessor *DestinationProcessor,
+    PsThread *Thread) {
+    /* Moving a cache hot thread just trades a short wait in the queue for a bunch of cache misses
+     * in the new processor; Leave those alone. */
+    bool CacheHot = Thread->Processor == Processor &&
+                    Processor->Ticks - Thread->LastRunTick < PSP_CACHE_HOT_TICKS;
+    return !CacheHot && PspIsProcessorAllowed(Thread, DestinationProcessor);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function grabs a batch of threads from the given processor, so that they can be moved
+ *     elsewhere. We take up to half of the queued threads, starting from the ones that would run
+ *     last (lowest priority, and at the back of their queue), and skipping anything that ran in
+ *     the processor recently enough that its working set should still be in the caches, or that
+ *     isn't allowed to run in the destination processor. Threads already in their ideal
+ *     processor are only taken after everything else, and only if the processor is overloaded
+ *     enough to be worth rebalancing. This should be called with the processor lock held.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor to grab the threads from.
+ *     DestinationProcessor - Which processor the threads are going to.
+ *     StolenList - Output; List where we should add the stolen threads (linked through their
+ *                  ListHeader, and ordered as they would have run in the victim processor).
+ *
+ * RETURN VALUE:
+ *     How many threads we stole.
+ *-----------------------------------------------------------------------------------------------*/
+uint64_t PspStealReadyThreads(
+    KeProcessor *Processor,
+    KeProcessor *DestinationProcessor,
+    RtDList *StolenList) {
+    uint64_t ThreadCount = __atomic_load_n(&Processor->ThreadCount, __ATOMIC_RELAXED);
+    uint64_t MaxCount = ThreadCount / 2;
+    if (MaxCount > PSP_MAX_STEAL_COUNT) {
+        MaxCount = PSP_MAX_STEAL_COUNT;
+    }
+
+    /* The ideal processor is just a hint; Count how much we can take without touching it first,
+     * and only dip into the threads that want to stay here if that's not enough, and the victim
+     * is considerably more loaded than the destination (using the same hysteresis as the initial
+     * placement). */
+    uint64_t IdealCount = 0;
+    uint64_t DestinationCount =
+        __atomic_load_n(&DestinationProcessor->ThreadCount, __ATOMIC_RELAXED);
+    if (ThreadCount >= DestinationCount + PSP_LOAD_BALANCE_HYSTERESIS + 2) {
+        uint64_t OtherCount = 0;
+        uint32_t Summary = __atomic_load_n(&Processor->ReadySummary, __ATOMIC_RELAXED);
+        while (Summary && OtherCount < MaxCount) {
+            int Priority = __builtin_ctz(Summary);
+            Summary &= ~(1u << Priority);
+
+            RtDList *Queue = &Processor->ThreadQueue[Priority];
+            for (RtDList *ListHeader = Queue->Next; ListHeader != Queue && OtherCount < MaxCount;
+                 ListHeader = ListHeader->Next) {
+                PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+                if (__atomic_load_n(&Thread->IdealProcessor, __ATOMIC_RELAXED) !=
+                        Processor->Number &&
+                    CanStealThread(Processor, DestinationProcessor, Thread)) {
+                    OtherCount++;
+                }
+            }
+        }
+
+        IdealCount = MaxCount - OtherCount;
+    }
+
+    uint64_t Count = 0;
+    uint32_t Summary = __atomic_load_n(&Processor->ReadySummary, __ATOMIC_RELAXED);
+    while (Summary && Count < MaxCount) {
+        int Priority = __builtin_ctz(Summary);
+        Summary &= ~(1u << Priority);
+
+        RtDList *Queue = &Processor->ThreadQueue[Priority];
+        RtDList *ListHeader = Queue->Prev;
+        while (ListHeader != Queue && Count < MaxCount) {
+            RtDList *PreviousHeader = ListHeader->Prev;
+            PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+
+            bool Ideal = __atomic_load_n(&Thread->IdealProcessor, __ATOMIC_RELAXED) ==
+                         Processor->Number;
+            if ((!Ideal || IdealCount) && CanStealThread(Processor, DestinationProcessor, Thread)) {
+                RtUnlinkDList(ListHeader);
+                RemoveReadyThread(Processor, Priority, ListHeader);
+                RtPushDList(StolenList, ListHeader);
+                IdealCount -= Ideal;
+                Count++;
+            }
+
+            ListHeader = PreviousHeader;
+        }
+    }
+
+    return Count;
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -103,6 +352,10 @@ void PspSwitchThreads(
     PsThread *TargetThread,
     uint8_t Type,
     KeIrql OldIrql) {
+    /* The switch cost gets accounted by whoever we switch into (as it's only over once the target
+     * thread is back running), so it needs to stay in the processor struct. */
+    Processor->SwitchStartTicks = HalpGetTscTicks();
+
     /* Idle thread always has expiration 0 and state IDLE. */
     if (TargetThread != Processor->IdleThread) {
         TargetThread->State = PS_STATE_RUNNING;
@@ -110,7 +363,9 @@ void PspSwitchThreads(
         TargetThread->Processor = Processor;
     }
 
-    /* Mark the newly chosen target as the current one. */
+    /* Save when the old thread last ran here (so that we know if it's still cache hot), and mark
+     * the newly chosen target as the current one. */
+    CurrentThread->LastRunTick = Processor->Ticks;
     Processor->CurrentThread = TargetThread;
     Processor->StackBase = TargetThread->Stack;
     Processor->StackLimit = TargetThread->StackLimit;
@@ -118,8 +373,17 @@ void PspSwitchThreads(
     /* We only want to reschedule/requeue the old thread in case of a "normal" context switch (yield
      * or quantum expiration), for anything else, we just set as busy and skip the requeue. */
     CurrentThread->State = Type;
+
+    /* Threads inside a KeSaveExtendedState section have live vector registers that nobody else
+     * knows about, so they need saving before anyone else can pick up the thread; Everyone else
+     * skips the XSAVE entirely. */
+    Processor->SwitchSavedExtendedState = CurrentThread->ExtendedStateDepth != 0;
+    if (CurrentThread->ExtendedStateDepth) {
+        HalpSaveExtendedState(CurrentThread->ExtendedState);
+    }
+
     __atomic_store_n(&CurrentThread->ContextFrame.Busy, 0x01, __ATOMIC_RELEASE);
-    KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
+    KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
 
     if (Type == PS_STATE_QUEUED) {
         PspQueueThread(CurrentThread, false);
@@ -129,6 +393,23 @@ void PspSwitchThreads(
      * returns. */
     HalpSwitchContext(&CurrentThread->ContextFrame, &TargetThread->ContextFrame);
 
+    if (CurrentThread->ExtendedStateDepth) {
+        HalpRestoreExtendedState(CurrentThread->ExtendedState);
+    }
+
+    /* We might have been picked up by another processor, so the switch that just finished is the
+     * one that the current processor started (not necessarily the one we started above). Freshly
+     * created threads never return here, so their first switch doesn't get counted. */
+    KeProcessor *SwitchProcessor = KeGetCurrentProcessor();
+    uint64_t SwitchCycles = HalpGetTscTicks() - SwitchProcessor->SwitchStartTicks;
+    __atomic_add_fetch(&SwitchProcessor->ContextSwitchCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SwitchProcessor->ContextSwitchCycles, SwitchCycles, __ATOMIC_RELAXED);
+    if (SwitchProcessor->SwitchSavedExtendedState || CurrentThread->ExtendedStateDepth) {
+        __atomic_add_fetch(&SwitchProcessor->ExtendedStateSwitchCount, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(
+            &SwitchProcessor->ExtendedStateSwitchCycles, SwitchCycles, __ATOMIC_RELAXED);
+    }
+
     /* Just check if any alerts have been queued for this thread; If so, lower to SIGNAL
      * and process them first. */
     if (CurrentThread->AlertList.Next && OldIrql < KE_IRQL_ALERT) {
@@ -157,8 +438,12 @@ void PspProcessQueue(void) {
         KeFatalError(KE_PANIC_IRQL_NOT_EQUAL, KE_IRQL_DISPATCH, Irql, 0, 0);
     }
 
-    /* We shouldn't have anything to do if the initial thread still isn't running. */
+    /* Whoever notified us might have queued something that needs the tick back (and the wait
+     * expiration check below needs an up to date tick count anyways). */
     KeProcessor *Processor = KeGetCurrentProcessor();
+    EvpRestartTick(Processor, false);
+
+    /* We shouldn't have anything to do if the initial thread still isn't running. */
     PsThread *CurrentThread = Processor->CurrentThread;
     if (!CurrentThread) {
         return;
@@ -186,32 +471,24 @@ void PspProcessQueue(void) {
 
     /* Requeue any waiting threads that have expired (this can also be done at DISPATCH). */
     if (Processor->Ticks >= Processor->ClosestWaitTick) {
-        while (true) {
-            /* Hold the processor lock while modifying the per-processor wait list. */
-            KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
-            RtAvlNode *Node = RtLookupByIndexAvlTree(&Processor->WaitTree, 0);
-            if (!Node) {
-                KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
-                break;
-            }
+        /* Turn the wait wheel and claim all expired waits in a single batch while holding the
+         * processor lock; Anything whose completion was already claimed by the signal side gets
+         * dropped from the batch (the signal side takes care of it). */
+        RtDList ExpiredList;
+        RtInitializeDList(&ExpiredList);
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+        PspCollectExpiredWaits(Processor, &ExpiredList);
+
+        RtDList *ListHeader = ExpiredList.Next;
+        while (ListHeader != &ExpiredList) {
+            PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, WaitWheelHeader);
+            ListHeader = ListHeader->Next;
 
-            /* The list should be ordered, so we're the closest expiration; If we didn't expire yet,
-             * no one ahead of us did. */
-            PsThread *Thread = CONTAINING_RECORD(Node, PsThread, WaitTreeNode);
             if (Thread->State != PS_STATE_WAITING) {
                 KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_WAITING, 0, 0);
-            } else if (Processor->Ticks < Thread->WaitTicks) {
-                Processor->ClosestWaitTick = Thread->WaitTicks;
-                KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
-                break;
-            }
-
-            if (RtRemoveAvlTree(&Processor->WaitTree, &Thread->WaitTreeNode) !=
-                &Thread->WaitTreeNode) {
-                KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_WAITING, 3, 0);
             }
 
-            Thread->WaitTreeLinked = false;
             uint8_t ExpectedCompletion = PS_WAIT_COMPLETION_NONE;
             if (!__atomic_compare_exchange_n(
                     &Thread->WaitCompletion,
@@ -220,62 +497,112 @@ void PspProcessQueue(void) {
                     false,
                     __ATOMIC_ACQ_REL,
                     __ATOMIC_ACQUIRE)) {
-                KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
-                continue;
+                RtUnlinkDList(&Thread->WaitWheelHeader);
             }
+        }
 
-            KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
-
-            /* Shortcut for DelayThread(), we always want to queue the thread in that case. */
-            EvHeader *Event = Thread->WaitObject;
-            if (!Event) {
-                Thread->State = PS_STATE_QUEUED;
-                PspQueueThread(Thread, true);
-                continue;
-            }
+        KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
 
-            /* Now with the processor lock released, acquire the event lock and unlink only if the
-             * signal side did not already remove this waiter after losing the winner race. */
-            KeAcquireSpinLockAtCurrentIrql(&Event->Lock);
-            if (Thread->WaitListLinked) {
-                RtUnlinkDList(&Thread->WaitListHeader);
-                Thread->WaitListLinked = false;
+        while (true) {
+            ListHeader = RtPopDList(&ExpiredList);
+            if (ListHeader == &ExpiredList) {
+                break;
             }
-            KeReleaseSpinLockAtCurrentIrql(&Event->Lock);
 
+            /* We don't need to touch the event wait lists here; The thread unlinks its own wait
+             * blocks once it runs again (and the signal side skips any block whose wait was
+             * already completed). */
+            PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, WaitWheelHeader);
             Thread->State = PS_STATE_QUEUED;
             PspQueueThread(Thread, true);
         }
-
-        if (!RtQuerySizeAvlTree(&Processor->WaitTree)) {
-            Processor->ClosestWaitTick = UINT64_MAX;
-        }
     }
 
-    /* We shouldn't have anything left to do if we haven't expired yet (or if we're the idle
-     * thread). */
-    if (CurrentThread->ExpirationTicks || CurrentThread == Processor->IdleThread) {
+    /* We shouldn't have anything left to do if we're the idle thread, or if we haven't expired yet
+     * and nothing more important than us got queued (unless our affinity just changed to exclude
+     * this processor). */
+    bool Expired = !CurrentThread->ExpirationTicks;
+    bool Allowed = PspIsProcessorAllowed(CurrentThread, Processor);
+    if (CurrentThread == Processor->IdleThread ||
+        (!Expired && Allowed &&
+         PspGetHighestReadyPriority(Processor) <= CurrentThread->Priority)) {
         return;
     }
 
     /* Now we can raise to SYNCH (block device interrupts) and acquire the processor lock (don't let
      * any other processors mess with us while we mess with the thread queue). */
-    KeIrql OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
-    RtDList *ListHeader = RtPopDList(&Processor->ThreadQueue);
-
-    /* We won't enter idle through here (as we're not forced to), so if there was nothing, just keep
-     * on executing the current thread. */
-    if (ListHeader == &Processor->ThreadQueue) {
-        CurrentThread->ExpirationTicks = PSP_DEFAULT_TICKS;
-        KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
-        KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+    KeLockQueueNode LockNode;
+    KeIrql OldIrql =
+        KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
+
+    /* Switching out with a QUEUED state requeues us somewhere we're allowed to run (even if that
+     * leaves this processor idle). */
+    if (!Allowed) {
+        PspSuspendExecution(Processor, CurrentThread, PS_STATE_QUEUED, OldIrql);
         return;
     }
 
-    __atomic_sub_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
-    __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
-    KeClearAffinityBit(&KiIdleProcessors, Processor->Number);
+    /* Any wait boost wears off one level per quantum. */
+    if (Expired && CurrentThread->Priority > CurrentThread->BasePriority) {
+        CurrentThread->Priority--;
+    }
+
+    /* Only threads of the same priority get to round-robin with us when our quantum expires (and
+     * only more important ones get to preempt us before that); We won't enter idle through here
+     * (as we're not forced to), so otherwise just keep on executing the current thread. */
+    int Priority = PspGetHighestReadyPriority(Processor);
+    if (Priority < CurrentThread->Priority || (!Expired && Priority == CurrentThread->Priority)) {
+        if (Expired) {
+            CurrentThread->ExpirationTicks = PSP_DEFAULT_TICKS;
+        }
 
-    PsThread *TargetThread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+        if (Priority < 0) {
+            KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
+        }
+
+        KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+        return;
+    }
+
+    KeClearAffinityBit(&KiIdleProcessors, Processor->Number);
+    PsThread *TargetThread = PspPopReadyThread(Processor);
     PspSwitchThreads(Processor, CurrentThread, TargetThread, PS_STATE_QUEUED, OldIrql);
 }
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function collects the scheduler statistics of the online processors.
+ *
+ * PARAMETERS:
+ *     Buffer - Output; Where to store the information about each processor.
+ *     Start - Index of the first processor we should collect.
+ *     Count - How many entries the buffer can hold.
+ *
+ * RETURN VALUE:
+ *     How many processors are online (which might be more than what we stored in the buffer).
+ *-----------------------------------------------------------------------------------------------*/
+size_t PsQueryProcessors(PsProcessorInformation *Buffer, size_t Start, size_t Count) {
+    for (size_t i = Start; i < HalpOnlineProcessorCount && i - Start < Count; i++) {
+        KeProcessor *Processor = HalpProcessorList[i];
+        PsProcessorInformation *Information = &Buffer[i - Start];
+        Information->Number = Processor->Number;
+        Information->ThreadCount = __atomic_load_n(&Processor->ThreadCount, __ATOMIC_RELAXED);
+        Information->StealCount = __atomic_load_n(&Processor->StealCount, __ATOMIC_RELAXED);
+        Information->StolenThreadCount =
+            __atomic_load_n(&Processor->StolenThreadCount, __ATOMIC_RELAXED);
+        Information->DispatchIpiCount =
+            __atomic_load_n(&Processor->DispatchIpiCount, __ATOMIC_RELAXED);
+        Information->SuppressedDispatchIpiCount =
+            __atomic_load_n(&Processor->SuppressedDispatchIpiCount, __ATOMIC_RELAXED);
+        Information->ContextSwitchCount =
+            __atomic_load_n(&Processor->ContextSwitchCount, __ATOMIC_RELAXED);
+        Information->ContextSwitchCycles =
+            __atomic_load_n(&Processor->ContextSwitchCycles, __ATOMIC_RELAXED);
+        Information->ExtendedStateSwitchCount =
+            __atomic_load_n(&Processor->ExtendedStateSwitchCount, __ATOMIC_RELAXED);
+        Information->ExtendedStateSwitchCycles =
+            __atomic_load_n(&Processor->ExtendedStateSwitchCycles, __ATOMIC_RELAXED);
+    }
+
+    return HalpOnlineProcessorCount;
+}
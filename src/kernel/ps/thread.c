@@ -1,9 +1,11 @@
 /* SPDX-FileCopyrightText: (C) 2023-2026 ilmmatias
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <crt_impl/rand.h>
 #include <kernel/ev.h>
 #include <kernel/evp.h>
 #include <kernel/halp.h>
+#include <kernel/kd.h>
 #include <kernel/ke.h>
 #include <kernel/mm.h>
 #include <kernel/ob.h>
@@ -11,11 +13,16 @@
 #include <kernel/ps.h>
 #include <kernel/psp.h>
 #include <os/containing_record.h>
-#include <rt/avltree.h>
+#include <os/intrin.h>
 #include <rt/list.h>
 #include <stddef.h>
 #include <stdint.h>
 
+typedef struct {
+    KeProcessor *Processor;
+    RtDList ThreadList;
+} WakeGroup;
+
 extern KeAffinity KiIdleProcessors;
 
 uint64_t PspGlobalThreadCount = 0;
@@ -43,6 +50,10 @@ static PsThread *CreateThread(void (*EntryPoint)(void *), void *Parameter, void
     }
 
     Thread->State = PS_STATE_CREATED;
+    Thread->BasePriority = PS_PRIORITY_NORMAL;
+    Thread->Priority = PS_PRIORITY_NORMAL;
+    Thread->IdealProcessor = PS_IDEAL_PROCESSOR_NONE;
+    KeInitializeAffinity(&Thread->Affinity);
     Thread->Stack = Stack;
     if (!Thread->Stack) {
         Thread->AllocatedStack = MmAllocatePool(KE_STACK_SIZE, MM_POOL_TAG_KERNEL_STACK);
@@ -83,23 +94,207 @@ static PsThread *CreateThread(void (*EntryPoint)(void *), void *Parameter, void
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 static void QueueThreadIn(PsThread *Thread, KeProcessor *Processor, bool EventQueue) {
-    KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+    PspInsertReadyThread(Processor, Thread, EventQueue);
 
-    if (EventQueue) {
-        RtPushDList(&Processor->ThreadQueue, &Thread->ListHeader);
-    } else {
-        RtAppendDList(&Processor->ThreadQueue, &Thread->ListHeader);
-    }
+    /* If we're more important than whatever is running there, we'll need a dispatch interrupt to
+     * preempt it (even if the target is the current processor). */
+    PsThread *CurrentThread = Processor->CurrentThread;
+    bool Preempt = CurrentThread && CurrentThread != Processor->IdleThread &&
+                   Thread->Priority > CurrentThread->Priority;
 
-    __atomic_add_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
-    __atomic_add_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
-    KeReleaseSpinLockAtCurrentIrql(&Processor->Lock);
+    /* The same goes if the tick is stopped (as the timer interrupt that would give us a quantum
+     * might not come for a while); The dispatch handler restarts it. */
+    bool TickStopped = Processor->TickStopped;
+    KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
 
-    if (Processor != KeGetCurrentProcessor()) {
+    if (Processor != KeGetCurrentProcessor() || Preempt || TickStopped) {
         HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
     }
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function gets the ideal processor of the given thread, if it has one and it's allowed
+ *     by the thread affinity mask.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread to check.
+ *
+ * RETURN VALUE:
+ *     Pointer to the processor, or NULL if the thread has no usable ideal processor.
+ *-----------------------------------------------------------------------------------------------*/
+static KeProcessor *GetIdealProcessor(PsThread *Thread) {
+    uint32_t Number = __atomic_load_n(&Thread->IdealProcessor, __ATOMIC_RELAXED);
+    if (Number >= HalpOnlineProcessorCount) {
+        return NULL;
+    }
+
+    KeProcessor *Processor = HalpProcessorList[Number];
+    return PspIsProcessorAllowed(Thread, Processor) ? Processor : NULL;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function searches for the idle processor closest (topology-wise) to the given one,
+ *     out of the processors the thread is allowed to run in.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread we're placing.
+ *     IdleProcessors - Which processors are idle (usually KiIdleProcessors).
+ *     SourceProcessor - Which processor we want to stay close to.
+ *
+ * RETURN VALUE:
+ *     Pointer to the processor, or NULL if no allowed processors are idle.
+ *-----------------------------------------------------------------------------------------------*/
+static KeProcessor *
+FindIdleProcessor(PsThread *Thread, KeAffinity *IdleProcessors, KeProcessor *SourceProcessor) {
+    KeProcessor *TargetProcessor = NULL;
+    int TargetDistance = PSP_DISTANCE_COUNT;
+
+    for (uint32_t Word = 0; Word < (IdleProcessors->Size + 63) >> 6; Word++) {
+        uint64_t Bits = __atomic_load_n(&IdleProcessors->Bits[Word], __ATOMIC_RELAXED) &
+                        __atomic_load_n(&Thread->Affinity.Bits[Word], __ATOMIC_RELAXED);
+        while (Bits) {
+            uint32_t Index = (Word << 6) + __builtin_ctzll(Bits);
+            Bits &= Bits - 1;
+
+            KeProcessor *Processor = HalpProcessorList[Index];
+            int Distance = PspGetProcessorDistance(SourceProcessor, Processor);
+            if (Distance == PSP_DISTANCE_CORE) {
+                return Processor;
+            } else if (Distance < TargetDistance) {
+                TargetProcessor = Processor;
+                TargetDistance = Distance;
+            }
+        }
+    }
+
+    return TargetProcessor;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function searches for the least loaded processor the thread is allowed to run in,
+ *     preferring processors close (topology-wise) to the given one.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread we're placing.
+ *     SourceProcessor - Which processor we want to stay close to.
+ *
+ * RETURN VALUE:
+ *     Pointer to the processor (which might be the source processor itself, if it's allowed).
+ *-----------------------------------------------------------------------------------------------*/
+static KeProcessor *FindLeastLoadedProcessor(PsThread *Thread, KeProcessor *SourceProcessor) {
+    KeProcessor *BestProcessor[PSP_DISTANCE_COUNT] = {0};
+    uint64_t BestLoad[PSP_DISTANCE_COUNT] = {0};
+
+    /* Walk the affinity mask directly, so that pinned threads only ever look at the processors
+     * they can actually use. */
+    for (uint32_t Word = 0; Word < (Thread->Affinity.Size + 63) >> 6; Word++) {
+        uint64_t Bits = __atomic_load_n(&Thread->Affinity.Bits[Word], __ATOMIC_RELAXED);
+        while (Bits) {
+            uint32_t Index = (Word << 6) + __builtin_ctzll(Bits);
+            Bits &= Bits - 1;
+
+            KeProcessor *Processor = HalpProcessorList[Index];
+            uint64_t ThreadCount = __atomic_load_n(&Processor->ThreadCount, __ATOMIC_ACQUIRE);
+            int Distance = PspGetProcessorDistance(SourceProcessor, Processor);
+            if (!BestProcessor[Distance] || ThreadCount < BestLoad[Distance]) {
+                BestProcessor[Distance] = Processor;
+                BestLoad[Distance] = ThreadCount;
+            }
+        }
+    }
+
+    /* Only move further away if that gets us a considerably less loaded processor (so that small
+     * imbalances don't make threads bounce between caches and packages); If we can't stay in the
+     * source processor, anything allowed is better than it. */
+    KeProcessor *TargetProcessor = SourceProcessor;
+    uint64_t TargetLoad = __atomic_load_n(&SourceProcessor->ThreadCount, __ATOMIC_ACQUIRE);
+    if (!PspIsProcessorAllowed(Thread, SourceProcessor)) {
+        TargetProcessor = NULL;
+        TargetLoad = UINT64_MAX - PSP_LOAD_BALANCE_HYSTERESIS;
+    }
+    for (int Distance = PSP_DISTANCE_CORE; Distance < PSP_DISTANCE_COUNT; Distance++) {
+        uint64_t Margin = Distance == PSP_DISTANCE_CORE ? 1 : PSP_LOAD_BALANCE_HYSTERESIS;
+        if (BestProcessor[Distance] && BestLoad[Distance] + Margin <= TargetLoad) {
+            TargetProcessor = BestProcessor[Distance];
+            TargetLoad = BestLoad[Distance];
+        }
+    }
+
+    return TargetProcessor;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds a target processor (out of the ones allowed by the thread affinity
+ *     mask) for a thread that is about to be queued.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread we're placing.
+ *     EventQueue - Set this to true if this thread was waiting for an event that expired or was
+ *                  signaled.
+ *
+ * RETURN VALUE:
+ *     Pointer to the processor.
+ *-----------------------------------------------------------------------------------------------*/
+static KeProcessor *SelectProcessor(PsThread *Thread, bool EventQueue) {
+    /* Threads coming back from a wait get a temporary boost (so that they can react to whatever
+     * they were waiting for quickly); Realtime threads have a fixed priority, and the boost never
+     * takes a normal thread into the realtime range. */
+    if (EventQueue && Thread->BasePriority < PS_PRIORITY_REALTIME) {
+        uint8_t Priority = Thread->BasePriority + PSP_WAIT_PRIORITY_BOOST;
+        if (Priority >= PS_PRIORITY_REALTIME) {
+            Priority = PS_PRIORITY_REALTIME - 1;
+        }
+
+        if (Priority > Thread->Priority) {
+            Thread->Priority = Priority;
+        }
+    }
+
+    /* The home processor is where we'd like the thread to run (its ideal processor, or otherwise,
+     * wherever it last ran); If the thread can't run there anymore, just stay near wherever we
+     * are now. */
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    KeProcessor *IdealProcessor = GetIdealProcessor(Thread);
+    KeProcessor *HomeProcessor = IdealProcessor;
+    if (!HomeProcessor) {
+        HomeProcessor = Thread->Processor;
+        if (!HomeProcessor || !PspIsProcessorAllowed(Thread, HomeProcessor)) {
+            HomeProcessor = Processor;
+        }
+    }
+
+    /* First, if the current inbalance isn't too bad, we want to place it in the current processor
+     * (as the processor's cache will probably be more warm/have more hits for the thread if we stay
+     * always on the same thread); Threads with an ideal processor go for that one instead. */
+    KeProcessor *PreferredProcessor = IdealProcessor ? IdealProcessor : Processor;
+    if (PspIsProcessorAllowed(Thread, PreferredProcessor)) {
+        uint64_t LocalThreadCount =
+            __atomic_load_n(&PreferredProcessor->ThreadCount, __ATOMIC_ACQUIRE) + 1;
+        uint64_t GlobalThreadCount = __atomic_load_n(&PspGlobalThreadCount, __ATOMIC_ACQUIRE) + 1;
+        if (LocalThreadCount < (GlobalThreadCount * PSP_LOAD_BALANCE_BIAS) / 100) {
+            return PreferredProcessor;
+        }
+    }
+
+    /* Otherwise, we'd rather place the thread in an idle processor, as close as possible to its
+     * home processor (so that it can still make use of whatever it left in the caches); We'll just
+     * assume the processor is still idle (rather than looping until we lock() an actually idle
+     * processor). */
+    KeProcessor *TargetProcessor = FindIdleProcessor(Thread, &KiIdleProcessors, HomeProcessor);
+    if (TargetProcessor) {
+        return TargetProcessor;
+    }
+
+    /* Otherwise, we fallback onto the slow path, and search for the least loaded processor. */
+    return FindLeastLoadedProcessor(Thread, HomeProcessor);
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function finds a target processor and adds a thread to its queue; We expect to be at
@@ -114,40 +309,101 @@ static void QueueThreadIn(PsThread *Thread, KeProcessor *Processor, bool EventQu
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 void PspQueueThread(PsThread *Thread, bool EventQueue) {
-    /* First, if the current inbalance isn't too bad, we want to place it in the current processor
-     * (as the processor's cache will probably be more warm/have more hits for the thread if we stay
-     * always on the same thread).  */
-    KeProcessor *Processor = KeGetCurrentProcessor();
-    uint64_t LocalThreadCount = __atomic_load_n(&Processor->ThreadCount, __ATOMIC_ACQUIRE) + 1;
-    uint64_t GlobalThreadCount = __atomic_load_n(&PspGlobalThreadCount, __ATOMIC_ACQUIRE) + 1;
-    if (LocalThreadCount < (GlobalThreadCount * PSP_LOAD_BALANCE_BIAS) / 100) {
-        QueueThreadIn(Thread, Processor, EventQueue);
-        return;
-    }
+    QueueThreadIn(Thread, SelectProcessor(Thread, EventQueue), EventQueue);
+}
 
-    /* Otherwise, we'd rather place the thread in an idle processor; We'll just assume the processor
-     * is still idle (rather than looping until we lock() an actually idle processor). */
-    uint32_t Index = KeGetFirstAffinitySetBit(&KiIdleProcessors);
-    if (Index != (uint32_t)-1) {
-        KeProcessor *Processor = HalpProcessorList[Index];
-        QueueThreadIn(Thread, Processor, EventQueue);
-        return;
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function adds all threads of a wake group into its target processor, in a single
+ *     locked step, and with a single notification.
+ *
+ * PARAMETERS:
+ *     Group - Which group to flush.
+ *     EventQueue - Set this to true if the threads were waiting for an event that expired or was
+ *                  signaled.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void FlushWakeGroup(WakeGroup *Group, bool EventQueue) {
+    KeProcessor *Processor = Group->Processor;
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+    int Priority = PspSpliceReadyThreads(Processor, &Group->ThreadList, EventQueue);
+
+    PsThread *CurrentThread = Processor->CurrentThread;
+    bool Preempt = CurrentThread && CurrentThread != Processor->IdleThread &&
+                   Priority > CurrentThread->Priority;
+    bool TickStopped = Processor->TickStopped;
+    KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+
+    if (Processor != KeGetCurrentProcessor() || Preempt || TickStopped) {
+        HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
     }
+}
 
-    /* Otherwise, we fallback onto the slow path, and search for the least loaded processor (falling
-     * back to the current processor if everyone is equally loaded). */
-    uint32_t TargetIndex = Processor->Number;
-    uint64_t TargetLoad = __atomic_load_n(&Processor->ThreadCount, __ATOMIC_ACQUIRE);
-    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
-        KeProcessor *Processor = HalpProcessorList[i];
-        uint64_t ThreadCount = __atomic_load_n(&Processor->ThreadCount, __ATOMIC_ACQUIRE);
-        if (ThreadCount < TargetLoad) {
-            TargetIndex = i;
-            TargetLoad = ThreadCount;
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds a target processor for each thread in the given list, and adds them to
+ *     their queues; Threads going into the same processor are grouped, so that each processor
+ *     only gets locked and notified once. We expect to be at least raised to DISPATCH, and with
+ *     no processor locks acquired.
+ *
+ * PARAMETERS:
+ *     ThreadList - Threads to add (linked through their ListHeader); This will be left empty.
+ *     EventQueue - Set this to true if the threads were waiting for an event that expired or was
+ *                  signaled.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspQueueThreads(RtDList *ThreadList, bool EventQueue) {
+    WakeGroup Groups[PSP_WAKE_GROUP_COUNT];
+    uint32_t GroupCount = 0;
+
+    while (true) {
+        RtDList *ListHeader = RtPopDList(ThreadList);
+        if (ListHeader == ThreadList) {
+            break;
         }
+
+        PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+        KeProcessor *Processor = SelectProcessor(Thread, EventQueue);
+
+        uint32_t Index = 0;
+        while (Index < GroupCount && Groups[Index].Processor != Processor) {
+            Index++;
+        }
+
+        /* We can only track so many target processors at once; Just flush everything once we run
+         * out of space, and start over. */
+        if (Index == PSP_WAKE_GROUP_COUNT) {
+            for (uint32_t i = 0; i < GroupCount; i++) {
+                FlushWakeGroup(&Groups[i], EventQueue);
+            }
+
+            Index = 0;
+            GroupCount = 0;
+        }
+
+        if (Index == GroupCount) {
+            Groups[Index].Processor = Processor;
+            RtInitializeDList(&Groups[Index].ThreadList);
+            GroupCount++;
+        }
+
+        /* Account for the thread right away (and take the processor out of the idle set), so that
+         * the placement of the rest of the batch doesn't pile everything into the same
+         * processor. */
+        RtAppendDList(&Groups[Index].ThreadList, ListHeader);
+        __atomic_add_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
+        KeClearAffinityBit(&KiIdleProcessors, Processor->Number);
     }
 
-    QueueThreadIn(Thread, HalpProcessorList[TargetIndex], EventQueue);
+    for (uint32_t i = 0; i < GroupCount; i++) {
+        FlushWakeGroup(&Groups[i], EventQueue);
+    }
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -164,6 +420,10 @@ void PspQueueThread(PsThread *Thread, bool EventQueue) {
  *     None.
  *-----------------------------------------------------------------------------------------------*/
 void PspSetupThreadWait(KeProcessor *Processor, PsThread *Thread, uint64_t Time) {
+    /* The tick count might be stale if the tick was stopped, and we need it to be up to date to
+     * calculate the expiration tick. */
+    EvpRestartTick(Processor, false);
+
     uint64_t WaitTicks = Time / EVP_TICK_PERIOD;
     if (Time % EVP_TICK_PERIOD) {
         WaitTicks++;
@@ -175,15 +435,7 @@ void PspSetupThreadWait(KeProcessor *Processor, PsThread *Thread, uint64_t Time)
         Thread->WaitTicks = Processor->Ticks + WaitTicks;
     }
 
-    if (Thread->WaitTicks < Processor->ClosestWaitTick) {
-        Processor->ClosestWaitTick = Thread->WaitTicks;
-    }
-
-    if (!RtInsertAvlTree(&Processor->WaitTree, &Thread->WaitTreeNode)) {
-        KeFatalError(KE_PANIC_BAD_THREAD_STATE, Thread->State, PS_STATE_WAITING, 2, 0);
-    }
-
-    Thread->WaitTreeLinked = true;
+    PspInsertWaitThread(Processor, Thread);
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -195,7 +447,7 @@ void PspSetupThreadWait(KeProcessor *Processor, PsThread *Thread, uint64_t Time)
  *     Processor - Current processor structure.
  *     CurrentThread - Current running thread block.
  *     NewState - Which state we should put the thread on.
- *     OldIrql - Return value of KeAcquireSpinLockAndRaiseIrql; Set this to -1 if we should
+ *     OldIrql - Return value of KeAcquireQueuedSpinLockAndRaiseIrql; Set this to -1 if we should
  *               acquire the lock ourselves.
  *
  * RETURN VALUE:F
@@ -209,19 +461,15 @@ void PspSuspendExecution(
     /* If the caller hasn't done it already, raise to SYNCH (block device interrupts) and
      * acquire the processor lock (don't let any other processors mess with us while we mess
      * with the thread queue). */
+    KeLockQueueNode LockNode;
     if (OldIrql == (KeIrql)-1) {
-        OldIrql = KeAcquireSpinLockAndRaiseIrql(&Processor->Lock, KE_IRQL_SYNCH);
+        OldIrql = KeAcquireQueuedSpinLockAndRaiseIrql(&Processor->Lock, &LockNode, KE_IRQL_SYNCH);
     }
 
-    RtDList *ListHeader = RtPopDList(&Processor->ThreadQueue);
-    PsThread *TargetThread = Processor->IdleThread;
-
-    if (ListHeader == &Processor->ThreadQueue) {
+    PsThread *TargetThread = PspPopReadyThread(Processor);
+    if (!TargetThread) {
+        TargetThread = Processor->IdleThread;
         KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
-    } else {
-        __atomic_sub_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
-        __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
-        TargetThread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
     }
 
     PspSwitchThreads(Processor, CurrentThread, TargetThread, NewState, OldIrql);
@@ -352,7 +600,8 @@ bool PsResumeThread(PsThread *Thread) {
 
     /* Mark ourselves for termination, and switch out (the next dispatch event should clean up the
      * thread for us). */
-    KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
     RtAppendDList(&Processor->TerminationQueue, &CurrentThread->ListHeader);
     PspSuspendExecution(Processor, CurrentThread, PS_STATE_TERMINATED, KE_IRQL_SYNCH);
     KeFatalError(KE_PANIC_BAD_THREAD_STATE, PS_STATE_RUNNING, PS_STATE_TERMINATED, 0, 0);
@@ -376,7 +625,8 @@ void PsYieldThread(void) {
      * scheduler queue). */
     KeIrql OldIrql = KeRaiseIrql(KE_IRQL_SYNCH);
     KeProcessor *Processor = KeGetCurrentProcessor();
-    KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
 
     /* Make sure the thread state is sane. */
     PsThread *CurrentThread = Processor->CurrentThread;
@@ -385,21 +635,23 @@ void PsYieldThread(void) {
     }
 
     /* Check if we have any thread to switch into (we don't bother to switch if nothing is
-     * available, as this thread would have been chosen to run next up anyways). */
-    RtDList *ListHeader = RtPopDList(&Processor->ThreadQueue);
-    if (ListHeader == &Processor->ThreadQueue) {
-        KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
-        KeReleaseSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
+     * available, or if everything is less important than us, as this thread would have been chosen
+     * to run next up anyways). */
+    int Priority = PspGetHighestReadyPriority(Processor);
+    if (Priority < CurrentThread->Priority) {
+        if (Priority < 0) {
+            KeSetAffinityBit(&KiIdleProcessors, Processor->Number);
+        }
+
+        KeReleaseQueuedSpinLockAndLowerIrql(&Processor->Lock, OldIrql);
         return;
     }
 
     /* If we call YieldThread on a tight loop, we need to make sure we clear the idle bit
      * once the queue isn't empty. */
-    __atomic_sub_fetch(&Processor->ThreadCount, 1, __ATOMIC_RELEASE);
-    __atomic_sub_fetch(&PspGlobalThreadCount, 1, __ATOMIC_RELEASE);
     KeClearAffinityBit(&KiIdleProcessors, Processor->Number);
 
-    PsThread *TargetThread = CONTAINING_RECORD(ListHeader, PsThread, ListHeader);
+    PsThread *TargetThread = PspPopReadyThread(Processor);
     PspSwitchThreads(Processor, CurrentThread, TargetThread, PS_STATE_QUEUED, OldIrql);
 }
 
@@ -427,7 +679,8 @@ void PsDelayThread(uint64_t Time) {
      * per-processor fields and the queue). */
     KeIrql OldIrql = KeRaiseIrql(KE_IRQL_SYNCH);
     KeProcessor *Processor = KeGetCurrentProcessor();
-    KeAcquireSpinLockAtCurrentIrql(&Processor->Lock);
+    KeLockQueueNode LockNode;
+    KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
 
     /* Make sure the thread state is sane. */
     PsThread *CurrentThread = Processor->CurrentThread;
@@ -437,14 +690,190 @@ void PsDelayThread(uint64_t Time) {
 
     /* Do the wait list manipulation (that also calculates the target ticks) as early as
      * possible (so that we don't overshoot the wait too much). */
-    CurrentThread->WaitObject = NULL;
     CurrentThread->WaitCompletion = PS_WAIT_COMPLETION_NONE;
-    CurrentThread->WaitListLinked = false;
-    CurrentThread->WaitTreeLinked = false;
+    CurrentThread->WaitWheelLinked = false;
     PspSetupThreadWait(Processor, CurrentThread, Time);
     PspSuspendExecution(Processor, CurrentThread, PS_STATE_WAITING, OldIrql);
 }
 
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function changes the base priority of a thread (dropping any wait boost it had). If
+ *     the thread is queued, it gets moved into the run queue of its new priority; If it's running
+ *     (or got queued) somewhere, that processor gets notified whenever the change means it should
+ *     switch threads.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread to modify.
+ *     Priority - New priority (between PS_PRIORITY_LOWEST and PS_PRIORITY_HIGHEST).
+ *
+ * RETURN VALUE:
+ *     true if the priority was updated, false if it was out of range.
+ *-----------------------------------------------------------------------------------------------*/
+bool PsSetThreadPriority(PsThread *Thread, uint8_t Priority) {
+    if (Priority > PS_PRIORITY_HIGHEST) {
+        return false;
+    }
+
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_SYNCH);
+    __atomic_store_n(&Thread->BasePriority, Priority, __ATOMIC_RELAXED);
+
+    /* Queued threads need to move into the right run queue; They might get picked up or stolen
+     * before we get the processor lock, so recheck where the thread is after locking. Anyone
+     * queueing the thread at the same time as us might still use the old priority, but that only
+     * lasts until the thread runs again. */
+    while (true) {
+        KeProcessor *Processor = __atomic_load_n(&Thread->ReadyProcessor, __ATOMIC_RELAXED);
+        if (!Processor) {
+            __atomic_store_n(&Thread->Priority, Priority, __ATOMIC_RELAXED);
+            break;
+        }
+
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+        if (Thread->ReadyProcessor != Processor) {
+            KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+            continue;
+        }
+
+        bool Preempt = PspRequeueReadyThread(Processor, Thread, Priority);
+        KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+
+        if (Preempt) {
+            HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
+        }
+
+        KeLowerIrql(OldIrql);
+        return true;
+    }
+
+    /* If we just lowered the priority of a running thread, something queued in its processor
+     * might need to run now. */
+    KeProcessor *Processor = Thread->Processor;
+    if (Processor && __atomic_load_n(&Thread->State, __ATOMIC_RELAXED) == PS_STATE_RUNNING) {
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+        bool Preempt = Processor->CurrentThread == Thread &&
+                       PspGetHighestReadyPriority(Processor) > Priority;
+        KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+
+        if (Preempt) {
+            HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
+        }
+    }
+
+    KeLowerIrql(OldIrql);
+    return true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function restricts which processors the given thread is allowed to run in. If the
+ *     thread is queued in a processor it can't use anymore, it gets requeued somewhere else; If
+ *     it's running in one, that processor gets notified to switch it out (or, for the current
+ *     thread, it gets moved away immediately).
+ *
+ * PARAMETERS:
+ *     Thread - Which thread to modify.
+ *     Affinity - New affinity mask; This gets copied into the thread.
+ *
+ * RETURN VALUE:
+ *     true if the affinity was updated, false if the mask has no online processors.
+ *-----------------------------------------------------------------------------------------------*/
+bool PsSetThreadAffinity(PsThread *Thread, KeAffinity *Affinity) {
+    bool Usable = false;
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount && !Usable; i++) {
+        Usable = KeGetAffinityBit(Affinity, i);
+    }
+
+    if (!Usable) {
+        return false;
+    }
+
+    /* Add the new processors before removing the old ones, so that anyone placing the thread
+     * concurrently never sees an empty mask. */
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_SYNCH);
+    KeAffinity *ThreadAffinity = &Thread->Affinity;
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        if (KeGetAffinityBit(Affinity, i)) {
+            KeSetAffinityBit(ThreadAffinity, i);
+        }
+    }
+
+    for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+        if (!KeGetAffinityBit(Affinity, i)) {
+            KeClearAffinityBit(ThreadAffinity, i);
+        }
+    }
+
+    /* Switching out with a QUEUED state requeues us somewhere we're allowed to run. */
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    if (Thread == Processor->CurrentThread && !PspIsProcessorAllowed(Thread, Processor)) {
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+        PspSuspendExecution(Processor, Thread, PS_STATE_QUEUED, OldIrql);
+        return true;
+    }
+
+    /* Queued threads get pulled out of any processor they can't use anymore; Same as with
+     * priorities, the thread might get picked up or stolen before we get the lock, so recheck
+     * where it is after locking. Anyone queueing the thread at the same time as us might still
+     * use the old mask, but the thread moves away as soon as that processor reschedules. */
+    while (true) {
+        Processor = __atomic_load_n(&Thread->ReadyProcessor, __ATOMIC_RELAXED);
+        if (!Processor || PspIsProcessorAllowed(Thread, Processor)) {
+            break;
+        }
+
+        KeLockQueueNode LockNode;
+        KeAcquireQueuedSpinLockAtCurrentIrql(&Processor->Lock, &LockNode);
+        if (Thread->ReadyProcessor != Processor) {
+            KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+            continue;
+        }
+
+        PspRemoveReadyThread(Processor, Thread);
+        KeReleaseQueuedSpinLockAtCurrentIrql(&Processor->Lock);
+        PspQueueThread(Thread, false);
+        KeLowerIrql(OldIrql);
+        return true;
+    }
+
+    /* Threads running somewhere they can't use anymore get switched out by their processor
+     * (PspProcessQueue requeues them when it sees the processor isn't allowed). */
+    Processor = Thread->Processor;
+    if (Processor && __atomic_load_n(&Thread->State, __ATOMIC_RELAXED) == PS_STATE_RUNNING &&
+        !PspIsProcessorAllowed(Thread, Processor)) {
+        HalpNotifyProcessor(Processor, KE_IRQL_DISPATCH);
+    }
+
+    KeLowerIrql(OldIrql);
+    return true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function sets the processor the given thread would prefer to run in. This is only a
+ *     hint (it gets ignored if the processor isn't in the thread affinity mask), and it only takes
+ *     effect the next time the thread gets queued.
+ *
+ * PARAMETERS:
+ *     Thread - Which thread to modify.
+ *     Number - Which processor the thread should prefer, or PS_IDEAL_PROCESSOR_NONE to clear the
+ *              hint.
+ *
+ * RETURN VALUE:
+ *     true if the hint was updated, false if the processor doesn't exist.
+ *-----------------------------------------------------------------------------------------------*/
+bool PsSetIdealProcessor(PsThread *Thread, uint32_t Number) {
+    if (Number != PS_IDEAL_PROCESSOR_NONE && Number >= HalpOnlineProcessorCount) {
+        return false;
+    }
+
+    __atomic_store_n(&Thread->IdealProcessor, Number, __ATOMIC_RELAXED);
+    return true;
+}
+
 /*-------------------------------------------------------------------------------------------------
  * PURPOSE:
  *     This function creates and enqueues the system thread. We should only be called by the
@@ -502,3 +931,344 @@ void PspCreateIdleThread(void) {
     /* We're never ready or queued or anything else, always idle. */
     Processor->IdleThread->State = PS_STATE_IDLE;
 }
+
+#ifndef NDEBUG
+#define TEST_THREADS 8
+#define TEST_ITERATIONS 256
+#define TEST_DELAY (100 * EV_MICROSECS)
+#define TEST_LOAD_THREADS 2
+#define TEST_WAKEUPS 64
+#define TEST_PLACEMENT_ROUNDS 64
+
+static uint64_t TestRemainingThreads = 0;
+
+/* State shared between the wakeup latency self-test, its high priority waiter and the background
+ * load threads. */
+static EvSignal *TestWakeSignal = NULL;
+static EvSignal *TestDoneSignal = NULL;
+static volatile uint64_t TestWakeTicks = 0;
+static volatile uint64_t TestLatency = 0;
+static volatile bool TestStopLoad = false;
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function makes sure we're running on the processor we were pinned to.
+ *
+ * PARAMETERS:
+ *     Number - Which processor we should be running on.
+ *     Iteration - Which iteration of the test we're on (only used for the panic message).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckTestProcessor(uint32_t Number, uint32_t Iteration) {
+    KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+    KeProcessor *Processor = KeGetCurrentProcessor();
+    if (Processor->Number != Number) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            (uint64_t)Processor->CurrentThread,
+            Processor->Number,
+            Number,
+            Iteration);
+    }
+
+    KeLowerIrql(OldIrql);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the affinity self-test threads; We keep yielding and
+ *     sleeping (so that the scheduler has plenty of chances to move or steal us), halfway through
+ *     we re-pin ourselves into the next processor, and we make sure we never run anywhere else.
+ *
+ * PARAMETERS:
+ *     Parameter - Which processor we were initially pinned to.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void TestAffinityThread(void *Parameter) {
+    uint32_t Number = (uint64_t)Parameter;
+
+    for (uint32_t i = 0; i < TEST_ITERATIONS; i++) {
+        /* Re-pinning the current thread should move it away right inside PsSetThreadAffinity. */
+        if (i == TEST_ITERATIONS / 2) {
+            KeAffinity Affinity;
+            KeInitializeEmptyAffinity(&Affinity);
+            Number = (Number + 1) % HalpOnlineProcessorCount;
+            KeSetAffinityBit(&Affinity, Number);
+
+            KeIrql OldIrql = KeRaiseIrql(KE_IRQL_DISPATCH);
+            PsThread *Thread = KeGetCurrentProcessor()->CurrentThread;
+            KeLowerIrql(OldIrql);
+            PsSetThreadAffinity(Thread, &Affinity);
+        }
+
+        CheckTestProcessor(Number, i);
+        if (i & 1) {
+            PsDelayThread(TEST_DELAY);
+        } else {
+            PsYieldThread();
+        }
+
+        CheckTestProcessor(Number, i);
+    }
+
+    __atomic_sub_fetch(&TestRemainingThreads, 1, __ATOMIC_RELEASE);
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function exercises thread affinity (debug builds only), running a few threads pinned
+ *     to a single processor each (spread over all online processors, so that the others have
+ *     something to steal), and making sure none of them is ever seen running off its mask.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspTestThreadAffinity(void) {
+    __atomic_store_n(&TestRemainingThreads, TEST_THREADS, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        uint64_t Number = i % HalpOnlineProcessorCount;
+        PsThread *Thread =
+            PsCreateThread(PS_CREATE_THREAD_SUSPENDED, TestAffinityThread, (void *)Number);
+        if (!Thread) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, Number, 0, 0);
+        }
+
+        KeAffinity Affinity;
+        KeInitializeEmptyAffinity(&Affinity);
+        KeSetAffinityBit(&Affinity, Number);
+        if (!PsSetThreadAffinity(Thread, &Affinity)) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, i, Number, (uint64_t)Thread, 0);
+        }
+
+        PsResumeThread(Thread);
+        ObDereferenceObject(Thread);
+    }
+
+    while (__atomic_load_n(&TestRemainingThreads, __ATOMIC_ACQUIRE)) {
+        PsDelayThread(TEST_DELAY);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the wakeup latency self-test background threads; We
+ *     just burn the processor (without ever blocking or yielding) until the test is done.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void TestLoadThread(void *) {
+    while (!TestStopLoad) {
+        PauseProcessor();
+    }
+
+    __atomic_sub_fetch(&TestRemainingThreads, 1, __ATOMIC_RELEASE);
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function is the entry point for the wakeup latency self-test waiter; Every time the
+ *     wake signal gets set, we measure how long it took until we got to run.
+ *
+ * PARAMETERS:
+ *     Parameter - Unused.
+ *
+ * RETURN VALUE:
+ *     Does not return.
+ *-----------------------------------------------------------------------------------------------*/
+[[noreturn]] static void TestWakeupThread(void *) {
+    for (uint32_t i = 0; i < TEST_WAKEUPS; i++) {
+        EvWaitForObject(TestWakeSignal, EV_TIMEOUT_UNLIMITED);
+        TestLatency = HalGetTimerTicks() - TestWakeTicks;
+        EvClearSignal(TestWakeSignal);
+        EvSetSignal(TestDoneSignal);
+    }
+
+    __atomic_sub_fetch(&TestRemainingThreads, 1, __ATOMIC_RELEASE);
+    PsTerminateThread();
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function creates a thread for the wakeup latency self-test, pinned to the given
+ *     processor.
+ *
+ * PARAMETERS:
+ *     EntryPoint - Entry point of the thread.
+ *     Number - Which processor the thread should run on.
+ *     Priority - Which priority the thread should run at.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CreateTestLatencyThread(void (*EntryPoint)(void *), uint32_t Number, uint8_t Priority) {
+    PsThread *Thread = PsCreateThread(PS_CREATE_THREAD_SUSPENDED, EntryPoint, NULL);
+    if (!Thread) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)EntryPoint, Number, Priority, 0);
+    }
+
+    KeAffinity Affinity;
+    KeInitializeEmptyAffinity(&Affinity);
+    KeSetAffinityBit(&Affinity, Number);
+    if (!PsSetThreadAffinity(Thread, &Affinity) || !PsSetThreadPriority(Thread, Priority)) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)EntryPoint, Number, Priority, 1);
+    }
+
+    PsResumeThread(Thread);
+    ObDereferenceObject(Thread);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures the wakeup-to-run latency of a high priority thread (debug builds
+ *     only), while a few CPU-bound normal priority threads keep its processor busy. Waking it up
+ *     should preempt the background load right away, so the worst case should never get anywhere
+ *     near the default quantum (which is how long a round-robin pass over the load would take).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspTestWakeupLatency(void) {
+    TestWakeSignal = EvCreateSignal();
+    TestDoneSignal = EvCreateSignal();
+    if (!TestWakeSignal || !TestDoneSignal) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    /* Use the last processor, so that (on SMP) we're signaling from somewhere else. */
+    uint32_t Number = HalpOnlineProcessorCount - 1;
+    TestStopLoad = false;
+    __atomic_store_n(&TestRemainingThreads, TEST_LOAD_THREADS + 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < TEST_LOAD_THREADS; i++) {
+        CreateTestLatencyThread(TestLoadThread, Number, PS_PRIORITY_NORMAL);
+    }
+
+    CreateTestLatencyThread(TestWakeupThread, Number, PS_PRIORITY_REALTIME);
+
+    uint64_t Frequency = HalGetTimerFrequency();
+    uint64_t TotalLatency = 0;
+    uint64_t MaxLatency = 0;
+    for (uint32_t i = 0; i < TEST_WAKEUPS; i++) {
+        /* Give the waiter some time to block again (and the load some time to run). */
+        PsDelayThread(TEST_DELAY);
+        TestWakeTicks = HalGetTimerTicks();
+        EvSetSignal(TestWakeSignal);
+        EvWaitForObject(TestDoneSignal, EV_TIMEOUT_UNLIMITED);
+        EvClearSignal(TestDoneSignal);
+
+        uint64_t Latency = (__uint128_t)TestLatency * EV_SECS / Frequency;
+        TotalLatency += Latency;
+        if (Latency > MaxLatency) {
+            MaxLatency = Latency;
+        }
+    }
+
+    TestStopLoad = true;
+    while (__atomic_load_n(&TestRemainingThreads, __ATOMIC_ACQUIRE)) {
+        PsDelayThread(TEST_DELAY);
+    }
+
+    ObDereferenceObject(TestWakeSignal);
+    ObDereferenceObject(TestDoneSignal);
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "wakeup latency under load: %llu ns average, %llu ns worst case\n",
+        TotalLatency / TEST_WAKEUPS,
+        MaxLatency);
+    if (MaxLatency >= PSP_DEFAULT_TICKS * EVP_TICK_PERIOD) {
+        KeFatalError(
+            KE_PANIC_SELF_TEST_FAILURE,
+            MaxLatency,
+            TotalLatency / TEST_WAKEUPS,
+            PSP_DEFAULT_TICKS * EVP_TICK_PERIOD,
+            0);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function checks the topology preference of the idle processor search (debug builds
+ *     only): From every source processor, and for random sets of idle and allowed processors, the
+ *     pick should always be at the smallest distance available (same core, then same cache, then
+ *     same package). This only tells us something on a machine with more than one core, cache or
+ *     package (for example, QEMU with `-smp sockets=2,cores=4,threads=2`).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspTestPlacement(void) {
+    PsThread *Thread = MmAllocatePool(sizeof(PsThread), MM_POOL_TAG_THREAD);
+    if (!Thread) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, 0, 0, 0, 0);
+    }
+
+    for (uint32_t Source = 0; Source < HalpOnlineProcessorCount; Source++) {
+        KeProcessor *SourceProcessor = HalpProcessorList[Source];
+
+        for (uint32_t Round = 0; Round < TEST_PLACEMENT_ROUNDS; Round++) {
+            KeAffinity IdleProcessors;
+            KeInitializeEmptyAffinity(&IdleProcessors);
+            KeInitializeEmptyAffinity(&Thread->Affinity);
+
+            /* Every other round also restricts the affinity, so that the closest idle processors
+             * aren't always allowed. */
+            int Expected = PSP_DISTANCE_COUNT;
+            for (uint32_t i = 0; i < HalpOnlineProcessorCount; i++) {
+                uint64_t Random = __rand64();
+                bool Idle = Random & 1;
+                bool Allowed = !(Round & 1) || (Random & 2);
+                if (Idle) {
+                    KeSetAffinityBit(&IdleProcessors, i);
+                }
+
+                if (Allowed) {
+                    KeSetAffinityBit(&Thread->Affinity, i);
+                }
+
+                int Distance = PspGetProcessorDistance(SourceProcessor, HalpProcessorList[i]);
+                if (Idle && Allowed && Distance < Expected) {
+                    Expected = Distance;
+                }
+            }
+
+            KeProcessor *Processor = FindIdleProcessor(Thread, &IdleProcessors, SourceProcessor);
+            if (!Processor) {
+                if (Expected != PSP_DISTANCE_COUNT) {
+                    KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Source, Round, Expected, 0);
+                }
+
+                continue;
+            }
+
+            int Distance = PspGetProcessorDistance(SourceProcessor, Processor);
+            if (Distance != Expected || !KeGetAffinityBit(&IdleProcessors, Processor->Number) ||
+                !KeGetAffinityBit(&Thread->Affinity, Processor->Number)) {
+                KeFatalError(
+                    KE_PANIC_SELF_TEST_FAILURE, Source, Round, Expected, Processor->Number + 1);
+            }
+        }
+    }
+
+    MmFreePool(Thread, MM_POOL_TAG_THREAD);
+}
+#endif /* NDEBUG */
@@ -0,0 +1,615 @@
+/* SPDX-FileCopyrightText: (C) 2026 ilmmatias
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <crt_impl/rand.h>
+#include <kernel/halp.h>
+#include <kernel/kd.h>
+#include <kernel/ke.h>
+#include <kernel/mm.h>
+#include <kernel/ps.h>
+#include <kernel/psp.h>
+#include <os/containing_record.h>
+#include <rt/list.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function returns the shift that converts a tick into a slot index for the given wheel
+ *     level.
+ *
+ * PARAMETERS:
+ *     Level - Which level of the wheel we want.
+ *
+ * RETURN VALUE:
+ *     Shift amount.
+ *-----------------------------------------------------------------------------------------------*/
+static uint32_t GetLevelShift(uint32_t Level) {
+    return Level * PS_WAIT_WHEEL_SHIFT;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function links the given thread into the slot that covers its expiration tick. Near
+ *     expirations go into the lower levels (one tick per slot), while far ones go into the higher
+ *     levels (and get cascaded down as the wheel turns).
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel to insert the thread into.
+ *     Thread - Which thread to insert; WaitTicks should already be set up.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void LinkThread(PsWaitWheel *Wheel, PsThread *Thread) {
+    uint64_t Tick = Thread->WaitTicks;
+    uint64_t Delta = Tick - Wheel->CurrentTick;
+    uint32_t Level = 0;
+
+    while (Level < PS_WAIT_WHEEL_LEVELS - 1 && Delta >= 1ull << GetLevelShift(Level + 1)) {
+        Level++;
+    }
+
+    /* Anything past the last level gets parked in its furthest slot, and will be reinserted when
+     * that slot gets cascaded. */
+    uint64_t Range = 1ull << GetLevelShift(PS_WAIT_WHEEL_LEVELS);
+    if (Delta >= Range) {
+        Tick = Wheel->CurrentTick + Range - 1;
+    }
+
+    uint32_t Index = (Tick >> GetLevelShift(Level)) & PS_WAIT_WHEEL_MASK;
+    RtAppendDList(&Wheel->Slots[Level][Index], &Thread->WaitWheelHeader);
+    Wheel->Occupied[Level] |= 1ull << Index;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function finds the earliest tick at which the wheel needs to do something (either
+ *     expire a slot at the lowest level, or cascade a slot from a higher level). For the lowest
+ *     level this is exact; For the higher levels, this is the start of the slot range (which is
+ *     a lower bound on the expiration ticks inside it).
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel to check.
+ *
+ * RETURN VALUE:
+ *     Earliest tick, or UINT64_MAX if the wheel is empty.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t GetNextTick(PsWaitWheel *Wheel) {
+    uint64_t NextTick = UINT64_MAX;
+
+    for (uint32_t Level = 0; Level < PS_WAIT_WHEEL_LEVELS; Level++) {
+        uint64_t Occupied = Wheel->Occupied[Level];
+        if (!Occupied) {
+            continue;
+        }
+
+        /* Rotate the mask so that bit 0 is the slot the current tick maps into. */
+        uint32_t Shift = GetLevelShift(Level);
+        uint64_t Base = Wheel->CurrentTick >> Shift;
+        uint32_t Index = Base & PS_WAIT_WHEEL_MASK;
+        if (Index) {
+            Occupied = (Occupied >> Index) | (Occupied << (PS_WAIT_WHEEL_SLOTS - Index));
+        }
+
+        /* On the higher levels, if we're already past the start of the current slot, it was
+         * already cascaded, and anything in it belongs to the next rotation. */
+        uint64_t Distance;
+        if (Level && (Wheel->CurrentTick & ((1ull << Shift) - 1)) && (Occupied & 1)) {
+            Occupied &= ~1ull;
+            Distance = Occupied ? (uint64_t)__builtin_ctzll(Occupied) : PS_WAIT_WHEEL_SLOTS;
+        } else {
+            Distance = __builtin_ctzll(Occupied);
+        }
+
+        uint64_t Tick = (Base + Distance) << Shift;
+        if (Tick < NextTick) {
+            NextTick = Tick;
+        }
+    }
+
+    return NextTick;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function moves everything inside a higher level slot down into the lower levels (at
+ *     their exact positions relative to the current tick).
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel we're turning.
+ *     Level - Which level the slot is in.
+ *     Index - Which slot we're cascading.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CascadeSlot(PsWaitWheel *Wheel, uint32_t Level, uint32_t Index) {
+    if (!(Wheel->Occupied[Level] & (1ull << Index))) {
+        return;
+    }
+
+    RtDList SlotList;
+    RtInitializeDList(&SlotList);
+    RtSpliceTailDList(&SlotList, &Wheel->Slots[Level][Index]);
+    Wheel->Occupied[Level] &= ~(1ull << Index);
+
+    /* Keep the original order, so that threads expiring on the same tick still leave the wheel in
+     * the order they were inserted. */
+    while (true) {
+        RtDList *ListHeader = RtPopDList(&SlotList);
+        if (ListHeader == &SlotList) {
+            break;
+        }
+
+        LinkThread(Wheel, CONTAINING_RECORD(ListHeader, PsThread, WaitWheelHeader));
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function initializes an empty wait wheel.
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel to initialize.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspInitializeWaitWheel(PsWaitWheel *Wheel) {
+    Wheel->CurrentTick = 0;
+    Wheel->Count = 0;
+
+    for (uint32_t Level = 0; Level < PS_WAIT_WHEEL_LEVELS; Level++) {
+        Wheel->Occupied[Level] = 0;
+        for (uint32_t Index = 0; Index < PS_WAIT_WHEEL_SLOTS; Index++) {
+            RtInitializeDList(&Wheel->Slots[Level][Index]);
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function adds the given thread into a wait wheel.
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel to insert the thread into.
+ *     Thread - Which thread to insert; WaitTicks should already be set up.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void InsertThread(PsWaitWheel *Wheel, PsThread *Thread) {
+    /* We might not have turned the wheel up to the current tick yet; Anything that should have
+     * already expired goes into the next slot we'll look at. */
+    if (Thread->WaitTicks < Wheel->CurrentTick) {
+        Thread->WaitTicks = Wheel->CurrentTick;
+    }
+
+    LinkThread(Wheel, Thread);
+    Wheel->Count++;
+    Thread->WaitWheelLinked = true;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function removes the given thread from a wait wheel.
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel the thread is in.
+ *     Thread - Which thread to remove.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void RemoveThread(PsWaitWheel *Wheel, PsThread *Thread) {
+    RtDList *Next = Thread->WaitWheelHeader.Next;
+
+    RtUnlinkDList(&Thread->WaitWheelHeader);
+    Wheel->Count--;
+    Thread->WaitWheelLinked = false;
+
+    /* If we were the last entry in the slot, Next is the slot head itself, so we can find out
+     * which slot it was without recalculating the position. */
+    if (Next->Next != Next) {
+        return;
+    }
+
+    for (uint32_t Level = 0; Level < PS_WAIT_WHEEL_LEVELS; Level++) {
+        RtDList *Slots = Wheel->Slots[Level];
+        if (Next >= Slots && Next < Slots + PS_WAIT_WHEEL_SLOTS) {
+            Wheel->Occupied[Level] &= ~(1ull << (Next - Slots));
+            break;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function turns a wait wheel up to the given tick, moving all expired threads (in
+ *     expiration order) into the given list.
+ *
+ * PARAMETERS:
+ *     Wheel - Which wheel we're turning.
+ *     Ticks - Current tick.
+ *     ExpiredList - Output; List where we should append the expired threads (linked through their
+ *                   WaitWheelHeader).
+ *
+ * RETURN VALUE:
+ *     Lower bound on the next expiration tick, or UINT64_MAX if the wheel is now empty.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t CollectExpiredThreads(PsWaitWheel *Wheel, uint64_t Ticks, RtDList *ExpiredList) {
+    /* Jump straight to the next tick where something happens, instead of going one tick at a
+     * time (there might have been a long time since the last collection). */
+    while (Wheel->CurrentTick <= Ticks) {
+        uint64_t Tick = GetNextTick(Wheel);
+        if (Tick > Ticks) {
+            break;
+        }
+
+        Wheel->CurrentTick = Tick;
+
+        /* Cascade from the top, so that anything moving down into a slot that also starts at this
+         * tick gets moved all the way down. */
+        for (uint32_t Level = PS_WAIT_WHEEL_LEVELS - 1; Level > 0; Level--) {
+            uint32_t Shift = GetLevelShift(Level);
+            if (!(Tick & ((1ull << Shift) - 1))) {
+                CascadeSlot(Wheel, Level, (Tick >> Shift) & PS_WAIT_WHEEL_MASK);
+            }
+        }
+
+        /* Everything in the lowest level slot expires on this exact tick. */
+        uint32_t Index = Tick & PS_WAIT_WHEEL_MASK;
+        RtDList *Slot = &Wheel->Slots[0][Index];
+        while (Slot->Next != Slot) {
+            PsThread *Thread = CONTAINING_RECORD(Slot->Next, PsThread, WaitWheelHeader);
+            RtUnlinkDList(&Thread->WaitWheelHeader);
+            RtAppendDList(ExpiredList, &Thread->WaitWheelHeader);
+            Thread->WaitWheelLinked = false;
+            Wheel->Count--;
+        }
+
+        Wheel->Occupied[0] &= ~(1ull << Index);
+        Wheel->CurrentTick = Tick + 1;
+    }
+
+    if (Wheel->CurrentTick <= Ticks) {
+        Wheel->CurrentTick = Ticks + 1;
+    }
+
+    return Wheel->Count ? GetNextTick(Wheel) : UINT64_MAX;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function adds the given thread into the processor wait wheel. The processor lock is
+ *     expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor is currently active.
+ *     Thread - Which thread to insert; WaitTicks should already be set up.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspInsertWaitThread(KeProcessor *Processor, PsThread *Thread) {
+    InsertThread(&Processor->WaitWheel, Thread);
+    if (Thread->WaitTicks < Processor->ClosestWaitTick) {
+        Processor->ClosestWaitTick = Thread->WaitTicks;
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function removes the given thread from the processor wait wheel. The processor lock is
+ *     expected to be held by the caller. We don't update ClosestWaitTick here (it only needs to be
+ *     a lower bound, and the next collection will fix it up).
+ *
+ * PARAMETERS:
+ *     Processor - Which processor is currently active.
+ *     Thread - Which thread to remove.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspRemoveWaitThread(KeProcessor *Processor, PsThread *Thread) {
+    RemoveThread(&Processor->WaitWheel, Thread);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function turns the processor wait wheel up to the current tick, moving all expired
+ *     threads (in expiration order) into the given list, and updating ClosestWaitTick. The
+ *     processor lock is expected to be held by the caller.
+ *
+ * PARAMETERS:
+ *     Processor - Which processor is currently active.
+ *     ExpiredList - Output; List where we should append the expired threads (linked through their
+ *                   WaitWheelHeader).
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspCollectExpiredWaits(KeProcessor *Processor, RtDList *ExpiredList) {
+    Processor->ClosestWaitTick =
+        CollectExpiredThreads(&Processor->WaitWheel, Processor->Ticks, ExpiredList);
+}
+
+#ifndef NDEBUG
+#define TEST_THREADS 4096
+#define TEST_TIMERS 100000
+#define TEST_START_TICK ((1ull << 24) - 12345)
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function picks how far away the next self-test timer expires. Most timers are near
+ *     (lowest level), but some of them should land on every other level, and some should go past
+ *     the end of the wheel.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Delay in ticks.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t GetTestDelay(void) {
+    static const uint8_t Bits[16] = {6, 6, 6, 6, 6, 6, 6, 6, 12, 12, 12, 12, 18, 18, 24, 26};
+    uint64_t Random = __rand64();
+    return (Random >> 4) & ((1ull << Bits[Random & 0x0F]) - 1);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function picks how far the self-test turns the wheel on the next collection. Most
+ *     collections happen every few ticks (like the normal timer interrupt would), but some of them
+ *     skip a long range of ticks (like after the processor was idle for a while).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     Step in ticks.
+ *-----------------------------------------------------------------------------------------------*/
+static uint64_t GetTestStep(void) {
+    static const uint8_t Bits[16] = {3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 10, 10, 10, 10, 20};
+    uint64_t Random = __rand64();
+    return ((Random >> 4) & ((1ull << Bits[Random & 0x0F]) - 1)) + 1;
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function makes sure every self-test thread still inside the wheel expires in the
+ *     future, that the wheel count matches, and that the next tick we got back from the collection
+ *     is really a lower bound.
+ *
+ * PARAMETERS:
+ *     Wheel - Self-test wheel.
+ *     Threads - Self-test threads.
+ *     Ticks - Tick we just collected up to.
+ *     NextTick - What the collection told us the next tick was.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+static void CheckTestWheel(
+    PsWaitWheel *Wheel,
+    PsThread *Threads,
+    uint64_t Ticks,
+    uint64_t NextTick) {
+    uint64_t Count = 0;
+
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        PsThread *Thread = &Threads[i];
+        if (!Thread->WaitWheelLinked) {
+            continue;
+        }
+
+        if (Thread->WaitTicks <= Ticks || Thread->WaitTicks < NextTick) {
+            KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Thread->WaitTicks, Ticks, NextTick, i);
+        }
+
+        Count++;
+    }
+
+    if (Count != Wheel->Count || (!Count && NextTick != UINT64_MAX)) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Count, Wheel->Count, NextTick, Ticks);
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function exercises the wait wheel (debug builds only), pushing 100k timers through a
+ *     private wheel (with every level, far timers, early removals and long idle gaps), and making
+ *     sure each one expires exactly on the collection that covers its tick, in expiration order.
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspTestWaitWheel(void) {
+    PsWaitWheel *Wheel = MmAllocatePool(sizeof(PsWaitWheel), MM_POOL_TAG_THREAD);
+    PsThread *Threads =
+        MmAllocatePool(TEST_THREADS * sizeof(PsThread), MM_POOL_TAG_THREAD);
+    if (!Wheel || !Threads) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)Wheel, (uint64_t)Threads, 0, 0);
+    }
+
+    /* Start a bit before the top level wraps around, so that the higher levels also have to deal
+     * with rotating the occupied mask. */
+    RtDList ExpiredList;
+    RtInitializeDList(&ExpiredList);
+    PspInitializeWaitWheel(Wheel);
+
+    uint64_t Ticks = TEST_START_TICK;
+    CollectExpiredThreads(Wheel, Ticks, &ExpiredList);
+
+    uint32_t Inserted = 0;
+    uint32_t Expired = 0;
+    uint32_t Removed = 0;
+
+    for (uint32_t i = 0; i < TEST_THREADS; i++) {
+        Threads[i].WaitTicks = Ticks + GetTestDelay();
+        InsertThread(Wheel, &Threads[i]);
+        Inserted++;
+    }
+
+    while (Wheel->Count) {
+        uint64_t LastTicks = Ticks;
+        uint64_t LastExpiration = 0;
+        Ticks += GetTestStep();
+
+        uint64_t NextTick = CollectExpiredThreads(Wheel, Ticks, &ExpiredList);
+        CheckTestWheel(Wheel, Threads, Ticks, NextTick);
+
+        /* Everything we get back should have expired after the last collection (anything older
+         * should have come out back then), and in order. */
+        while (true) {
+            RtDList *ListHeader = RtPopDList(&ExpiredList);
+            if (ListHeader == &ExpiredList) {
+                break;
+            }
+
+            PsThread *Thread = CONTAINING_RECORD(ListHeader, PsThread, WaitWheelHeader);
+            if (Thread->WaitWheelLinked || Thread->WaitTicks <= LastTicks ||
+                Thread->WaitTicks > Ticks || Thread->WaitTicks < LastExpiration) {
+                KeFatalError(
+                    KE_PANIC_SELF_TEST_FAILURE,
+                    Thread->WaitTicks,
+                    LastTicks,
+                    Ticks,
+                    LastExpiration);
+            }
+
+            LastExpiration = Thread->WaitTicks;
+            Expired++;
+
+            if (Inserted < TEST_TIMERS) {
+                Thread->WaitTicks = Ticks + GetTestDelay();
+                InsertThread(Wheel, Thread);
+                Inserted++;
+            }
+        }
+
+        /* Cancel a random timer every now and then (like a wait getting satisfied before its
+         * timeout). */
+        PsThread *Thread = &Threads[__rand64() % TEST_THREADS];
+        if (Thread->WaitWheelLinked && !(__rand64() & 3)) {
+            RemoveThread(Wheel, Thread);
+            Removed++;
+
+            if (Inserted < TEST_TIMERS) {
+                Thread->WaitTicks = Ticks + GetTestDelay();
+                InsertThread(Wheel, Thread);
+                Inserted++;
+            }
+        }
+    }
+
+    /* And at the end, nothing should have been lost, and every slot should be empty again. */
+    if (Inserted != TEST_TIMERS || Expired + Removed != Inserted) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, Inserted, Expired, Removed, Wheel->Count);
+    }
+
+    for (uint32_t Level = 0; Level < PS_WAIT_WHEEL_LEVELS; Level++) {
+        for (uint32_t Index = 0; Index < PS_WAIT_WHEEL_SLOTS; Index++) {
+            RtDList *Slot = &Wheel->Slots[Level][Index];
+            if (Slot->Next != Slot || (Wheel->Occupied[Level] & (1ull << Index))) {
+                KeFatalError(
+                    KE_PANIC_SELF_TEST_FAILURE,
+                    Level,
+                    Index,
+                    Wheel->Occupied[Level],
+                    (uint64_t)Slot->Next);
+            }
+        }
+    }
+
+    MmFreePool(Threads, MM_POOL_TAG_THREAD);
+    MmFreePool(Wheel, MM_POOL_TAG_THREAD);
+}
+
+/*-------------------------------------------------------------------------------------------------
+ * PURPOSE:
+ *     This function measures the wait wheel costs (debug builds only): Arming and cancelling 100k
+ *     timers (in batches of self-test threads, with the same delay mix as the self-test), and
+ *     collecting them all as they expire. The results are only printed (nothing fails).
+ *
+ * PARAMETERS:
+ *     None.
+ *
+ * RETURN VALUE:
+ *     None.
+ *-----------------------------------------------------------------------------------------------*/
+void PspBenchmarkWaitWheel(void) {
+    PsWaitWheel *Wheel = MmAllocatePool(sizeof(PsWaitWheel), MM_POOL_TAG_THREAD);
+    PsThread *Threads =
+        MmAllocatePool(TEST_THREADS * sizeof(PsThread), MM_POOL_TAG_THREAD);
+    if (!Wheel || !Threads) {
+        KeFatalError(KE_PANIC_SELF_TEST_FAILURE, (uint64_t)Wheel, (uint64_t)Threads, 0, 0);
+    }
+
+    RtDList ExpiredList;
+    RtInitializeDList(&ExpiredList);
+    PspInitializeWaitWheel(Wheel);
+
+    uint64_t Ticks = TEST_START_TICK;
+    CollectExpiredThreads(Wheel, Ticks, &ExpiredList);
+
+    uint64_t Timers = 0;
+    uint64_t ArmCycles = 0;
+    uint64_t CancelCycles = 0;
+    uint64_t CollectCycles = 0;
+
+    while (Timers < TEST_TIMERS) {
+        /* Pick the delays up front, so that we only time the wheel itself. */
+        for (uint32_t i = 0; i < TEST_THREADS; i++) {
+            Threads[i].WaitTicks = Ticks + GetTestDelay();
+        }
+
+        uint64_t Start = HalpGetTscTicks();
+        for (uint32_t i = 0; i < TEST_THREADS; i++) {
+            InsertThread(Wheel, &Threads[i]);
+        }
+
+        ArmCycles += HalpGetTscTicks() - Start;
+
+        Start = HalpGetTscTicks();
+        for (uint32_t i = 0; i < TEST_THREADS; i++) {
+            RemoveThread(Wheel, &Threads[i]);
+        }
+
+        CancelCycles += HalpGetTscTicks() - Start;
+
+        /* Arm the same timers again, but this time let all of them expire. */
+        for (uint32_t i = 0; i < TEST_THREADS; i++) {
+            InsertThread(Wheel, &Threads[i]);
+        }
+
+        while (Wheel->Count) {
+            Ticks += GetTestStep();
+            Start = HalpGetTscTicks();
+            CollectExpiredThreads(Wheel, Ticks, &ExpiredList);
+            CollectCycles += HalpGetTscTicks() - Start;
+
+            /* Nobody needs the expired threads, so just drop them all. */
+            RtInitializeDList(&ExpiredList);
+        }
+
+        Timers += TEST_THREADS;
+    }
+
+    MmFreePool(Threads, MM_POOL_TAG_THREAD);
+    MmFreePool(Wheel, MM_POOL_TAG_THREAD);
+
+    KdPrint(
+        KD_TYPE_DEBUG,
+        "wait wheel benchmark: %llu timers, %llu cycles per arm, %llu per cancel, %llu per "
+        "expiry\n",
+        Timers,
+        ArmCycles / Timers,
+        CancelCycles / Timers,
+        CollectCycles / Timers);
+}
+#endif /* NDEBUG */
@@ -11,6 +11,7 @@ ovmf_vars_source=
 qemu_binary=qemu-system-x86_64
 machine=q35
 cpu_count=$(nproc)
+topology=
 
 debug_enabled=false
 debug_port=50005
@@ -54,6 +55,7 @@ Options:
   --qemu BINARY         Use an explicit QEMU binary
   --machine MACHINE     Specify what machine QEMU should emulate
   --cpus COUNT          Specify the amount of virtual CPUs
+  --topology S,C,T      Use S sockets of C cores with T threads each (overrides --cpus)
   --no-kvm              Do not enable KVM acceleration
   --debug-enabled       Enable the debugger network interface
   --debug-port PORT     Forward this UDP port and enable debugger networking
@@ -73,6 +75,7 @@ parse_args() {
             --ovmf-vars) ovmf_vars_source=$(require_value "$@"); shift 2 ;;
             --qemu) qemu_binary=$(require_value "$@"); shift 2 ;;
             --cpus) cpu_count=$(require_value "$@"); shift 2 ;;
+            --topology) topology=$(require_value "$@"); shift 2 ;;
             --no-kvm) kvm_enabled=false; shift ;;
             --debug-enabled) debug_enabled=true; shift ;;
             --debug-port) debug_port=$(require_value "$@"); shift 2 ;;
@@ -126,6 +129,23 @@ check_cpus() {
     fi
 }
 
+# Validate the virtual processor topology, and derive the CPU count from it
+check_topology() {
+    if [[ -z $topology ]]; then
+        return
+    fi
+
+    local sockets cores threads
+    IFS=, read -r sockets cores threads <<<"$topology"
+    if [[ ! $sockets =~ ^[1-9][0-9]{0,3}$ || ! $cores =~ ^[1-9][0-9]{0,3}$ ||
+          ! $threads =~ ^[1-9][0-9]{0,3}$ ]]; then
+        usage_error "topology must be SOCKETS,CORES,THREADS"
+    fi
+
+    cpu_count=$((sockets * cores * threads))
+    topology=sockets=$sockets,cores=$cores,threads=$threads
+}
+
 # Copy the OVMF code and variable templates when persistent state is absent
 prepare_ovmf() {
     local code=$state_dir/code.bin
@@ -162,7 +182,7 @@ run_qemu() {
     args+=(
         -machine "$machine"
         -cpu "$cpu"
-        -smp "$cpu_count"
+        -smp "$cpu_count${topology:+,$topology}"
         -drive "if=pflash,format=raw,unit=0,file=$code,readonly=on"
         -drive "if=pflash,format=raw,unit=1,file=$vars"
         -cdrom "$iso"
@@ -191,6 +211,7 @@ main() {
     command -v "$qemu_binary" >/dev/null || die "QEMU binary not found: $qemu_binary"
 
     check_paths
+    check_topology
     check_cpus
     check_debug
     prepare_ovmf